@@ -15,14 +15,19 @@
  *
  * io buffers are aligned in case you want to do raw io
  *
+ * the io can go through libaio (the default) or io_uring (-E io_uring).
+ * Both engines run the same stages over the same io units and buffers, so
+ * their numbers on the same files can be compared directly.
+ *
  * compile with gcc -Wall -laio -lpthread -o aio-stress aio-stress.c
+ * add -DURING -luring for io_uring support
  *
  * run aio-stress -h to see the options
  *
  * Please mail Chris Mason (mason@suse.com) with bug reports or patches
  */
 #define _FILE_OFFSET_BITS 64
-#define PROG_VERSION "0.21"
+#define PROG_VERSION "0.22"
 #define NEW_GETEVENTS
 
 #include <stdio.h>
@@ -35,12 +40,22 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <time.h>
+#include <limits.h>
+#include <math.h>
 #include <libaio.h>
+#ifdef URING
+#include <liburing.h>
+#endif
 #include <sys/ipc.h>
 #include <sys/shm.h>
 #include <sys/mman.h>
 #include <string.h>
 #include <pthread.h>
+#include <sched.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
 
 #define IO_FREE 0
 #define IO_PENDING 1
@@ -55,12 +70,26 @@ enum {
     READ,
     RWRITE,
     RREAD,
+    MIXED,
     LAST_STAGE,
 };
 
 #define USE_MALLOC 0
 #define USE_SHM 1
 #define USE_SHMFS 2
+#define USE_HUGETLB 3
+
+/* distributions of the offsets of the random and mixed stages */
+#define DIST_UNIFORM 0
+#define DIST_ZIPF 1
+#define DIST_PARETO 2
+#define DIST_NORMAL 3
+
+/* zipf ranks past this are left out of zeta(n), like fio does */
+#define ZIPF_MAX_GEN 10000000
+
+#define ENGINE_LIBAIO 0
+#define ENGINE_URING 1
 
 /* 
  * various globals, these are effectively read only by the time the threads
@@ -72,6 +101,7 @@ int o_direct = 0;
 int o_sync = 0;
 int latency_stats = 0;
 int completion_latency_stats = 0;
+FILE *json_file = NULL;
 int io_iter = 8;
 int iterations = RUN_FOREVER;
 int max_io_submit = 0;
@@ -90,6 +120,52 @@ int stonewall = 1;
 int verify = 0;
 char *verify_buf = NULL;
 int unlink_files = 0;
+int engine = ENGINE_LIBAIO;
+int uring_fixed_bufs = 0;
+int uring_fixed_files = 0;
+int uring_iopoll = 0;
+int uring_sqpoll = 0;
+int *cpu_list = NULL;		/* -A, thread i runs on cpu_list[i % nr_cpus] */
+int nr_cpus = 0;
+int read_pct = 50;
+int offset_dist = DIST_UNIFORM;
+double dist_param;
+int numa_buffers = 0;		/* -N, io buffers on the node of the thread */
+size_t buffer_chunk;		/* -N, alignment of the buffers of a thread */
+size_t buffer_ram;		/* size of the io buffer allocation */
+
+/*
+ * -W runs every combination of the thread counts of -t, the depths of -d
+ * and the file counts of -f, and keeps the results of each stage of each
+ */
+int sweep = 0;
+int *threads_list = NULL;
+int nr_thread_counts = 0;
+int *depth_list = NULL;
+int nr_depths = 0;
+int *files_list = NULL;
+int nr_file_counts = 0;
+int sweep_files;		/* files of the current run */
+
+/*
+ * the knee is the smallest depth within this many percent of the best iops
+ * of its thread and file count
+ */
+#define KNEE_GAIN 10
+
+struct sweep_result {
+    int threads;
+    int files;
+    int depth;
+    int rw;
+    int knee;
+    double iops;
+    double mb_s;
+    unsigned long long p50;	/* completion latency, ns */
+    unsigned long long p99;
+};
+struct sweep_result *sweep_results = NULL;
+int nr_sweep_results = 0;
 
 struct io_unit;
 struct thread_info;
@@ -103,19 +179,31 @@ struct timeval global_stage_start_time;
 struct thread_info *global_thread_info;
 
 /* 
- * latencies during io_submit are measured, these are the 
- * granularities for deviations 
+ * latencies of io_submit and of io completion are measured in nanoseconds
+ * and kept in log-linear histograms.  Values below LAT_SUB get a bucket
+ * each, above that every power of two is split into LAT_SUB buckets, so a
+ * bucket is never wider than 1/LAT_SUB of the values in it.
  */
-#define DEVIATIONS 6
-int deviations[DEVIATIONS] = { 100, 250, 500, 1000, 5000, 10000 };
+#define LAT_SUB_BITS 6
+#define LAT_SUB (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS ((64 - LAT_SUB_BITS + 1) * LAT_SUB)
 struct io_latency {
-    double max;
-    double min;
-    double total_io;
-    double total_lat;
-    double deviations[DEVIATIONS]; 
+    unsigned long long max;
+    unsigned long long min;		/* ULLONG_MAX when empty */
+    unsigned long long total_io;
+    unsigned long long total_lat;
+    unsigned long long buckets[LAT_BUCKETS];
 };
 
+#define NR_PERCENTILES 5
+double percentiles[NR_PERCENTILES] = { 50, 90, 99, 99.9, 99.99 };
+
+/* the latencies of all threads for the current stage */
+struct io_latency stage_submit_latency;
+struct io_latency stage_completion_latency;
+struct io_latency stage_read_latency;
+struct io_latency stage_write_latency;
+
 /* container for a series of operations to a file */
 struct io_oper {
     /* already open file descriptor, valid for whatever operation you want */
@@ -151,6 +239,9 @@ struct io_oper {
     /* number of ios we've already sent */
     int started_ios;
 
+    /* how many of those were reads, for the mixed stage */
+    int started_reads;
+
     /* last offset used in an io operation */
     off_t last_offset;
 
@@ -164,6 +255,18 @@ struct io_oper {
     struct timeval start_time;
 
     char *file_name;
+
+    /* index of fd in the registered files of the thread (io_uring -R) */
+    int file_index;
+
+    /*
+     * records between start and end, the step that spreads ranks over
+     * them, and zeta(2), zeta(n) for -D zipf
+     */
+    off_t nr_blocks;
+    unsigned long long scatter;
+    double zeta2;
+    double zetan;
 };
 
 /* a single io, and all the tracking needed for it */
@@ -188,11 +291,19 @@ struct io_unit {
 
     struct io_unit *next;
 
-    struct timeval io_start_time;		/* time of io_submit */
+    unsigned long long io_start_time;	/* time of io_submit, ns */
 };
 
 struct thread_info {
     io_context_t io_ctx;
+    /* cpu this thread is pinned to and its numa node, -1 when not pinned */
+    int cpu;
+    int node;
+
+#ifdef URING
+    /* used instead of io_ctx with -E io_uring */
+    struct io_uring ring;
+#endif
     pthread_t tid;
 
     /* allocated array of io_unit structs */
@@ -231,6 +342,13 @@ struct thread_info {
 
     /* latency completion stats i/o time from io_submit until io_getevents */
     struct io_latency io_completion_latency;
+
+    /* the same, for reads and writes apart, reported for the mixed stage */
+    struct io_latency io_read_latency;
+    struct io_latency io_write_latency;
+
+    /* how much of stage_mb_trans was read */
+    double stage_read_mb;
 };
 
 /*
@@ -262,29 +380,120 @@ static double time_since_now(struct timeval *start_tv)
     return time_since(start_tv, &stop_time);
 }
 
+/*
+ * return CLOCK_MONOTONIC in nanoseconds, for latencies
+ */
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int lat_bucket(unsigned long long ns)
+{
+    int msb;
+
+    if (ns < LAT_SUB)
+        return ns;
+    msb = 63 - __builtin_clzll(ns);
+    return (msb - LAT_SUB_BITS + 1) * LAT_SUB +
+	   ((ns >> (msb - LAT_SUB_BITS)) & (LAT_SUB - 1));
+}
+
+/* the largest value that goes in bucket i */
+static unsigned long long lat_bucket_max(int i)
+{
+    int shift;
+
+    if (i < LAT_SUB)
+        return i;
+    shift = i / LAT_SUB - 1;
+    return ((unsigned long long)(LAT_SUB + i % LAT_SUB) << shift) +
+	   (1ULL << shift) - 1;
+}
+
+static void reset_latency(struct io_latency *lat)
+{
+    memset(lat, 0, sizeof(*lat));
+    lat->min = ULLONG_MAX;
+}
+
 /*
  * Add latency info to latency struct 
  */
-static void calc_latency(struct timeval *start_tv, struct timeval *stop_tv,
+static void calc_latency(unsigned long long start, unsigned long long stop,
 			struct io_latency *lat)
 {
-    double delta;
-    int i;
-    delta = time_since(start_tv, stop_tv);
-    delta = delta * 1000;
+    unsigned long long delta = stop > start ? stop - start : 0;
 
     if (delta > lat->max)
     	lat->max = delta;
-    if (!lat->min || delta < lat->min)
+    if (delta < lat->min)
     	lat->min = delta;
     lat->total_io++;
     lat->total_lat += delta;
-    for (i = 0 ; i < DEVIATIONS ; i++) {
-        if (delta < deviations[i]) {
-	    lat->deviations[i]++;
+    lat->buckets[lat_bucket(delta)]++;
+}
+
+/*
+ * add the latencies of a thread to those of the stage.  This is done by
+ * each thread at the end of the stage, with atomics rather than a lock,
+ * and the stage totals are only read once all threads are done
+ */
+static void merge_latency(struct io_latency *to, struct io_latency *from)
+{
+    unsigned long long old;
+    int i;
+
+    if (!from->total_io)
+        return;
+    __atomic_fetch_add(&to->total_io, from->total_io, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&to->total_lat, from->total_lat, __ATOMIC_RELAXED);
+    for (i = 0 ; i < LAT_BUCKETS ; i++) {
+	if (from->buckets[i])
+	    __atomic_fetch_add(&to->buckets[i], from->buckets[i],
+			       __ATOMIC_RELAXED);
+    }
+    old = __atomic_load_n(&to->min, __ATOMIC_RELAXED);
+    while (from->min < old &&
+           !__atomic_compare_exchange_n(&to->min, &old, from->min, 0,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	;
+    old = __atomic_load_n(&to->max, __ATOMIC_RELAXED);
+    while (from->max > old &&
+           !__atomic_compare_exchange_n(&to->max, &old, from->max, 0,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	;
+}
+
+/*
+ * the latency below which pct percent of the ios were, as the top of the
+ * bucket it falls in
+ */
+static unsigned long long lat_percentile(struct io_latency *lat, double pct)
+{
+    unsigned long long want;
+    unsigned long long seen = 0;
+    unsigned long long ret;
+    int i;
+
+    want = (unsigned long long)(lat->total_io * pct / 100);
+    if (want < lat->total_io * pct / 100)
+        want++;
+    if (!want)
+        want = 1;
+    for (i = 0 ; i < LAT_BUCKETS ; i++) {
+	seen += lat->buckets[i];
+	if (seen >= want)
 	    break;
-	}
     }
+    ret = lat_bucket_max(i);
+    if (ret > lat->max)
+        ret = lat->max;
+    if (ret < lat->min)
+        ret = lat->min;
+    return ret;
 }
 
 static void oper_list_add(struct io_oper *oper, struct io_oper **list)
@@ -325,7 +534,7 @@ static int check_finished_io(struct io_unit *io) {
   		  * If file size is large enough for the read, then this short
   		  * read is an error.
   		  */
-  		 if ((io->io_oper->rw == READ || io->io_oper->rw == RREAD) &&
+  		 if (io->iocb.aio_lio_opcode == IO_CMD_PREAD &&
   		     s.st_size > (io->iocb.u.c.offset + io->res)) {
   
   		 		 fprintf(stderr, "io err %lu (%s) op %d, off %Lu size %d\n",
@@ -374,15 +583,26 @@ char *stage_name(int rw) {
         return "random write";
     case RREAD:
         return "random read";
+    case MIXED:
+        return "mixed";
     }
     return "unknown";
 }
 
+char *engine_name(void) {
+    return engine == ENGINE_URING ? "io_uring" : "libaio";
+}
+
 static inline double oper_mb_trans(struct io_oper *oper) {
     return ((double)oper->started_ios * (double)oper->reclen) /
                 (double)(1024 * 1024);
 }
 
+static inline double oper_read_mb(struct io_oper *oper) {
+    return ((double)oper->started_reads * (double)oper->reclen) /
+                (double)(1024 * 1024);
+}
+
 static void print_time(struct io_oper *oper) {
     double runtime;
     double tput;
@@ -391,37 +611,137 @@ static void print_time(struct io_oper *oper) {
     runtime = time_since_now(&oper->start_time); 
     mb = oper_mb_trans(oper);
     tput = mb / runtime;
+    if (oper->rw == MIXED) {
+	fprintf(stderr, "%s on %s (%.2f MB/s) %.2f MB in %.2fs, "
+		"read %.2f MB/s write %.2f MB/s\n",
+		stage_name(oper->rw), oper->file_name, tput, mb, runtime,
+		oper_read_mb(oper) / runtime,
+		(mb - oper_read_mb(oper)) / runtime);
+	return;
+    }
     fprintf(stderr, "%s on %s (%.2f MB/s) %.2f MB in %.2fs\n", 
 	    stage_name(oper->rw), oper->file_name, tput, mb, runtime);
 }
 
-static void print_lat(char *str, struct io_latency *lat) {
-    double avg = lat->total_lat / lat->total_io;
+/* latencies are printed in usecs */
+static void print_lat(char *prefix, char *stage, char *str,
+		      struct io_latency *lat) {
     int i;
-    double total_counted = 0;
-    fprintf(stderr, "%s min %.2f avg %.2f max %.2f\n\t", 
-            str, lat->min, avg, lat->max);
 
-    for (i = 0 ; i < DEVIATIONS ; i++) {
-	fprintf(stderr, " %.0f < %d", lat->deviations[i], deviations[i]);
-	total_counted += lat->deviations[i];
-    }
-    if (total_counted && lat->total_io - total_counted)
-        fprintf(stderr, " < %.0f", lat->total_io - total_counted);
+    if (!lat->total_io)
+        return;
+    flockfile(stderr);
+    fprintf(stderr, "%s%s %s min %.2f avg %.2f max %.2f usec\n\t",
+            prefix, stage, str, lat->min / 1000.0,
+	    (double)lat->total_lat / lat->total_io / 1000.0,
+	    lat->max / 1000.0);
+    for (i = 0 ; i < NR_PERCENTILES ; i++)
+	fprintf(stderr, " p%g %.2f", percentiles[i],
+	        lat_percentile(lat, percentiles[i]) / 1000.0);
     fprintf(stderr, "\n");
-    memset(lat, 0, sizeof(*lat));
+    funlockfile(stderr);
+}
+
+/*
+ * write a histogram to the -J file as one JSON object on a line of its
+ * own.  thread is -1 for the stage totals of all threads.  Buckets are
+ * given as [largest ns in the bucket, ios] and only when not empty.
+ */
+static void json_lat(long thread, char *stage, char *type,
+		     struct io_latency *lat)
+{
+    int i;
+    char *sep = "";
+
+    if (!json_file || !lat->total_io)
+        return;
+    flockfile(json_file);
+    fprintf(json_file, "{\"stage\": \"%s\", ", stage);
+    if (thread < 0)
+	fprintf(json_file, "\"threads\": %d, ", num_threads);
+    else
+	fprintf(json_file, "\"thread\": %ld, ", thread);
+    fprintf(json_file, "\"type\": \"%s\", \"engine\": \"%s\", "
+	    "\"ios\": %llu, \"min_ns\": %llu, \"avg_ns\": %llu, "
+	    "\"max_ns\": %llu", type, engine_name(), lat->total_io, lat->min,
+	    lat->total_lat / lat->total_io, lat->max);
+    for (i = 0 ; i < NR_PERCENTILES ; i++)
+	fprintf(json_file, ", \"p%g_ns\": %llu", percentiles[i],
+	        lat_percentile(lat, percentiles[i]));
+    fprintf(json_file, ", \"buckets\": [");
+    for (i = 0 ; i < LAT_BUCKETS ; i++) {
+	if (!lat->buckets[i])
+	    continue;
+	fprintf(json_file, "%s[%llu, %llu]", sep, lat_bucket_max(i),
+	        lat->buckets[i]);
+	sep = ", ";
+    }
+    fprintf(json_file, "]}\n");
+    fflush(json_file);
+    funlockfile(json_file);
 }
 
-static void print_latency(struct thread_info *t)
+/*
+ * report the latencies of a thread for the stage it just finished, add
+ * them to the stage totals and start over
+ */
+static void thread_latency(struct thread_info *t, char *stage)
 {
-    struct io_latency *lat = &t->io_submit_latency;
-    print_lat("latency", lat);
+    long thread = t - global_thread_info;
+    char prefix[32];
+
+    snprintf(prefix, sizeof(prefix), "thread %ld ", thread);
+    if (latency_stats) {
+	print_lat(prefix, stage, "latency", &t->io_submit_latency);
+	json_lat(thread, stage, "submit", &t->io_submit_latency);
+	merge_latency(&stage_submit_latency, &t->io_submit_latency);
+    }
+    if (completion_latency_stats) {
+	print_lat(prefix, stage, "completion latency",
+		  &t->io_completion_latency);
+	json_lat(thread, stage, "completion", &t->io_completion_latency);
+    }
+    /* a sweep wants the completion latencies of the stage either way */
+    merge_latency(&stage_completion_latency, &t->io_completion_latency);
+    if (completion_latency_stats && !strcmp(stage, stage_name(MIXED))) {
+	print_lat(prefix, stage, "read completion latency",
+		  &t->io_read_latency);
+	json_lat(thread, stage, "read completion", &t->io_read_latency);
+	merge_latency(&stage_read_latency, &t->io_read_latency);
+	print_lat(prefix, stage, "write completion latency",
+		  &t->io_write_latency);
+	json_lat(thread, stage, "write completion", &t->io_write_latency);
+	merge_latency(&stage_write_latency, &t->io_write_latency);
+    }
+    reset_latency(&t->io_submit_latency);
+    reset_latency(&t->io_completion_latency);
+    reset_latency(&t->io_read_latency);
+    reset_latency(&t->io_write_latency);
 }
 
-static void print_completion_latency(struct thread_info *t)
+/*
+ * report the latencies of all threads for a stage, called once every
+ * thread is done with it
+ */
+static void stage_latency(char *stage)
 {
-    struct io_latency *lat = &t->io_completion_latency;
-    print_lat("completion latency", lat);
+    if (num_threads > 1) {
+	print_lat("", stage, "latency", &stage_submit_latency);
+	if (completion_latency_stats)
+	    print_lat("", stage, "completion latency",
+		      &stage_completion_latency);
+	print_lat("", stage, "read completion latency", &stage_read_latency);
+	print_lat("", stage, "write completion latency", &stage_write_latency);
+    }
+    json_lat(-1, stage, "submit", &stage_submit_latency);
+    if (completion_latency_stats)
+	json_lat(-1, stage, "completion", &stage_completion_latency);
+    json_lat(-1, stage, "read completion", &stage_read_latency);
+    json_lat(-1, stage, "write completion", &stage_write_latency);
+    reset_latency(&stage_submit_latency);
+    reset_latency(&stage_completion_latency);
+    reset_latency(&stage_read_latency);
+    reset_latency(&stage_write_latency);
 }
 
 /*
@@ -429,10 +749,16 @@ static void print_completion_latency(struct thread_info *t)
  * io unit, and make the io unit reusable again
  */
 void finish_io(struct thread_info *t, struct io_unit *io, long result,
-		struct timeval *tv_now) {
+		unsigned long long now) {
     struct io_oper *oper = io->io_oper;
 
-    calc_latency(&io->io_start_time, tv_now, &t->io_completion_latency);
+    calc_latency(io->io_start_time, now, &t->io_completion_latency);
+    if (oper->rw == MIXED) {
+	if (io->iocb.aio_lio_opcode == IO_CMD_PREAD)
+	    calc_latency(io->io_start_time, now, &t->io_read_latency);
+	else
+	    calc_latency(io->io_start_time, now, &t->io_write_latency);
+    }
     io->res = result;
     io->busy = IO_FREE;
     io->next = t->free_ious;
@@ -447,30 +773,126 @@ void finish_io(struct thread_info *t, struct io_unit *io, long result,
     } 
 }
 
+/*
+ * the io engines.  Both take the iocbs made by build_iocb and hand back
+ * completions as io_events, everything above them is shared.
+ */
+#ifdef URING
+static int uring_submit(struct thread_info *t, int nr, struct iocb **my_iocbs)
+{
+    struct io_uring_sqe *sqe;
+    struct io_unit *io;
+    int fd;
+    int i;
+    int ret;
+
+    for (i = 0 ; i < nr ; i++) {
+	sqe = io_uring_get_sqe(&t->ring);
+	if (!sqe)
+	    break;
+	io = (struct io_unit *)my_iocbs[i];
+	fd = uring_fixed_files ? io->io_oper->file_index : io->iocb.aio_fildes;
+	if (uring_fixed_bufs) {
+	    if (io->iocb.aio_lio_opcode == IO_CMD_PWRITE)
+		io_uring_prep_write_fixed(sqe, fd, io->buf, io->iocb.u.c.nbytes,
+					  io->iocb.u.c.offset, io - t->ios);
+	    else
+		io_uring_prep_read_fixed(sqe, fd, io->buf, io->iocb.u.c.nbytes,
+					 io->iocb.u.c.offset, io - t->ios);
+	} else {
+	    if (io->iocb.aio_lio_opcode == IO_CMD_PWRITE)
+		io_uring_prep_write(sqe, fd, io->buf, io->iocb.u.c.nbytes,
+				    io->iocb.u.c.offset);
+	    else
+		io_uring_prep_read(sqe, fd, io->buf, io->iocb.u.c.nbytes,
+				   io->iocb.u.c.offset);
+	}
+	if (uring_fixed_files)
+	    io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+	io_uring_sqe_set_data(sqe, io);
+    }
+    if (i == 0)
+	return -EAGAIN;
+
+    /*
+     * whatever the kernel doesn't take now stays on the sq ring and goes
+     * in with the next io_uring_submit_and_wait, so it is submitted as far
+     * as run_built is concerned
+     */
+    ret = io_uring_submit(&t->ring);
+    if (ret < 0 && ret != -EAGAIN && ret != -EBUSY)
+	return ret;
+    return i;
+}
+
+static int uring_getevents(struct thread_info *t, int min_nr, int nr,
+			   struct io_event *events)
+{
+    struct io_uring_cqe *cqe;
+    int ret;
+    int i;
+
+    /* like io_getevents, don't come back with fewer than min_nr */
+    do {
+	ret = io_uring_submit_and_wait(&t->ring, min_nr);
+	if (ret < 0 && ret != -EINTR)
+	    return ret;
+    } while (io_uring_cq_ready(&t->ring) < min_nr);
+
+    for (i = 0 ; i < nr ; i++) {
+	if (io_uring_peek_cqe(&t->ring, &cqe))
+	    break;
+	events[i].obj = io_uring_cqe_get_data(cqe);
+	events[i].res = cqe->res;
+	io_uring_cqe_seen(&t->ring, cqe);
+    }
+    return i;
+}
+#endif
+
+static int engine_submit(struct thread_info *t, int nr, struct iocb **my_iocbs)
+{
+#ifdef URING
+    if (engine == ENGINE_URING)
+	return uring_submit(t, nr, my_iocbs);
+#endif
+    return io_submit(t->io_ctx, nr, my_iocbs);
+}
+
+static int engine_getevents(struct thread_info *t, int min_nr, int nr,
+			    struct io_event *events)
+{
+#ifdef URING
+    if (engine == ENGINE_URING)
+	return uring_getevents(t, min_nr, nr, events);
+#endif
+#ifdef NEW_GETEVENTS
+    return io_getevents(t->io_ctx, min_nr, nr, events, NULL);
+#else
+    return io_getevents(t->io_ctx, nr, events, NULL);
+#endif
+}
+
 int read_some_events(struct thread_info *t) {
     struct io_unit *event_io;
     struct io_event *event;
     int nr;
     int i; 
     int min_nr = io_iter;
-    struct timeval stop_time;
+    unsigned long long stop_time;
 
     if (t->num_global_pending < io_iter)
         min_nr = t->num_global_pending;
 
-#ifdef NEW_GETEVENTS
-    nr = io_getevents(t->io_ctx, min_nr, t->num_global_events, t->events,NULL);
-#else
-    nr = io_getevents(t->io_ctx, t->num_global_events, t->events, NULL);
-#endif
+    nr = engine_getevents(t, min_nr, t->num_global_events, t->events);
     if (nr <= 0)
         return nr;
 
-    gettimeofday(&stop_time, NULL);
+    stop_time = now_ns();
     for (i = 0 ; i < nr ; i++) {
 	event = t->events + i;
 	event_io = (struct io_unit *)((unsigned long)event->obj); 
-	finish_io(t, event_io, event->res, &stop_time);
+	finish_io(t, event_io, event->res, stop_time);
     }
     return nr;
 }
@@ -519,16 +941,10 @@ static int io_oper_wait(struct thread_info *t, struct io_oper *oper) {
     /* this func is not speed sensitive, no need to go wild reading
      * more than one event at a time
      */
-#ifdef NEW_GETEVENTS
-    while(io_getevents(t->io_ctx, 1, 1, &event, NULL) > 0) {
-#else
-    while(io_getevents(t->io_ctx, 1, &event, NULL) > 0) {
-#endif
-	struct timeval tv_now;
+    while(engine_getevents(t, 1, 1, &event) > 0) {
         event_io = (struct io_unit *)((unsigned long)event.obj); 
 
-	gettimeofday(&tv_now, NULL);
-	finish_io(t, event_io, event.res, &tv_now);
+	finish_io(t, event_io, event.res, now_ns());
 
 	if (oper->num_pending == 0)
 	    break;
@@ -572,6 +988,110 @@ off_t random_byte_offset(struct io_oper *oper) {
     return rand_byte;
 }
 
+static double rand_unit(void)
+{
+    return rand() / (RAND_MAX + 1.0);
+}
+
+/*
+ * set up what -D needs for an oper: the number of records it covers and
+ * for zipf, zeta(2) and zeta(n)
+ */
+static void dist_setup(struct io_oper *oper)
+{
+    unsigned long long a;
+    unsigned long long b;
+    unsigned long long r;
+    off_t i;
+    off_t n;
+
+    oper->nr_blocks = (oper->end - oper->start) / oper->reclen;
+    if (oper->nr_blocks < 1)
+        oper->nr_blocks = 1;
+
+    /* the step must be coprime with the records to be a permutation */
+    oper->scatter = 2654435761ULL;
+    for (a = oper->scatter, b = oper->nr_blocks ; b ; ) {
+	r = a % b;
+	a = b;
+	b = r;
+    }
+    if (a != 1)
+	oper->scatter = 1;
+
+    if (offset_dist != DIST_ZIPF)
+        return;
+    n = oper->nr_blocks < ZIPF_MAX_GEN ? oper->nr_blocks : ZIPF_MAX_GEN;
+    oper->zeta2 = 1.0 + pow(2.0, -dist_param);
+    oper->zetan = 0;
+    for (i = 1 ; i <= n ; i++)
+	oper->zetan += pow((double)i, -dist_param);
+}
+
+/*
+ * the rank the zipf, pareto or normal distribution picks, 0 being the
+ * hottest for zipf and pareto, and the middle of the file for normal
+ */
+static off_t dist_rank(struct io_oper *oper)
+{
+    off_t n = oper->nr_blocks;
+    double alpha;
+    double eta;
+    double u;
+    double z;
+    double v;
+
+    switch (offset_dist) {
+    case DIST_ZIPF:
+	/* Gray et al., Quickly Generating Billion-Record Synthetic Databases */
+	alpha = 1.0 / (1.0 - dist_param);
+	eta = (1.0 - pow(2.0 / n, 1.0 - dist_param)) /
+	      (1.0 - oper->zeta2 / oper->zetan);
+	u = rand_unit();
+	z = u * oper->zetan;
+	if (z < 1.0)
+	    return 0;
+	if (z < 1.0 + pow(0.5, dist_param))
+	    return 1 % n;
+	v = n * pow(eta * u - eta + 1.0, alpha);
+	return v < n ? (off_t)v : n - 1;
+    case DIST_PARETO:
+	/*
+	 * dist_param of the ios go to 1 - dist_param of the records, the
+	 * ones near n - 1, so count the ranks from there
+	 */
+	v = (n - 1) * pow(rand_unit(),
+			  log(dist_param) / log(1.0 - dist_param));
+	return n - 1 - (off_t)v;
+    case DIST_NORMAL:
+	/* Box-Muller, dist_param is the deviation in percent of the range */
+	do {
+	    u = 1.0 - rand_unit();
+	    z = sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * rand_unit());
+	    v = n / 2.0 + z * n * dist_param / 100.0;
+	} while (v < 0 || v >= n);
+	return (off_t)v;
+    }
+    return 0;
+}
+
+/*
+ * byte offset of the next random or mixed io.  Uniform keeps the old
+ * megabyte based offsets, the others pick a record and spread the ranks
+ * over the file so that the hot records aren't all at the start of it
+ */
+static off_t random_offset(struct io_oper *oper)
+{
+    unsigned long long rank;
+
+    if (offset_dist == DIST_UNIFORM)
+	return random_byte_offset(oper);
+    rank = dist_rank(oper);
+    if (offset_dist != DIST_NORMAL)
+	rank = (rank * oper->scatter) % oper->nr_blocks;
+    return oper->start + rank * oper->reclen;
+}
+
 /* 
  * build an aio iocb for an operation, based on oper->rw and the
  * last offset used.  This finds the struct io_unit that will be attached
@@ -603,18 +1123,28 @@ static struct io_unit *build_iocb(struct thread_info *t, struct io_oper *oper)
 	oper->last_offset += oper->reclen;
 	break;
     case RREAD:
-	rand_byte = random_byte_offset(oper);
+	rand_byte = random_offset(oper);
 	oper->last_offset = rand_byte;
         io_prep_pread(&io->iocb,oper->fd, io->buf, oper->reclen, 
 	              rand_byte);
         break;
     case RWRITE:
-	rand_byte = random_byte_offset(oper);
+	rand_byte = random_offset(oper);
 	oper->last_offset = rand_byte;
         io_prep_pwrite(&io->iocb,oper->fd, io->buf, oper->reclen, 
 	              rand_byte);
         
         break;
+    case MIXED:
+	rand_byte = random_offset(oper);
+	oper->last_offset = rand_byte;
+	if (rand() % 100 < read_pct)
+	    io_prep_pread(&io->iocb,oper->fd, io->buf, oper->reclen,
+			  rand_byte);
+	else
+	    io_prep_pwrite(&io->iocb,oper->fd, io->buf, oper->reclen,
+			   rand_byte);
+	break;
     }
 
     return io;
@@ -665,6 +1195,7 @@ create_oper(int fd, int rw, off_t start, off_t end, int reclen, int depth,
     oper->rw = rw;
     oper->total_ios = (oper->end - oper->start) / oper->reclen;
     oper->file_name = file_name;
+    dist_setup(oper);
 
     return oper;
 }
@@ -703,7 +1234,7 @@ int build_oper(struct thread_info *t, struct io_oper *oper, int num_ios,
  * counters in the associated oper struct
  */
 static void update_iou_counters(struct iocb **my_iocbs, int nr,
-	struct timeval *tv_now) 
+	unsigned long long now) 
 {
     struct io_unit *io;
     int i;
@@ -711,7 +1242,9 @@ static void update_iou_counters(struct iocb **my_iocbs, int nr,
 	io = (struct io_unit *)(my_iocbs[i]);
 	io->io_oper->num_pending++;
 	io->io_oper->started_ios++;
-	io->io_start_time = *tv_now;	/* set time of io_submit */
+	if (io->iocb.aio_lio_opcode == IO_CMD_PREAD)
+	    io->io_oper->started_reads++;
+	io->io_start_time = now;	/* set time of io_submit */
     }
 }
 
@@ -719,19 +1252,19 @@ static void update_iou_counters(struct iocb **my_iocbs, int nr,
 int run_built(struct thread_info *t, int num_ios, struct iocb **my_iocbs) 
 {
     int ret;
-    struct timeval start_time;
-    struct timeval stop_time;
+    unsigned long long start_time;
+    unsigned long long stop_time;
 
 resubmit:
-    gettimeofday(&start_time, NULL);
-    ret = io_submit(t->io_ctx, num_ios, my_iocbs);
-    gettimeofday(&stop_time, NULL);
-    calc_latency(&start_time, &stop_time, &t->io_submit_latency);
+    start_time = now_ns();
+    ret = engine_submit(t, num_ios, my_iocbs);
+    stop_time = now_ns();
+    calc_latency(start_time, stop_time, &t->io_submit_latency);
 
     if (ret != num_ios) {
 	/* some ios got through */
 	if (ret > 0) {
-	    update_iou_counters(my_iocbs, ret, &stop_time);
+	    update_iou_counters(my_iocbs, ret, stop_time);
 	    my_iocbs += ret;
 	    t->num_global_pending += ret;
 	    num_ios -= ret;
@@ -753,7 +1286,7 @@ resubmit:
 	fprintf(stderr, "ret %d (%s) on io_submit\n", ret, strerror(-ret));
 	return -1;
     }
-    update_iou_counters(my_iocbs, ret, &stop_time);
+    update_iou_counters(my_iocbs, ret, stop_time);
     t->num_global_pending += ret;
     return 0;
 }
@@ -778,10 +1311,14 @@ static int restart_oper(struct io_oper *oper) {
     case RWRITE:
 	if (!new_rw && stages & (1 << RREAD))
 	    new_rw = RREAD;
+    case RREAD:
+	if (!new_rw && stages & (1 << MIXED))
+	    new_rw = MIXED;
     }
 
     if (new_rw) {
 	oper->started_ios = 0;
+	oper->started_reads = 0;
 	oper->last_offset = oper->start;
 	oper->stonewalled = 0;
 
@@ -903,65 +1440,350 @@ void aio_setup(io_context_t *io_ctx, int n)
     }
 }
 
+#ifdef URING
 /*
- * allocate io operation and event arrays for a given thread
+ * the ring is sized so every io unit of the thread fits on it at once.
+ * -F registers each io unit's buffer at its index in t->ios, -R registers
+ * the fds of the thread's opers in list order
  */
-int setup_ious(struct thread_info *t, 
-              int num_files, int depth, 
-	      int reclen, int max_io_submit) {
+void uring_setup(struct thread_info *t)
+{
+    struct io_uring_params p;
+    struct io_oper *oper;
+    struct iovec *iovecs;
+    int *fds;
+    int res;
     int i;
-    size_t bytes = num_files * depth * sizeof(*t->ios);
 
-    t->ios = malloc(bytes);
-    if (!t->ios) {
-	fprintf(stderr, "unable to allocate io units\n");
-	return -1;
+    memset(&p, 0, sizeof(p));
+    if (uring_iopoll)
+	p.flags |= IORING_SETUP_IOPOLL;
+    if (uring_sqpoll)
+	p.flags |= IORING_SETUP_SQPOLL;
+    res = io_uring_queue_init_params(t->num_global_ios, &t->ring, &p);
+    if (res != 0) {
+	fprintf(stderr, "io_uring_queue_init(%d) returned %d (%s)\n",
+		t->num_global_ios, res, strerror(-res));
+	exit(3);
     }
-    memset(t->ios, 0, bytes);
 
-    for (i = 0 ; i < depth * num_files; i++) {
-	t->ios[i].buf = aligned_buffer;
-	aligned_buffer += padded_reclen;
-	t->ios[i].buf_size = reclen;
-	if (verify)
-	    memset(t->ios[i].buf, 'b', reclen);
-	else
-	    memset(t->ios[i].buf, 0, reclen);
-	t->ios[i].next = t->free_ious;
-	t->free_ious = t->ios + i;
+    if (uring_fixed_bufs) {
+	iovecs = malloc(sizeof(*iovecs) * t->num_global_ios);
+	if (!iovecs) {
+	    fprintf(stderr, "unable to allocate iovecs\n");
+	    exit(3);
+	}
+	for (i = 0 ; i < t->num_global_ios ; i++) {
+	    iovecs[i].iov_base = t->ios[i].buf;
+	    iovecs[i].iov_len = t->ios[i].buf_size;
+	}
+	res = io_uring_register_buffers(&t->ring, iovecs, t->num_global_ios);
+	free(iovecs);
+	if (res != 0) {
+	    fprintf(stderr, "io_uring_register_buffers returned %d (%s)\n",
+		    res, strerror(-res));
+	    exit(3);
+	}
     }
-    if (verify) {
-        verify_buf = aligned_buffer;
-        memset(verify_buf, 'b', reclen);
+
+    if (uring_fixed_files && t->active_opers) {
+	fds = malloc(sizeof(*fds) * t->num_files);
+	if (!fds) {
+	    fprintf(stderr, "unable to allocate fds\n");
+	    exit(3);
+	}
+	i = 0;
+	oper = t->active_opers;
+	do {
+	    oper->file_index = i;
+	    fds[i++] = oper->fd;
+	    oper = oper->next;
+	} while (oper != t->active_opers);
+	res = io_uring_register_files(&t->ring, fds, i);
+	free(fds);
+	if (res != 0) {
+	    fprintf(stderr, "io_uring_register_files returned %d (%s)\n",
+		    res, strerror(-res));
+	    exit(3);
+	}
     }
+}
+#endif
 
-    t->iocbs = malloc(sizeof(struct iocb *) * max_io_submit);
-    if (!t->iocbs) {
-        fprintf(stderr, "unable to allocate iocbs\n");
-	goto free_buffers;
+void engine_setup(struct thread_info *t)
+{
+#ifdef URING
+    if (engine == ENGINE_URING) {
+	uring_setup(t);
+	return;
     }
+#endif
+    aio_setup(&t->io_ctx, 512);
+}
 
-    memset(t->iocbs, 0, max_io_submit * sizeof(struct iocb *));
+void engine_release(struct thread_info *t)
+{
+#ifdef URING
+    if (engine == ENGINE_URING) {
+	io_uring_queue_exit(&t->ring);
+	return;
+    }
+#endif
+    io_queue_release(t->io_ctx);
+}
 
-    t->events = malloc(sizeof(struct io_event) * depth * num_files);
-    if (!t->events) {
-        fprintf(stderr, "unable to allocate ram for events\n");
-	goto free_buffers;
+/*
+ * parse a list like 0-3,8,10-11 into an array of ints, for the cpus of
+ * -A and the thread, depth and file counts of a sweep
+ */
+int parse_list(char *arg, int **list, int *nr)
+{
+    char *p = arg;
+    char *end;
+    long first;
+    long last;
+
+    *nr = 0;
+    while (*p) {
+	first = strtol(p, &end, 10);
+	if (end == p || first < 0)
+	    return -1;
+	last = first;
+	if (*end == '-') {
+	    p = end + 1;
+	    last = strtol(p, &end, 10);
+	    if (end == p || last < first)
+		return -1;
+	}
+	if (last > INT_MAX)
+	    return -1;
+	for (; first <= last ; first++) {
+	    *list = realloc(*list, sizeof(**list) * (*nr + 1));
+	    if (!*list) {
+		perror("realloc");
+		exit(1);
+	    }
+	    (*list)[(*nr)++] = first;
+	}
+	if (*end == ',')
+	    end++;
+	else if (*end)
+	    return -1;
+	p = end;
     }
-    memset(t->events, 0, num_files * sizeof(struct io_event)*depth);
+    return *nr ? 0 : -1;
+}
 
-    t->num_global_ios = num_files * depth;
-    t->num_global_events = t->num_global_ios;
-    return 0;
+/* a list of counts, which can't be zero */
+int parse_count_list(char *arg, int **list, int *nr)
+{
+    int i;
 
-free_buffers:
-    if (t->ios)
-        free(t->ios);
-    if (t->iocbs)
-        free(t->iocbs);  
-    if (t->events)
-        free(t->events);
-    return -1;
+    if (parse_list(arg, list, nr))
+	return -1;
+    for (i = 0 ; i < *nr ; i++) {
+	if ((*list)[i] < 1)
+	    return -1;
+    }
+    return 0;
+}
+
+/*
+ * the numa node of a cpu, from the nodeN link sysfs has for it.  Kernels
+ * without numa have none, and everything is node 0
+ */
+int cpu_node(int cpu)
+{
+    char path[64];
+    struct dirent *de;
+    DIR *dir;
+    int node = 0;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    dir = opendir(path);
+    if (!dir)
+	return 0;
+    while ((de = readdir(dir)) != NULL) {
+	if (sscanf(de->d_name, "node%d", &node) == 1)
+	    break;
+	node = 0;
+    }
+    closedir(dir);
+    return node;
+}
+
+/*
+ * parse -D, the distribution name and its parameter after a colon
+ */
+int parse_dist(char *arg)
+{
+    char *param = strchr(arg, ':');
+    char *end;
+
+    if (param)
+	*param++ = '\0';
+    if (!strcmp(arg, "uniform")) {
+	offset_dist = DIST_UNIFORM;
+	return param ? -1 : 0;
+    }
+    if (!param)
+	return -1;
+    dist_param = strtod(param, &end);
+    if (end == param || *end || !(dist_param > 0))
+	return -1;
+    if (!strcmp(arg, "zipf") && dist_param != 1.0)
+	offset_dist = DIST_ZIPF;
+    else if (!strcmp(arg, "pareto") && dist_param < 1.0)
+	offset_dist = DIST_PARETO;
+    else if (!strcmp(arg, "normal"))
+	offset_dist = DIST_NORMAL;
+    else
+	return -1;
+    return 0;
+}
+
+/* size of the default huge pages, zero if there are none */
+size_t huge_page_size(void)
+{
+    char line[128];
+    size_t kb = 0;
+    FILE *f;
+
+    f = fopen("/proc/meminfo", "r");
+    if (!f)
+	return 0;
+    while (fgets(line, sizeof(line), f)) {
+	if (sscanf(line, "Hugepagesize: %zu kB", &kb) == 1)
+	    break;
+    }
+    fclose(f);
+    return kb * 1024;
+}
+
+/*
+ * bind the io buffers of a thread to its numa node.  This is done before
+ * anything touches them, so the pages are allocated there in the first
+ * place, and MPOL_MF_MOVE takes care of any that already were
+ */
+int bind_buffers(struct thread_info *t, char *buf, size_t len)
+{
+    unsigned long nodemask[1024 / (8 * sizeof(unsigned long))];
+    long ret;
+
+    if (t->node >= 1024) {
+	fprintf(stderr, "numa node %d is too large\n", t->node);
+	return -1;
+    }
+    memset(nodemask, 0, sizeof(nodemask));
+    nodemask[t->node / (8 * sizeof(unsigned long))] |=
+		1UL << (t->node % (8 * sizeof(unsigned long)));
+    len = (len + buffer_chunk - 1) & ~(buffer_chunk - 1);
+    ret = syscall(SYS_mbind, buf, len, MPOL_BIND, nodemask,
+		  sizeof(nodemask) * 8, MPOL_MF_MOVE);
+    if (ret) {
+	fprintf(stderr, "mbind to node %d failed: %s\n", t->node,
+		strerror(errno));
+	return -1;
+    }
+    return 0;
+}
+
+/*
+ * free the io buffers, and the io unit and event arrays of the threads
+ */
+void free_buffers(struct thread_info *t, int num_threads)
+{
+    int i;
+
+    for (i = 0 ; i < num_threads ; i++) {
+	free(t[i].ios);
+	free(t[i].iocbs);
+	free(t[i].events);
+    }
+    if (use_shm == USE_MALLOC) {
+	free(unaligned_buffer);
+    } else if (use_shm == USE_SHM) {
+	shmdt(unaligned_buffer);
+    } else {
+	munmap(unaligned_buffer, buffer_ram);
+	if (use_shm == USE_SHMFS)
+	    close(shm_id);
+    }
+    unaligned_buffer = NULL;
+    aligned_buffer = NULL;
+}
+
+/*
+ * allocate io operation and event arrays for a given thread
+ */
+int setup_ious(struct thread_info *t, 
+              int num_files, int depth, 
+	      int reclen, int max_io_submit) {
+    int i;
+    size_t bytes = num_files * depth * sizeof(*t->ios);
+
+    t->ios = malloc(bytes);
+    if (!t->ios) {
+	fprintf(stderr, "unable to allocate io units\n");
+	return -1;
+    }
+    memset(t->ios, 0, bytes);
+    reset_latency(&t->io_submit_latency);
+    reset_latency(&t->io_completion_latency);
+    reset_latency(&t->io_read_latency);
+    reset_latency(&t->io_write_latency);
+
+    if (numa_buffers) {
+	aligned_buffer = (char *)(((intptr_t)aligned_buffer + buffer_chunk - 1) &
+				  ~(intptr_t)(buffer_chunk - 1));
+	if (bind_buffers(t, aligned_buffer,
+			 (size_t)depth * num_files * padded_reclen))
+	    return -1;
+    }
+
+    for (i = 0 ; i < depth * num_files; i++) {
+	t->ios[i].buf = aligned_buffer;
+	aligned_buffer += padded_reclen;
+	t->ios[i].buf_size = reclen;
+	if (verify)
+	    memset(t->ios[i].buf, 'b', reclen);
+	else
+	    memset(t->ios[i].buf, 0, reclen);
+	t->ios[i].next = t->free_ious;
+	t->free_ious = t->ios + i;
+    }
+    if (verify) {
+        verify_buf = aligned_buffer;
+        memset(verify_buf, 'b', reclen);
+    }
+
+    t->iocbs = malloc(sizeof(struct iocb *) * max_io_submit);
+    if (!t->iocbs) {
+        fprintf(stderr, "unable to allocate iocbs\n");
+	goto free_buffers;
+    }
+
+    memset(t->iocbs, 0, max_io_submit * sizeof(struct iocb *));
+
+    t->events = malloc(sizeof(struct io_event) * depth * num_files);
+    if (!t->events) {
+        fprintf(stderr, "unable to allocate ram for events\n");
+	goto free_buffers;
+    }
+    memset(t->events, 0, num_files * sizeof(struct io_event)*depth);
+
+    t->num_global_ios = num_files * depth;
+    t->num_global_events = t->num_global_ios;
+    return 0;
+
+free_buffers:
+    if (t->ios)
+        free(t->ios);
+    if (t->iocbs)
+        free(t->iocbs);  
+    if (t->events)
+        free(t->events);
+    return -1;
 }
 
 /*
@@ -983,6 +1805,16 @@ int setup_shared_mem(int num_threads, int num_files, int depth,
     if (verify)
     	total_ram += padded_reclen;
 
+    /* with -N each thread's buffers start and end on a chunk of their own */
+    if (numa_buffers) {
+	buffer_chunk = getpagesize();
+	if (use_shm == USE_HUGETLB)
+	    buffer_chunk = huge_page_size();
+	if (buffer_chunk < page_size_mask + 1)
+	    buffer_chunk = page_size_mask + 1;
+	total_ram += num_threads * 2 * buffer_chunk;
+    }
+
     if (use_shm == USE_MALLOC) {
 	p = malloc(total_ram + page_size_mask);
     } else if (use_shm == USE_SHM) {
@@ -1019,12 +1851,28 @@ int setup_shared_mem(int num_threads, int num_files, int depth,
 	    perror("mmap");
 	    goto free_buffers;
 	}
+    } else if (use_shm == USE_HUGETLB) {
+	size_t huge = huge_page_size();
+
+	if (!huge) {
+	    fprintf(stderr, "no huge pages\n");
+	    goto free_buffers;
+	}
+	total_ram = (total_ram + page_size_mask + huge - 1) & ~(huge - 1);
+	p = mmap(NULL, total_ram, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p == MAP_FAILED) {
+	    perror("mmap MAP_HUGETLB");
+	    p = NULL;
+	    goto free_buffers;
+	}
     }
     if (!p) {
         fprintf(stderr, "unable to allocate buffers\n");
 	goto free_buffers;
     }
     unaligned_buffer = p;
+    buffer_ram = total_ram;
     p = (char*)((intptr_t) (p + page_size_mask) & ~page_size_mask);
     aligned_buffer = p;
     return 0;
@@ -1042,12 +1890,17 @@ free_buffers:
  */
 void global_thread_throughput(struct thread_info *t, char *this_stage) {
     int i;
+    int j;
+    int node_threads;
     double runtime = time_since_now(&global_stage_start_time);
     double total_mb = 0;
+    double read_mb = 0;
     double min_trans = 0;
+    double node_mb;
 
     for (i = 0 ; i < num_threads ; i++) {
         total_mb += global_thread_info[i].stage_mb_trans;
+        read_mb += global_thread_info[i].stage_read_mb;
 	if (!min_trans || t->stage_mb_trans < min_trans)
 	    min_trans = t->stage_mb_trans;
     }
@@ -1057,11 +1910,194 @@ void global_thread_throughput(struct thread_info *t, char *this_stage) {
 	fprintf(stderr, "%.2f MB in %.2fs", total_mb, runtime);
         if (stonewall)
 	    fprintf(stderr, " min transfer %.2fMB", min_trans);
+	if (!strcmp(this_stage, stage_name(MIXED)))
+	    fprintf(stderr, ", read %.2f MB/s write %.2f MB/s",
+		    read_mb / runtime, (total_mb - read_mb) / runtime);
         fprintf(stderr, "\n");
     }
+
+    /* with -A, break it down by numa node, in order of first thread */
+    for (i = 0 ; total_mb && cpu_list && i < num_threads ; i++) {
+	for (j = 0 ; j < i ; j++) {
+	    if (global_thread_info[j].node == global_thread_info[i].node)
+		break;
+	}
+	if (j < i)
+	    continue;
+	node_mb = 0;
+	node_threads = 0;
+	for (j = i ; j < num_threads ; j++) {
+	    if (global_thread_info[j].node != global_thread_info[i].node)
+		continue;
+	    node_mb += global_thread_info[j].stage_mb_trans;
+	    node_threads++;
+	}
+	fprintf(stderr, "%s node %d throughput (%.2f MB/s) %.2f MB "
+		"from %d threads\n", this_stage, global_thread_info[i].node,
+		node_mb / runtime, node_mb, node_threads);
+    }
 }
 
 
+/*
+ * keep the results of a stage for the sweep report, called once every
+ * thread is done with it
+ */
+void sweep_record(int rw, double runtime)
+{
+    struct sweep_result *r;
+    double mb = 0;
+    int i;
+
+    if (!sweep)
+        return;
+    for (i = 0 ; i < num_threads ; i++)
+	mb += global_thread_info[i].stage_mb_trans;
+    if (!mb || runtime <= 0)
+	return;
+    sweep_results = realloc(sweep_results,
+			    sizeof(*r) * (nr_sweep_results + 1));
+    if (!sweep_results) {
+	perror("realloc");
+	exit(1);
+    }
+    r = sweep_results + nr_sweep_results++;
+    memset(r, 0, sizeof(*r));
+    r->threads = num_threads;
+    r->files = sweep_files;
+    r->depth = depth;
+    r->rw = rw;
+    r->mb_s = mb / runtime;
+    r->iops = mb * 1024 * 1024 / rec_len / runtime;
+    if (stage_completion_latency.total_io) {
+	r->p50 = lat_percentile(&stage_completion_latency, 50);
+	r->p99 = lat_percentile(&stage_completion_latency, 99);
+    }
+}
+
+/*
+ * the end of the group of rows starting at rows[i]: those of one thread
+ * and file count, which come in order of depth
+ */
+static int sweep_group_end(int *rows, int nr, int i)
+{
+    struct sweep_result *prev;
+    struct sweep_result *next;
+
+    for (i++ ; i < nr ; i++) {
+	prev = sweep_results + rows[i - 1];
+	next = sweep_results + rows[i];
+	if (next->threads != prev->threads || next->files != prev->files ||
+	    next->depth <= prev->depth)
+	    break;
+    }
+    return i;
+}
+
+/* the row with the most iops in the group rows[i] to rows[end - 1] */
+static struct sweep_result *sweep_group_best(int *rows, int i, int end)
+{
+    struct sweep_result *best = sweep_results + rows[i];
+
+    for (i++ ; i < end ; i++) {
+	if (sweep_results[rows[i]].iops > best->iops)
+	    best = sweep_results + rows[i];
+    }
+    return best;
+}
+
+/*
+ * print a table of the sweep for each stage, and for each thread and file
+ * count the knee: the smallest depth that gets within KNEE_GAIN percent of
+ * the best iops of any depth, deeper than that mostly adds latency.  Going
+ * by the best of the group rather than by the next depth keeps one noisy
+ * run from putting the knee early.  If only the deepest run gets there,
+ * there is no knee.  With -J the rows go to the JSON file too.
+ */
+void sweep_report(void)
+{
+    struct sweep_result *r;
+    struct sweep_result *best;
+    int *rows;
+    int nr;
+    int rw;
+    int i;
+    int j;
+    int k;
+
+    rows = malloc(sizeof(*rows) * (nr_sweep_results + 1));
+    if (!rows) {
+	perror("malloc");
+	exit(1);
+    }
+    for (rw = 0 ; rw < LAST_STAGE ; rw++) {
+	nr = 0;
+	for (i = 0 ; i < nr_sweep_results ; i++) {
+	    if (sweep_results[i].rw == rw)
+		rows[nr++] = i;
+	}
+	if (!nr)
+	    continue;
+
+	for (i = 0 ; i < nr ; i = j) {
+	    j = sweep_group_end(rows, nr, i);
+	    best = sweep_group_best(rows, i, j);
+	    for (k = i ; k + 1 < j ; k++) {
+		r = sweep_results + rows[k];
+		if (r->iops * (100 + KNEE_GAIN) / 100 >= best->iops) {
+		    r->knee = 1;
+		    break;
+		}
+	    }
+	}
+
+	fprintf(stderr, "\n%s sweep\n", stage_name(rw));
+	fprintf(stderr, "threads files depth       iops      MB/s   p50 usec   p99 usec\n");
+	for (i = 0 ; i < nr ; i++) {
+	    r = sweep_results + rows[i];
+	    fprintf(stderr, "%7d %5d %5d %10.0f %9.2f %10.2f %10.2f%s\n",
+		    r->threads, r->files, r->depth, r->iops, r->mb_s,
+		    r->p50 / 1000.0, r->p99 / 1000.0, r->knee ? " knee" : "");
+	    if (json_file)
+		fprintf(json_file, "{\"sweep\": \"%s\", \"engine\": \"%s\", "
+			"\"threads\": %d, \"files\": %d, \"depth\": %d, "
+			"\"iops\": %.0f, \"mb_s\": %.2f, \"p50_ns\": %llu, "
+			"\"p99_ns\": %llu, \"knee\": %s}\n", stage_name(rw),
+			engine_name(), r->threads, r->files, r->depth, r->iops,
+			r->mb_s, r->p50, r->p99, r->knee ? "true" : "false");
+	}
+
+	for (i = 0 ; i < nr ; i = j) {
+	    j = sweep_group_end(rows, nr, i);
+	    if (j - i < 2)
+		continue;
+	    for (k = i ; k + 1 < j ; k++) {
+		if (sweep_results[rows[k]].knee)
+		    break;
+	    }
+	    r = sweep_results + rows[k];
+	    if (k + 1 == j) {
+		fprintf(stderr, "threads %d files %d: no knee up to depth %d\n",
+			r->threads, r->files, r->depth);
+		continue;
+	    }
+	    best = sweep_group_best(rows, i, j);
+	    if (best == r) {
+		fprintf(stderr, "threads %d files %d: knee at depth %d, "
+			"deeper gets no more iops\n", r->threads, r->files,
+			r->depth);
+		continue;
+	    }
+	    fprintf(stderr, "threads %d files %d: knee at depth %d, "
+		    "the best depth %d adds %+.1f%% iops and %+.1f%% p99 "
+		    "latency\n", r->threads, r->files, r->depth, best->depth,
+		    (best->iops / r->iops - 1) * 100,
+		    r->p99 ? ((double)best->p99 / r->p99 - 1) * 100 : 0);
+	}
+    }
+    free(rows);
+}
+
 /* this is the meat of the state machine.  There is a list of
  * active operations structs, and as each one finishes the required
  * io it is moved to a list of finished operations.  Once they have
@@ -1075,12 +2111,25 @@ int worker(struct thread_info *t)
 {
     struct io_oper *oper;
     char *this_stage = NULL;
+    int stage_rw = 0;
     struct timeval stage_time;
     int status = 0;
     int iteration = 0;
     int cnt;
 
-    aio_setup(&t->io_ctx, 512);
+    if (t->cpu >= 0) {
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(t->cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set)) {
+	    fprintf(stderr, "unable to run thread %llu on cpu %d: %s\n",
+		    (unsigned long long)(t - global_thread_info), t->cpu,
+		    strerror(errno));
+	    exit(1);
+	}
+    }
+    engine_setup(t);
 
 restart:
     if (num_threads > 1) {
@@ -1096,9 +2145,11 @@ restart:
         pthread_mutex_unlock(&stage_mutex);
     }
     if (t->active_opers) {
-        this_stage = stage_name(t->active_opers->rw);
+        stage_rw = t->active_opers->rw;
+        this_stage = stage_name(stage_rw);
 	gettimeofday(&stage_time, NULL);
 	t->stage_mb_trans = 0;
+	t->stage_read_mb = 0;
     }
 
     cnt = 0;
@@ -1114,12 +2165,6 @@ restart:
         }
 	cnt++;
     }
-    if (latency_stats)
-        print_latency(t);
-
-    if (completion_latency_stats)
-	print_completion_latency(t);
-
     /* then we wait for all the operations to finish */
     oper = t->finished_opers;
     do {
@@ -1129,6 +2174,9 @@ restart:
 	oper = oper->next;
     } while(oper != t->finished_opers);
 
+    if (this_stage)
+	thread_latency(t, this_stage);
+
     /* then we do an fsync to get the timing for any future operations
      * right, and check to see if any of these need to get restarted
      */
@@ -1137,6 +2185,7 @@ restart:
 	if (fsync_stages)
             fsync(oper->fd);
 	t->stage_mb_trans += oper_mb_trans(oper);
+	t->stage_read_mb += oper_read_mb(oper);
 	if (restart_oper(oper)) {
 	    oper_list_del(oper, &t->finished_opers);
 	    oper_list_add(oper, &t->active_opers);
@@ -1150,9 +2199,16 @@ restart:
 
     if (t->stage_mb_trans && t->num_files > 0) {
         double seconds = time_since_now(&stage_time);
-	fprintf(stderr, "thread %llu %s totals (%.2f MB/s) %.2f MB in %.2fs\n",
+	flockfile(stderr);
+	fprintf(stderr, "thread %llu %s totals (%.2f MB/s) %.2f MB in %.2fs",
 	        (unsigned long long)(t - global_thread_info), this_stage,
 		t->stage_mb_trans/seconds, t->stage_mb_trans, seconds);
+	if (!strcmp(this_stage, stage_name(MIXED)))
+	    fprintf(stderr, ", read %.2f MB/s write %.2f MB/s",
+		    t->stage_read_mb / seconds,
+		    (t->stage_mb_trans - t->stage_read_mb) / seconds);
+	fprintf(stderr, "\n");
+	funlockfile(stderr);
     }
 
     if (num_threads > 1) {
@@ -1162,10 +2218,18 @@ restart:
 	    threads_starting = 0;
 	    pthread_cond_broadcast(&stage_cond);
 	    global_thread_throughput(t, this_stage);
+	    if (this_stage) {
+		sweep_record(stage_rw,
+			     time_since_now(&global_stage_start_time));
+		stage_latency(this_stage);
+	    }
 	}
 	while(threads_ending != num_threads)
 	    pthread_cond_wait(&stage_cond, &stage_mutex);
 	pthread_mutex_unlock(&stage_mutex);
+    } else if (this_stage) {
+	sweep_record(stage_rw, time_since_now(&stage_time));
+	stage_latency(this_stage);
     }
     
     /* someone got restarted, go back to the beginning */
@@ -1184,7 +2248,7 @@ restart:
     if (t->num_global_pending) {
         fprintf(stderr, "global num pending is %d\n", t->num_global_pending);
     }
-    io_queue_release(t->io_ctx);
+    engine_release(t);
     
     return status;
 }
@@ -1246,6 +2310,12 @@ off_t parse_size(char *size_arg, off_t mult) {
 void print_usage(void) {
     printf("usage: aio-stress [-s size] [-r size] [-a size] [-d num] [-b num]\n");
     printf("                  [-i num] [-t num] [-c num] [-C size] [-nxhOS ]\n");
+    printf("                  [-W [-t list] [-d list] [-f list]]\n");
+#ifdef URING
+    printf("                  [-E engine] [-FRPQ]\n");
+#else
+    printf("                  [-E engine]\n");
+#endif
     printf("                  file1 [file2 ...]\n");
     printf("\t-a size in KB at which to align buffers\n");
     printf("\t-b max number of iocbs to give io_submit at once\n");
@@ -1259,42 +2329,178 @@ void print_usage(void) {
     printf("\t-O Use O_DIRECT (not available in 2.4 kernels),\n");
     printf("\t-S Use O_SYNC for writes\n");
     printf("\t-o add an operation to the list: write=0, read=1,\n"); 
-    printf("\t   random write=2, random read=3.\n");
+    printf("\t   random write=2, random read=3, mixed random read/write=4.\n");
     printf("\t   repeat -o to specify multiple ops: -o 0 -o 1 etc.\n");
+    printf("\t-M percentage of reads in the mixed stage, default 50\n");
+    printf("\t-D offset distribution of the random and mixed stages:\n");
+    printf("\t   uniform (default), zipf:theta, pareto:h or normal:dev%%\n");
     printf("\t-m shm use ipc shared memory for io buffers instead of malloc\n");
     printf("\t-m shmfs mmap a file in /dev/shm for io buffers\n");
+    printf("\t-m hugetlb use huge pages for io buffers\n");
+    printf("\t-A cpu list like 0-3,8 to run thread i on the i-th cpu of,\n");
+    printf("\t   also reports throughput per numa node\n");
+    printf("\t-N put the io buffers of each thread on the numa node of\n");
+    printf("\t   its cpu, needs -A\n");
     printf("\t-n no fsyncs between write stage and read stage\n");
     printf("\t-l print io_submit latencies after each stage\n");
     printf("\t-L print io completion latencies after each stage\n");
+    printf("\t-J file also write the -l and -L latency histograms to file,\n");
+    printf("\t   as one JSON object per line\n");
     printf("\t-t number of threads to run\n");
+    printf("\t-W sweep: run the stages for every thread count, depth and\n");
+    printf("\t   file count given as lists like -t 1,2,4 -d 1-32,64 -f 1,2\n");
+    printf("\t   (-f uses the first n files), then print iops and p50/p99\n");
+    printf("\t   completion latency per point and the depth where adding\n");
+    printf("\t   more mostly adds latency.  -J also gets the rows\n");
     printf("\t-u unlink files after completion\n");
     printf("\t-v verification of bytes written\n");
     printf("\t-x turn off thread stonewalling\n");
+#ifdef URING
+    printf("\t-E io engine, libaio (default) or io_uring\n");
+    printf("\t-F io_uring: register the io buffers (fixed buffers)\n");
+    printf("\t-R io_uring: register the files\n");
+    printf("\t-P io_uring: polled completions (IOPOLL), needs -O and\n");
+    printf("\t   a device with poll queues\n");
+    printf("\t-Q io_uring: kernel submission thread (SQPOLL)\n");
+#else
+    printf("\t-E io engine, only libaio in this build\n");
+#endif
     printf("\t-h this message\n");
     printf("\n\t   the size options (-a -s and -r) allow modifiers -s 400{k,m,g}\n");
     printf("\t   translate to 400KB, 400MB and 400GB\n");
     printf("version %s\n", PROG_VERSION);
 }
 
-int main(int ac, char **av) 
+/*
+ * one run over the files: set up the threads, opers and buffers for the
+ * current num_threads and depth, run the stages and free it all again
+ */
+int run_test(char **files, int num_files, int first_stage, off_t file_size)
 {
     int rwfd;
     int i;
     int j;
+    struct io_oper *oper;
+    int status = 0;
+    int open_fds = 0;
+    struct thread_info *t;
+
+    /* 
+     * make sure we don't try to submit more ios than we have allocated
+     * memory for
+     */
+    if (depth < io_iter) {
+	io_iter = depth;
+        fprintf(stderr, "dropping io_iter to %d\n", io_iter);
+    }
+
+    if (num_threads > (num_files * num_contexts)) {
+        num_threads = num_files * num_contexts;
+	fprintf(stderr, "dropping thread count to the number of contexts %d\n", 
+	        num_threads);
+    }
+
+    t = calloc(num_threads, sizeof(*t));
+    if (!t) {
+        perror("calloc");
+	exit(1);
+    }
+    global_thread_info = t;
+    reset_latency(&stage_submit_latency);
+    reset_latency(&stage_completion_latency);
+    reset_latency(&stage_read_latency);
+    reset_latency(&stage_write_latency);
+    for (i = 0 ; i < num_threads ; i++) {
+	t[i].cpu = -1;
+	t[i].node = -1;
+	if (cpu_list) {
+	    t[i].cpu = cpu_list[i % nr_cpus];
+	    t[i].node = cpu_node(t[i].cpu);
+	    fprintf(stderr, "thread %d on cpu %d node %d\n", i, t[i].cpu,
+		    t[i].node);
+	}
+    }
+
+    /* by default, allow a huge number of iocbs to be sent towards
+     * io_submit
+     */
+    if (!max_io_submit)
+        max_io_submit = num_files * io_iter * num_contexts;
+
+    /*
+     * make sure we don't try to submit more ios than max_io_submit allows 
+     */
+    if (max_io_submit < io_iter) {
+        io_iter = max_io_submit;
+	fprintf(stderr, "dropping io_iter to %d\n", io_iter);
+    }
+
+    fprintf(stderr, "file size %LuMB, record size %luKB, depth %d, ios per iteration %d\n",
+	    (unsigned long long)file_size / (1024 * 1024),
+	    rec_len / 1024, depth, io_iter);
+    fprintf(stderr, "max io_submit %d, buffer alignment set to %luKB\n", 
+            max_io_submit, (page_size_mask + 1)/1024);
+    fprintf(stderr, "threads %d files %d contexts %d context offset %LuMB verification %s\n", 
+            num_threads, num_files, num_contexts, 
+	    (unsigned long long)context_offset / (1024 * 1024),
+	    verify ? "on" : "off");
+    /* open all the files and do any required setup for them */
+    for (i = 0 ; i < num_files ; i++) {
+	int thread_index;
+	for (j = 0 ; j < num_contexts ; j++) {
+	    thread_index = open_fds % num_threads;
+	    open_fds++;
+
+	    rwfd = open(files[i], O_CREAT | O_RDWR | o_direct | o_sync, 0600);
+	    assert(rwfd != -1);
+
+	    oper = create_oper(rwfd, first_stage, j * context_offset, 
+	                       file_size - j * context_offset, rec_len, 
+			       depth, io_iter, files[i]);
+	    if (!oper) {
+		fprintf(stderr, "error in create_oper\n");
+		exit(-1);
+	    }
+	    oper_list_add(oper, &t[thread_index].active_opers);
+	    t[thread_index].num_files++;
+	}
+    }
+    if (setup_shared_mem(num_threads, num_files * num_contexts, 
+                         depth, rec_len, max_io_submit))
+    {
+        exit(1);
+    }
+    for (i = 0 ; i < num_threads ; i++) {
+	if (setup_ious(&t[i], t[i].num_files, depth, rec_len, max_io_submit))
+		exit(1);
+    }
+    if (num_threads > 1){
+        printf("Running multi thread version num_threads:%d\n", num_threads);
+        run_workers(t, num_threads);
+    } else {
+        printf("Running single thread version \n");
+	status = worker(t);
+    }
+    free_buffers(t, num_threads);
+    free(t);
+    global_thread_info = NULL;
+    return status;
+}
+
+int main(int ac, char **av) 
+{
+    int i;
     int c;
 
     off_t file_size = 1 * 1024 * 1024 * 1024;
     int first_stage = WRITE;
-    struct io_oper *oper;
     int status = 0;
     int num_files = 0;
-    int open_fds = 0;
-    struct thread_info *t;
 
     page_size_mask = getpagesize() - 1;
 
     while(1) {
-	c = getopt(ac, av, "a:b:c:C:m:s:r:d:i:I:o:t:lLnhOSxvu");
+	c = getopt(ac, av, "a:A:b:c:C:D:E:f:J:m:M:s:r:d:i:I:o:t:lLnNhOSxvuFRPQW");
 	if  (c < 0)
 	    break;
 
@@ -1303,6 +2509,34 @@ int main(int ac, char **av)
 	    page_size_mask = parse_size(optarg, 1024);
 	    page_size_mask--;
 	    break;
+	case 'A':
+	    if (parse_list(optarg, &cpu_list, &nr_cpus)) {
+		fprintf(stderr, "bad cpu list %s\n", optarg);
+		exit(1);
+	    }
+	    for (i = 0 ; i < nr_cpus ; i++) {
+		if (cpu_list[i] >= CPU_SETSIZE) {
+		    fprintf(stderr, "cpu %d is too large\n", cpu_list[i]);
+		    exit(1);
+		}
+	    }
+	    break;
+	case 'N':
+	    numa_buffers = 1;
+	    break;
+	case 'M':
+	    read_pct = atoi(optarg);
+	    if (read_pct < 0 || read_pct > 100) {
+		fprintf(stderr, "read percentage must be 0 to 100\n");
+		exit(1);
+	    }
+	    break;
+	case 'D':
+	    if (parse_dist(optarg)) {
+		fprintf(stderr, "bad offset distribution %s\n", optarg);
+		exit(1);
+	    }
+	    break;
 	case 'c':
 	    num_contexts = atoi(optarg);
 	    break;
@@ -1315,7 +2549,11 @@ int main(int ac, char **av)
 	    file_size = parse_size(optarg, 1024 * 1024);
 	    break;
 	case 'd':
-	    depth = atoi(optarg);
+	    if (parse_count_list(optarg, &depth_list, &nr_depths)) {
+		fprintf(stderr, "bad depth %s\n", optarg);
+		exit(1);
+	    }
+	    depth = depth_list[0];
 	    break;
 	case 'r':
 	    rec_len = parse_size(optarg, 1024);
@@ -1335,6 +2573,13 @@ int main(int ac, char **av)
 	case 'L':
 	    completion_latency_stats = 1;
 	    break;
+	case 'J':
+	    json_file = fopen(optarg, "w");
+	    if (!json_file) {
+		perror(optarg);
+		exit(1);
+	    }
+	    break;
 	case 'm':
 	    if (!strcmp(optarg, "shm")) {
 		fprintf(stderr, "using ipc shm\n");
@@ -1342,6 +2587,9 @@ int main(int ac, char **av)
 	    } else if (!strcmp(optarg, "shmfs")) {
 	        fprintf(stderr, "using /dev/shm for buffers\n");
 		use_shm = USE_SHMFS;
+	    } else if (!strcmp(optarg, "hugetlb")) {
+	        fprintf(stderr, "using huge pages for buffers\n");
+		use_shm = USE_HUGETLB;
 	    }
 	    break;
 	case 'o': 
@@ -1356,7 +2604,20 @@ int main(int ac, char **av)
 	    o_sync = O_SYNC;
 	    break;
 	case 't':
-	    num_threads = atoi(optarg);
+	    if (parse_count_list(optarg, &threads_list, &nr_thread_counts)) {
+		fprintf(stderr, "bad thread count %s\n", optarg);
+		exit(1);
+	    }
+	    num_threads = threads_list[0];
+	    break;
+	case 'f':
+	    if (parse_count_list(optarg, &files_list, &nr_file_counts)) {
+		fprintf(stderr, "bad file count %s\n", optarg);
+		exit(1);
+	    }
+	    break;
+	case 'W':
+	    sweep = 1;
 	    break;
 	case 'x':
 	    stonewall = 0;
@@ -1367,6 +2628,30 @@ int main(int ac, char **av)
 	case 'v':
 	    verify = 1;
 	    break;
+	case 'E':
+	    if (!strcmp(optarg, "libaio")) {
+		engine = ENGINE_LIBAIO;
+#ifdef URING
+	    } else if (!strcmp(optarg, "io_uring")) {
+		engine = ENGINE_URING;
+#endif
+	    } else {
+		fprintf(stderr, "unknown io engine %s\n", optarg);
+		exit(1);
+	    }
+	    break;
+	case 'F':
+	    uring_fixed_bufs = 1;
+	    break;
+	case 'R':
+	    uring_fixed_files = 1;
+	    break;
+	case 'P':
+	    uring_iopoll = 1;
+	    break;
+	case 'Q':
+	    uring_sqpoll = 1;
+	    break;
 	case 'h':
 	default:
 	    print_usage();
@@ -1374,13 +2659,22 @@ int main(int ac, char **av)
 	}
     }
 
-    /* 
-     * make sure we don't try to submit more ios than we have allocated
-     * memory for
-     */
-    if (depth < io_iter) {
-	io_iter = depth;
-        fprintf(stderr, "dropping io_iter to %d\n", io_iter);
+    if (engine != ENGINE_URING &&
+        (uring_fixed_bufs || uring_fixed_files || uring_iopoll || uring_sqpoll)) {
+	fprintf(stderr, "-F, -R, -P and -Q need -E io_uring\n");
+	exit(1);
+    }
+    if (numa_buffers && !cpu_list) {
+	fprintf(stderr, "-N needs -A\n");
+	exit(1);
+    }
+    if (json_file && !latency_stats && !completion_latency_stats && !sweep) {
+	fprintf(stderr, "-J needs -l, -L or -W\n");
+	exit(1);
+    }
+    if (uring_iopoll && !o_direct) {
+	fprintf(stderr, "polled io (-P) needs O_DIRECT (-O)\n");
+	exit(1);
     }
 
     if (optind >= ac) {
@@ -1390,31 +2684,16 @@ int main(int ac, char **av)
 
     num_files = ac - optind;
 
-    if (num_threads > (num_files * num_contexts)) {
-        num_threads = num_files * num_contexts;
-	fprintf(stderr, "dropping thread count to the number of contexts %d\n", 
-	        num_threads);
-    }
-
-    t = calloc(num_threads, sizeof(*t));
-    if (!t) {
-        perror("calloc");
+    if (!sweep && (nr_thread_counts > 1 || nr_depths > 1 || files_list)) {
+	fprintf(stderr, "lists for -t and -d, and -f, need -W\n");
 	exit(1);
     }
-    global_thread_info = t;
-
-    /* by default, allow a huge number of iocbs to be sent towards
-     * io_submit
-     */
-    if (!max_io_submit)
-        max_io_submit = num_files * io_iter * num_contexts;
-
-    /*
-     * make sure we don't try to submit more ios than max_io_submit allows 
-     */
-    if (max_io_submit < io_iter) {
-        io_iter = max_io_submit;
-	fprintf(stderr, "dropping io_iter to %d\n", io_iter);
+    for (i = 0 ; i < nr_file_counts ; i++) {
+	if (files_list[i] > num_files) {
+	    fprintf(stderr, "-f %d is more than the %d files given\n",
+		    files_list[i], num_files);
+	    exit(1);
+	}
     }
 
     if (!stages) {
@@ -1435,52 +2714,66 @@ int main(int ac, char **av)
 	exit(1);
     }
 
-    fprintf(stderr, "file size %LuMB, record size %luKB, depth %d, ios per iteration %d\n",
-	    (unsigned long long)file_size / (1024 * 1024),
-	    rec_len / 1024, depth, io_iter);
-    fprintf(stderr, "max io_submit %d, buffer alignment set to %luKB\n", 
-            max_io_submit, (page_size_mask + 1)/1024);
-    fprintf(stderr, "threads %d files %d contexts %d context offset %LuMB verification %s\n", 
-            num_threads, num_files, num_contexts, 
-	    (unsigned long long)context_offset / (1024 * 1024),
-	    verify ? "on" : "off");
-    /* open all the files and do any required setup for them */
-    for (i = optind ; i < ac ; i++) {
-	int thread_index;
-	for (j = 0 ; j < num_contexts ; j++) {
-	    thread_index = open_fds % num_threads;
-	    open_fds++;
+    if ((stages & (1 << MIXED)) || offset_dist != DIST_UNIFORM) {
+	char *dists[] = { "uniform", "zipf", "pareto", "normal" };
 
-	    rwfd = open(av[i], O_CREAT | O_RDWR | o_direct | o_sync, 0600);
-	    assert(rwfd != -1);
+	fprintf(stderr, "random offsets %s", dists[offset_dist]);
+	if (offset_dist != DIST_UNIFORM)
+	    fprintf(stderr, ":%g", dist_param);
+	fprintf(stderr, ", mixed stage reads %d%%\n", read_pct);
+    }
+    fprintf(stderr, "io engine %s%s%s%s%s\n", engine_name(),
+	    uring_fixed_bufs ? " fixed buffers" : "",
+	    uring_fixed_files ? " registered files" : "",
+	    uring_iopoll ? " iopoll" : "", uring_sqpoll ? " sqpoll" : "");
 
-	    oper = create_oper(rwfd, first_stage, j * context_offset, 
-	                       file_size - j * context_offset, rec_len, 
-			       depth, io_iter, av[i]);
-	    if (!oper) {
-		fprintf(stderr, "error in create_oper\n");
-		exit(-1);
+    if (!sweep) {
+	status = run_test(av + optind, num_files, first_stage, file_size);
+    } else {
+	int io_iter_arg = io_iter;
+	int max_io_submit_arg = max_io_submit;
+	int f;
+	int n;
+	int d;
+
+	if (!threads_list) {
+	    threads_list = &num_threads;
+	    nr_thread_counts = 1;
+	}
+	if (!depth_list) {
+	    depth_list = &depth;
+	    nr_depths = 1;
+	}
+	if (!files_list) {
+	    files_list = &num_files;
+	    nr_file_counts = 1;
+	}
+	for (f = 0 ; !status && f < nr_file_counts ; f++) {
+	    for (n = 0 ; !status && n < nr_thread_counts ; n++) {
+		/* run_test would drop these to a point we already have */
+		if (threads_list[n] > files_list[f] * num_contexts) {
+		    fprintf(stderr, "\nsweep: skipping threads %d files %d, "
+			    "not enough contexts\n", threads_list[n],
+			    files_list[f]);
+		    continue;
+		}
+		for (d = 0 ; !status && d < nr_depths ; d++) {
+		    num_threads = threads_list[n];
+		    depth = depth_list[d];
+		    io_iter = io_iter_arg;
+		    max_io_submit = max_io_submit_arg;
+		    sweep_files = files_list[f];
+		    fprintf(stderr, "\nsweep: threads %d files %d depth %d\n",
+			    num_threads, sweep_files, depth);
+		    status = run_test(av + optind, sweep_files, first_stage,
+				      file_size);
+		}
 	    }
-	    oper_list_add(oper, &t[thread_index].active_opers);
-	    t[thread_index].num_files++;
 	}
+	sweep_report();
     }
-    if (setup_shared_mem(num_threads, num_files * num_contexts, 
-                         depth, rec_len, max_io_submit))
-    {
-        exit(1);
-    }
-    for (i = 0 ; i < num_threads ; i++) {
-	if (setup_ious(&t[i], t[i].num_files, depth, rec_len, max_io_submit))
-		exit(1);
-    }
-    if (num_threads > 1){
-        printf("Running multi thread version num_threads:%d\n", num_threads);
-        run_workers(t, num_threads);
-    } else {
-        printf("Running single thread version \n");
-	status = worker(t);
-    }
+    if (json_file)
+	fclose(json_file);
     if (unlink_files) {
 	for (i = optind ; i < ac ; i++) {
 	    printf("Cleaning up file %s \n", av[i]);
@@ -1493,5 +2786,3 @@ int main(int ac, char **av)
     }
     return status;
 }
-
-
@@ -0,0 +1,52 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Counter based random numbers for fsx and fsstress.
+ *
+ * The n-th number of a stream is a hash of the stream's key and n, so a
+ * stream can be positioned anywhere without generating what comes before
+ * it, and every thread can have streams of its own without any locking.
+ * ctr_rand_seek() keys a stream by the seed and the worker and starts it at
+ * the op number, so the inputs of op N can be generated from (seed, worker,
+ * N) alone.  The hash is the SplitMix64 finalizer, which is plenty for
+ * picking ops and offsets.
+ */
+#ifndef CTRRAND_H
+#define CTRRAND_H
+
+#include <stdint.h>
+
+/* numbers an op can draw before running into the stream of the next op */
+#define CTR_RAND_OP_BITS	32
+
+struct ctr_rand {
+	uint64_t	key;
+	uint64_t	ctr;
+};
+
+static inline uint64_t
+ctr_rand_mix(uint64_t x)
+{
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+static inline void
+ctr_rand_seek(struct ctr_rand *r, uint64_t seed, uint64_t worker,
+	      uint64_t opno)
+{
+	r->key = ctr_rand_mix(ctr_rand_mix(seed + 0x9e3779b97f4a7c15ULL) ^
+			      worker);
+	r->ctr = opno << CTR_RAND_OP_BITS;
+}
+
+/* 31 bits, like random() */
+static inline long
+ctr_rand(struct ctr_rand *r)
+{
+	return ctr_rand_mix(r->key + r->ctr++ * 0x9e3779b97f4a7c15ULL) >> 33;
+}
+
+#endif /* CTRRAND_H */
@@ -0,0 +1,89 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Expected state journal written by fsstress --journal and checked by
+ * fssverify after a crash.
+ *
+ * The journal is text, one record per line, each line starting with the
+ * number of the fsstress proc it is about and written with a single write
+ * to a file opened O_APPEND, so that all procs can share one journal:
+ *
+ *	fsstress-journal 2			first line of the file
+ *	<proc> C <n>				checkpoint n starts
+ *	<proc> F <ino> <size> <hash> <path>	regular file
+ *	<proc> D <path>				directory
+ *	<proc> O <path>				anything else
+ *	<proc> E <n>				checkpoint n is complete
+ *	<proc> S <ino> <size> <hash> <path>	a regular file was fsynced
+ *	<proc> M <ino> <path>			path is about to change
+ *
+ * A checkpoint is the whole file list of a proc right after a sync, and is
+ * written and fdatasynced in one go.  An S record is a file right after an
+ * fsync or fdatasync.  Each op that changes an existing entry writes an M
+ * record first, so anything the filesystem may have seen half done is known
+ * not to be in its synced state any more.  The inode of an M record is that
+ * of the regular file at path, 0 for anything else, so that the other hard
+ * links of a file are known to change too.  Paths are relative to the
+ * directory of the proc.  The journal must not live on the filesystem under
+ * test.
+ */
+#ifndef FSSJOURNAL_H
+#define FSSJOURNAL_H
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#define FSSJ_MAGIC	"fsstress-journal 2"
+#define FSSJ_BLOCK	4096
+
+#define FSSJ_FNV_OFFSET	0xcbf29ce484222325ULL
+#define FSSJ_FNV_PRIME	0x100000001b3ULL
+
+/*
+ * FNV-1a over the blocks of a file that aren't all zeroes, each started
+ * with its offset.  Zeroes are left out so that the hash is the same
+ * whether a range is a hole, unwritten or zeroes written out, which a crash
+ * is free to change.
+ */
+static inline int
+fssj_hash_fd(int fd, uint64_t *hashp)
+{
+	static __thread unsigned char	buf[FSSJ_BLOCK];
+	uint64_t			h = FSSJ_FNV_OFFSET;
+	off_t				off, end;
+	ssize_t				n, i;
+
+	for (off = 0; ; ) {
+		off = lseek(fd, off, SEEK_DATA);
+		if (off < 0) {
+			if (errno == ENXIO)
+				break;
+			return -1;
+		}
+		end = lseek(fd, off, SEEK_HOLE);
+		if (end < 0)
+			return -1;
+		off -= off % FSSJ_BLOCK;
+		for (; off < end; off += n) {
+			n = pread(fd, buf, FSSJ_BLOCK, off);
+			if (n < 0)
+				return -1;
+			if (n == 0)
+				break;
+			for (i = 0; i < n && !buf[i]; i++)
+				;
+			if (i == n)
+				continue;
+			h = (h ^ off) * FSSJ_FNV_PRIME;
+			for (i = 0; i < n; i++)
+				h = (h ^ buf[i]) * FSSJ_FNV_PRIME;
+		}
+		if (off < end)
+			break;
+	}
+	*hashp = h;
+	return 0;
+}
+
+#endif /* FSSJOURNAL_H */
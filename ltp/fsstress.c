@@ -8,9 +8,18 @@
 #include <setjmp.h>
 #include <sys/uio.h>
 #include <stddef.h>
+#include <ctype.h>
 #include <stdbool.h>
 #include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include "global.h"
+#include "ctrrand.h"
+#include "fssjournal.h"
+#include "ophist.h"
 
 #ifdef HAVE_BTRFSUTIL_H
 #include <btrfsutil.h>
@@ -24,13 +33,22 @@
 #ifdef AIO
 #include <libaio.h>
 #define AIO_ENTRIES	1
-io_context_t	io_ctx;
+__thread io_context_t	io_ctx;
 #endif
 #ifdef URING
 #include <liburing.h>
-#define URING_ENTRIES	1
-struct io_uring	ring;
-bool have_io_uring;			/* to indicate runtime availability */
+/* uring_creat and uring_meta submit up to URING_BATCH files at a time */
+#define URING_BATCH	8
+#define URING_ENTRIES	(3 * URING_BATCH)
+/* liburing 2.2 has all the prep helpers uring_creat and uring_meta need */
+#if LIBURING_MAJOR_VERSION > 2 || \
+    (LIBURING_MAJOR_VERSION == 2 && LIBURING_MINOR_VERSION >= 2)
+#define URING_FSOPS
+#endif
+__thread struct io_uring	ring;
+__thread bool have_io_uring;		/* to indicate runtime availability */
+__thread bool have_uring_files;		/* file table for direct opens */
+__thread struct io_uring_probe	*uring_probe;
 #endif
 #include <sys/syscall.h>
 #include <sys/xattr.h>
@@ -151,6 +169,8 @@ typedef enum {
 	OP_UNLINK,
 	OP_UNRESVSP,
 	OP_UNSHARE,
+	OP_URING_CREAT,
+	OP_URING_META,
 	OP_URING_READ,
 	OP_URING_WRITE,
 	OP_WRITE,
@@ -176,8 +196,26 @@ typedef struct fent {
 	int	ft;
 	int	parent;
 	int	xattr_counter;
+	int	next;		/* siblings with the same parent, see fidx */
+	int	prev;
 } fent_t;
 
+/*
+ * Index of the entries in flist by id, in an open addressing hash.  Each
+ * directory also heads the list of its children, chained through fent.next
+ * and fent.prev, and caches its pathname until the next directory rename.
+ * ft is -1 for an id that only holds children (see fix_parent).
+ */
+typedef struct fidx {
+	int		id;
+	int		ft;
+	int		slot;
+	int		child;
+	int		nchild;
+	unsigned int	path_gen;
+	char		*path;
+} fidx_t;
+
 typedef struct flist {
 	int	nfiles;
 	int	nslots;
@@ -220,7 +258,7 @@ struct print_string {
 #define	FT_ANYDIR	(FT_DIRm | FT_SUBVOLm)
 
 #define	FLIST_SLOT_INCR	16
-#define	NDCACHE	64
+#define	FIDX_EMPTY	-1
 
 #define	MAXFSIZE	((1ULL << 63) - 1ULL)
 #define	MAXFSIZE32	((1ULL << 40) - 1ULL)
@@ -284,6 +322,8 @@ void	sync_f(opnum_t, long);
 void	truncate_f(opnum_t, long);
 void	unlink_f(opnum_t, long);
 void	unresvsp_f(opnum_t, long);
+void	uring_creat_f(opnum_t, long);
+void	uring_meta_f(opnum_t, long);
 void	uring_read_f(opnum_t, long);
 void	uring_write_f(opnum_t, long);
 void	write_dontcache_f(opnum_t, long);
@@ -357,6 +397,8 @@ struct opdesc	ops[OP_LAST]	= {
 	[OP_UNLINK]	   = {"unlink",	       unlink_f,	1, 1 },
 	[OP_UNRESVSP]	   = {"unresvsp",      unresvsp_f,	1, 1 },
 	[OP_UNSHARE]	   = {"unshare",       unshare_f,	1, 1 },
+	[OP_URING_CREAT]   = {"uring_creat",   uring_creat_f,	0, 1 },
+	[OP_URING_META]	   = {"uring_meta",    uring_meta_f,	0, 1 },
 	[OP_URING_READ]	   = {"uring_read",    uring_read_f,	1, 0 },
 	[OP_URING_WRITE]   = {"uring_write",   uring_write_f,	1, 1 },
 	[OP_WRITE]	   = {"write",	       write_f,		4, 1 },
@@ -374,13 +416,29 @@ flist_t	flist[FT_nft] = {
 	{ 0, 0, 's', NULL },
 };
 
-int		dcache[NDCACHE];
+fidx_t		*fidx;
+unsigned int	fidx_size;	/* power of two */
+unsigned int	fidx_used;
+unsigned int	path_gen = 1;
+int		top_children;	/* entries in the top directory */
+
+/*
+ * With --threads the workers of a proc share its directory, flist and fidx.
+ * ns_mutex covers those, but is never held across a syscall, so the workers
+ * do race each other in the filesystem and just put up with the ENOENT and
+ * friends that follow.  It is recursive so that the flist helpers can take
+ * it whether or not their caller already has.
+ */
+pthread_mutex_t	ns_mutex;
+#define NSNAP		8
+__thread fent_t	fent_snap[NSNAP];	/* copies handed out by get_fname */
+__thread int	fent_snap_next;
 int		errrange;
 int		errtag;
 opty_t		*freq_table;
 int		freq_table_size;
 struct xfs_fsop_geom	geom;
-char		*homedir;
+__thread char	*homedir;
 int		*ilist;
 int		ilistlen;
 off64_t		maxfsize;
@@ -389,24 +447,132 @@ int		namerand;
 int		nameseq;
 int		nops;
 int		nproc = 1;
+int		nthreads = 0;	/* --threads, per proc */
+int		loops = 1;
 opnum_t		operations = 1;
 unsigned int	idmodulo = XFS_IDMODULO_MAX;
 unsigned int	attr_mask = ~0;
-int		procid;
+__thread int	procid;
 int		rtpct;
 unsigned long	seed = 0;
-ino_t		top_ino;
+__thread ino_t	top_ino;
 int		cleanup = 0;
 int		verbose = 0;
 int		verifiable_log = 0;
 sig_atomic_t	should_stop = 0;
-sigjmp_buf	*sigbus_jmp = NULL;
+__thread sigjmp_buf	*sigbus_jmp = NULL;
 char		*execute_cmd = NULL;
 int		execute_freq = 1;
-struct print_string	flag_str = {0};
+__thread struct print_string	flag_str = {0};
 
 struct timespec deadline = { 0 };
 
+int		replayable = 0;
+int		ctr_random = 0;		/* --ctr-random, --replayable, --threads */
+__thread struct ctr_rand	rng;
+char		*replay_ops = NULL;
+int		*replay_procs;
+opnum_t		*replay_opnos;
+int		nr_replay;
+
+#define STATS_CLIENTS	16
+
+struct proc_stats {
+	struct op_hist	hist[OP_LAST];
+	struct op_hist	lag;		/* how late ops started, with --rate */
+};
+
+struct proc_stats	*all_stats;	/* nproc of them, shared by all procs */
+struct proc_stats	*stats;		/* this proc's, NULL without stats */
+char		*stats_path;		/* --stats */
+char		*stats_sock_path;	/* --stats-socket */
+long		stats_interval;		/* --stats-interval */
+FILE		*statsf;
+int		stats_sock = -1;
+int		stats_clients[STATS_CLIENTS];
+int		nr_stats_clients;
+struct timespec	stats_start;
+sig_atomic_t	stats_dump = 0;		/* SIGUSR1 */
+
+#define FANOUT_TRIES	4
+
+/* A phase of a --profile, see read_profile() */
+struct phase {
+	char		*name;
+	opnum_t		ops;		/* per proc, 0 for no limit */
+	long		duration;	/* seconds, 0 for no limit */
+	int		freq[OP_LAST];
+	opty_t		*freq_table;
+	int		freq_table_size;
+	size_t		iosize_min;	/* 0 for the default 1..FILELEN_MAX */
+	size_t		iosize_max;
+	off64_t		filesize;	/* 0 for maxfsize */
+	int		fanout;		/* 0 for no limit */
+};
+
+char		*profile;		/* --profile */
+struct phase	*phases;
+int		nphases;
+__thread struct phase	*phase;		/* the one running, NULL before */
+__thread opnum_t	phase_end;
+__thread struct timespec	phase_deadline;
+
+double		rate;			/* --rate, ops/sec per worker */
+double		rate_total;		/* --rate-total */
+int		poisson;		/* --arrival=poisson */
+__thread struct timespec	rate_next;	/* when the next op is due */
+__thread struct ctr_rand	rate_rng;
+
+/* --names: what generate_fname() and fent_to_name() make names like */
+enum {
+	NAMES_SEQ,		/* tag and id, padded with -r */
+	NAMES_XFS_COLLIDE,	/* all with the same XFS dir hash */
+	NAMES_XFS_CLUSTER,	/* XFS dir hashes in a band of 256 */
+	NAMES_EXT4_CLUSTER,	/* ext4 legacy dir hashes in 1/256 of the range */
+};
+int		name_mode;
+
+/* --bigdir: every new entry goes in the top directory */
+#define BIGDIR_FIRST	1024	/* entries at the first latency report */
+int		bigdir;
+int		bigdir_ops[] = { OP_CREAT, OP_STAT, OP_GETDENTS, OP_UNLINK };
+#define BIGDIR_NOPS	(sizeof(bigdir_ops) / sizeof(bigdir_ops[0]))
+__thread struct op_hist	bigdir_hist[BIGDIR_NOPS];
+__thread int	bigdir_next;		/* entries at the next report */
+
+char		*journal_path;		/* --journal */
+int		journal_fd = -1;
+unsigned long	journal_seq;		/* checkpoints written by this proc */
+__thread int	op_iswrite;		/* of the op running */
+
+/* --verify: what the regular files of a proc should hold, see vmap_get() */
+#define VSTAMP_SIZE	16
+#define VMAP_HASH	1024
+
+struct vext {
+	off64_t		off;
+	off64_t		len;
+	off64_t		origin;		/* offset the data was written at */
+	uint32_t	id;		/* of the entry it was written through */
+	uint32_t	gen;		/* of the write, 0 if not known */
+};
+
+struct vmap {
+	struct vmap	*hnext;
+	dev_t		dev;
+	ino64_t		ino;
+	off64_t		size;
+	uint32_t	gen;		/* of the last write */
+	int		nexts;
+	int		aexts;
+	struct vext	*exts;
+};
+
+int		verify_data;
+int		verify_failed;
+int		children_failed;	/* the run exits with this */
+struct vmap	*vmap_hash[VMAP_HASH];
+
 void	add_to_flist(int, int, int, int);
 void	append_pathname(pathname_t *, char *);
 int	attr_list_path(pathname_t *, char *, const int);
@@ -415,27 +581,45 @@ int	attr_set_path(pathname_t *, const char *, const char *, const int);
 void	check_cwd(void);
 void	cleanup_flist(void);
 int	creat_path(pathname_t *, mode_t);
-void	dcache_enter(int, int);
-void	dcache_init(void);
-fent_t	*dcache_lookup(int);
-void	dcache_purge(int, int);
 void	del_from_flist(int, int);
+char	*dir_path(int);
 int	dirid_to_name(char *, int);
 void	doproc(void);
 int	fent_to_name(pathname_t *, fent_t *);
 bool	fents_ancestor_check(fent_t *, fent_t *);
+fidx_t	*fidx_find(int);
+fidx_t	*fidx_get(int);
+void	fidx_put(fidx_t *);
+void	fidx_reserve(unsigned int);
 void	fix_parent(int, int, bool);
 void	free_pathname(pathname_t *);
 int	generate_fname(fent_t *, int, pathname_t *, int *, int *);
 int	generate_xattr_name(int, char *, int);
 int	get_fname(int, long, pathname_t *, flist_t **, fent_t **, int *);
+void	journal_checkpoint(void);
+void	journal_init(void);
+void	journal_mark(pathname_t *);
+void	journal_sync(pathname_t *);
+void	vmap_unknown(struct vmap *, off64_t, off64_t);
+fent_t	*id_to_fent(int);
+void	del_fent(fent_t *);
+void	ns_lock(void);
+void	ns_unlock(void);
+int	pick_fname(int, long, pathname_t *, flist_t **, fent_t **, int *);
+int	get_parent(int, long, fent_t **, int *);
+bool	phase_running(opnum_t);
+void	read_profile(void);
+void	make_phase_tables(const char *);
 void	init_pathname(pathname_t *);
+void	io_exit(void);
+void	io_init(void);
 int	lchown_path(pathname_t *, uid_t, gid_t);
 int	link_path(pathname_t *, pathname_t *);
 int	lstat64_path(pathname_t *, struct stat64 *);
 void	make_freq_table(void);
 int	mkdir_path(pathname_t *, mode_t);
 int	mknod_path(pathname_t *, mode_t, dev_t);
+void	make_name(char *, int, int);
 void	namerandpad(int, char *, int);
 int	open_file_or_dir(pathname_t *, int);
 int	open_path(pathname_t *, int);
@@ -443,14 +627,23 @@ DIR	*opendir_path(pathname_t *);
 void	process_freq(char *);
 int	readlink_path(pathname_t *, char *, size_t);
 int	rename_path(pathname_t *, pathname_t *, int);
+void	run_threads(int);
 int	rmdir_path(pathname_t *);
 void	separate_pathname(pathname_t *, char *, pathname_t *);
 void	show_ops(int, char *);
+void	stats_init(void);
+void	stats_lag(const struct timespec *, const struct timespec *);
+void	stats_op(int, const struct timespec *, int);
+void	rate_wait(struct timespec *);
+void	stats_report(bool, bool);
+void	child_exited(int);
+void	stats_wait(void);
 int	stat64_path(pathname_t *, struct stat64 *);
 int	symlink_path(const char *, pathname_t *);
 int	truncate64_path(pathname_t *, off64_t);
 int	unlink_path(pathname_t *);
 void	usage(void);
+void	*worker(void *);
 void	read_freq(void);
 void	write_freq(void);
 void	zero_freq(void);
@@ -463,6 +656,9 @@ void sg_handler(int signum)
 	case SIGPIPE:
 		should_stop = 1;
 		break;
+	case SIGUSR1:
+		stats_dump = 1;
+		break;
 	case SIGBUS:
 		/*
 		 * Only handle SIGBUS when mmap write to a hole and no
@@ -507,8 +703,514 @@ keep_looping(int i, int loops)
 	return i < loops;
 }
 
+/*
+ * --ctr-random takes the random numbers of every op from a counter based
+ * stream of its own, keyed by the seed and the proc and started at the op
+ * number (see ctrrand.h), instead of from random().  So each op draws the
+ * same random numbers whichever ops ran before it, and the --threads workers
+ * don't serialize on the lock of the random() state.  The operation it picks
+ * is then the same too, but the entries it picks from the name pools and
+ * so its arguments still depend on what the ops before it did.
+ *
+ * --replayable and --threads imply it.  --replay-ops then runs only the ops
+ * that appear in a -v log of a --replayable run, which lets ltp/opsmin shrink
+ * the log of a failing run down to the ops that matter.  The rest of the
+ * command line has to match the original run.
+ */
+static inline long
+fss_random(void)
+{
+	return ctr_random ? ctr_rand(&rng) : random();
+}
+
+/* the length of a read or write, from the --profile phase if it says */
+static inline size_t
+io_len(void)
+{
+	if (phase && phase->iosize_max)
+		return phase->iosize_min +
+			fss_random() % (phase->iosize_max - phase->iosize_min + 1);
+	return (fss_random() % FILELEN_MAX) + 1;
+}
+
+/* the size files can grow to, from the --profile phase if it says */
+static inline off64_t
+file_max(void)
+{
+	return phase && phase->filesize ? MIN(phase->filesize, maxfsize) :
+					  maxfsize;
+}
+
+void
+read_replay_ops(void)
+{
+	FILE		*f;
+	char		line[1024];
+	int		id;
+	long long	opno;
+
+	f = fopen(replay_ops, "r");
+	if (!f) {
+		perror(replay_ops);
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), f)) {
+		/* "procid/opno: op ..." lines, an op may print several */
+		if (sscanf(line, "%d/%lld:", &id, &opno) != 2)
+			continue;
+		if (nr_replay && replay_procs[nr_replay - 1] == id &&
+		    replay_opnos[nr_replay - 1] == opno)
+			continue;
+		if (nr_replay % 1024 == 0) {
+			replay_procs = realloc(replay_procs,
+					(nr_replay + 1024) * sizeof(int));
+			replay_opnos = realloc(replay_opnos,
+					(nr_replay + 1024) * sizeof(opnum_t));
+			if (!replay_procs || !replay_opnos) {
+				perror("realloc");
+				exit(1);
+			}
+		}
+		replay_procs[nr_replay] = id;
+		replay_opnos[nr_replay++] = opno;
+	}
+	fclose(f);
+}
+
+void
+io_init(void)
+{
+#ifdef URING
+	int	c;
+#endif
+
+#ifdef AIO
+	if (io_setup(AIO_ENTRIES, &io_ctx) != 0) {
+		fprintf(stderr, "io_setup failed\n");
+		exit(1);
+	}
+#endif
+#ifdef URING
+	have_io_uring = true;
+	/*
+	 * If ENOSYS, just ignore uring, due to kernel doesn't support it.
+	 * If EPERM, maybe due to sysctl kernel.io_uring_disabled isn't 0,
+	 *           or some selinux policies, etc.
+	 * Other errors are fatal.
+	 */
+	c = io_uring_queue_init(URING_ENTRIES, &ring, 0);
+	switch(c){
+	case 0:
+		have_io_uring = true;
+		break;
+	case -ENOSYS:
+		have_io_uring = false;
+		if (verbose)
+			printf("io_uring isn't supported by kernel\n");
+		break;
+	case -EPERM:
+		have_io_uring = false;
+		if (verbose)
+			printf("io_uring isn't allowed, check io_uring_disabled sysctl or selinux policy\n");
+		break;
+	default:
+		fprintf(stderr, "io_uring_queue_init failed, errno=%d\n", -c);
+		exit(1);
+	}
+	if (have_io_uring) {
+		int	fds[URING_BATCH];
+
+		/* an old kernel without a probe just gets the read and write */
+		uring_probe = io_uring_get_probe_ring(&ring);
+		/* a table of empty slots for the direct opens of uring_creat */
+		for (c = 0; c < URING_BATCH; c++)
+			fds[c] = -1;
+		have_uring_files =
+			io_uring_register_files(&ring, fds, URING_BATCH) == 0;
+	}
+#endif
+}
+
+#ifdef URING
+void
+io_exit_uring(void)
+{
+	if (uring_probe)
+		io_uring_free_probe(uring_probe);
+	uring_probe = NULL;
+	if (have_io_uring)
+		io_uring_queue_exit(&ring);
+	have_io_uring = false;
+	have_uring_files = false;
+}
+#endif
+
+void
+io_exit(void)
+{
+#ifdef AIO
+	if(io_destroy(io_ctx) != 0) {
+		fprintf(stderr, "io_destroy failed");
+		exit(1);
+	}
+#endif
+#ifdef URING
+	io_exit_uring();
+#endif
+}
+
+/*
+ * --stats and --stats-socket: per op latency histograms and op and error
+ * counts for every proc.  The procs count into a mapping they share with
+ * the parent, with atomics since the --threads workers of a proc share its
+ * counters, and the parent adds them up into a line of JSON.  It writes
+ * one to the --stats file at the end, on SIGUSR1 and every --stats-interval
+ * seconds, and streams one every --stats-interval seconds (default 1) to
+ * every client of the socket.  An op counts as an error if it returns with
+ * errno set.  The histograms are those of ophist.h.
+ */
+void
+stats_init(void)
+{
+	struct sockaddr_un	addr = { .sun_family = AF_UNIX };
+	int			i, op;
+
+	all_stats = mmap(NULL, nproc * sizeof(*all_stats),
+			 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+			 -1, 0);
+	if (all_stats == MAP_FAILED) {
+		perror("mmap stats");
+		exit(1);
+	}
+	for (i = 0; i < nproc; i++) {
+		for (op = 0; op < OP_LAST; op++)
+			hist_init(&all_stats[i].hist[op]);
+		hist_init(&all_stats[i].lag);
+	}
+
+	if (stats_path) {
+		statsf = fopen(stats_path, "w");
+		if (!statsf) {
+			perror(stats_path);
+			exit(1);
+		}
+	}
+	if (stats_sock_path) {
+		if (strlen(stats_sock_path) >= sizeof(addr.sun_path)) {
+			fprintf(stderr, "%s: socket path too long\n",
+				stats_sock_path);
+			exit(1);
+		}
+		strcpy(addr.sun_path, stats_sock_path);
+		unlink(stats_sock_path);
+		stats_sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK |
+				    SOCK_CLOEXEC, 0);
+		if (stats_sock < 0 ||
+		    bind(stats_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+		    listen(stats_sock, STATS_CLIENTS) < 0) {
+			perror(stats_sock_path);
+			exit(1);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stats_start);
+}
+
+/*
+ * Count an op of this proc that started at start and failed with err.  With
+ * --rate start is when the op was due, not when it got going, so that the
+ * time it spent waiting behind the ops before it counts too.
+ */
+void
+stats_op(int op, const struct timespec *start, int err)
+{
+	struct timespec	now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	hist_add(&stats->hist[op], ts_ns(&now) - ts_ns(start), err);
+}
+
+/* Count how much later than sched an op started, with --rate. */
+void
+stats_lag(const struct timespec *sched, const struct timespec *start)
+{
+	hist_add(&stats->lag, ts_ns(start) - ts_ns(sched), 0);
+}
+
+static void
+stats_hist_json(FILE *f, const char *name, struct op_hist *h, double secs,
+		bool buckets)
+{
+	unsigned	b;
+	int		n = 0;
+
+	fprintf(f, "{");
+	if (name)
+		fprintf(f, "\"op\": \"%s\", ", name);
+	fprintf(f, "\"count\": %llu, \"errors\": %llu, "
+		"\"ops_per_sec\": %.1f, \"min_ns\": %llu, \"mean_ns\": %llu, "
+		"\"p50_ns\": %llu, \"p90_ns\": %llu, \"p99_ns\": %llu, "
+		"\"p999_ns\": %llu, \"max_ns\": %llu",
+		h->count, h->errors, h->count / secs, h->min,
+		h->sum / h->count, hist_percentile(h, 0.5),
+		hist_percentile(h, 0.9), hist_percentile(h, 0.99),
+		hist_percentile(h, 0.999), h->max);
+	if (buckets) {
+		/* [lowest latency in the bucket, count] pairs */
+		fprintf(f, ", \"buckets\": [");
+		for (b = 0; b < HIST_BUCKETS; b++) {
+			if (!h->buckets[b])
+				continue;
+			fprintf(f, "%s[%llu, %llu]", n++ ? ", " : "",
+				hist_value(b), h->buckets[b]);
+		}
+		fprintf(f, "]");
+	}
+	fprintf(f, "}");
+}
+
+/*
+ * Build a report: the totals, then every proc with its ops by type, then
+ * the ops by type of all procs together with their histogram buckets.  With
+ * --rate the procs and the totals also get the lag of op starts behind the
+ * schedule.
+ */
+static char *
+stats_json(bool final, size_t *len)
+{
+	static struct op_hist	sum[OP_LAST];
+	static struct op_hist	lag;
+	struct op_hist		h;
+	struct timespec		now;
+	unsigned long long	total = 0, errors = 0;
+	unsigned long long	pops, perrors;
+	double			secs;
+	char			*buf = NULL;
+	FILE			*f;
+	int			i, op, n;
+
+	f = open_memstream(&buf, len);
+	if (!f) {
+		perror("open_memstream");
+		exit(1);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	secs = (ts_ns(&now) - ts_ns(&stats_start)) / 1e9;
+	for (op = 0; op < OP_LAST; op++)
+		hist_init(&sum[op]);
+	hist_init(&lag);
+
+	fprintf(f, "{\"time\": %.3f, \"final\": %s, \"procs\": [",
+		secs, final ? "true" : "false");
+	for (i = 0; i < nproc; i++) {
+		pops = perrors = 0;
+		for (op = 0; op < OP_LAST; op++) {
+			pops += all_stats[i].hist[op].count;
+			perrors += all_stats[i].hist[op].errors;
+		}
+		fprintf(f, "%s{\"proc\": %d, \"ops\": %llu, \"errors\": %llu, "
+			"\"ops_per_sec\": %.1f, \"ops_by_type\": [",
+			i ? ", " : "", i, pops, perrors, pops / secs);
+		for (n = op = 0; op < OP_LAST; op++) {
+			/* a copy, the proc may be counting into it */
+			hist_init(&h);
+			hist_sum(&h, &all_stats[i].hist[op]);
+			if (!h.count)
+				continue;
+			fprintf(f, "%s", n++ ? ", " : "");
+			stats_hist_json(f, ops[op].name, &h, secs, false);
+			hist_sum(&sum[op], &h);
+		}
+		fprintf(f, "]");
+		hist_init(&h);
+		hist_sum(&h, &all_stats[i].lag);
+		if (h.count) {
+			fprintf(f, ", \"start_lag\": ");
+			stats_hist_json(f, NULL, &h, secs, false);
+			hist_sum(&lag, &h);
+		}
+		fprintf(f, "}");
+		total += pops;
+		errors += perrors;
+	}
+	fprintf(f, "], \"ops\": %llu, \"errors\": %llu, \"ops_per_sec\": %.1f, "
+		"\"ops_by_type\": [", total, errors, total / secs);
+	for (n = op = 0; op < OP_LAST; op++) {
+		if (!sum[op].count)
+			continue;
+		fprintf(f, "%s", n++ ? ", " : "");
+		stats_hist_json(f, ops[op].name, &sum[op], secs, true);
+	}
+	fprintf(f, "]");
+	if (lag.count) {
+		fprintf(f, ", \"start_lag\": ");
+		stats_hist_json(f, NULL, &lag, secs, true);
+	}
+	fprintf(f, "}\n");
+	fclose(f);
+	return buf;
+}
+
+/* Write a report to the --stats file if tofile, and to the socket clients. */
+void
+stats_report(bool final, bool tofile)
+{
+	size_t	len;
+	char	*buf;
+	int	i;
+
+	if ((!statsf || !tofile) && !nr_stats_clients)
+		return;
+	buf = stats_json(final, &len);
+	if (statsf && tofile) {
+		fwrite(buf, len, 1, statsf);
+		fflush(statsf);
+	}
+	/* drop the clients that can't keep up */
+	for (i = 0; i < nr_stats_clients; i++) {
+		if (send(stats_clients[i], buf, len,
+			 MSG_NOSIGNAL | MSG_DONTWAIT) == len)
+			continue;
+		close(stats_clients[i]);
+		stats_clients[i--] = stats_clients[--nr_stats_clients];
+	}
+	free(buf);
+}
+
+/*
+ * A proc that failed a --verify exits 1.  Note that, or a proc killed by
+ * anything but the SIGTERM that stops the run, so that the run exits 1 too.
+ */
+void
+child_exited(int stat)
+{
+	if (WIFEXITED(stat) ? WEXITSTATUS(stat) != 0 :
+			      WTERMSIG(stat) != SIGTERM)
+		children_failed = 1;
+}
+
+/*
+ * The parent's wait for the procs with stats on: reap them without blocking,
+ * so that it can report when the interval is up or SIGUSR1 asks it to, and
+ * let new clients onto the stats socket in between.
+ */
+void
+stats_wait(void)
+{
+	struct pollfd	pfd = { .fd = stats_sock, .events = POLLIN };
+	struct timespec	now, next;
+	long		interval = stats_interval ? stats_interval : 1;
+	int		stat;
+	int		fd;
+	pid_t		pid;
+
+	next = stats_start;
+	next.tv_sec += interval;
+	while (!should_stop) {
+		while ((pid = waitpid(-1, &stat, WNOHANG)) > 0)
+			child_exited(stat);
+		if (pid < 0)
+			break;
+		if (poll(&pfd, stats_sock >= 0, 100) > 0) {
+			fd = accept4(stats_sock, NULL, NULL, SOCK_CLOEXEC);
+			if (fd >= 0 && nr_stats_clients < STATS_CLIENTS)
+				stats_clients[nr_stats_clients++] = fd;
+			else if (fd >= 0)
+				close(fd);
+		}
+		if (stats_dump) {
+			stats_dump = 0;
+			stats_report(false, true);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (now.tv_sec >= next.tv_sec) {
+			stats_report(false, stats_interval != 0);
+			next.tv_sec = now.tv_sec + interval;
+		}
+	}
+}
+
+/*
+ * --threads: run nthreads workers in a proc, all of them in its directory
+ * and on its flist.  Every worker has a cwd of its own, so the ENAMETOOLONG
+ * fallbacks can still chdir, and aio and io_uring contexts of its own.
+ */
+void *
+worker(void *arg)
+{
+	int	i;
+
+	procid = (long)arg;
+	if (unshare(CLONE_FS) < 0) {
+		perror("unshare");
+		exit(1);
+	}
+	io_init();
+	for (i = 0; keep_looping(i, loops); i++)
+		doproc();
+	io_exit();
+	return NULL;
+}
+
+void
+run_threads(int proc)
+{
+	pthread_mutexattr_t	attr;
+	pthread_t		*tids;
+	char			cmd[64];
+	int			i;
+	int			ret;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&ns_mutex, &attr);
+
+	seed += proc;
+	srandom(seed);
+	if (namerand)
+		namerand = random();
+
+	tids = calloc(nthreads, sizeof(*tids));
+	if (!tids) {
+		perror("calloc");
+		exit(1);
+	}
+	for (i = 0; i < nthreads; i++) {
+		ret = pthread_create(&tids[i], NULL, worker,
+				     (void *)(long)(proc * nthreads + i));
+		if (ret) {
+			errno = ret;
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+	for (i = 0; i < nthreads; i++)
+		pthread_join(tids[i], NULL);
+	free(tids);
+
+	if (cleanup) {
+		sprintf(cmd, "rm -rf p%x", proc);
+		if (system(cmd) != 0)
+			perror("cleaning up");
+	}
+}
+
 static struct option longopts[] = {
 	{"duration", optional_argument, 0, 256},
+	{"replayable", no_argument, 0, 257},
+	{"replay-ops", required_argument, 0, 258},
+	{"threads", required_argument, 0, 259},
+	{"stats", required_argument, 0, 260},
+	{"stats-interval", required_argument, 0, 261},
+	{"stats-socket", required_argument, 0, 262},
+	{"ctr-random", no_argument, 0, 263},
+	{"profile", required_argument, 0, 264},
+	{"rate", required_argument, 0, 265},
+	{"rate-total", required_argument, 0, 266},
+	{"arrival", required_argument, 0, 267},
+	{"journal", required_argument, 0, 268},
+	{"names", required_argument, 0, 269},
+	{"bigdir", no_argument, 0, 270},
+	{"verify", no_argument, 0, 271},
 	{ }
 };
 
@@ -529,7 +1231,6 @@ int main(int argc, char **argv)
 	int             nousage = 0;
 	xfs_error_injection_t	        err_inj;
 	struct sigaction action;
-	int		loops = 1;
 	const char	*allopts = "cd:e:f:i:l:m:M:n:o:p:rRs:S:vVwx:X:zH";
 	long long	duration;
 
@@ -653,6 +1354,88 @@ int main(int argc, char **argv)
 			deadline.tv_sec += duration;
 			deadline.tv_nsec = 1;
 			break;
+		case 257:  /* --replayable */
+			replayable = 1;
+			break;
+		case 258:  /* --replay-ops */
+			replay_ops = optarg;
+			replayable = 1;
+			break;
+		case 259:  /* --threads */
+			nthreads = atoi(optarg);
+			if (nthreads < 1) {
+				fprintf(stderr, "%s: invalid thread count\n",
+					optarg);
+				exit(1);
+			}
+			break;
+		case 260:  /* --stats */
+			stats_path = optarg;
+			break;
+		case 261:  /* --stats-interval */
+			stats_interval = strtol(optarg, &p, 0);
+			if (stats_interval < 1 || *p) {
+				fprintf(stderr, "%s: invalid stats interval\n",
+					optarg);
+				exit(1);
+			}
+			break;
+		case 262:  /* --stats-socket */
+			stats_sock_path = optarg;
+			break;
+		case 263:  /* --ctr-random */
+			ctr_random = 1;
+			break;
+		case 264:  /* --profile */
+			profile = optarg;
+			break;
+		case 265:  /* --rate */
+			rate = strtod(optarg, &p);
+			if (*p || !(rate > 0)) {
+				fprintf(stderr, "%s: invalid rate\n", optarg);
+				exit(1);
+			}
+			break;
+		case 266:  /* --rate-total */
+			rate_total = strtod(optarg, &p);
+			if (*p || !(rate_total > 0)) {
+				fprintf(stderr, "%s: invalid rate\n", optarg);
+				exit(1);
+			}
+			break;
+		case 267:  /* --arrival */
+			if (strcmp(optarg, "poisson") == 0)
+				poisson = 1;
+			else if (strcmp(optarg, "constant") != 0) {
+				fprintf(stderr, "%s: invalid arrival, use constant or poisson\n",
+					optarg);
+				exit(1);
+			}
+			break;
+		case 268:  /* --journal */
+			journal_path = optarg;
+			break;
+		case 269:  /* --names */
+			if (strcmp(optarg, "seq") == 0)
+				name_mode = NAMES_SEQ;
+			else if (strcmp(optarg, "xfs-collide") == 0)
+				name_mode = NAMES_XFS_COLLIDE;
+			else if (strcmp(optarg, "xfs-cluster") == 0)
+				name_mode = NAMES_XFS_CLUSTER;
+			else if (strcmp(optarg, "ext4-cluster") == 0)
+				name_mode = NAMES_EXT4_CLUSTER;
+			else {
+				fprintf(stderr, "%s: invalid names, use seq, xfs-collide, xfs-cluster or ext4-cluster\n",
+					optarg);
+				exit(1);
+			}
+			break;
+		case 270:  /* --bigdir */
+			bigdir = 1;
+			break;
+		case 271:  /* --verify */
+			verify_data = 1;
+			break;
 		case '?':
 			fprintf(stderr, "%s - invalid parameters\n",
 				myprog);
@@ -669,7 +1452,43 @@ int main(int argc, char **argv)
             exit(1);
         }
 
+	if (nthreads && replayable) {
+		fprintf(stderr, "--threads excludes --replayable and --replay-ops\n");
+		exit(1);
+	}
+	if (replayable || nthreads)
+		ctr_random = 1;
+	if (rate && rate_total) {
+		fprintf(stderr, "--rate excludes --rate-total\n");
+		exit(1);
+	}
+	if (rate_total)
+		rate = rate_total / (nproc * (nthreads ? nthreads : 1));
+	if (replay_ops)
+		read_replay_ops();
+	if (stats_interval && !stats_path && !stats_sock_path) {
+		fprintf(stderr, "--stats-interval requires --stats or --stats-socket\n");
+		exit(1);
+	}
+	if (stats_path || stats_sock_path)
+		stats_init();
+	if (journal_path) {
+		if (nthreads) {
+			fprintf(stderr, "--threads excludes --journal\n");
+			exit(1);
+		}
+		journal_init();
+	}
+	if (verify_data && nthreads) {
+		fprintf(stderr, "--threads excludes --verify\n");
+		exit(1);
+	}
+
 	non_btrfs_freq(dirname);
+	if (profile) {
+		read_profile();
+		make_phase_tables(dirname);
+	}
 	(void)mkdir(dirname, 0777);
 	if (logname && logname[0] != '/') {
 		if (!getcwd(rpath, sizeof(rpath))){
@@ -697,8 +1516,8 @@ int main(int argc, char **argv)
 		maxfsize = (off64_t)MAXFSIZE32;
 	else
 		maxfsize = (off64_t)MAXFSIZE;
-	make_freq_table();
-	dcache_init();
+	if (!phases)
+		make_freq_table();
 	setlinebuf(stdout);
 	if (!seed) {
 		gettimeofday(&t, (void *)NULL);
@@ -756,6 +1575,10 @@ int main(int argc, char **argv)
 		perror("sigaction failed");
 		exit(1);
 	}
+	if (all_stats && sigaction(SIGUSR1, &action, 0)) {
+		perror("sigaction failed");
+		exit(1);
+	}
 
 	for (i = 0; i < nproc; i++) {
 		if (fork() == 0) {
@@ -765,6 +1588,10 @@ int main(int argc, char **argv)
 				return 1;
 			if (sigaction(SIGBUS, &action, 0))
 				return 1;
+			/* only the parent reports */
+			signal(SIGUSR1, all_stats ? SIG_IGN : SIG_DFL);
+			if (all_stats)
+				stats = &all_stats[i];
 #ifdef HAVE_SYS_PRCTL_H
 			prctl(PR_SET_PDEATHSIG, SIGKILL);
 			if (getppid() == 1) /* parent died already? */
@@ -780,65 +1607,32 @@ int main(int argc, char **argv)
 				}
 			}
 			procid = i;
-#ifdef AIO
-			if (io_setup(AIO_ENTRIES, &io_ctx) != 0) {
-				fprintf(stderr, "io_setup failed\n");
-				exit(1);
+			if (nthreads)
+				run_threads(i);
+			else {
+				io_init();
+				for (i = 0; keep_looping(i, loops) &&
+					    !verify_failed; i++)
+					doproc();
+				io_exit();
 			}
-#endif
-#ifdef URING
-			have_io_uring = true;
-			/*
-			 * If ENOSYS, just ignore uring, due to kernel doesn't support it.
-			 * If EPERM, maybe due to sysctl kernel.io_uring_disabled isn't 0,
-			 *           or some selinux policies, etc.
-			 * Other errors are fatal.
-			 */
-			c = io_uring_queue_init(URING_ENTRIES, &ring, 0);
-			switch(c){
-			case 0:
-				have_io_uring = true;
-				break;
-			case -ENOSYS:
-				have_io_uring = false;
-				if (verbose)
-					printf("io_uring isn't supported by kernel\n");
-				break;
-			case -EPERM:
-				have_io_uring = false;
-				if (verbose)
-					printf("io_uring isn't allowed, check io_uring_disabled sysctl or selinux policy\n");
-				break;
-			default:
-				fprintf(stderr, "io_uring_queue_init failed, errno=%d\n", -c);
-				exit(1);
-			}
-#endif
-			for (i = 0; keep_looping(i, loops); i++)
-				doproc();
-#ifdef AIO
-			if(io_destroy(io_ctx) != 0) {
-				fprintf(stderr, "io_destroy failed");
-				return 1;
-			}
-#endif
-#ifdef URING
-			if (have_io_uring)
-				io_uring_queue_exit(&ring);
-#endif
 			cleanup_flist();
 			free(freq_table);
-			return 0;
+			return verify_failed ? 1 : 0;
 		}
 	}
-	while (wait(&stat) > 0 && !should_stop) {
-		continue;
-	}
+	if (all_stats)
+		stats_wait();
+	else
+		while (wait(&stat) > 0 && !should_stop) {
+			child_exited(stat);
+			continue;
+		}
 	action.sa_flags = SA_RESTART;
 	sigaction(SIGTERM, &action, 0);
 	kill(-getpid(), SIGTERM);
 	while (wait(&stat) > 0)
-		continue;
+		child_exited(stat);
 
 	if (errtag != 0) {
 		err_inj.errtag = 0;
@@ -854,9 +1648,16 @@ int main(int argc, char **argv)
 		close(fd);
 	}
 
+	if (all_stats) {
+		stats_report(true, true);
+		if (statsf)
+			fclose(statsf);
+		if (stats_sock >= 0)
+			unlink(stats_sock_path);
+	}
 	free(freq_table);
 	unlink(buf);
-	return 0;
+	return children_failed;
 }
 
 int
@@ -931,17 +1732,36 @@ add_to_flist(int ft, int id, int parent, int xattr_counter)
 {
 	fent_t	*fep;
 	flist_t	*ftp;
+	fidx_t	*idx;
 
+	ns_lock();
 	ftp = &flist[ft];
 	if (ftp->nfiles == ftp->nslots) {
-		ftp->nslots += FLIST_SLOT_INCR;
+		ftp->nslots = ftp->nslots ? 2 * ftp->nslots : FLIST_SLOT_INCR;
 		ftp->fents = realloc(ftp->fents, ftp->nslots * sizeof(fent_t));
 	}
+	fidx_reserve(2);
 	fep = &ftp->fents[ftp->nfiles++];
 	fep->id = id;
 	fep->ft = ft;
 	fep->parent = parent;
 	fep->xattr_counter = xattr_counter;
+	fep->prev = -1;
+	fep->next = -1;
+
+	idx = fidx_get(id);
+	idx->ft = ft;
+	idx->slot = fep - ftp->fents;
+	if (parent != -1) {
+		idx = fidx_get(parent);
+		fep->next = idx->child;
+		if (idx->child != -1)
+			id_to_fent(idx->child)->prev = id;
+		idx->child = id;
+		idx->nchild++;
+	} else
+		top_children++;
+	ns_unlock();
 }
 
 void
@@ -1085,6 +1905,13 @@ cleanup_flist(void)
 		free(flp->fents);
 		flp->fents = NULL;
 	}
+	for (i = 0; i < fidx_size; i++)
+		if (fidx[i].id != FIDX_EMPTY)
+			free(fidx[i].path);
+	free(fidx);
+	fidx = NULL;
+	fidx_size = fidx_used = 0;
+	top_children = 0;
 }
 
 int
@@ -1106,47 +1933,6 @@ creat_path(pathname_t *name, mode_t mode)
 	return rval;
 }
 
-void
-dcache_enter(int dirid, int slot)
-{
-	dcache[dirid % NDCACHE] = slot;
-}
-
-void
-dcache_init(void)
-{
-	int	i;
-
-	for (i = 0; i < NDCACHE; i++)
-		dcache[i] = -1;
-}
-
-fent_t *
-dcache_lookup(int dirid)
-{
-	fent_t	*fep;
-	int	i;
-
-	i = dcache[dirid % NDCACHE];
-	if (i >= 0 && i < flist[FT_DIR].nfiles &&
-	    (fep = &flist[FT_DIR].fents[i])->id == dirid)
-		return fep;
-	if (i >= 0 && i < flist[FT_SUBVOL].nfiles &&
-	    (fep = &flist[FT_SUBVOL].fents[i])->id == dirid)
-		return fep;
-	return NULL;
-}
-
-void
-dcache_purge(int dirid, int ft)
-{
-	int	*dcp;
-	dcp = &dcache[dirid % NDCACHE];
-	if (*dcp >= 0 && *dcp < flist[ft].nfiles &&
-	    flist[ft].fents[*dcp].id == dirid)
-		*dcp = -1;
-}
-
 /*
  * Delete the item from the list by
  * moving last entry over the deleted one;
@@ -1157,61 +1943,230 @@ void
 del_from_flist(int ft, int slot)
 {
 	flist_t	*ftp;
+	fent_t	*fep;
+	fidx_t	*idx;
 
+	ns_lock();
 	ftp = &flist[ft];
-	if (ft == FT_DIR || ft == FT_SUBVOL)
-		dcache_purge(ftp->fents[slot].id, ft);
+	fep = &ftp->fents[slot];
+
+	/* unlink it from its parent's children */
+	if (fep->parent != -1) {
+		idx = fidx_find(fep->parent);
+		idx->nchild--;
+		if (fep->prev == -1)
+			idx->child = fep->next;
+		fidx_put(idx);
+	} else
+		top_children--;
+	if (fep->prev != -1)
+		id_to_fent(fep->prev)->next = fep->next;
+	if (fep->next != -1)
+		id_to_fent(fep->next)->prev = fep->prev;
+
+	idx = fidx_find(fep->id);
+	idx->ft = -1;
+	free(idx->path);
+	idx->path = NULL;
+	fidx_put(idx);
+
 	if (slot != ftp->nfiles - 1) {
-		if (ft == FT_DIR || ft == FT_SUBVOL)
-			dcache_purge(ftp->fents[ftp->nfiles - 1].id, ft);
 		ftp->fents[slot] = ftp->fents[--ftp->nfiles];
+		fidx_find(ftp->fents[slot].id)->slot = slot;
 	} else
 		ftp->nfiles--;
+	ns_unlock();
+}
+
+/* Delete the entry fep is a copy of, unless a worker has beaten us to it. */
+void
+del_fent(fent_t *fep)
+{
+	fidx_t	*idx;
+
+	ns_lock();
+	idx = fidx_find(fep->id);
+	if (idx && idx->ft != -1)
+		del_from_flist(idx->ft, idx->slot);
+	ns_unlock();
 }
 
 void
 delete_subvol_children(int parid)
 {
-	flist_t	*flp;
-	int	i;
-again:
-	for (i = 0, flp = flist; i < FT_nft; i++, flp++) {
-		int c;
-		for (c = 0; c < flp->nfiles; c++) {
-			if (flp->fents[c].parent == parid) {
-				int id = flp->fents[c].id;
-				del_from_flist(i, c);
-				if (i == FT_DIR || i == FT_SUBVOL)
-					delete_subvol_children(id);
-				goto again;
-			}
-		}
+	fidx_t	*idx;
+	fent_t	*fep;
+	int	id;
+	int	ft;
+
+	ns_lock();
+	while ((idx = fidx_find(parid)) && idx->child != -1) {
+		fep = id_to_fent(idx->child);
+		id = fep->id;
+		ft = fep->ft;
+		if (ft == FT_DIR || ft == FT_SUBVOL)
+			delete_subvol_children(id);
+		fep = id_to_fent(id);
+		del_from_flist(ft, fep - flist[ft].fents);
 	}
+	ns_unlock();
+}
+
+/*
+ * The pathname of directory dirid, built from the cached pathname of its
+ * parent.  It stays cached until a directory is renamed.
+ */
+char *
+dir_path(int dirid)
+{
+	pathname_t	name;
+	fidx_t		*idx;
+
+	idx = fidx_find(dirid);
+	if (!idx || (idx->ft != FT_DIR && idx->ft != FT_SUBVOL))
+		return NULL;
+	if (idx->path && idx->path_gen == path_gen)
+		return idx->path;
+
+	init_pathname(&name);
+	if (!fent_to_name(&name, &flist[idx->ft].fents[idx->slot])) {
+		free_pathname(&name);
+		return NULL;
+	}
+	/* building the name only looks up entries, so idx is still good */
+	free(idx->path);
+	idx->path = name.path;
+	idx->path_gen = path_gen;
+	return idx->path;
+}
+
+fent_t *
+id_to_fent(int id)
+{
+	fidx_t	*idx;
+
+	idx = fidx_find(id);
+	if (!idx || idx->ft == -1)
+		return NULL;
+	return &flist[idx->ft].fents[idx->slot];
 }
 
 fent_t *
 dirid_to_fent(int dirid)
 {
-	fent_t	*efep;
-	fent_t	*fep;
-	flist_t	*flp;
-	int	ft = FT_DIR;
-
-	if ((fep = dcache_lookup(dirid)))
-		return fep;
-again:
-	flp = &flist[ft];
-	for (fep = flp->fents, efep = &fep[flp->nfiles]; fep < efep; fep++) {
-		if (fep->id == dirid) {
-			dcache_enter(dirid, fep - flp->fents);
-			return fep;
-		}
+	fidx_t	*idx;
+
+	idx = fidx_find(dirid);
+	if (!idx || (idx->ft != FT_DIR && idx->ft != FT_SUBVOL))
+		return NULL;
+	return &flist[idx->ft].fents[idx->slot];
+}
+
+static inline unsigned int
+fidx_hash(int id)
+{
+	return ((unsigned int)id * 2654435761U) & (fidx_size - 1);
+}
+
+fidx_t *
+fidx_find(int id)
+{
+	unsigned int	i;
+
+	if (!fidx_size)
+		return NULL;
+	for (i = fidx_hash(id); fidx[i].id != FIDX_EMPTY;
+	     i = (i + 1) & (fidx_size - 1))
+		if (fidx[i].id == id)
+			return &fidx[i];
+	return NULL;
+}
+
+/* Make room for n more ids, so that fidx_get() does not move entries. */
+void
+fidx_reserve(unsigned int n)
+{
+	fidx_t		*old = fidx;
+	unsigned int	old_size = fidx_size;
+	unsigned int	i, j;
+
+	if (2 * (fidx_used + n) <= fidx_size)
+		return;
+	fidx_size = fidx_size ? 2 * fidx_size : 1024;
+	fidx = malloc(fidx_size * sizeof(*fidx));
+	if (!fidx) {
+		perror("fidx_reserve: malloc");
+		exit(1);
 	}
-	if (ft == FT_DIR) {
-		ft = FT_SUBVOL;
-		goto again;
+	for (i = 0; i < fidx_size; i++)
+		fidx[i].id = FIDX_EMPTY;
+	for (i = 0; i < old_size; i++) {
+		if (old[i].id == FIDX_EMPTY)
+			continue;
+		for (j = fidx_hash(old[i].id); fidx[j].id != FIDX_EMPTY;
+		     j = (j + 1) & (fidx_size - 1))
+			;
+		fidx[j] = old[i];
 	}
-	return NULL;
+	free(old);
+}
+
+/* Look up id, adding it without an entry or children if it is not there. */
+fidx_t *
+fidx_get(int id)
+{
+	unsigned int	i;
+
+	fidx_reserve(1);
+	for (i = fidx_hash(id); fidx[i].id != FIDX_EMPTY;
+	     i = (i + 1) & (fidx_size - 1))
+		if (fidx[i].id == id)
+			return &fidx[i];
+	fidx_used++;
+	fidx[i].id = id;
+	fidx[i].ft = -1;
+	fidx[i].slot = -1;
+	fidx[i].child = -1;
+	fidx[i].nchild = 0;
+	fidx[i].path = NULL;
+	return &fidx[i];
+}
+
+/* Drop idx if it has neither an entry nor children any more. */
+void
+fidx_put(fidx_t *idx)
+{
+	unsigned int	i = idx - fidx;
+	unsigned int	j, k;
+
+	if (idx->ft != -1 || idx->child != -1)
+		return;
+	free(idx->path);
+	fidx_used--;
+	/* backward shift the rest of the cluster over the hole */
+	for (j = (i + 1) & (fidx_size - 1); fidx[j].id != FIDX_EMPTY;
+	     j = (j + 1) & (fidx_size - 1)) {
+		k = fidx_hash(fidx[j].id);
+		if (((j - k) & (fidx_size - 1)) < ((j - i) & (fidx_size - 1)))
+			continue;
+		fidx[i] = fidx[j];
+		i = j;
+	}
+	fidx[i].id = FIDX_EMPTY;
+}
+
+void
+ns_lock(void)
+{
+	if (nthreads)
+		pthread_mutex_lock(&ns_mutex);
+}
+
+void
+ns_unlock(void)
+{
+	if (nthreads)
+		pthread_mutex_unlock(&ns_mutex);
 }
 
 bool
@@ -1231,10 +2186,1016 @@ keep_running(opnum_t opno, opnum_t operations)
 			return false;
 		}
 
-		return now.tv_sec <= deadline.tv_sec;
+		return now.tv_sec <= deadline.tv_sec;
+	}
+
+	return opno < operations;
+}
+
+/*
+ * --profile: run the ops in phases, each with an op mix of its own and
+ * optionally its own I/O sizes, file size and directory fanout.  A profile
+ * is an ini file with a [section] per phase, run in order:
+ *
+ *	# fill a tree with small files
+ *	[populate]
+ *	ops = 100000			# per proc
+ *	freq = creat=20 mkdir=1
+ *	fanout = 64			# entries per directory
+ *
+ *	[mixed]
+ *	duration = 600			# seconds
+ *	freq = read=35 mread=35 writev=30
+ *	iosize = 4k-64k			# read and write lengths
+ *	filesize = 1m			# how big writes grow the files
+ *
+ * A phase ends after its ops or its duration, whichever comes first, and
+ * the ops that a phase doesn't list don't run in it.  Op numbers carry on
+ * from phase to phase, and the ops of a phase are the ones after those of
+ * the phases before it, so that --replay-ops runs every op in the phase it
+ * ran in.  Where a duration ends a phase is down to timing, which a replay
+ * can't know, so --replay-ops doesn't take phases with a duration.  With
+ * --threads every worker goes through the phases on its own.
+ */
+static unsigned long long
+profile_num(const char *path, int lineno, char *str, char **end)
+{
+	unsigned long long	n;
+
+	errno = 0;
+	n = strtoull(str, end, 0);
+	if (errno || *end == str)
+		goto bad;
+	switch (**end) {
+	case 'k': case 'K':
+		n <<= 10;
+		(*end)++;
+		break;
+	case 'm': case 'M':
+		n <<= 20;
+		(*end)++;
+		break;
+	case 'g': case 'G':
+		n <<= 30;
+		(*end)++;
+		break;
+	}
+	return n;
+bad:
+	fprintf(stderr, "%s:%d: bad number %s\n", path, lineno, str);
+	exit(1);
+}
+
+void
+read_profile(void)
+{
+	char		line[1024];
+	char		*s, *key, *val, *end, *tok;
+	struct phase	*ph = NULL;
+	FILE		*f;
+	int		lineno = 0;
+	int		op;
+
+	f = fopen(profile, "r");
+	if (!f) {
+		perror(profile);
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		line[strcspn(line, "#;\n")] = '\0';
+		s = line + strspn(line, " \t");
+		end = s + strlen(s);
+		while (end > s && isspace(end[-1]))
+			*--end = '\0';
+		if (!*s)
+			continue;
+		if (*s == '[') {
+			end = strchr(s, ']');
+			if (!end || end[1])
+				goto bad;
+			*end = '\0';
+			phases = realloc(phases, (nphases + 1) * sizeof(*phases));
+			if (!phases) {
+				perror("realloc");
+				exit(1);
+			}
+			ph = &phases[nphases++];
+			memset(ph, 0, sizeof(*ph));
+			ph->name = strdup(s + 1);
+			continue;
+		}
+		val = strchr(s, '=');
+		if (!ph || !val)
+			goto bad;
+		for (end = val; end > s && isspace(end[-1]); end--)
+			;
+		*end = '\0';
+		key = s;
+		val += 1 + strspn(val + 1, " \t");
+
+		if (strcmp(key, "ops") == 0) {
+			ph->ops = profile_num(profile, lineno, val, &end);
+		} else if (strcmp(key, "duration") == 0) {
+			ph->duration = profile_num(profile, lineno, val, &end);
+		} else if (strcmp(key, "freq") == 0) {
+			for (tok = strtok(val, " \t,"); tok;
+			     tok = strtok(NULL, " \t,")) {
+				s = strchr(tok, '=');
+				if (!s)
+					goto bad;
+				*s++ = '\0';
+				for (op = 0; op < OP_LAST; op++)
+					if (strcmp(tok, ops[op].name) == 0)
+						break;
+				if (op == OP_LAST) {
+					fprintf(stderr, "%s:%d: can't find op type %s\n",
+						profile, lineno, tok);
+					exit(1);
+				}
+				ph->freq[op] = profile_num(profile, lineno, s, &end);
+				if (*end)
+					goto bad;
+			}
+			end = "";
+		} else if (strcmp(key, "iosize") == 0) {
+			ph->iosize_min = profile_num(profile, lineno, val, &end);
+			ph->iosize_max = ph->iosize_min;
+			if (*end == '-')
+				ph->iosize_max = profile_num(profile, lineno,
+							     end + 1, &end);
+			if (!ph->iosize_min || ph->iosize_max < ph->iosize_min)
+				goto bad;
+		} else if (strcmp(key, "filesize") == 0) {
+			ph->filesize = profile_num(profile, lineno, val, &end);
+		} else if (strcmp(key, "fanout") == 0) {
+			ph->fanout = profile_num(profile, lineno, val, &end);
+		} else
+			goto bad;
+		if (*end)
+			goto bad;
+	}
+	fclose(f);
+
+	if (!nphases) {
+		fprintf(stderr, "%s: no phases\n", profile);
+		exit(1);
+	}
+	for (ph = phases; ph < phases + nphases; ph++) {
+		if (!ph->ops && !ph->duration) {
+			fprintf(stderr, "%s: phase %s needs ops or a duration\n",
+				profile, ph->name);
+			exit(1);
+		}
+		if (ph->duration && replay_ops) {
+			fprintf(stderr, "%s: --replay-ops excludes phase %s "
+				"with a duration\n", profile, ph->name);
+			exit(1);
+		}
+	}
+	return;
+bad:
+	fprintf(stderr, "%s:%d: can't parse this line\n", profile, lineno);
+	exit(1);
+}
+
+/* Build the freq_table of every phase, like main does for the -f mix. */
+void
+make_phase_tables(const char *dirname)
+{
+	struct phase	*ph;
+	int		op;
+
+	for (ph = phases; ph < phases + nphases; ph++) {
+		for (op = 0; op < OP_LAST; op++)
+			ops[op].freq = ph->freq[op];
+		non_btrfs_freq(dirname);
+		make_freq_table();
+		if (!freq_table_size) {
+			fprintf(stderr, "%s: phase %s has no ops to run\n",
+				profile, ph->name);
+			exit(1);
+		}
+		ph->freq_table = freq_table;
+		ph->freq_table_size = freq_table_size;
+	}
+	freq_table = phases[0].freq_table;
+	freq_table_size = phases[0].freq_table_size;
+}
+
+/*
+ * Move on to the next phase once this one has run its ops or its time, and
+ * tell doproc whether there is one left to run opno in.
+ */
+bool
+phase_running(opnum_t opno)
+{
+	struct timespec	now = { 0 };
+	opnum_t		start;
+
+	if (should_stop)
+		return false;
+	if ((phase && phase->duration) || deadline.tv_nsec)
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	if (deadline.tv_nsec && now.tv_sec > deadline.tv_sec)
+		return false;
+	while (!phase || opno >= phase_end ||
+	       (phase->duration && now.tv_sec >= phase_deadline.tv_sec)) {
+		/* where the last phase ended, not where this op is */
+		start = phase ? MIN(opno, phase_end) : 0;
+		phase = phase ? phase + 1 : phases;
+		if (phase == phases + nphases) {
+			phase = NULL;
+			return false;
+		}
+		phase_end = phase->ops ? start + phase->ops : LLONG_MAX;
+		if (phase->duration) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			phase_deadline.tv_sec = now.tv_sec + phase->duration;
+		}
+		if (verbose)
+			printf("%d/%lld: phase %s\n", procid, opno, phase->name);
+	}
+	return true;
+}
+
+/*
+ * Pick the directory for a new entry like get_fname(which, ...) would, with
+ * 0 for the top directory.  With a phase fanout pass over the directories
+ * that are full already, and if the ones tried all are, take the emptiest.
+ */
+int
+get_parent(int which, long r, fent_t **fepp, int *v)
+{
+	fent_t	*best = NULL;
+	fidx_t	*idx;
+	int	bestn = INT_MAX;
+	int	bestret = 0;
+	int	i, n, ret;
+
+	if (bigdir) {
+		*fepp = NULL;
+		*v = verbose;
+		return 0;
+	}
+	if (!phase || !phase->fanout)
+		return get_fname(which, r, NULL, NULL, fepp, v);
+	for (i = 0; i < FANOUT_TRIES; i++) {
+		ret = get_fname(which, i ? fss_random() : r, NULL, NULL,
+				fepp, v);
+		ns_lock();
+		if (!ret)
+			n = top_children;
+		else
+			n = (idx = fidx_find((*fepp)->id)) ? idx->nchild : 0;
+		ns_unlock();
+		if (n < phase->fanout)
+			return ret;
+		if (n < bestn) {
+			bestn = n;
+			best = ret ? *fepp : NULL;
+			bestret = ret;
+		}
+	}
+	*fepp = best;
+	return bestret;
+}
+
+/*
+ * --rate: open loop pacing.  Every worker keeps a schedule of op starts,
+ * 1/rate seconds apart, evenly or with the exponential gaps of a Poisson
+ * process, and starts each op when it is due, or at once when it is behind.
+ * It never skips ops to catch up.  The latencies of --stats run from when an
+ * op was due, so a stall shows in the ops queued up behind it as well, not
+ * just in the op that stalled; that is the coordinated omission correction.
+ * The schedule has a random stream of its own, so the ops don't change.
+ * The first op of each worker is put off by its share of a gap, so that
+ * with even gaps the workers take turns instead of all starting together.
+ */
+void
+rate_wait(struct timespec *sched)
+{
+	unsigned long long	next;
+	double			gap;
+	int			workers = nproc * (nthreads ? nthreads : 1);
+
+	if (!rate_next.tv_sec && !rate_next.tv_nsec) {
+		clock_gettime(CLOCK_MONOTONIC, &rate_next);
+		next = ts_ns(&rate_next) + procid / (rate * workers) * 1e9;
+		rate_next.tv_sec = next / 1000000000;
+		rate_next.tv_nsec = next % 1000000000;
+		ctr_rand_seek(&rate_rng, seed, (1ULL << 32) | procid, 0);
+	}
+	*sched = rate_next;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, sched,
+			       NULL) == EINTR && !should_stop)
+		;
+
+	if (poisson)
+		gap = -log((ctr_rand(&rate_rng) + 1.0) / (RAND_MAX + 2.0)) / rate;
+	else
+		gap = 1 / rate;
+	next = ts_ns(&rate_next) + gap * 1e9;
+	rate_next.tv_sec = next / 1000000000;
+	rate_next.tv_nsec = next % 1000000000;
+}
+
+/*
+ * --journal: the expected state journal of fssjournal.h.  A checkpoint
+ * after every sync and an S record after every fsync say what has to
+ * survive a crash, and get_fname() writes an M record for every entry an
+ * op that writes is about to work on.  The M records aren't synced: the
+ * journal is meant for a crash of the filesystem under test, with godown or
+ * dm-flakey, which doesn't lose what's written to another filesystem.
+ */
+void
+journal_init(void)
+{
+	journal_fd = open(journal_path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND,
+			  0666);
+	if (journal_fd < 0) {
+		perror(journal_path);
+		exit(1);
+	}
+	if (dprintf(journal_fd, "%s\n", FSSJ_MAGIC) < 0) {
+		perror(journal_path);
+		exit(1);
+	}
+}
+
+/* one write, so that the records of procs don't get mixed up */
+void
+journal_write(char *buf, size_t len, bool sync)
+{
+	if (write(journal_fd, buf, len) != len ||
+	    (sync && fdatasync(journal_fd) < 0)) {
+		perror(journal_path);
+		exit(1);
+	}
+}
+
+/*
+ * The inode goes in too: an op may write a file through a hard link that
+ * was made after the file was synced under its other name.
+ */
+void
+journal_mark(pathname_t *name)
+{
+	struct stat64	stb;
+	char		*buf;
+	int		len;
+
+	if (stat64_path(name, &stb) < 0 || !S_ISREG(stb.st_mode))
+		stb.st_ino = 0;
+	len = asprintf(&buf, "%d M %llu %s\n", procid,
+		       (unsigned long long)stb.st_ino, name->path);
+	if (len < 0) {
+		perror("asprintf");
+		exit(1);
+	}
+	journal_write(buf, len, false);
+	free(buf);
+}
+
+/* the size and hash of a regular file, 0 if it is something else */
+int
+journal_hash(pathname_t *name, struct stat64 *stb, uint64_t *hash)
+{
+	int	fd;
+	int	ret = 0;
+
+	fd = open_path(name, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (fstat64(fd, stb) < 0)
+		ret = -1;
+	else if (S_ISREG(stb->st_mode))
+		ret = fssj_hash_fd(fd, hash) < 0 ? -1 : 1;
+	close(fd);
+	return ret;
+}
+
+/* name has just been fsynced */
+void
+journal_sync(pathname_t *name)
+{
+	struct stat64	stb;
+	uint64_t	hash;
+	char		*buf;
+	int		len;
+
+	if (journal_hash(name, &stb, &hash) <= 0)
+		return;
+	len = asprintf(&buf, "%d S %llu %lld %016llx %s\n", procid,
+		       (unsigned long long)stb.st_ino, (long long)stb.st_size,
+		       (unsigned long long)hash, name->path);
+	if (len < 0) {
+		perror("asprintf");
+		exit(1);
+	}
+	journal_write(buf, len, true);
+	free(buf);
+}
+
+/* the whole file list has just been synced */
+void
+journal_checkpoint(void)
+{
+	struct stat64	stb;
+	pathname_t	name;
+	flist_t		*flp;
+	fent_t		*fep;
+	uint64_t	hash;
+	char		*buf;
+	size_t		len;
+	FILE		*f;
+	int		i;
+
+	f = open_memstream(&buf, &len);
+	if (!f) {
+		perror("open_memstream");
+		exit(1);
+	}
+	fprintf(f, "%d C %lu\n", procid, ++journal_seq);
+	for (flp = flist; flp < flist + FT_nft; flp++) {
+		for (i = 0, fep = flp->fents; i < flp->nfiles; i++, fep++) {
+			init_pathname(&name);
+			if (!fent_to_name(&name, fep)) {
+				free_pathname(&name);
+				continue;
+			}
+			if (fep->ft == FT_DIR || fep->ft == FT_SUBVOL)
+				fprintf(f, "%d D %s\n", procid, name.path);
+			else if (fep->ft != FT_REG && fep->ft != FT_RTF)
+				fprintf(f, "%d O %s\n", procid, name.path);
+			else if (journal_hash(&name, &stb, &hash) > 0)
+				fprintf(f, "%d F %llu %lld %016llx %s\n",
+					procid, (unsigned long long)stb.st_ino,
+					(long long)stb.st_size,
+					(unsigned long long)hash, name.path);
+			free_pathname(&name);
+		}
+	}
+	fprintf(f, "%d E %lu\n", procid, journal_seq);
+	if (fclose(f) == EOF) {
+		perror("open_memstream");
+		exit(1);
+	}
+	journal_write(buf, len, true);
+	free(buf);
+}
+
+/*
+ * --verify: the data ops write stamps, and the ops that read check what
+ * they get against a map of what the file should hold.  Each 16 bytes of
+ * the data of a write hold the id of the entry it went through, the
+ * generation of the write in its file and the offset the 16 bytes were
+ * written at, so whatever turns up where it shouldn't says where it came
+ * from.  The map of a file is a sorted list of extents, each part of one
+ * write, maybe moved since by a clone, copy, splice or collapse, and the
+ * file reads as zeroes between them.  An extent of generation 0 isn't
+ * known and isn't checked: all of a file that wasn't created by this proc
+ * starts out that way, and so does a range an op may have changed half
+ * way before it failed.  Maps are kept by inode, so they follow links and
+ * renames, and a map whose size doesn't match the file any more is taken
+ * to be lost and starts over as not known.
+ */
+void
+vstamp_fill(char *buf, size_t len, uint32_t id, uint32_t gen, off64_t origin)
+{
+	unsigned char	st[VSTAMP_SIZE];
+	uint64_t	q = origin - origin % VSTAMP_SIZE;
+	size_t		skip = origin % VSTAMP_SIZE;
+	size_t		n;
+
+	memcpy(st, &id, sizeof(id));
+	memcpy(st + 4, &gen, sizeof(gen));
+	if (skip) {
+		memcpy(st + 8, &q, sizeof(q));
+		n = MIN(len, VSTAMP_SIZE - skip);
+		memcpy(buf, st + skip, n);
+		buf += n;
+		len -= n;
+		q += VSTAMP_SIZE;
+	}
+	/* whole stamps, with copies of a constant size the compiler inlines */
+	for (; len >= VSTAMP_SIZE; len -= VSTAMP_SIZE, q += VSTAMP_SIZE) {
+		memcpy(st + 8, &q, sizeof(q));
+		memcpy(buf, st, VSTAMP_SIZE);
+		buf += VSTAMP_SIZE;
+	}
+	if (len) {
+		memcpy(st + 8, &q, sizeof(q));
+		memcpy(buf, st, len);
+	}
+}
+
+/*
+ * Offset of the first byte of buf that isn't as expected, or -1.  Zeroes
+ * are expected for generation 0.
+ */
+ssize_t
+vstamp_cmp(const char *buf, size_t len, uint32_t id, uint32_t gen,
+	   off64_t origin)
+{
+	char	exp[4096];
+	size_t	done;
+	size_t	n;
+	size_t	i;
+
+	for (done = 0; done < len; done += n) {
+		n = MIN(len - done, sizeof(exp));
+		if (gen)
+			vstamp_fill(exp, n, id, gen, origin + done);
+		else if (done == 0)
+			memset(exp, 0, n);
+		if (memcmp(exp, buf + done, n) == 0)
+			continue;
+		for (i = 0; exp[i] == buf[done + i]; i++)
+			;
+		return done + i;
+	}
+	return -1;
+}
+
+struct vmap *
+vmap_lookup(struct stat64 *stb)
+{
+	struct vmap	**mp;
+	struct vmap	*m;
+
+	mp = &vmap_hash[(stb->st_ino ^ stb->st_dev) % VMAP_HASH];
+	for (m = *mp; m; m = m->hnext)
+		if (m->ino == stb->st_ino && m->dev == stb->st_dev)
+			return m;
+	m = calloc(1, sizeof(*m));
+	if (!m) {
+		perror("vmap_lookup");
+		exit(1);
+	}
+	m->dev = stb->st_dev;
+	m->ino = stb->st_ino;
+	m->hnext = *mp;
+	*mp = m;
+	return m;
+}
+
+/* the map of a file an op has just fstat()ed, NULL without --verify */
+struct vmap *
+vmap_get(struct stat64 *stb)
+{
+	struct vmap	*m;
+
+	if (!verify_data)
+		return NULL;
+	m = vmap_lookup(stb);
+	if (m->size != stb->st_size) {
+		m->nexts = 0;
+		m->size = stb->st_size;
+		vmap_unknown(m, 0, m->size);
+	}
+	return m;
+}
+
+/* the file has just been created */
+struct vmap *
+vmap_new(struct stat64 *stb)
+{
+	struct vmap	*m;
+
+	if (!verify_data)
+		return NULL;
+	m = vmap_lookup(stb);
+	m->nexts = 0;
+	m->size = 0;
+	return m;
+}
+
+/* index of the first extent that ends after off */
+int
+vmap_find(struct vmap *m, off64_t off)
+{
+	int	lo = 0;
+	int	hi = m->nexts;
+	int	mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (m->exts[mid].off + m->exts[mid].len <= off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+void
+vext_skip(struct vext *e, off64_t skip)
+{
+	e->off += skip;
+	e->origin += skip;
+	e->len -= skip;
+}
+
+/* replace whatever the map has in [off, off + len) with the nadd extents */
+void
+vmap_replace(struct vmap *m, off64_t off, off64_t len, struct vext *add,
+	     int nadd)
+{
+	struct vext	left;
+	struct vext	right;
+	off64_t		end = off + len;
+	int		nl = 0;
+	int		nr = 0;
+	int		i;
+	int		j;
+	int		n;
+
+	if (len <= 0)
+		return;
+	i = vmap_find(m, off);
+	for (j = i; j < m->nexts && m->exts[j].off < end; j++)
+		;
+	if (i < j && m->exts[i].off < off) {
+		left = m->exts[i];
+		left.len = off - left.off;
+		nl = 1;
+	}
+	if (i < j && m->exts[j - 1].off + m->exts[j - 1].len > end) {
+		right = m->exts[j - 1];
+		vext_skip(&right, end - right.off);
+		nr = 1;
+	}
+	n = nl + nadd + nr;
+	if (m->nexts - (j - i) + n > m->aexts) {
+		m->aexts = MAX(2 * m->aexts, m->nexts - (j - i) + n);
+		m->exts = realloc(m->exts, m->aexts * sizeof(*m->exts));
+		if (!m->exts) {
+			perror("vmap_replace");
+			exit(1);
+		}
+	}
+	memmove(&m->exts[i + n], &m->exts[j],
+		(m->nexts - j) * sizeof(*m->exts));
+	m->nexts += n - (j - i);
+	if (nl)
+		m->exts[i++] = left;
+	memcpy(&m->exts[i], add, nadd * sizeof(*add));
+	if (nr)
+		m->exts[i + nadd] = right;
+}
+
+/*
+ * What the map has in [off, off + len), with the offsets made relative to
+ * off, in an array the caller frees.
+ */
+int
+vmap_extents(struct vmap *m, off64_t off, off64_t len, struct vext **extsp)
+{
+	struct vext	*exts;
+	off64_t		end = off + len;
+	int		i;
+	int		j;
+	int		n = 0;
+
+	i = vmap_find(m, off);
+	for (j = i; len > 0 && j < m->nexts && m->exts[j].off < end; j++)
+		n++;
+	exts = malloc(MAX(n, 1) * sizeof(*exts));
+	if (!exts) {
+		perror("vmap_extents");
+		exit(1);
+	}
+	memcpy(exts, &m->exts[i], n * sizeof(*exts));
+	if (n && exts[0].off < off)
+		vext_skip(&exts[0], off - exts[0].off);
+	if (n && exts[n - 1].off + exts[n - 1].len > end)
+		exts[n - 1].len = end - exts[n - 1].off;
+	for (i = 0; i < n; i++)
+		exts[i].off -= off;
+	*extsp = exts;
+	return n;
+}
+
+/* put extents made by vmap_extents() at off */
+void
+vmap_put(struct vmap *m, off64_t off, off64_t len, struct vext *exts, int n)
+{
+	int	i;
+
+	for (i = 0; i < n; i++)
+		exts[i].off += off;
+	vmap_replace(m, off, len, exts, n);
+	free(exts);
+}
+
+/* fill buf with the data of a new write to off, or the old pattern */
+uint32_t
+vmap_fill(struct vmap *m, char *buf, size_t len, off64_t off, int id)
+{
+	if (!m) {
+		memset(buf, nameseq & 0xff, len);
+		return 0;
+	}
+	vstamp_fill(buf, len, id, ++m->gen, off);
+	return m->gen;
+}
+
+/* len bytes of the data vmap_fill() made have been written to off */
+void
+vmap_write(struct vmap *m, off64_t off, off64_t len, int id, uint32_t gen)
+{
+	struct vext	e = {
+		.off	= off,
+		.len	= len,
+		.origin	= off,
+		.id	= id,
+		.gen	= gen,
+	};
+
+	if (!m || len <= 0)
+		return;
+	vmap_replace(m, off, len, &e, 1);
+	m->size = MAX(m->size, off + len);
+	m->gen = MAX(m->gen, gen);
+}
+
+/* nothing is known about [off, off + len) any more */
+void
+vmap_unknown(struct vmap *m, off64_t off, off64_t len)
+{
+	struct vext	e = { .off = off };
+
+	if (!m)
+		return;
+	e.len = MIN(off + len, m->size) - off;
+	if (e.len > 0)
+		vmap_replace(m, off, e.len, &e, 1);
+}
+
+void
+vmap_zero(struct vmap *m, off64_t off, off64_t len)
+{
+	if (m)
+		vmap_replace(m, off, MIN(off + len, m->size) - off, NULL, 0);
+}
+
+void
+vmap_truncate(struct vmap *m, off64_t size)
+{
+	if (!m)
+		return;
+	vmap_zero(m, size, m->size - size);
+	m->size = size;
+}
+
+/* len bytes at soff in src have been copied or cloned to doff in dst */
+void
+vmap_copy(struct vmap *dst, off64_t doff, struct vmap *src, off64_t soff,
+	  off64_t len)
+{
+	struct vext	*exts;
+	int		n;
+
+	if (!dst || len <= 0)
+		return;
+	n = vmap_extents(src, soff, len, &exts);
+	vmap_put(dst, doff, len, exts, n);
+	dst->size = MAX(dst->size, doff + len);
+}
+
+void
+vmap_exchange(struct vmap *m1, off64_t off1, struct vmap *m2, off64_t off2,
+	      off64_t len)
+{
+	struct vext	*exts1;
+	struct vext	*exts2;
+	int		n1;
+	int		n2;
+
+	if (!m1)
+		return;
+	n1 = vmap_extents(m1, off1, len, &exts1);
+	n2 = vmap_extents(m2, off2, len, &exts2);
+	vmap_put(m1, off1, len, exts2, n2);
+	vmap_put(m2, off2, len, exts1, n1);
+}
+
+/* fallocate with FALLOC_FL_COLLAPSE_RANGE or FALLOC_FL_INSERT_RANGE */
+void
+vmap_shift(struct vmap *m, off64_t off, off64_t len, bool insert)
+{
+	struct vext	*exts;
+	off64_t		from = insert ? off : off + len;
+	off64_t		to = insert ? off + len : off;
+	int		n;
+
+	if (!m)
+		return;
+	n = vmap_extents(m, from, m->size - from, &exts);
+	vmap_zero(m, off, m->size - off);
+	m->size += to - from;
+	vmap_put(m, to, m->size - to, exts, n);
+}
+
+/*
+ * The errors that an op that changes a range of a file gives up with
+ * before it changes anything.  After any other the range isn't known.
+ */
+bool
+vmap_early_error(int e)
+{
+	return e == 0 || e == EINVAL || e == EOPNOTSUPP || e == ENOTTY ||
+	       e == EXDEV || e == EFBIG || e == EPERM || e == EBADF ||
+	       e == ETXTBSY;
+}
+
+void
+vmap_report(opnum_t opno, const char *op, pathname_t *name, const char *buf,
+	    off64_t off, size_t len, off64_t bad, struct vext *e)
+{
+	uint64_t	q;
+	uint32_t	id;
+	uint32_t	gen;
+	off64_t		st;
+
+	fprintf(stderr, "%d/%lld: %s %s: data mismatch at %lld, expected ",
+		procid, opno, op, name->path, (long long)bad);
+	if (e) {
+		q = e->origin + bad - e->off;
+		fprintf(stderr, "id %u gen %u offset %lld", e->id, e->gen,
+			(long long)(q - q % VSTAMP_SIZE));
+		st = bad - q % VSTAMP_SIZE;
+	} else {
+		fprintf(stderr, "zeroes");
+		st = bad - bad % VSTAMP_SIZE;
+	}
+	if (st >= off && st + VSTAMP_SIZE <= off + len) {
+		memcpy(&id, buf + st - off, sizeof(id));
+		memcpy(&gen, buf + st - off + 4, sizeof(gen));
+		memcpy(&q, buf + st - off + 8, sizeof(q));
+		fprintf(stderr, ", found id %u gen %u offset %lld\n", id, gen,
+			(long long)q);
+	} else {
+		fprintf(stderr, ", found 0x%02x\n",
+			(unsigned char)buf[bad - off]);
+	}
+	verify_failed = 1;
+}
+
+/* check the len bytes an op read from off against the map */
+void
+vmap_check(opnum_t opno, const char *op, pathname_t *name, struct vmap *m,
+	   const char *buf, off64_t off, ssize_t len)
+{
+	struct vext	*e;
+	off64_t		pos = off;
+	off64_t		end = off + len;
+	off64_t		n;
+	ssize_t		bad;
+	int		i;
+
+	if (!m || len <= 0)
+		return;
+	for (i = vmap_find(m, off); pos < end; i++) {
+		e = i < m->nexts ? &m->exts[i] : NULL;
+		n = (e ? MIN(e->off, end) : end) - pos;
+		if (n > 0) {
+			bad = vstamp_cmp(buf + pos - off, n, 0, 0, 0);
+			if (bad >= 0) {
+				vmap_report(opno, op, name, buf, off, len,
+					    pos + bad, NULL);
+				return;
+			}
+			pos += n;
+		}
+		if (!e || pos >= end)
+			break;
+		n = MIN(e->off + e->len, end) - pos;
+		if (e->gen) {
+			bad = vstamp_cmp(buf + pos - off, n, e->id, e->gen,
+					 e->origin + pos - e->off);
+			if (bad >= 0) {
+				vmap_report(opno, op, name, buf, off, len,
+					    pos + bad, e);
+				return;
+			}
+		}
+		pos += n;
+	}
+}
+
+/*
+ * Make the data the map has in [off, off + len) in buf.  Returns false if
+ * any of it isn't known.
+ */
+bool
+vmap_expect(struct vmap *m, char *buf, off64_t off, off64_t len)
+{
+	struct vext	*exts;
+	int		i;
+	int		n;
+
+	if (off + len > m->size)
+		return false;
+	n = vmap_extents(m, off, len, &exts);
+	memset(buf, 0, len);
+	for (i = 0; i < n && exts[i].gen; i++)
+		vstamp_fill(buf + exts[i].off, exts[i].len, exts[i].id,
+			    exts[i].gen, exts[i].origin);
+	free(exts);
+	return i == n;
+}
+
+/*
+ * A dedupe said whether the two ranges hold the same data.  Check that
+ * against the maps, if they know all of both.
+ */
+void
+vmap_check_dedupe(opnum_t opno, pathname_t *name1, struct vmap *m1,
+		  off64_t off1, pathname_t *name2, struct vmap *m2,
+		  off64_t off2, off64_t len, bool same)
+{
+	char	*buf1;
+	char	*buf2;
+	bool	known;
+
+	if (!m1 || len <= 0)
+		return;
+	buf1 = malloc(len);
+	buf2 = malloc(len);
+	if (!buf1 || !buf2) {
+		perror("vmap_check_dedupe");
+		exit(1);
+	}
+	known = vmap_expect(m1, buf1, off1, len) &&
+		vmap_expect(m2, buf2, off2, len);
+	if (known && same != !memcmp(buf1, buf2, len)) {
+		fprintf(stderr, "%d/%lld: deduperange %s [%lld,%lld] -> %s "
+			"[%lld,%lld]: data %s but should %s\n",
+			procid, opno, name1->path, (long long)off1,
+			(long long)len, name2->path, (long long)off2,
+			(long long)len, same ? "was the same" : "differed",
+			same ? "differ" : "be the same");
+		verify_failed = 1;
+	}
+	free(buf1);
+	free(buf2);
+}
+
+/*
+ * --bigdir: time the ops that have to search the one big directory, and
+ * report their latencies every time it doubles in size.
+ */
+void
+bigdir_reset(void)
+{
+	int	i;
+
+	for (i = 0; i < BIGDIR_NOPS; i++)
+		hist_init(&bigdir_hist[i]);
+}
+
+void
+bigdir_report(int entries)
+{
+	struct op_hist	*h;
+	const char	*sep = "";
+	int		i;
+
+	printf("%d: bigdir %d entries:", procid, entries);
+	for (i = 0, h = bigdir_hist; i < BIGDIR_NOPS; i++, h++) {
+		if (!h->count)
+			continue;
+		printf("%s %s %llu ops p50 %lluns p99 %lluns max %lluns", sep,
+		       ops[bigdir_ops[i]].name, h->count,
+		       hist_percentile(h, 0.5), hist_percentile(h, 0.99),
+		       h->max);
+		sep = ",";
+	}
+	printf("\n");
+	bigdir_reset();
+}
+
+void
+bigdir_op(int op, const struct timespec *start)
+{
+	struct timespec	now;
+	int		entries;
+	int		i;
+
+	for (i = 0; i < BIGDIR_NOPS; i++) {
+		if (bigdir_ops[i] != op)
+			continue;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		hist_add(&bigdir_hist[i], ts_ns(&now) - ts_ns(start), 0);
 	}
-
-	return opno < operations;
+	entries = __atomic_load_n(&top_children, __ATOMIC_RELAXED);
+	if (entries < bigdir_next)
+		return;
+	bigdir_report(entries);
+	while (bigdir_next <= entries)
+		bigdir_next *= 2;
 }
 
 void
@@ -1247,25 +3208,51 @@ doproc(void)
 	int		rval;
 	opdesc_t	*p;
 	long long	dividend;
+	opnum_t		last = -1;
+	int		i = 0;
+	struct timespec	start;
+	struct timespec	sched;
 
 	dividend = (operations + execute_freq) / (execute_freq + 1);
-	sprintf(buf, "p%x", procid);
+	sprintf(buf, "p%x", nthreads ? procid / nthreads : procid);
 	(void)mkdir(buf, 0777);
 	if (chdir(buf) < 0 || stat64(".", &statbuf) < 0) {
 		perror(buf);
 		_exit(1);
 	}
 	top_ino = statbuf.st_ino;
+	phase = NULL;
+	rate_next.tv_sec = rate_next.tv_nsec = 0;
 	homedir = getcwd(NULL, 0);
 	if (!homedir) {
 		perror("getcwd failed");
 		_exit(1);
 	}
-	seed += procid;
-	srandom(seed);
-	if (namerand)
-		namerand = random();
-	for (opno = 0; keep_running(opno, operations); opno++) {
+	if (bigdir) {
+		bigdir_reset();
+		bigdir_next = BIGDIR_FIRST;
+	}
+	/* the workers of a proc share its PRNG and names, see run_threads */
+	if (!nthreads) {
+		seed += procid;
+		srandom(seed);
+		if (namerand)
+			namerand = random();
+	}
+	for (opno = 0; ; opno++) {
+		if (replay_ops) {
+			/* skip to the next op of this proc in the log */
+			while (i < nr_replay && (replay_procs[i] != procid ||
+						 replay_opnos[i] <= last))
+				i++;
+			if (i == nr_replay || should_stop)
+				break;
+			opno = last = replay_opnos[i++];
+			if (phases && !phase_running(opno))
+				break;
+		} else if (phases ? !phase_running(opno) :
+				    !keep_running(opno, operations))
+			break;
 		if (execute_cmd && opno && opno % dividend == 0) {
 			if (verbose)
 				printf("%lld: execute command %s\n", opno,
@@ -1275,8 +3262,42 @@ doproc(void)
 				fprintf(stderr, "execute command failed with "
 					"%d\n", rval);
 		}
-		p = &ops[freq_table[random() % freq_table_size]];
-		p->func(opno, random());
+		if (ctr_random)
+			ctr_rand_seek(&rng, seed, procid, opno);
+		if (phase)
+			p = &ops[phase->freq_table[fss_random() %
+						   phase->freq_table_size]];
+		else
+			p = &ops[freq_table[fss_random() % freq_table_size]];
+		if (rate)
+			rate_wait(&sched);
+		if (stats || bigdir) {
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			if (rate && stats) {
+				stats_lag(&sched, &start);
+				start = sched;
+			}
+		}
+		errno = 0;
+		op_iswrite = p->iswrite;
+		p->func(opno, fss_random());
+		if (stats)
+			stats_op(p - ops, &start, errno);
+		if (bigdir)
+			bigdir_op(p - ops, &start);
+		if (verify_failed)
+			break;
+		/*
+		 * After a shutdown every op would mark its entries as changed,
+		 * which they aren't, so stop journaling at the first EIO.
+		 */
+		if (journal_fd >= 0 && errno == EIO) {
+			if (verbose)
+				printf("%d/%lld: journal stopped on EIO\n",
+				       procid, opno);
+			close(journal_fd);
+			journal_fd = -1;
+		}
 		/*
 		 * test for forced shutdown by stat'ing the test
 		 * directory.  If this stat returns EIO, assume
@@ -1291,9 +3312,12 @@ doproc(void)
 		}
 	}
 errout:
+	if (bigdir)
+		bigdir_report(top_children);
 	assert(chdir("..") == 0);
 	free(homedir);
-	if (cleanup) {
+	/* leave the files that didn't verify for a look */
+	if (cleanup && !nthreads && !verify_failed) {
 		int ret;
 
 		sprintf(cmd, "rm -rf %s", buf);
@@ -1312,34 +3336,32 @@ errout:
 int
 fent_to_name(pathname_t *name, fent_t *fep)
 {
-	flist_t	*flp = &flist[fep->ft];
 	char	buf[NAME_MAX + 1];
-	int	i;
-	fent_t	*pfep;
-	int	e;
+	char	*path = NULL;
 
 	if (fep == NULL)
 		return 0;
 
 	/* build up parent directory name */
 	if (fep->parent != -1) {
-		pfep = dirid_to_fent(fep->parent);
+		ns_lock();
+		path = dir_path(fep->parent);
 #ifdef DEBUG
-		if (pfep == NULL) {
+		if (path == NULL) {
 			fprintf(stderr, "%d: fent-id = %d: can't find parent id: %d\n",
 				procid, fep->id, fep->parent);
 		} 
 #endif
-		if (pfep == NULL)
-			return 0;
-		e = fent_to_name(name, pfep);
-		if (!e)
+		if (path) {
+			append_pathname(name, path);
+			append_pathname(name, "/");
+		}
+		ns_unlock();
+		if (path == NULL)
 			return 0;
-		append_pathname(name, "/");
 	}
 
-	i = sprintf(buf, "%c%x", flp->tag, fep->id);
-	namerandpad(fep->id, buf, i);
+	make_name(buf, fep->ft, fep->id);
 	append_pathname(name, buf);
 	return 1;
 }
@@ -1348,32 +3370,55 @@ bool
 fents_ancestor_check(fent_t *fep, fent_t *dfep)
 {
 	fent_t  *tmpfep;
+	bool	ret = false;
 
-	for (tmpfep = fep; tmpfep->parent != -1;
+	ns_lock();
+	for (tmpfep = fep; tmpfep && tmpfep->parent != -1;
 	     tmpfep = dirid_to_fent(tmpfep->parent)) {
-		if (tmpfep->parent == dfep->id)
-			return true;
+		if (tmpfep->parent == dfep->id) {
+			ret = true;
+			break;
+		}
 	}
-
-	return false;
+	ns_unlock();
+	return ret;
 }
 
+/*
+ * Hand the children of oldid over to newid, and with swap those of newid to
+ * oldid.  A rename calls this before newid has its own entry.
+ */
 void
 fix_parent(int oldid, int newid, bool swap)
 {
+	fidx_t	*oidx;
+	fidx_t	*nidx;
 	fent_t	*fep;
-	flist_t	*flp;
-	int	i;
-	int	j;
-
-	for (i = 0, flp = flist; i < FT_nft; i++, flp++) {
-		for (j = 0, fep = flp->fents; j < flp->nfiles; j++, fep++) {
-			if (fep->parent == oldid)
-				fep->parent = newid;
-			else if (swap && fep->parent == newid)
-				fep->parent = oldid;
-		}
-	}
+	int	child;
+
+	ns_lock();
+	fidx_reserve(2);
+	oidx = fidx_get(oldid);
+	nidx = fidx_get(newid);
+	child = oidx->child;
+	oidx->child = swap ? nidx->child : -1;
+	nidx->child = child;
+	child = oidx->nchild;
+	oidx->nchild = swap ? nidx->nchild : 0;
+	nidx->nchild = child;
+	for (child = nidx->child; child != -1; child = fep->next) {
+		fep = id_to_fent(child);
+		fep->parent = newid;
+	}
+	for (child = oidx->child; child != -1; child = fep->next) {
+		fep = id_to_fent(child);
+		fep->parent = oldid;
+	}
+	/* every cached path below either of them is stale now */
+	path_gen++;
+	fidx_put(nidx);
+	fidx_put(fidx_find(oldid));
+	ns_unlock();
 }
 
 void
@@ -1395,18 +3440,27 @@ int
 generate_fname(fent_t *fep, int ft, pathname_t *name, int *idp, int *v)
 {
 	char	buf[NAME_MAX + 1];
-	flist_t	*flp;
 	int	id;
 	int	j;
-	int	len;
 	int	e;
 
 	/* create name */
-	flp = &flist[ft];
-	len = sprintf(buf, "%c%x", flp->tag, id = nameseq++);
-	namerandpad(id, buf, len);
+	id = __atomic_fetch_add(&nameseq, 1, __ATOMIC_RELAXED);
+	make_name(buf, ft, id);
+
+	/* callers use *v even when there is no name to return */
+	*v = verbose;
+	for (j = 0; !*v && j < ilistlen; j++) {
+		if (ilist[j] == id) {
+			*v = 1;
+			break;
+		}
+	}
 
-	/* prepend fep parent dir-name to it */
+	/*
+	 * prepend fep parent dir-name to it, with --threads the directory
+	 * can be gone by now
+	 */
 	if (fep) {
 		e = fent_to_name(name, fep);
 		if (!e)
@@ -1416,13 +3470,6 @@ generate_fname(fent_t *fep, int ft, pathname_t *name, int *idp, int *v)
 	append_pathname(name, buf);
 
 	*idp = id;
-	*v = verbose;
-	for (j = 0; !*v && j < ilistlen; j++) {
-		if (ilist[j] == id) {
-			*v = 1;
-			break;
-		}
-	}
 	return 1;
 }
 
@@ -1448,6 +3495,35 @@ int generate_xattr_name(int xattr_num, char *buffer, int buflen)
 int
 get_fname(int which, long r, pathname_t *name, flist_t **flpp, fent_t **fepp,
 	  int *v)
+{
+	fent_t	*fep = NULL;
+	fent_t	*snap;
+	int	e;
+
+	/*
+	 * Entries move around flist as others are deleted, and with --threads
+	 * that can happen as soon as ns_lock is dropped, so hand out a copy.
+	 * Change an entry through its id, under ns_lock.
+	 */
+	ns_lock();
+	e = pick_fname(which, r, name, flpp, &fep, v);
+	if (fepp) {
+		*fepp = NULL;
+		if (fep) {
+			snap = &fent_snap[fent_snap_next++ % NSNAP];
+			*snap = *fep;
+			*fepp = snap;
+		}
+	}
+	ns_unlock();
+	if (journal_fd >= 0 && op_iswrite && name && e)
+		journal_mark(name);
+	return e;
+}
+
+int
+pick_fname(int which, long r, pathname_t *name, flist_t **flpp, fent_t **fepp,
+	   int *v)
 {
 	int	totalsum = 0; /* total number of matching files */
 	int	partialsum = 0; /* partial sum of matching files */
@@ -1701,6 +3777,115 @@ namerandpad(int id, char *buf, int i)
 	}
 }
 
+/* xfs_da_hashname() */
+static uint32_t
+xfs_dir_hash(const unsigned char *name, int len)
+{
+	uint32_t	hash;
+
+	for (hash = 0; len >= 4; len -= 4, name += 4)
+		hash = (name[0] << 21) ^ (name[1] << 14) ^ (name[2] << 7) ^
+		       (name[3] << 0) ^ ((hash << 28) | (hash >> 4));
+	switch (len) {
+	case 3:
+		return (name[0] << 14) ^ (name[1] << 7) ^ (name[2] << 0) ^
+		       ((hash << 21) | (hash >> 11));
+	case 2:
+		return (name[0] << 7) ^ (name[1] << 0) ^
+		       ((hash << 14) | (hash >> 18));
+	case 1:
+		return (name[0] << 0) ^ ((hash << 7) | (hash >> 25));
+	}
+	return hash;
+}
+
+/* dx_hack_hash(), ext4's legacy dir hash, which has no per fs seed */
+static uint32_t
+ext4_legacy_hash(const unsigned char *name, int len)
+{
+	uint32_t	hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+
+	while (len--) {
+		hash = hash1 + (hash0 ^ (*name++ * 7152373));
+		if (hash & 0x80000000)
+			hash -= 0x7fffffff;
+		hash1 = hash0;
+		hash0 = hash;
+	}
+	return hash0 << 1;
+}
+
+static bool
+name_char_ok(uint32_t c)
+{
+	return c > ' ' && c < 0x7f && c != '/';
+}
+
+/*
+ * Follow the tag and id in buf with a salt of eight printable characters,
+ * tried one after another for as long as it takes the name to hash where
+ * --names wants it.  For XFS four more characters then set the hash: the
+ * last four bytes of a name are xored into the low 29 bits of the hash of
+ * what comes before them, rotated, so salts are only tried until the ones
+ * that would have to cancel that out are printable.  It takes two blocks of
+ * salt to reach all the bits of that.  The ext4 hash can't be steered like
+ * that, so the salt alone has to land it in the band, which takes 256 tries
+ * on average.  Either way the name only depends on the id.
+ */
+static void
+hash_name(char *buf, int len, int id)
+{
+	uint32_t	target = 0x2bad1dea;
+	uint32_t	x;
+	uint64_t	k, r;
+	int		i;
+
+	if (name_mode == NAMES_XFS_CLUSTER)
+		target += ctr_rand_mix(id) & 0xff;
+	/* keep the salt and tail in whole XFS hash blocks */
+	while (len % 4)
+		buf[len++] = '_';
+	for (k = 0; ; k++) {
+		r = ctr_rand_mix(((uint64_t)id << 32) + k);
+		for (i = 0; i < 8; i++, r /= '~' - '!' + 1)
+			buf[len + i] = '!' + r % ('~' - '!' + 1);
+		if (memchr(buf + len, '/', 8))
+			continue;
+		if (name_mode == NAMES_EXT4_CLUSTER) {
+			buf[len + 8] = '\0';
+			if (ext4_legacy_hash((unsigned char *)buf, len + 8) >> 24 ==
+			    target >> 24)
+				return;
+			continue;
+		}
+		x = xfs_dir_hash((unsigned char *)buf, len + 8);
+		x = target ^ ((x << 28) | (x >> 4));
+		if (!name_char_ok(x >> 21) || !name_char_ok((x >> 14) & 0x7f) ||
+		    !name_char_ok((x >> 7) & 0x7f) || !name_char_ok(x & 0x7f) ||
+		    (x >> 21) & ~0x7f)
+			continue;
+		buf[len + 8] = x >> 21;
+		buf[len + 9] = (x >> 14) & 0x7f;
+		buf[len + 10] = (x >> 7) & 0x7f;
+		buf[len + 11] = x & 0x7f;
+		buf[len + 12] = '\0';
+		return;
+	}
+}
+
+/* the name of entry id of type ft */
+void
+make_name(char *buf, int ft, int id)
+{
+	int	len;
+
+	len = sprintf(buf, "%c%x", flist[ft].tag, id);
+	if (name_mode == NAMES_SEQ)
+		namerandpad(id, buf, len);
+	else
+		hash_name(buf, len, id);
+}
+
 int
 open_file_or_dir(pathname_t *name, int flags)
 {
@@ -2052,6 +4237,31 @@ usage(void)
 	printf("   -X ncmd          number of calls to the -x command (default 1)\n");
 	printf("   -H               prints usage and exits\n");
 	printf("   --duration=s     ignore any -n setting and run for this many seconds\n");
+	printf("   --ctr-random     draw every op's random numbers from a stream of its own\n");
+	printf("   --profile=file   run the phases of an ini profile, each with its own op mix,\n");
+	printf("                    instead of -n ops of the -f mix\n");
+	printf("   --rate=n         start n ops a second in every worker, however long they take\n");
+	printf("   --rate-total=n   start n ops a second spread over all workers\n");
+	printf("   --arrival=a      constant (default) or poisson gaps between --rate op starts\n");
+	printf("   --replayable     like --ctr-random, so that -v logs can be replayed\n");
+	printf("   --replay-ops=log only run the ops in the -v log of a --replayable run\n");
+	printf("   --threads=n      run n threads in every proc, sharing its directory\n");
+	printf("   --stats=file     write per op latency histograms and error counts to file as JSON\n");
+	printf("                    at the end and on SIGUSR1\n");
+	printf("   --stats-interval=s  also write them every s seconds\n");
+	printf("   --stats-socket=path stream them to the clients of a unix socket, every\n");
+	printf("                    --stats-interval seconds (default 1)\n");
+	printf("   --journal=file   record what has to survive a crash as of every sync and\n");
+	printf("                    fsync, for fssverify to check after recovery\n");
+	printf("   --names=m        seq (default) names, or names whose directory hashes are\n");
+	printf("                    xfs-collide: all the same on XFS, xfs-cluster: close together\n");
+	printf("                    on XFS, ext4-cluster: close together with the ext4 legacy hash\n");
+	printf("   --bigdir         make every new entry in the top directory of its proc and\n");
+	printf("                    report the creat, stat, getdents and unlink latencies each\n");
+	printf("                    time the directory doubles in size\n");
+	printf("   --verify         write stamped data and check everything read against what\n");
+	printf("                    the files should hold, stopping a proc at the first mismatch\n");
+	printf("                    and exiting 1\n");
 }
 
 void
@@ -2182,6 +4392,8 @@ afsync_f(opnum_t opno, long r)
 	}
 
 	e = event.res2;
+	if (e == 0 && event.res == 0 && journal_fd >= 0)
+		journal_sync(&f);
 	if (v)
 		printf("%d/%lld: afsync %s %d\n", procid, opno, f.path, e);
 	free_pathname(&f);
@@ -2206,13 +4418,16 @@ do_aio_rw(opnum_t opno, long r, int flags)
 	int		v;
 	char		st[1024];
 	char		*dio_env;
+	fent_t		*fep;
+	struct vmap	*vm;
+	uint32_t	gen;
 	struct iocb	iocb;
 	struct io_event	event;
 	struct iocb	*iocbs[] = { &iocb };
 	int		iswrite = (flags & (O_WRONLY | O_RDWR)) ? 1 : 0;
 
 	init_pathname(&f);
-	if (!get_fname(FT_REGFILE, r, &f, NULL, NULL, &v)) {
+	if (!get_fname(FT_REGFILE, r, &f, NULL, &fep, &v)) {
 		if (v)
 			printf("%d/%lld: do_aio_rw - no filename\n", procid, opno);
 		goto aio_out;
@@ -2233,6 +4448,7 @@ do_aio_rw(opnum_t opno, long r, int flags)
 		goto aio_out;
 	}
 	inode_info(st, sizeof(st), &stb, v);
+	vm = vmap_get(&stb);
 	if (!iswrite && stb.st_size == 0) {
 		if (v)
 			printf("%d/%lld: do_aio_rw - %s%s zero size\n", procid, opno,
@@ -2252,8 +4468,8 @@ do_aio_rw(opnum_t opno, long r, int flags)
 	if (dio_env)
 		diob.d_mem = diob.d_miniosz = atoi(dio_env);
 	align = (int64_t)diob.d_miniosz;
-	lr = ((int64_t)random() << 32) + random();
-	len = (random() % FILELEN_MAX) + 1;
+	lr = ((int64_t)fss_random() << 32) + fss_random();
+	len = io_len();
 	len -= (len % align);
 	if (len <= 0)
 		len = align;
@@ -2270,8 +4486,8 @@ do_aio_rw(opnum_t opno, long r, int flags)
 	if (iswrite) {
 		off = (off64_t)(lr % MIN(stb.st_size + (1024 * 1024), MAXFSIZE));
 		off -= (off % align);
-		off %= maxfsize;
-		memset(buf, nameseq & 0xff, len);
+		off %= file_max();
+		gen = vmap_fill(vm, buf, len, off, fep->id);
 		io_prep_pwrite(&iocb, fd, buf, len, off);
 	} else {
 		off = (off64_t)(lr % stb.st_size);
@@ -2292,6 +4508,10 @@ do_aio_rw(opnum_t opno, long r, int flags)
 	}
 
 	e = event.res != len ? event.res2 : 0;
+	if (iswrite)
+		vmap_write(vm, off, (long)event.res, fep->id, gen);
+	else
+		vmap_check(opno, "aread", &f, vm, buf, off, (long)event.res);
 	if (v)
 		printf("%d/%lld: %s %s%s [%lld,%d] %d\n",
 		       procid, opno, iswrite ? "awrite" : "aread",
@@ -2319,6 +4539,9 @@ do_uring_rw(opnum_t opno, long r, int flags)
 	struct stat64	stb;
 	int		v;
 	char		st[1024];
+	fent_t		*fep;
+	struct vmap	*vm;
+	uint32_t	gen;
 	struct io_uring_sqe	*sqe;
 	struct io_uring_cqe	*cqe;
 	struct iovec	iovec;
@@ -2328,7 +4551,7 @@ do_uring_rw(opnum_t opno, long r, int flags)
 		return;
 
 	init_pathname(&f);
-	if (!get_fname(FT_REGFILE, r, &f, NULL, NULL, &v)) {
+	if (!get_fname(FT_REGFILE, r, &f, NULL, &fep, &v)) {
 		if (v)
 			printf("%d/%lld: do_uring_rw - no filename\n", procid, opno);
 		goto uring_out;
@@ -2349,6 +4572,7 @@ do_uring_rw(opnum_t opno, long r, int flags)
 		goto uring_out;
 	}
 	inode_info(st, sizeof(st), &stb, v);
+	vm = vmap_get(&stb);
 	if (!iswrite && stb.st_size == 0) {
 		if (v)
 			printf("%d/%lld: do_uring_rw - %s%s zero size\n", procid, opno,
@@ -2362,8 +4586,8 @@ do_uring_rw(opnum_t opno, long r, int flags)
 			       procid, opno);
 		goto uring_out;
 	}
-	lr = ((int64_t)random() << 32) + random();
-	len = (random() % FILELEN_MAX) + 1;
+	lr = ((int64_t)fss_random() << 32) + fss_random();
+	len = io_len();
 	buf = malloc(len);
 	if (!buf) {
 		if (v)
@@ -2375,8 +4599,8 @@ do_uring_rw(opnum_t opno, long r, int flags)
 	iovec.iov_len = len;
 	if (iswrite) {
 		off = (off64_t)(lr % MIN(stb.st_size + (1024 * 1024), MAXFSIZE));
-		off %= maxfsize;
-		memset(buf, nameseq & 0xff, len);
+		off %= file_max();
+		gen = vmap_fill(vm, buf, len, off, fep->id);
 		io_uring_prep_writev(sqe, fd, &iovec, 1, off);
 	} else {
 		off = (off64_t)(lr % stb.st_size);
@@ -2399,6 +4623,10 @@ do_uring_rw(opnum_t opno, long r, int flags)
 		printf("%d/%lld: %s %s%s [%lld, %d(res=%d)] %d\n",
 		       procid, opno, iswrite ? "uring_write" : "uring_read",
 		       f.path, st, (long long)off, (int)len, cqe->res, e);
+	if (iswrite)
+		vmap_write(vm, off, cqe->res, fep->id, gen);
+	else
+		vmap_check(opno, "uring_read", &f, vm, buf, off, cqe->res);
 	io_uring_cqe_seen(&ring, cqe);
 
  uring_out:
@@ -2410,6 +4638,344 @@ do_uring_rw(opnum_t opno, long r, int flags)
 }
 #endif
 
+#ifdef URING_FSOPS
+/*
+ * uring_creat and uring_meta put a batch of ops on the ring, enter the
+ * kernel once for all of them and update the file list from the
+ * completions.  The ops of a batch run concurrently, in no set order, so
+ * they must not depend on each other: each works on an entry, or makes a
+ * name, of its own, and directories are only ever made, never removed or
+ * renamed, which leaves the parents of the new names in place.
+ */
+bool
+uring_op_supported(int op)
+{
+	return have_io_uring && uring_probe &&
+	       io_uring_opcode_supported(uring_probe, op);
+}
+
+/*
+ * Submit the nr ops on the ring and put the result of each in res[], at the
+ * index of its user data.  If that goes wrong there is no telling what is
+ * left on the ring, so stop using io_uring in this worker, but only once
+ * the ops that did get submitted are done with the caller's buffers.
+ */
+int
+uring_submit_batch(opnum_t opno, const char *name, int nr, int *res)
+{
+	struct io_uring_cqe	*cqe;
+	int			submitted;
+	int			done = 0;
+	int			e;
+
+	submitted = e = io_uring_submit_and_wait(&ring, nr);
+	if (e != nr)
+		goto fail;
+	for (; done < nr; done++) {
+		if ((e = io_uring_wait_cqe(&ring, &cqe)) < 0)
+			goto fail;
+		res[io_uring_cqe_get_data64(cqe)] = cqe->res;
+		io_uring_cqe_seen(&ring, cqe);
+	}
+	return 0;
+
+ fail:
+	if (verbose)
+		printf("%d/%lld: %s - io_uring batch of %d failed %d, "
+		       "disabling io_uring\n", procid, opno, name, nr, e);
+	while (done < submitted) {
+		if ((e = io_uring_wait_cqe(&ring, &cqe)) == -EINTR)
+			continue;
+		if (e < 0)
+			break;
+		io_uring_cqe_seen(&ring, cqe);
+		done++;
+	}
+	io_exit_uring();
+	return -1;
+}
+
+/*
+ * Create up to URING_BATCH files and write their first block, each with a
+ * linked openat, write and close through a slot of the registered file
+ * table, all in a single io_uring_enter.
+ */
+void
+do_uring_creat(opnum_t opno, long r)
+{
+	char			*buf[URING_BATCH] = { NULL };
+	pathname_t		f[URING_BATCH];
+	fent_t			*fep;
+	int			id[URING_BATCH];
+	size_t			len[URING_BATCH];
+	int			parid[URING_BATCH];
+	int			res[3 * URING_BATCH];
+	struct io_uring_sqe	*sqe;
+	struct stat64		stb;
+	struct vmap		*vm;
+	int			err = 0;
+	int			i;
+	int			n;
+	int			v = 0;
+	int			v1;
+
+	if (!have_uring_files || !uring_op_supported(IORING_OP_OPENAT) ||
+	    !uring_op_supported(IORING_OP_WRITE) ||
+	    !uring_op_supported(IORING_OP_CLOSE)) {
+		if (verbose)
+			printf("%d/%lld: uring_creat - not supported\n",
+			       procid, opno);
+		return;
+	}
+	for (i = 0; i < URING_BATCH; i++)
+		init_pathname(&f[i]);
+	for (n = 0; n < 1 + r % URING_BATCH; n++) {
+		if (!get_parent(FT_ANYDIR, fss_random(), &fep, &v1))
+			parid[n] = -1;
+		else
+			parid[n] = fep->id;
+		v |= v1;
+		if (!generate_fname(fep, FT_REG, &f[n], &id[n], &v1))
+			break;
+		v |= v1;
+		len[n] = io_len();
+		buf[n] = malloc(len[n]);
+		if (!buf[n])
+			break;
+		/* the first write to the new file */
+		if (verify_data)
+			vstamp_fill(buf[n], len[n], id[n], 1, 0);
+		else
+			memset(buf[n], nameseq & 0xff, len[n]);
+
+		sqe = io_uring_get_sqe(&ring);
+		io_uring_prep_openat_direct(sqe, AT_FDCWD, f[n].path,
+				O_CREAT | O_EXCL | O_WRONLY, 0666, n);
+		io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+		io_uring_sqe_set_data64(sqe, 3 * n);
+		/* a hard link, so that a failed write still closes the slot */
+		sqe = io_uring_get_sqe(&ring);
+		io_uring_prep_write(sqe, n, buf[n], len[n], 0);
+		io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK);
+		io_uring_sqe_set_data64(sqe, 3 * n + 1);
+		sqe = io_uring_get_sqe(&ring);
+		io_uring_prep_close_direct(sqe, n);
+		io_uring_sqe_set_data64(sqe, 3 * n + 2);
+	}
+	if (n == 0) {
+		if (v)
+			printf("%d/%lld: uring_creat - no filename\n",
+			       procid, opno);
+		goto out;
+	}
+	if (uring_submit_batch(opno, "uring_creat", 3 * n, res) < 0)
+		goto out;
+
+	for (i = 0; i < n; i++) {
+		if (v)
+			printf("%d/%lld: uring_creat %s %d [0,%d(res=%d)] %d\n",
+			       procid, opno, f[i].path,
+			       res[3 * i] < 0 ? -res[3 * i] : 0,
+			       (int)len[i], res[3 * i + 1], res[3 * i + 2]);
+		if (res[3 * i] >= 0) {
+			add_to_flist(FT_REG, id[i], parid[i], 0);
+			if (v)
+				printf("%d/%lld: uring_creat add id=%d,parent=%d\n",
+				       procid, opno, id[i], parid[i]);
+			if (verify_data && stat64_path(&f[i], &stb) == 0) {
+				vm = vmap_new(&stb);
+				vmap_write(vm, 0, res[3 * i + 1], id[i], 1);
+			}
+		} else if (!err)
+			err = -res[3 * i];
+	}
+ out:
+	for (i = 0; i < URING_BATCH; i++) {
+		free(buf[i]);
+		free_pathname(&f[i]);
+	}
+	errno = err;
+}
+
+enum {
+	UM_MKDIR,
+	UM_UNLINK,
+	UM_RENAME,
+	UM_STATX,
+	UM_LAST
+};
+
+struct uring_meta {
+	int		op;
+	pathname_t	f;
+	pathname_t	newf;
+	fent_t		fe;		/* the existing entry worked on */
+	int		ft;
+	int		id;		/* of the new name */
+	int		parid;
+	struct statx	stx;
+};
+
+/*
+ * A batch of up to URING_BATCH mkdirs, unlinks, renames and statxs, each
+ * on an entry no other op of the batch touches.
+ */
+void
+do_uring_meta(opnum_t opno, long r)
+{
+	static const char	*names[UM_LAST] = {
+		[UM_MKDIR]	= "mkdir",
+		[UM_UNLINK]	= "unlink",
+		[UM_RENAME]	= "rename",
+		[UM_STATX]	= "statx",
+	};
+	static const int	opcodes[UM_LAST] = {
+		[UM_MKDIR]	= IORING_OP_MKDIRAT,
+		[UM_UNLINK]	= IORING_OP_UNLINKAT,
+		[UM_RENAME]	= IORING_OP_RENAMEAT,
+		[UM_STATX]	= IORING_OP_STATX,
+	};
+	struct uring_meta	m[URING_BATCH];
+	struct uring_meta	*mp;
+	fent_t			*fep;
+	flist_t			*flp;
+	int			res[URING_BATCH];
+	struct io_uring_sqe	*sqe;
+	int			err = 0;
+	int			i;
+	int			j;
+	int			n = 0;
+	int			nops;
+	int			v = 0;
+	int			v1;
+
+	for (i = 0; i < UM_LAST; i++)
+		if (uring_op_supported(opcodes[i]))
+			break;
+	if (i == UM_LAST) {
+		if (verbose)
+			printf("%d/%lld: uring_meta - not supported\n",
+			       procid, opno);
+		return;
+	}
+	for (i = 0; i < URING_BATCH; i++) {
+		init_pathname(&m[i].f);
+		init_pathname(&m[i].newf);
+	}
+	nops = 1 + r % URING_BATCH;
+	for (i = 0; i < nops; i++) {
+		mp = &m[n];
+		free_pathname(&mp->f);
+		free_pathname(&mp->newf);
+		mp->op = fss_random() % UM_LAST;
+		if (!uring_op_supported(opcodes[mp->op]))
+			continue;
+		if (mp->op == UM_MKDIR) {
+			if (!get_parent(FT_ANYDIR, fss_random(), &fep, &v1))
+				mp->parid = -1;
+			else
+				mp->parid = fep->id;
+			v |= v1;
+			if (!generate_fname(fep, FT_DIR, &mp->f, &mp->id, &v1))
+				continue;
+			v |= v1;
+			mp->ft = FT_DIR;
+			goto add;
+		}
+		if (!get_fname(mp->op == UM_STATX ? FT_ANYm : FT_NOTDIR,
+			       fss_random(), &mp->f, &flp, &fep, &v1))
+			continue;
+		v |= v1;
+		mp->fe = *fep;
+		mp->ft = flp - flist;
+		/* leave an entry to the first op of the batch that picked it */
+		for (j = 0; j < n; j++)
+			if (m[j].op != UM_MKDIR && m[j].fe.id == mp->fe.id)
+				break;
+		if (j < n)
+			continue;
+		if (mp->op == UM_RENAME) {
+			if (!get_parent(FT_DIRm, fss_random(), &fep, &v1))
+				mp->parid = -1;
+			else
+				mp->parid = fep->id;
+			v |= v1;
+			if (!generate_fname(fep, mp->ft, &mp->newf, &mp->id,
+					    &v1))
+				continue;
+			v |= v1;
+		}
+ add:
+		sqe = io_uring_get_sqe(&ring);
+		switch (mp->op) {
+		case UM_MKDIR:
+			io_uring_prep_mkdirat(sqe, AT_FDCWD, mp->f.path, 0777);
+			break;
+		case UM_UNLINK:
+			io_uring_prep_unlinkat(sqe, AT_FDCWD, mp->f.path, 0);
+			break;
+		case UM_RENAME:
+			io_uring_prep_renameat(sqe, AT_FDCWD, mp->f.path,
+					       AT_FDCWD, mp->newf.path, 0);
+			break;
+		case UM_STATX:
+			io_uring_prep_statx(sqe, AT_FDCWD, mp->f.path,
+					    AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS,
+					    &mp->stx);
+			break;
+		}
+		io_uring_sqe_set_data64(sqe, n);
+		n++;
+	}
+	if (n == 0) {
+		if (v)
+			printf("%d/%lld: uring_meta - no filename\n",
+			       procid, opno);
+		goto out;
+	}
+	if (uring_submit_batch(opno, "uring_meta", n, res) < 0)
+		goto out;
+
+	for (i = 0, mp = m; i < n; i++, mp++) {
+		if (res[i] < 0 && !err)
+			err = -res[i];
+		if (res[i] == 0) {
+			ns_lock();
+			if (mp->op == UM_UNLINK || mp->op == UM_RENAME)
+				del_fent(&mp->fe);
+			if (mp->op == UM_RENAME)
+				add_to_flist(mp->ft, mp->id, mp->parid,
+					     mp->fe.xattr_counter);
+			else if (mp->op == UM_MKDIR)
+				add_to_flist(FT_DIR, mp->id, mp->parid, 0);
+			ns_unlock();
+		}
+		if (!v)
+			continue;
+		if (mp->op == UM_RENAME)
+			printf("%d/%lld: uring_meta rename %s to %s %d\n",
+			       procid, opno, mp->f.path, mp->newf.path,
+			       res[i] < 0 ? -res[i] : 0);
+		else
+			printf("%d/%lld: uring_meta %s %s %d\n", procid, opno,
+			       names[mp->op], mp->f.path,
+			       res[i] < 0 ? -res[i] : 0);
+		if (res[i] == 0 && mp->op != UM_STATX)
+			printf("%d/%lld: uring_meta %s id=%d,parent=%d\n",
+			       procid, opno,
+			       mp->op == UM_UNLINK ? "del" : "add",
+			       mp->op == UM_UNLINK ? mp->fe.id : mp->id,
+			       mp->op == UM_UNLINK ? mp->fe.parent : mp->parid);
+	}
+ out:
+	for (i = 0; i < URING_BATCH; i++) {
+		free_pathname(&m[i].f);
+		free_pathname(&m[i].newf);
+	}
+	errno = err;
+}
+#endif
+
 void
 aread_f(opnum_t opno, long r)
 {
@@ -2447,7 +5013,7 @@ attr_remove_f(opnum_t opno, long r)
 		return;
 	}
 
-	which = (int)(random() % total);
+	which = (int)(fss_random() % total);
 	bufname = buf;
 	bufend = buf + e;
 	ent = 0;
@@ -2493,9 +5059,10 @@ attr_set_f(opnum_t opno, long r)
 	init_pathname(&f);
 	if (!get_fname(FT_ANYm, r, &f, NULL, NULL, &v))
 		append_pathname(&f, ".");
-	sprintf(aname, "user.a%x", nameseq++);
-	li = (int)(random() % (sizeof(lengths) / sizeof(lengths[0])));
-	len = (int)(random() % lengths[li]);
+	sprintf(aname, "user.a%x",
+		__atomic_fetch_add(&nameseq, 1, __ATOMIC_RELAXED));
+	li = (int)(fss_random() % (sizeof(lengths) / sizeof(lengths[0])));
+	len = (int)(fss_random() % lengths[li]);
 	if (len == 0)
 		len = 1;
 	aval = malloc(len);
@@ -2565,7 +5132,7 @@ bulkstat1_f(opnum_t opno, long r)
 	struct xfs_fsop_bulkreq bsr;
         
 
-	good = random() & 1;
+	good = fss_random() & 1;
 	if (good) {
                /* use an inode we know exists */
 		init_pathname(&f);
@@ -2619,9 +5186,9 @@ chown_f(opnum_t opno, long r)
 	init_pathname(&f);
 	if (!get_fname(FT_ANYm, r, &f, NULL, NULL, &v))
 		append_pathname(&f, ".");
-	u = (uid_t)random();
-	g = (gid_t)random();
-	nbits = (int)(random() % idmodulo);
+	u = (uid_t)fss_random();
+	g = (gid_t)fss_random();
+	nbits = (int)(fss_random() % idmodulo);
 	u &= (1 << nbits) - 1;
 	g &= (1 << nbits) - 1;
 	e = lchown_path(&f, u, g) < 0 ? errno : 0;
@@ -2668,7 +5235,7 @@ exchangerange_f(
 	}
 
 	init_pathname(&fpath2);
-	if (!get_fname(FT_REGm, random(), &fpath2, NULL, NULL, &v2)) {
+	if (!get_fname(FT_REGm, fss_random(), &fpath2, NULL, NULL, &v2)) {
 		if (v2)
 			printf("%d/%lld: exchangerange write - no filename\n",
 				procid, opno);
@@ -2722,7 +5289,7 @@ exchangerange_f(
 	}
 
 	/* Never let us swap more than 1/4 of the files. */
-	len = (random() % FILELEN_MAX) + 1;
+	len = io_len();
 	if (len > stat1.st_size / 4)
 		len = stat1.st_size / 4;
 	if (len > stat2.st_size / 4)
@@ -2732,12 +5299,12 @@ exchangerange_f(
 		len = stat1.st_blksize;
 
 	/* Calculate offsets */
-	lr = ((int64_t)random() << 32) + random();
+	lr = ((int64_t)fss_random() << 32) + fss_random();
 	if (stat1.st_size == len)
 		off1 = 0;
 	else
 		off1 = (off64_t)(lr % MIN(stat1.st_size - len, MAXFSIZE));
-	off1 %= maxfsize;
+	off1 %= file_max();
 	off1 = rounddown_64(off1, stat1.st_blksize);
 
 	/*
@@ -2746,12 +5313,12 @@ exchangerange_f(
 	 */
 	max_off2 = MIN(stat2.st_size  - len, MAXFSIZE);
 	do {
-		lr = ((int64_t)random() << 32) + random();
+		lr = ((int64_t)fss_random() << 32) + fss_random();
 		if (stat2.st_size == len)
 			off2 = 0;
 		else
 			off2 = (off64_t)(lr % max_off2);
-		off2 %= maxfsize;
+		off2 %= file_max();
 		off2 = rounddown_64(off2, stat2.st_blksize);
 	} while (stat1.st_ino == stat2.st_ino &&
 		 llabs(off2 - off1) < len &&
@@ -2765,6 +5332,13 @@ exchangerange_f(
 
 	ret = ioctl(fd2, XFS_IOC_EXCHANGE_RANGE, &fxr);
 	e = ret < 0 ? errno : 0;
+	if (e == 0) {
+		vmap_exchange(vmap_get(&stat1), off1, vmap_get(&stat2), off2,
+			      len);
+	} else if (!vmap_early_error(e)) {
+		vmap_unknown(vmap_get(&stat1), off1, len);
+		vmap_unknown(vmap_get(&stat2), off2, len);
+	}
 	if (v1 || v2) {
 		printf("%d/%lld: exchangerange %s%s [%lld,%lld] -> %s%s [%lld,%lld]",
 			procid, opno,
@@ -2823,7 +5397,7 @@ clonerange_f(
 	}
 
 	init_pathname(&fpath2);
-	if (!get_fname(FT_REGm, random(), &fpath2, NULL, NULL, &v2)) {
+	if (!get_fname(FT_REGm, fss_random(), &fpath2, NULL, NULL, &v2)) {
 		if (v2)
 			printf("%d/%lld: clonerange write - no filename\n",
 				procid, opno);
@@ -2869,19 +5443,19 @@ clonerange_f(
 	inode_info(inoinfo2, sizeof(inoinfo2), &stat2, v2);
 
 	/* Calculate offsets */
-	len = (random() % FILELEN_MAX) + 1;
+	len = io_len();
 	len = rounddown_64(len, stat1.st_blksize);
 	if (len == 0)
 		len = stat1.st_blksize;
 	if (len > stat1.st_size)
 		len = stat1.st_size;
 
-	lr = ((int64_t)random() << 32) + random();
+	lr = ((int64_t)fss_random() << 32) + fss_random();
 	if (stat1.st_size == len)
 		off1 = 0;
 	else
 		off1 = (off64_t)(lr % MIN(stat1.st_size - len, MAXFSIZE));
-	off1 %= maxfsize;
+	off1 %= file_max();
 	off1 = rounddown_64(off1, stat1.st_blksize);
 
 	/*
@@ -2890,9 +5464,9 @@ clonerange_f(
 	 */
 	max_off2 = MIN(stat2.st_size + (1024ULL * stat2.st_blksize), MAXFSIZE);
 	do {
-		lr = ((int64_t)random() << 32) + random();
+		lr = ((int64_t)fss_random() << 32) + fss_random();
 		off2 = (off64_t)(lr % max_off2);
-		off2 %= maxfsize;
+		off2 %= file_max();
 		off2 = rounddown_64(off2, stat2.st_blksize);
 	} while (stat1.st_ino == stat2.st_ino && llabs(off2 - off1) < len);
 
@@ -2904,6 +5478,10 @@ clonerange_f(
 
 	ret = ioctl(fd2, FICLONERANGE, &fcr);
 	e = ret < 0 ? errno : 0;
+	if (e == 0)
+		vmap_copy(vmap_get(&stat2), off2, vmap_get(&stat1), off1, len);
+	else if (!vmap_early_error(e))
+		vmap_unknown(vmap_get(&stat2), off2, len);
 	if (v1 || v2) {
 		printf("%d/%lld: clonerange %s%s [%lld,%lld] -> %s%s [%lld,%lld]",
 			procid, opno,
@@ -2965,7 +5543,7 @@ copyrange_f(
 	}
 
 	init_pathname(&fpath2);
-	if (!get_fname(FT_REGm, random(), &fpath2, NULL, NULL, &v2)) {
+	if (!get_fname(FT_REGm, fss_random(), &fpath2, NULL, NULL, &v2)) {
 		if (v2)
 			printf("%d/%lld: copyrange write - no filename\n",
 				procid, opno);
@@ -3011,18 +5589,18 @@ copyrange_f(
 	inode_info(inoinfo2, sizeof(inoinfo2), &stat2, v2);
 
 	/* Calculate offsets */
-	len = (random() % FILELEN_MAX) + 1;
+	len = io_len();
 	if (len == 0)
 		len = stat1.st_blksize;
 	if (len > stat1.st_size)
 		len = stat1.st_size;
 
-	lr = ((int64_t)random() << 32) + random();
+	lr = ((int64_t)fss_random() << 32) + fss_random();
 	if (stat1.st_size == len)
 		off1 = 0;
 	else
 		off1 = (off64_t)(lr % MIN(stat1.st_size - len, MAXFSIZE));
-	off1 %= maxfsize;
+	off1 %= file_max();
 
 	/*
 	 * If srcfile == destfile, randomly generate destination ranges
@@ -3030,9 +5608,9 @@ copyrange_f(
 	 */
 	max_off2 = MIN(stat2.st_size + (1024ULL * stat2.st_blksize), MAXFSIZE);
 	do {
-		lr = ((int64_t)random() << 32) + random();
+		lr = ((int64_t)fss_random() << 32) + fss_random();
 		off2 = (off64_t)(lr % max_off2);
-		off2 %= maxfsize;
+		off2 %= file_max();
 	} while (stat1.st_ino == stat2.st_ino && llabs(off2 - off1) < len);
 
 	/*
@@ -3055,6 +5633,8 @@ copyrange_f(
 			len -= ret;
 	}
 	e = ret < 0 ? errno : 0;
+	vmap_copy(vmap_get(&stat2), offset2, vmap_get(&stat1), offset1,
+		  length - len);
 	if (v1 || v2) {
 		printf("%d/%lld: copyrange %s%s [%lld,%lld] -> %s%s [%lld,%lld]",
 			procid, opno,
@@ -3109,7 +5689,7 @@ deduperange_f(
 
 	/* Pick somewhere between 2 and 128 files. */
 	do {
-		nr = random() % (flist[FT_REG].nfiles + 1);
+		nr = fss_random() % (flist[FT_REG].nfiles + 1);
 	} while (nr < 2 || nr > 128);
 
 	/* Alloc memory */
@@ -3177,7 +5757,7 @@ deduperange_f(
 	}
 
 	for (i = 1; i < nr; i++) {
-		if (!get_fname(FT_REGm, random(), &fpath[i], NULL, NULL, &v[i])) {
+		if (!get_fname(FT_REGm, fss_random(), &fpath[i], NULL, NULL, &v[i])) {
 			if (v[i])
 				printf("%d/%lld: deduperange write - no filename\n",
 					procid, opno);
@@ -3229,7 +5809,7 @@ deduperange_f(
 	}
 
 	/* Never try to dedupe more than half of the src file. */
-	len = (random() % FILELEN_MAX) + 1;
+	len = io_len();
 	len = rounddown_64(len, stat[0].st_blksize);
 	if (len == 0)
 		len = stat[0].st_blksize / 2;
@@ -3237,12 +5817,12 @@ deduperange_f(
 		len = stat[0].st_size / 2;
 
 	/* Calculate offsets */
-	lr = ((int64_t)random() << 32) + random();
+	lr = ((int64_t)fss_random() << 32) + fss_random();
 	if (stat[0].st_size == len)
 		off[0] = 0;
 	else
 		off[0] = (off64_t)(lr % MIN(stat[0].st_size - len, MAXFSIZE));
-	off[0] %= maxfsize;
+	off[0] %= file_max();
 	off[0] = rounddown_64(off[0], stat[0].st_blksize);
 
 	/*
@@ -3253,12 +5833,12 @@ deduperange_f(
 		int	tries = 0;
 
 		do {
-			lr = ((int64_t)random() << 32) + random();
+			lr = ((int64_t)fss_random() << 32) + fss_random();
 			if (stat[i].st_size <= len)
 				off[i] = 0;
 			else
 				off[i] = (off64_t)(lr % MIN(stat[i].st_size - len, MAXFSIZE));
-			off[i] %= maxfsize;
+			off[i] %= file_max();
 			off[i] = rounddown_64(off[i], stat[i].st_blksize);
 		} while (stat[0].st_ino == stat[i].st_ino &&
 			 llabs(off[i] - off[0]) < len &&
@@ -3290,6 +5870,11 @@ deduperange_f(
 
 	for (i = 1; i < nr; i++) {
 		e = fdr->info[i - 1].status < 0 ? fdr->info[i - 1].status : 0;
+		if (fdr->info[i - 1].status >= 0)
+			vmap_check_dedupe(opno, &fpath[0], vmap_get(&stat[0]),
+				off[0], &fpath[i], vmap_get(&stat[i]), off[i],
+				len, fdr->info[i - 1].status ==
+				     FILE_DEDUPE_RANGE_SAME);
 		if (v[i]) {
 			printf("%d/%lld: ...to %s%s [%lld,%lld]",
 				procid, opno,
@@ -3350,9 +5935,9 @@ setxattr_f(opnum_t opno, long r)
 	check_cwd();
 
 	/* project ID */
-	p = (uint)random();
+	p = (uint)fss_random();
 	e = MIN(idmodulo, XFS_PROJIDMODULO_MAX);
-	nbits = (int)(random() % e);
+	nbits = (int)(fss_random() % e);
 	p &= (1 << nbits) - 1;
 
 	if ((e = xfsctl(f.path, fd, XFS_IOC_FSGETXATTR, &fsx)) == 0) {
@@ -3389,6 +5974,8 @@ splice_f(opnum_t opno, long r)
 	size_t			bytes;
 	int			e;
 	int			filedes[2];
+	struct vmap		*vm1;
+	struct vmap		*vm2;
 
 	/* Load paths */
 	init_pathname(&fpath1);
@@ -3400,7 +5987,7 @@ splice_f(opnum_t opno, long r)
 	}
 
 	init_pathname(&fpath2);
-	if (!get_fname(FT_REGm, random(), &fpath2, NULL, NULL, &v2)) {
+	if (!get_fname(FT_REGm, fss_random(), &fpath2, NULL, NULL, &v2)) {
 		if (v2)
 			printf("%d/%lld: splice write - no filename\n",
 				procid, opno);
@@ -3446,25 +6033,25 @@ splice_f(opnum_t opno, long r)
 	inode_info(inoinfo2, sizeof(inoinfo2), &stat2, v2);
 
 	/* Calculate offsets */
-	len = (random() % FILELEN_MAX) + 1;
+	len = io_len();
 	if (len == 0)
 		len = stat1.st_blksize;
 	if (len > stat1.st_size)
 		len = stat1.st_size;
 
-	lr = ((int64_t)random() << 32) + random();
+	lr = ((int64_t)fss_random() << 32) + fss_random();
 	if (stat1.st_size == len)
 		off1 = 0;
 	else
 		off1 = (off64_t)(lr % MIN(stat1.st_size - len, MAXFSIZE));
-	off1 %= maxfsize;
+	off1 %= file_max();
 
 	/*
 	 * splice can overlap write, so the offset of the target file can be
 	 * any number. But to avoid too large offset, add a clamp of 1024 blocks
 	 * past the current dest file EOF
 	 */
-	lr = ((int64_t)random() << 32) + random();
+	lr = ((int64_t)fss_random() << 32) + fss_random();
 	off2 = (off64_t)(lr % MIN(stat2.st_size + (1024ULL * stat2.st_blksize), MAXFSIZE));
 
 	/*
@@ -3484,6 +6071,8 @@ splice_f(opnum_t opno, long r)
 		}
 	}
 
+	vm1 = vmap_get(&stat1);
+	vm2 = vmap_get(&stat2);
 	bytes = 0;
 	total = 0;
 	while (len > 0) {
@@ -3504,6 +6093,8 @@ splice_f(opnum_t opno, long r)
 		}
 		if (ret2 < 0)
 			break;
+		/* a chunk at a time, in case the two ranges overlap */
+		vmap_copy(vm2, offset2 + total, vm1, offset1 + total, ret1);
 
 		len -= ret1;
 		total += ret1;
@@ -3513,6 +6104,9 @@ splice_f(opnum_t opno, long r)
 		e = errno;
 	else
 		e = 0;
+	/* some of what was in the pipe may have made it */
+	if (ret2 < 0)
+		vmap_unknown(vm2, offset2 + total, ret1);
 	if (v1 || v2) {
 		printf("%d/%lld: splice %s%s [%lld,%lld] -> %s%s [%lld,%lld] %d",
 			procid, opno,
@@ -3549,22 +6143,23 @@ creat_f(opnum_t opno, long r)
 	fent_t		*fep;
 	int		id;
 	int		parid;
+	struct stat64	stb;
 	int		type;
 	int		v;
 	int		v1;
 
-	if (!get_fname(FT_ANYDIR, r, NULL, NULL, &fep, &v1))
+	if (!get_parent(FT_ANYDIR, r, &fep, &v1))
 		parid = -1;
 	else
 		parid = fep->id;
 	init_pathname(&f);
-	e1 = (random() % 100);
+	e1 = (fss_random() % 100);
 	type = rtpct ? ((e1 > rtpct) ? FT_REG : FT_RTF) : FT_REG;
 #ifdef NOTYET
 	if (type == FT_RTF)	/* rt always gets an extsize */
-		extsize = (random() % 10) + 1;
+		extsize = (fss_random() % 10) + 1;
 	else if (e1 < 10)	/* one-in-ten get an extsize */
-		extsize = random() % 1024;
+		extsize = fss_random() % 1024;
 	else
 #endif
 		extsize = 0;
@@ -3574,7 +6169,7 @@ creat_f(opnum_t opno, long r)
 		if (v) {
 			(void)fent_to_name(&f, fep);
 			printf("%d/%lld: creat - no filename from %s\n",
-				procid, opno, f.path);
+				procid, opno, f.path ? f.path : "?");
 		}
 		free_pathname(&f);
 		return;
@@ -3600,6 +6195,8 @@ creat_f(opnum_t opno, long r)
 				e1 = errno;
 		}
 		add_to_flist(type, id, parid, 0);
+		if (verify_data && fstat64(fd, &stb) == 0)
+			vmap_new(&stb);
 		close(fd);
 	}
 	if (v) {
@@ -3626,6 +6223,8 @@ dread_f(opnum_t opno, long r)
 	int		v;
 	char		st[1024];
 	char		*dio_env;
+	struct vmap	*vm;
+	ssize_t		ret;
 
 	init_pathname(&f);
 	if (!get_fname(FT_REGFILE, r, &f, NULL, NULL, &v)) {
@@ -3653,6 +6252,7 @@ dread_f(opnum_t opno, long r)
 		return;
 	}
 	inode_info(st, sizeof(st), &stb, v);
+	vm = vmap_get(&stb);
 	if (stb.st_size == 0) {
 		if (v)
 			printf("%d/%lld: dread - %s%s zero size\n", procid, opno,
@@ -3676,18 +6276,20 @@ dread_f(opnum_t opno, long r)
 		diob.d_mem = diob.d_miniosz = atoi(dio_env);
 
 	align = (int64_t)diob.d_miniosz;
-	lr = ((int64_t)random() << 32) + random();
+	lr = ((int64_t)fss_random() << 32) + fss_random();
 	off = (off64_t)(lr % stb.st_size);
 	off -= (off % align);
 	lseek64(fd, off, SEEK_SET);
-	len = (random() % FILELEN_MAX) + 1;
+	len = io_len();
 	len -= (len % align);
 	if (len <= 0)
 		len = align;
 	else if (len > diob.d_maxiosz) 
 		len = diob.d_maxiosz;
 	buf = memalign(diob.d_mem, len);
-	e = read(fd, buf, len) < 0 ? errno : 0;
+	ret = read(fd, buf, len);
+	e = ret < 0 ? errno : 0;
+	vmap_check(opno, "dread", &f, vm, buf, off, ret);
 	free(buf);
 	if (v)
 		printf("%d/%lld: dread %s%s [%lld,%d] %d\n",
@@ -3712,9 +6314,13 @@ dwrite_f(opnum_t opno, long r)
 	int		v;
 	char		st[1024];
 	char		*dio_env;
+	fent_t		*fep;
+	struct vmap	*vm;
+	uint32_t	gen;
+	ssize_t		ret;
 
 	init_pathname(&f);
-	if (!get_fname(FT_REGFILE, r, &f, NULL, NULL, &v)) {
+	if (!get_fname(FT_REGFILE, r, &f, NULL, &fep, &v)) {
 		if (v)
 			printf("%d/%lld: dwrite - no filename\n", procid, opno);
 		free_pathname(&f);
@@ -3739,6 +6345,7 @@ dwrite_f(opnum_t opno, long r)
 		return;
 	}
 	inode_info(st, sizeof(st), &stb, v);
+	vm = vmap_get(&stb);
 	if (xfsctl(f.path, fd, XFS_IOC_DIOINFO, &diob) < 0) {
 		if (v)
 			printf("%d/%lld: dwrite - xfsctl(XFS_IOC_DIOINFO)"
@@ -3753,21 +6360,23 @@ dwrite_f(opnum_t opno, long r)
 		diob.d_mem = diob.d_miniosz = atoi(dio_env);
 
 	align = (int64_t)diob.d_miniosz;
-	lr = ((int64_t)random() << 32) + random();
+	lr = ((int64_t)fss_random() << 32) + fss_random();
 	off = (off64_t)(lr % MIN(stb.st_size + (1024 * 1024), MAXFSIZE));
 	off -= (off % align);
 	lseek64(fd, off, SEEK_SET);
-	len = (random() % FILELEN_MAX) + 1;
+	len = io_len();
 	len -= (len % align);
 	if (len <= 0)
 		len = align;
 	else if (len > diob.d_maxiosz) 
 		len = diob.d_maxiosz;
 	buf = memalign(diob.d_mem, len);
-	off %= maxfsize;
+	off %= file_max();
 	lseek64(fd, off, SEEK_SET);
-	memset(buf, nameseq & 0xff, len);
-	e = write(fd, buf, len) < 0 ? errno : 0;
+	gen = vmap_fill(vm, buf, len, off, fep->id);
+	ret = write(fd, buf, len);
+	e = ret < 0 ? errno : 0;
+	vmap_write(vm, off, ret, fep->id, gen);
 	free(buf);
 	if (v)
 		printf("%d/%lld: dwrite %s%s [%lld,%d] %d\n",
@@ -3806,6 +6415,7 @@ do_fallocate(opnum_t opno, long r, int mode)
 	struct stat64	stb;
 	int		v;
 	char		st[1024];
+	struct vmap	*vm;
 
 	init_pathname(&f);
 	if (!get_fname(FT_REGFILE, r, &f, NULL, NULL, &v)) {
@@ -3832,10 +6442,11 @@ do_fallocate(opnum_t opno, long r, int mode)
 		return;
 	}
 	inode_info(st, sizeof(st), &stb, v);
-	lr = ((int64_t)random() << 32) + random();
+	vm = vmap_get(&stb);
+	lr = ((int64_t)fss_random() << 32) + fss_random();
 	off = (off64_t)(lr % MIN(stb.st_size + (1024 * 1024), MAXFSIZE));
-	off %= maxfsize;
-	len = (off64_t)(random() % (1024 * 1024));
+	off %= file_max();
+	len = (off64_t)(fss_random() % (1024 * 1024));
 	/*
 	 * Collapse/insert range requires off and len to be block aligned,
 	 * make it more likely to be the case.
@@ -3845,8 +6456,24 @@ do_fallocate(opnum_t opno, long r, int mode)
 		off = roundup_64(off, stb.st_blksize);
 		len = roundup_64(len, stb.st_blksize);
 	}
-	mode |= FALLOC_FL_KEEP_SIZE & random();
+	mode |= FALLOC_FL_KEEP_SIZE & fss_random();
 	e = fallocate(fd, mode, (loff_t)off, (loff_t)len) < 0 ? errno : 0;
+	if (vm && e == 0) {
+		if (mode & (FALLOC_FL_COLLAPSE_RANGE | FALLOC_FL_INSERT_RANGE)) {
+			vmap_shift(vm, off, len,
+				   mode & FALLOC_FL_INSERT_RANGE);
+		} else {
+			if (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE))
+				vmap_zero(vm, off, len);
+			if (!(mode & FALLOC_FL_KEEP_SIZE))
+				vm->size = MAX(vm->size, off + len);
+		}
+	} else if (vm && !vmap_early_error(e)) {
+		if (mode & (FALLOC_FL_COLLAPSE_RANGE | FALLOC_FL_INSERT_RANGE))
+			vmap_unknown(vm, off, vm->size - off);
+		else if (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE))
+			vmap_unknown(vm, off, len);
+	}
 	if (v)
 		printf("%d/%lld: fallocate(%s) %s%s [%lld,%lld] %d\n",
 		       procid, opno, translate_falloc_flags(mode),
@@ -3891,6 +6518,8 @@ fdatasync_f(opnum_t opno, long r)
 		return;
 	}
 	e = fdatasync(fd) < 0 ? errno : 0;
+	if (e == 0 && journal_fd >= 0)
+		journal_sync(&f);
 	if (v)
 		printf("%d/%lld: fdatasync %s %d\n", procid, opno, f.path, e);
 	free_pathname(&f);
@@ -3949,7 +6578,7 @@ fiemap_f(opnum_t opno, long r)
 		return;
 	}
 	inode_info(st, sizeof(st), &stb, v);
-	blocks_to_map = random() & 0xffff;
+	blocks_to_map = fss_random() & 0xffff;
 	fiemap = (struct fiemap *)malloc(sizeof(struct fiemap) +
 			(blocks_to_map * sizeof(struct fiemap_extent)));
 	if (!fiemap) {
@@ -3959,14 +6588,14 @@ fiemap_f(opnum_t opno, long r)
 		close(fd);
 		return;
 	}
-	lr = ((int64_t)random() << 32) + random();
+	lr = ((int64_t)fss_random() << 32) + fss_random();
 	off = (off64_t)(lr % MIN(stb.st_size + (1024 * 1024), MAXFSIZE));
-	off %= maxfsize;
-	fiemap->fm_flags = random() & (FIEMAP_FLAGS_COMPAT | 0x10000);
+	off %= file_max();
+	fiemap->fm_flags = fss_random() & (FIEMAP_FLAGS_COMPAT | 0x10000);
 	fiemap->fm_extent_count = blocks_to_map;
-	fiemap->fm_mapped_extents = random() & 0xffff;
+	fiemap->fm_mapped_extents = fss_random() & 0xffff;
 	fiemap->fm_start = off;
-	fiemap->fm_length = ((int64_t)random() << 32) + random();
+	fiemap->fm_length = ((int64_t)fss_random() << 32) + fss_random();
 
 	e = ioctl(fd, FS_IOC_FIEMAP, (unsigned long)fiemap);
 	if (v)
@@ -4006,6 +6635,8 @@ fsync_f(opnum_t opno, long r)
 		return;
 	}
 	e = fsync(fd) < 0 ? errno : 0;
+	if (e == 0 && journal_fd >= 0)
+		journal_sync(&f);
 	if (v)
 		printf("%d/%lld: fsync %s %d\n", procid, opno, f.path, e);
 	free_pathname(&f);
@@ -4029,7 +6660,7 @@ gen_random_string(int len)
 		return NULL;
 
 	for (i = 0; i < len; i++)
-		s[i] = charset[random() % sizeof(charset)];
+		s[i] = charset[fss_random() % sizeof(charset)];
 
 	return s;
 }
@@ -4110,7 +6741,7 @@ getfattr_f(opnum_t opno, long r)
 	 * errno set to ENOATTR (61) in this case).
 	 */
 	if (fep->xattr_counter > 0)
-		xattr_num = (random() % fep->xattr_counter) + 1;
+		xattr_num = (fss_random() % fep->xattr_counter) + 1;
 	else
 		xattr_num = 0;
 
@@ -4174,7 +6805,7 @@ link_f(opnum_t opno, long r)
 		free_pathname(&f);
 		return;
 	}
-	if (!get_fname(FT_DIRm, random(), NULL, NULL, &fep, &v))
+	if (!get_parent(FT_DIRm, fss_random(), &fep, &v))
 		parid = -1;
 	else
 		parid = fep->id;
@@ -4186,7 +6817,7 @@ link_f(opnum_t opno, long r)
 		if (v) {
 			(void)fent_to_name(&l, fep);
 			printf("%d/%lld: link - no filename from %s\n",
-				procid, opno, l.path);
+				procid, opno, l.path ? l.path : "?");
 		}
 		free_pathname(&l);
 		free_pathname(&f);
@@ -4266,7 +6897,7 @@ mkdir_f(opnum_t opno, long r)
 	int		v;
 	int		v1;
 
-	if (!get_fname(FT_ANYDIR, r, NULL, NULL, &fep, &v))
+	if (!get_parent(FT_ANYDIR, r, &fep, &v))
 		parid = -1;
 	else
 		parid = fep->id;
@@ -4277,7 +6908,7 @@ mkdir_f(opnum_t opno, long r)
 		if (v) {
 			(void)fent_to_name(&f, fep);
 			printf("%d/%lld: mkdir - no filename from %s\n",
-				procid, opno, f.path);
+				procid, opno, f.path ? f.path : "?");
 		}
 		free_pathname(&f);
 		return;
@@ -4304,7 +6935,7 @@ mknod_f(opnum_t opno, long r)
 	int		v;
 	int		v1;
 
-	if (!get_fname(FT_ANYDIR, r, NULL, NULL, &fep, &v))
+	if (!get_parent(FT_ANYDIR, r, &fep, &v))
 		parid = -1;
 	else
 		parid = fep->id;
@@ -4315,7 +6946,7 @@ mknod_f(opnum_t opno, long r)
 		if (v) {
 			(void)fent_to_name(&f, fep);
 			printf("%d/%lld: mknod - no filename from %s\n",
-				procid, opno, f.path);
+				procid, opno, f.path ? f.path : "?");
 		}
 		free_pathname(&f);
 		return;
@@ -4358,9 +6989,12 @@ do_mmap(opnum_t opno, long r, int prot)
 	int		v;
 	char		st[1024];
 	sigjmp_buf	sigbus_jmpbuf;
+	fent_t		*fep;
+	struct vmap	*vm;
+	uint32_t	gen;
 
 	init_pathname(&f);
-	if (!get_fname(FT_REGFILE, r, &f, NULL, NULL, &v)) {
+	if (!get_fname(FT_REGFILE, r, &f, NULL, &fep, &v)) {
 		if (v)
 			printf("%d/%lld: do_mmap - no filename\n", procid, opno);
 		free_pathname(&f);
@@ -4385,6 +7019,7 @@ do_mmap(opnum_t opno, long r, int prot)
 		return;
 	}
 	inode_info(st, sizeof(st), &stb, v);
+	vm = vmap_get(&stb);
 	if (stb.st_size == 0) {
 		if (v)
 			printf("%d/%lld: do_mmap - %s%s zero size\n", procid, opno,
@@ -4394,12 +7029,12 @@ do_mmap(opnum_t opno, long r, int prot)
 		return;
 	}
 
-	lr = ((int64_t)random() << 32) + random();
+	lr = ((int64_t)fss_random() << 32) + fss_random();
 	off = (off64_t)(lr % stb.st_size);
 	off = rounddown_64(off, sysconf(_SC_PAGE_SIZE));
-	len = (size_t)(random() % MIN(stb.st_size - off, FILELEN_MAX)) + 1;
+	len = (size_t)(fss_random() % MIN(stb.st_size - off, FILELEN_MAX)) + 1;
 
-	flags = (random() % 2) ? MAP_SHARED : MAP_PRIVATE;
+	flags = (fss_random() % 2) ? MAP_SHARED : MAP_PRIVATE;
 	addr = mmap(NULL, len, prot, flags, fd, off);
 	e = (addr == MAP_FAILED) ? errno : 0;
 	if (e) {
@@ -4412,15 +7047,22 @@ do_mmap(opnum_t opno, long r, int prot)
 		return;
 	}
 
+	/* what goes to a private mapping never makes it to the file */
+	if ((prot & PROT_WRITE) && flags == MAP_PRIVATE)
+		vm = NULL;
 	if (prot & PROT_WRITE) {
 		if ((e = sigsetjmp(sigbus_jmpbuf, 1)) == 0) {
 			sigbus_jmp = &sigbus_jmpbuf;
-			memset(addr, nameseq & 0xff, len);
+			gen = vmap_fill(vm, addr, len, off, fep->id);
+			vmap_write(vm, off, len, fep->id, gen);
+		} else {
+			vmap_unknown(vm, off, len);
 		}
 	} else {
 		char *buf;
 		if ((buf = malloc(len)) != NULL) {
 			memcpy(buf, addr, len);
+			vmap_check(opno, "mread", &f, vm, buf, off, len);
 			free(buf);
 		}
 	}
@@ -4511,6 +7153,8 @@ read_f(opnum_t opno, long r)
 	struct stat64	stb;
 	int		v;
 	char		st[1024];
+	struct vmap	*vm;
+	ssize_t		ret;
 
 	init_pathname(&f);
 	if (!get_fname(FT_REGFILE, r, &f, NULL, NULL, &v)) {
@@ -4538,6 +7182,7 @@ read_f(opnum_t opno, long r)
 		return;
 	}
 	inode_info(st, sizeof(st), &stb, v);
+	vm = vmap_get(&stb);
 	if (stb.st_size == 0) {
 		if (v)
 			printf("%d/%lld: read - %s%s zero size\n", procid, opno,
@@ -4546,12 +7191,14 @@ read_f(opnum_t opno, long r)
 		close(fd);
 		return;
 	}
-	lr = ((int64_t)random() << 32) + random();
+	lr = ((int64_t)fss_random() << 32) + fss_random();
 	off = (off64_t)(lr % stb.st_size);
 	lseek64(fd, off, SEEK_SET);
-	len = (random() % FILELEN_MAX) + 1;
+	len = io_len();
 	buf = malloc(len);
-	e = read(fd, buf, len) < 0 ? errno : 0;
+	ret = read(fd, buf, len);
+	e = ret < 0 ? errno : 0;
+	vmap_check(opno, "read", &f, vm, buf, off, ret);
 	free(buf);
 	if (v)
 		printf("%d/%lld: read %s%s [%lld,%d] %d\n",
@@ -4600,6 +7247,8 @@ readv_f(opnum_t opno, long r)
 	size_t		iovb;
 	size_t		iovl;
 	int		i;
+	struct vmap	*vm;
+	ssize_t		ret;
 
 	init_pathname(&f);
 	if (!get_fname(FT_REGFILE, r, &f, NULL, NULL, &v)) {
@@ -4627,6 +7276,7 @@ readv_f(opnum_t opno, long r)
 		return;
 	}
 	inode_info(st, sizeof(st), &stb, v);
+	vm = vmap_get(&stb);
 	if (stb.st_size == 0) {
 		if (v)
 			printf("%d/%lld: readv - %s%s zero size\n", procid, opno,
@@ -4635,13 +7285,13 @@ readv_f(opnum_t opno, long r)
 		close(fd);
 		return;
 	}
-	lr = ((int64_t)random() << 32) + random();
+	lr = ((int64_t)fss_random() << 32) + fss_random();
 	off = (off64_t)(lr % stb.st_size);
 	lseek64(fd, off, SEEK_SET);
-	len = (random() % FILELEN_MAX) + 1;
+	len = io_len();
 	buf = malloc(len);
 
-	iovcnt = (random() % MIN(len, IOV_MAX)) + 1;
+	iovcnt = (fss_random() % MIN(len, IOV_MAX)) + 1;
 	iov = calloc(iovcnt, sizeof(struct iovec));
 	iovl = len / iovcnt;
 	iovb = 0;
@@ -4651,7 +7301,9 @@ readv_f(opnum_t opno, long r)
 		iovb += iovl;
 	}
 
-	e = readv(fd, iov, iovcnt) < 0 ? errno : 0;
+	ret = readv(fd, iov, iovcnt);
+	e = ret < 0 ? errno : 0;
+	vmap_check(opno, "readv", &f, vm, buf, off, ret);
 	free(iov);
 	free(buf);
 	if (v)
@@ -4675,6 +7327,8 @@ read_dontcache_f(opnum_t opno, long r)
 	char		st[1024];
 	struct iovec	iov;
 	int flags;
+	struct vmap	*vm;
+	ssize_t		ret;
 
 	init_pathname(&f);
 	if (!get_fname(FT_REGFILE, r, &f, NULL, NULL, &v)) {
@@ -4702,6 +7356,7 @@ read_dontcache_f(opnum_t opno, long r)
 		return;
 	}
 	inode_info(st, sizeof(st), &stb, v);
+	vm = vmap_get(&stb);
 	if (stb.st_size == 0) {
 		if (v)
 			printf("%d/%lld: read - %s%s zero size\n", procid, opno,
@@ -4710,16 +7365,19 @@ read_dontcache_f(opnum_t opno, long r)
 		close(fd);
 		return;
 	}
-	lr = ((int64_t)random() << 32) + random();
+	lr = ((int64_t)fss_random() << 32) + fss_random();
 	off = (off64_t)(lr % stb.st_size);
-	iov.iov_len = (random() % FILELEN_MAX) + 1;
+	iov.iov_len = io_len();
 	iov.iov_base = malloc(iov.iov_len);
 	flags = have_rwf_dontcache ? RWF_DONTCACHE : 0;
-	e = preadv2(fd, &iov, 1, off, flags) < 0 ? errno : 0;
+	ret = preadv2(fd, &iov, 1, off, flags);
+	e = ret < 0 ? errno : 0;
 	if (have_rwf_dontcache && e == EOPNOTSUPP) {
 		have_rwf_dontcache = 0;
-		e = preadv2(fd, &iov, 1, off, 0) < 0 ? errno : 0;
+		ret = preadv2(fd, &iov, 1, off, 0);
+		e = ret < 0 ? errno : 0;
 	}
+	vmap_check(opno, "read dontcache", &f, vm, iov.iov_base, off, ret);
 	free(iov.iov_base);
 	if (v)
 		printf("%d/%lld: read dontcache %s%s [%lld,%d] %d\n",
@@ -4753,7 +7411,7 @@ removefattr_f(opnum_t opno, long r)
 	 * errno set to ENOATTR (61) in this case).
 	 */
 	if (fep->xattr_counter > 0)
-		xattr_num = (random() % fep->xattr_counter) + 1;
+		xattr_num = (fss_random() % fep->xattr_counter) + 1;
 	else
 		xattr_num = 0;
 
@@ -4789,6 +7447,7 @@ do_renameat2(opnum_t opno, long r, int mode)
 	int		e;
 	pathname_t	f;
 	fent_t		*fep;
+	fent_t		*tmpfep;
 	flist_t		*flp;
 	int		id;
 	pathname_t	newf;
@@ -4818,7 +7477,7 @@ do_renameat2(opnum_t opno, long r, int mode)
 	if (mode == RENAME_EXCHANGE) {
 		which = 1 << (flp - flist);
 		init_pathname(&newf);
-		if (!get_fname(which, random(), &newf, NULL, &dfep, &v)) {
+		if (!get_fname(which, fss_random(), &newf, NULL, &dfep, &v)) {
 			if (v)
 				printf("%d/%lld: rename - no target filename\n",
 					procid, opno);
@@ -4844,7 +7503,7 @@ do_renameat2(opnum_t opno, long r, int mode)
 		 * Get an existing directory for the destination parent
 		 * directory name.
 		 */
-		if (!get_fname(FT_DIRm, random(), NULL, NULL, &dfep, &v))
+		if (!get_parent(FT_DIRm, fss_random(), &dfep, &v))
 			parid = -1;
 		else
 			parid = dfep->id;
@@ -4861,7 +7520,7 @@ do_renameat2(opnum_t opno, long r, int mode)
 			if (v) {
 				(void)fent_to_name(&f, dfep);
 				printf("%d/%lld: rename - no filename from %s\n",
-					procid, opno, f.path);
+					procid, opno, f.path ? f.path : "?");
 			}
 			free_pathname(&newf);
 			free_pathname(&f);
@@ -4882,19 +7541,24 @@ do_renameat2(opnum_t opno, long r, int mode)
 		 * Swap the parent ids for RENAME_EXCHANGE, and replace the
 		 * old parent id for the others.
 		 */
+		ns_lock();
 		if (ft == FT_DIR || ft == FT_SUBVOL)
 			fix_parent(oldid, id, swap);
 
 		if (mode == RENAME_WHITEOUT) {
-			fep->xattr_counter = 0;
+			if ((tmpfep = id_to_fent(oldid)))
+				tmpfep->xattr_counter = 0;
 			add_to_flist(flp - flist, id, parid, xattr_counter);
 		} else if (mode == RENAME_EXCHANGE) {
-			fep->xattr_counter = dfep->xattr_counter;
-			dfep->xattr_counter = xattr_counter;
+			if ((tmpfep = id_to_fent(oldid)))
+				tmpfep->xattr_counter = dfep->xattr_counter;
+			if ((tmpfep = id_to_fent(id)))
+				tmpfep->xattr_counter = xattr_counter;
 		} else {
-			del_from_flist(flp - flist, fep - flp->fents);
+			del_fent(fep);
 			add_to_flist(flp - flist, id, parid, xattr_counter);
 		}
+		ns_unlock();
 	}
 	if (v) {
 		printf("%d/%lld: rename(%s) %s to %s %d\n", procid,
@@ -4974,12 +7638,12 @@ resvsp_f(opnum_t opno, long r)
 		return;
 	}
 	inode_info(st, sizeof(st), &stb, v);
-	lr = ((int64_t)random() << 32) + random();
+	lr = ((int64_t)fss_random() << 32) + fss_random();
 	off = (off64_t)(lr % MIN(stb.st_size + (1024 * 1024), MAXFSIZE));
-	off %= maxfsize;
+	off %= file_max();
 	fl.l_whence = SEEK_SET;
 	fl.l_start = off;
-	fl.l_len = (off64_t)(random() % (1024 * 1024));
+	fl.l_len = (off64_t)(fss_random() % (1024 * 1024));
 	e = xfsctl(f.path, fd, XFS_IOC_RESVSP64, &fl) < 0 ? errno : 0;
 	if (v)
 		printf("%d/%lld: xfsctl(XFS_IOC_RESVSP64) %s%s [%lld,%lld] %d\n",
@@ -5011,7 +7675,7 @@ rmdir_f(opnum_t opno, long r)
 	if (e == 0) {
 		oldid = fep->id;
 		oldparid = fep->parent;
-		del_from_flist(FT_DIR, fep - flist[FT_DIR].fents);
+		del_fent(fep);
 	}
 	if (v) {
 		printf("%d/%lld: rmdir %s %d\n", procid, opno, f.path, e);
@@ -5038,7 +7702,7 @@ setattr_f(opnum_t opno, long r)
 	e = fd < 0 ? errno : 0;
 	check_cwd();
 
-	fl = attr_mask & (uint)random();
+	fl = attr_mask & (uint)fss_random();
 	e = ioctl(fd, FS_IOC_SETFLAGS, &fl);
 	if (v)
 		printf("%d/%lld: setattr %s %x %d\n", procid, opno, f.path, fl, e);
@@ -5067,13 +7731,13 @@ setfattr_f(opnum_t opno, long r)
 	}
 	check_cwd();
 
-	if ((fep->xattr_counter > 0) && (random() % 2)) {
+	if ((fep->xattr_counter > 0) && (fss_random() % 2)) {
 		/*
 		 * Use an existing xattr name for replacing its value or
 		 * create again a xattr that was previously deleted.
 		 */
-		xattr_num = (random() % fep->xattr_counter) + 1;
-		if (random() % 2)
+		xattr_num = (fss_random() % fep->xattr_counter) + 1;
+		if (fss_random() % 2)
 			flag = XATTR_REPLACE;
 	} else {
 		/* Use a new xattr name. */
@@ -5085,7 +7749,7 @@ setfattr_f(opnum_t opno, long r)
 		 * one of its other hard links), so we can end up updating an
 		 * existing xattr too.
 		 */
-		if (random() % 2)
+		if (fss_random() % 2)
 			flag = XATTR_CREATE;
 	}
 
@@ -5094,7 +7758,7 @@ setfattr_f(opnum_t opno, long r)
 	 * implementation, but 100 bytes is a safe value for most filesystems
 	 * at least.
 	 */
-	value_len = random() % 101;
+	value_len = fss_random() % 101;
 	value = gen_random_string(value_len);
 	if (!value && value_len > 0) {
 		if (v)
@@ -5110,8 +7774,12 @@ setfattr_f(opnum_t opno, long r)
 	}
 
 	e = setxattr(f.path, name, value, value_len, flag) < 0 ? errno : 0;
-	if (e == 0)
-		fep->xattr_counter++;
+	if (e == 0) {
+		ns_lock();
+		if ((fep = id_to_fent(fep->id)))
+			fep->xattr_counter++;
+		ns_unlock();
+	}
 	if (v)
 		printf("%d/%lld: setfattr file %s name %s flag %s value length %d: %d\n",
 		       procid, opno, f.path, name, xattr_flag_to_string(flag),
@@ -5151,7 +7819,7 @@ snapshot_f(opnum_t opno, long r)
 		if (v) {
 			(void)fent_to_name(&f, fep);
 			printf("%d/%lld: snapshot - no filename from %s\n",
-			       procid, opno, f.path);
+			       procid, opno, f.path ? f.path : "?");
 		}
 		free_pathname(&f);
 		return;
@@ -5206,7 +7874,7 @@ subvol_create_f(opnum_t opno, long r)
 	int			err;
 
 	init_pathname(&f);
-	if (!get_fname(FT_ANYDIR, r, NULL, NULL, &fep, &v))
+	if (!get_parent(FT_ANYDIR, r, &fep, &v))
 		parid = -1;
 	else
 		parid = fep->id;
@@ -5216,7 +7884,7 @@ subvol_create_f(opnum_t opno, long r)
 		if (v) {
 			(void)fent_to_name(&f, fep);
 			printf("%d/%lld: subvol_create - no filename from %s\n",
-			       procid, opno, f.path);
+			       procid, opno, f.path ? f.path : "?");
 		}
 		free_pathname(&f);
 		return;
@@ -5259,7 +7927,7 @@ subvol_delete_f(opnum_t opno, long r)
 		oldid = fep->id;
 		oldparid = fep->parent;
 		delete_subvol_children(oldid);
-		del_from_flist(FT_SUBVOL, fep - flist[FT_SUBVOL].fents);
+		del_fent(fep);
 	}
 	if (v) {
 		printf("%d/%lld: subvol_delete %s %d(%s)\n", procid, opno, f.path,
@@ -5286,7 +7954,7 @@ symlink_f(opnum_t opno, long r)
 	int		v1;
 	char		*val;
 
-	if (!get_fname(FT_ANYDIR, r, NULL, NULL, &fep, &v))
+	if (!get_parent(FT_ANYDIR, r, &fep, &v))
 		parid = -1;
 	else
 		parid = fep->id;
@@ -5297,12 +7965,12 @@ symlink_f(opnum_t opno, long r)
 		if (v) {
 			(void)fent_to_name(&f, fep);
 			printf("%d/%lld: symlink - no filename from %s\n",
-				procid, opno, f.path);
+				procid, opno, f.path ? f.path : "?");
 		}
 		free_pathname(&f);
 		return;
 	}
-	len = (int)(random() % PATH_MAX);
+	len = (int)(fss_random() % PATH_MAX);
 	val = malloc(len + 1);
 	if (len)
 		memset(val, 'x', len);
@@ -5333,12 +8001,16 @@ sync_f(opnum_t opno, long r)
 		goto use_sync;
 	e = syncfs(fd) < 0 ? errno : 0;
 	close(fd);
+	if (e == 0 && journal_fd >= 0)
+		journal_checkpoint();
 	if (verbose)
 		printf("%d/%lld: syncfs %d\n", procid, opno, e);
 	return;
 
 use_sync:
 	sync();
+	if (journal_fd >= 0)
+		journal_checkpoint();
 	if (verbose)
 		printf("%d/%lld: sync\n", procid, opno);
 }
@@ -5353,6 +8025,7 @@ truncate_f(opnum_t opno, long r)
 	struct stat64	stb;
 	int		v;
 	char		st[1024];
+	struct vmap	*vm;
 
 	init_pathname(&f);
 	if (!get_fname(FT_REGFILE, r, &f, NULL, NULL, &v)) {
@@ -5371,10 +8044,13 @@ truncate_f(opnum_t opno, long r)
 		return;
 	}
 	inode_info(st, sizeof(st), &stb, v);
-	lr = ((int64_t)random() << 32) + random();
+	vm = vmap_get(&stb);
+	lr = ((int64_t)fss_random() << 32) + fss_random();
 	off = (off64_t)(lr % MIN(stb.st_size + (1024 * 1024), MAXFSIZE));
-	off %= maxfsize;
+	off %= file_max();
 	e = truncate64_path(&f, off) < 0 ? errno : 0;
+	if (e == 0)
+		vmap_truncate(vm, off);
 	check_cwd();
 	if (v)
 		printf("%d/%lld: truncate %s%s %lld %d\n", procid, opno, f.path,
@@ -5405,7 +8081,7 @@ unlink_f(opnum_t opno, long r)
 	if (e == 0) {
 		oldid = fep->id;
 		oldparid = fep->parent;
-		del_from_flist(flp - flist, fep - flp->fents);
+		del_fent(fep);
 	}
 	if (v) {
 		printf("%d/%lld: unlink %s %d\n", procid, opno, f.path, e);
@@ -5428,6 +8104,7 @@ unresvsp_f(opnum_t opno, long r)
 	struct stat64	stb;
 	int		v;
 	char		st[1024];
+	struct vmap	*vm;
 
 	init_pathname(&f);
 	if (!get_fname(FT_REGFILE, r, &f, NULL, NULL, &v)) {
@@ -5455,13 +8132,18 @@ unresvsp_f(opnum_t opno, long r)
 		return;
 	}
 	inode_info(st, sizeof(st), &stb, v);
-	lr = ((int64_t)random() << 32) + random();
+	vm = vmap_get(&stb);
+	lr = ((int64_t)fss_random() << 32) + fss_random();
 	off = (off64_t)(lr % MIN(stb.st_size + (1024 * 1024), MAXFSIZE));
-	off %= maxfsize;
+	off %= file_max();
 	fl.l_whence = SEEK_SET;
 	fl.l_start = off;
-	fl.l_len = (off64_t)(random() % (1 << 20));
+	fl.l_len = (off64_t)(fss_random() % (1 << 20));
 	e = xfsctl(f.path, fd, XFS_IOC_UNRESVSP64, &fl) < 0 ? errno : 0;
+	if (e == 0)
+		vmap_zero(vm, off, fl.l_len);
+	else if (!vmap_early_error(e))
+		vmap_unknown(vm, off, fl.l_len);
 	if (v)
 		printf("%d/%lld: xfsctl(XFS_IOC_UNRESVSP64) %s%s [%lld,%lld] %d\n",
 		       procid, opno, f.path, st,
@@ -5470,6 +8152,22 @@ unresvsp_f(opnum_t opno, long r)
 	close(fd);
 }
 
+void
+uring_creat_f(opnum_t opno, long r)
+{
+#ifdef URING_FSOPS
+	do_uring_creat(opno, r);
+#endif
+}
+
+void
+uring_meta_f(opnum_t opno, long r)
+{
+#ifdef URING_FSOPS
+	do_uring_meta(opno, r);
+#endif
+}
+
 void
 uring_read_f(opnum_t opno, long r)
 {
@@ -5499,9 +8197,13 @@ write_f(opnum_t opno, long r)
 	struct stat64	stb;
 	int		v;
 	char		st[1024];
+	fent_t		*fep;
+	struct vmap	*vm;
+	uint32_t	gen;
+	ssize_t		ret;
 
 	init_pathname(&f);
-	if (!get_fname(FT_REGm, r, &f, NULL, NULL, &v)) {
+	if (!get_fname(FT_REGm, r, &f, NULL, &fep, &v)) {
 		if (v)
 			printf("%d/%lld: write - no filename\n", procid, opno);
 		free_pathname(&f);
@@ -5526,14 +8228,17 @@ write_f(opnum_t opno, long r)
 		return;
 	}
 	inode_info(st, sizeof(st), &stb, v);
-	lr = ((int64_t)random() << 32) + random();
+	vm = vmap_get(&stb);
+	lr = ((int64_t)fss_random() << 32) + fss_random();
 	off = (off64_t)(lr % MIN(stb.st_size + (1024 * 1024), MAXFSIZE));
-	off %= maxfsize;
+	off %= file_max();
 	lseek64(fd, off, SEEK_SET);
-	len = (random() % FILELEN_MAX) + 1;
+	len = io_len();
 	buf = malloc(len);
-	memset(buf, nameseq & 0xff, len);
-	e = write(fd, buf, len) < 0 ? errno : 0;
+	gen = vmap_fill(vm, buf, len, off, fep->id);
+	ret = write(fd, buf, len);
+	e = ret < 0 ? errno : 0;
+	vmap_write(vm, off, ret, fep->id, gen);
 	free(buf);
 	if (v)
 		printf("%d/%lld: write %s%s [%lld,%d] %d\n",
@@ -5560,9 +8265,13 @@ writev_f(opnum_t opno, long r)
 	size_t		iovb;
 	size_t		iovl;
 	int		i;
+	fent_t		*fep;
+	struct vmap	*vm;
+	uint32_t	gen;
+	ssize_t		ret;
 
 	init_pathname(&f);
-	if (!get_fname(FT_REGm, r, &f, NULL, NULL, &v)) {
+	if (!get_fname(FT_REGm, r, &f, NULL, &fep, &v)) {
 		if (v)
 			printf("%d/%lld: writev - no filename\n", procid, opno);
 		free_pathname(&f);
@@ -5587,15 +8296,16 @@ writev_f(opnum_t opno, long r)
 		return;
 	}
 	inode_info(st, sizeof(st), &stb, v);
-	lr = ((int64_t)random() << 32) + random();
+	vm = vmap_get(&stb);
+	lr = ((int64_t)fss_random() << 32) + fss_random();
 	off = (off64_t)(lr % MIN(stb.st_size + (1024 * 1024), MAXFSIZE));
-	off %= maxfsize;
+	off %= file_max();
 	lseek64(fd, off, SEEK_SET);
-	len = (random() % FILELEN_MAX) + 1;
+	len = io_len();
 	buf = malloc(len);
-	memset(buf, nameseq & 0xff, len);
+	gen = vmap_fill(vm, buf, len, off, fep->id);
 
-	iovcnt = (random() % MIN(len, IOV_MAX)) + 1;
+	iovcnt = (fss_random() % MIN(len, IOV_MAX)) + 1;
 	iov = calloc(iovcnt, sizeof(struct iovec));
 	iovl = len / iovcnt;
 	iovb = 0;
@@ -5605,7 +8315,9 @@ writev_f(opnum_t opno, long r)
 		iovb += iovl;
 	}
 
-	e = writev(fd, iov, iovcnt) < 0 ? errno : 0;
+	ret = writev(fd, iov, iovcnt);
+	e = ret < 0 ? errno : 0;
+	vmap_write(vm, off, ret, fep->id, gen);
 	free(buf);
 	free(iov);
 	if (v)
@@ -5629,9 +8341,13 @@ write_dontcache_f(opnum_t opno, long r)
 	char		st[1024];
 	struct iovec	iov;
 	int flags;
+	fent_t		*fep;
+	struct vmap	*vm;
+	uint32_t	gen;
+	ssize_t		ret;
 
 	init_pathname(&f);
-	if (!get_fname(FT_REGm, r, &f, NULL, NULL, &v)) {
+	if (!get_fname(FT_REGm, r, &f, NULL, &fep, &v)) {
 		if (v)
 			printf("%d/%lld: write - no filename\n", procid, opno);
 		free_pathname(&f);
@@ -5656,18 +8372,22 @@ write_dontcache_f(opnum_t opno, long r)
 		return;
 	}
 	inode_info(st, sizeof(st), &stb, v);
-	lr = ((int64_t)random() << 32) + random();
+	vm = vmap_get(&stb);
+	lr = ((int64_t)fss_random() << 32) + fss_random();
 	off = (off64_t)(lr % MIN(stb.st_size + (1024 * 1024), MAXFSIZE));
-	off %= maxfsize;
-	iov.iov_len = (random() % FILELEN_MAX) + 1;
+	off %= file_max();
+	iov.iov_len = io_len();
 	iov.iov_base = malloc(iov.iov_len);
-	memset(iov.iov_base, nameseq & 0xff, iov.iov_len);
+	gen = vmap_fill(vm, iov.iov_base, iov.iov_len, off, fep->id);
 	flags = have_rwf_dontcache ? RWF_DONTCACHE : 0;
-	e = pwritev2(fd, &iov, 1, off, flags) < 0 ? errno : 0;
+	ret = pwritev2(fd, &iov, 1, off, flags);
+	e = ret < 0 ? errno : 0;
 	if (have_rwf_dontcache && e == EOPNOTSUPP) {
 		have_rwf_dontcache = 0;
-		e = pwritev2(fd, &iov, 1, off, 0) < 0 ? errno : 0;
+		ret = pwritev2(fd, &iov, 1, off, 0);
+		e = ret < 0 ? errno : 0;
 	}
+	vmap_write(vm, off, ret, fep->id, gen);
 	free(iov.iov_base);
 	if (v)
 		printf("%d/%lld: write dontcache %s%s [%lld,%d] %d\n",
@@ -0,0 +1,495 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Check a filesystem after a crash against the journal fsstress --journal
+ * wrote while running on it, see fssjournal.h.
+ *
+ * For every fsstress proc the expected state is its last complete
+ * checkpoint, updated by the files it fsynced since.  Every entry in it
+ * must be there after recovery, and regular files must have the size and
+ * contents they had when synced, unless an op started changing the entry,
+ * one of its hard links or a directory above it after that.  Such entries
+ * are left out.  The checks run in parallel, a directory at a time.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <search.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "fssjournal.h"
+
+struct ent {
+	char		*path;		/* relative to the proc directory */
+	int		proc;
+	char		type;		/* F, D or O */
+	uint64_t	ino;
+	uint64_t	size;
+	uint64_t	hash;
+	unsigned long	synced;		/* journal line it was synced at */
+	char		*fullpath;
+	char		*err;		/* what the check found wrong */
+};
+
+/* the last journal line an op started changing a path or an inode at */
+struct mark {
+	char		*path;
+	uint64_t	ino;
+	unsigned long	line;
+};
+
+struct proc {
+	void		*ents;		/* by path */
+	void		*ckpt;		/* the checkpoint being read */
+	unsigned long	ckpt_seq;
+	void		*marks;		/* by path */
+	void		*ino_marks;	/* by inode */
+};
+
+struct proc	*procs;
+int		nprocs;
+char		*dir;
+struct ent	**ents;
+size_t		nents;
+size_t		*groups;		/* first entry of each directory */
+size_t		ngroups;
+size_t		next_group;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: fssverify [-j jobs] [-v] dir journal\n"
+		"	-j: check this many directories at a time (default 4)\n"
+		"	-v: print every entry checked\n");
+	exit(2);
+}
+
+static int
+ent_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct ent *)a)->path,
+		      ((const struct ent *)b)->path);
+}
+
+static int
+mark_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct mark *)a)->path,
+		      ((const struct mark *)b)->path);
+}
+
+static int
+ino_mark_cmp(const void *a, const void *b)
+{
+	uint64_t	x = ((const struct mark *)a)->ino;
+	uint64_t	y = ((const struct mark *)b)->ino;
+
+	return x < y ? -1 : x > y;
+}
+
+static void
+free_ent(void *p)
+{
+	struct ent	*e = p;
+
+	free(e->path);
+	free(e);
+}
+
+static struct proc *
+get_proc(int proc)
+{
+	if (proc >= nprocs) {
+		procs = realloc(procs, (proc + 1) * sizeof(*procs));
+		if (!procs) {
+			perror("realloc");
+			exit(2);
+		}
+		memset(procs + nprocs, 0, (proc + 1 - nprocs) * sizeof(*procs));
+		nprocs = proc + 1;
+	}
+	return &procs[proc];
+}
+
+/* add or replace the entry for e->path */
+static void
+put_ent(void **root, struct ent *e)
+{
+	struct ent	**old;
+
+	old = tsearch(e, root, ent_cmp);
+	if (!old) {
+		perror("tsearch");
+		exit(2);
+	}
+	if (*old != e) {
+		free_ent(*old);
+		*old = e;
+	}
+}
+
+static void
+put_mark(void **root, struct mark *key, int (*cmp)(const void *,
+						   const void *))
+{
+	struct mark	**m;
+	struct mark	*new;
+
+	m = tfind(key, root, cmp);
+	if (m) {
+		(*m)->line = key->line;
+		return;
+	}
+	new = malloc(sizeof(*new));
+	if (!new) {
+		perror("malloc");
+		exit(2);
+	}
+	*new = *key;
+	if (key->path && !(new->path = strdup(key->path))) {
+		perror("strdup");
+		exit(2);
+	}
+	if (!tsearch(new, root, cmp)) {
+		perror("tsearch");
+		exit(2);
+	}
+}
+
+static unsigned long
+mark_line(void *root, struct mark *key,
+	  int (*cmp)(const void *, const void *))
+{
+	struct mark	**m = tfind(key, &root, cmp);
+
+	return m ? (*m)->line : 0;
+}
+
+static void
+bad_record(const char *journal, unsigned long line)
+{
+	fprintf(stderr, "%s: bad record at line %lu\n", journal, line);
+	exit(2);
+}
+
+static void
+read_journal(const char *journal)
+{
+	struct proc	*p;
+	struct ent	key;
+	struct ent	**found;
+	struct ent	*e;
+	struct mark	m;
+	unsigned long	line = 0;
+	unsigned long	seq;
+	unsigned long long	ino, size, hash;
+	char		*buf = NULL;
+	size_t		bufsize = 0;
+	ssize_t		len;
+	char		type;
+	FILE		*f;
+	int		proc;
+	int		n, n2 = 0;
+
+	f = fopen(journal, "r");
+	if (!f) {
+		perror(journal);
+		exit(2);
+	}
+	while ((len = getline(&buf, &bufsize, f)) > 0) {
+		line++;
+		/* a torn last record is what a crash leaves */
+		if (buf[len - 1] != '\n')
+			break;
+		buf[--len] = '\0';
+		if (line == 1) {
+			if (strcmp(buf, FSSJ_MAGIC) != 0) {
+				fprintf(stderr, "%s: not an fsstress journal\n",
+					journal);
+				exit(2);
+			}
+			continue;
+		}
+		n = 0;
+		if (sscanf(buf, "%d %c %n", &proc, &type, &n) != 2 || !n ||
+		    proc < 0)
+			bad_record(journal, line);
+		p = get_proc(proc);
+		switch (type) {
+		case 'C':
+			if (sscanf(buf + n, "%lu", &seq) != 1)
+				bad_record(journal, line);
+			tdestroy(p->ckpt, free_ent);
+			p->ckpt = NULL;
+			p->ckpt_seq = seq;
+			break;
+		case 'E':
+			if (sscanf(buf + n, "%lu", &seq) != 1)
+				bad_record(journal, line);
+			if (seq != p->ckpt_seq)
+				break;
+			tdestroy(p->ents, free_ent);
+			p->ents = p->ckpt;
+			p->ckpt = NULL;
+			p->ckpt_seq = 0;
+			break;
+		case 'M':
+			if (sscanf(buf + n, "%llu %n", &ino, &n2) != 1 || !n2)
+				bad_record(journal, line);
+			n += n2;
+			m.path = buf + n;
+			m.ino = 0;
+			m.line = line;
+			put_mark(&p->marks, &m, mark_cmp);
+			/* fsstress couldn't stat it, go by what was synced */
+			if (!ino) {
+				key.path = buf + n;
+				found = tfind(&key, &p->ents, ent_cmp);
+				if (found && (*found)->type == 'F')
+					ino = (*found)->ino;
+			}
+			if (ino) {
+				m.path = NULL;
+				m.ino = ino;
+				put_mark(&p->ino_marks, &m, ino_mark_cmp);
+			}
+			break;
+		case 'F':
+		case 'S':
+		case 'D':
+		case 'O':
+			e = calloc(1, sizeof(*e));
+			if (!e) {
+				perror("calloc");
+				exit(2);
+			}
+			e->proc = proc;
+			e->type = type == 'S' ? 'F' : type;
+			e->synced = line;
+			if (e->type == 'F') {
+				if (sscanf(buf + n, "%llu %llu %llx %n", &ino,
+					   &size, &hash, &n2) != 3 || !n2)
+					bad_record(journal, line);
+				e->ino = ino;
+				e->size = size;
+				e->hash = hash;
+				n += n2;
+			}
+			e->path = strdup(buf + n);
+			if (!e->path) {
+				perror("strdup");
+				exit(2);
+			}
+			if (type == 'S')
+				put_ent(&p->ents, e);
+			else if (p->ckpt_seq)
+				put_ent(&p->ckpt, e);
+			else
+				free_ent(e);
+			break;
+		default:
+			bad_record(journal, line);
+		}
+	}
+	free(buf);
+	fclose(f);
+}
+
+/* has an op started changing e since it was synced? */
+static bool
+changed(struct proc *p, struct ent *e)
+{
+	struct mark	m = { .path = e->path };
+	char		*path;
+	char		*s;
+	bool		ret = false;
+
+	if (mark_line(p->marks, &m, mark_cmp) > e->synced)
+		return true;
+	m.path = NULL;
+	m.ino = e->ino;
+	if (e->type == 'F' && mark_line(p->ino_marks, &m,
+					ino_mark_cmp) > e->synced)
+		return true;
+	/* and the directories above it */
+	path = strdup(e->path);
+	if (!path) {
+		perror("strdup");
+		exit(2);
+	}
+	m.path = path;
+	while (!ret && (s = strrchr(path, '/'))) {
+		*s = '\0';
+		ret = mark_line(p->marks, &m, mark_cmp) > e->synced;
+	}
+	free(path);
+	return ret;
+}
+
+struct proc	*walk_proc;
+unsigned long	nchanged;
+
+static void
+collect(const void *node, VISIT which, int depth)
+{
+	struct ent	*e = *(struct ent **)node;
+
+	if (which != postorder && which != leaf)
+		return;
+	if (changed(walk_proc, e)) {
+		nchanged++;
+		return;
+	}
+	if (asprintf(&e->fullpath, "%s/p%x/%s", dir, e->proc, e->path) < 0) {
+		perror("asprintf");
+		exit(2);
+	}
+	ents = realloc(ents, (nents + 1) * sizeof(*ents));
+	if (!ents) {
+		perror("realloc");
+		exit(2);
+	}
+	ents[nents++] = e;
+}
+
+static int
+fullpath_cmp(const void *a, const void *b)
+{
+	return strcmp((*(struct ent * const *)a)->fullpath,
+		      (*(struct ent * const *)b)->fullpath);
+}
+
+static bool
+same_dir(const char *a, const char *b)
+{
+	const char	*sa = strrchr(a, '/');
+	const char	*sb = strrchr(b, '/');
+
+	return sa - a == sb - b && strncmp(a, b, sa - a) == 0;
+}
+
+static void
+check(struct ent *e)
+{
+	struct stat	st;
+	uint64_t	hash;
+	int		fd;
+	int		ret = 0;
+
+	if (lstat(e->fullpath, &st) < 0) {
+		ret = asprintf(&e->err, "%s", errno == ENOENT ? "missing" :
+			       strerror(errno));
+	} else if (e->type == 'D' && !S_ISDIR(st.st_mode)) {
+		ret = asprintf(&e->err, "not a directory");
+	} else if (e->type != 'F') {
+		return;
+	} else if (!S_ISREG(st.st_mode)) {
+		ret = asprintf(&e->err, "not a regular file");
+	} else if (st.st_size != e->size) {
+		ret = asprintf(&e->err, "size %lld, expected %llu",
+			       (long long)st.st_size,
+			       (unsigned long long)e->size);
+	} else if ((fd = open(e->fullpath, O_RDONLY)) < 0 ||
+		   fssj_hash_fd(fd, &hash) < 0) {
+		ret = asprintf(&e->err, "can't read: %s", strerror(errno));
+		if (fd >= 0)
+			close(fd);
+	} else {
+		close(fd);
+		if (hash != e->hash)
+			ret = asprintf(&e->err, "contents differ");
+	}
+	if (ret < 0) {
+		perror("asprintf");
+		exit(2);
+	}
+}
+
+static void *
+worker(void *arg)
+{
+	size_t	g, i, end;
+
+	while ((g = __atomic_fetch_add(&next_group, 1, __ATOMIC_RELAXED)) <
+	       ngroups) {
+		end = g + 1 < ngroups ? groups[g + 1] : nents;
+		for (i = groups[g]; i < end; i++)
+			check(ents[i]);
+	}
+	return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+	pthread_t	*tids;
+	unsigned long	nbad = 0;
+	size_t		i;
+	int		jobs = 4;
+	int		verbose = 0;
+	int		c;
+
+	while ((c = getopt(argc, argv, "j:v")) != EOF) {
+		switch (c) {
+		case 'j':
+			jobs = atoi(optarg);
+			if (jobs < 1)
+				usage();
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 2)
+		usage();
+	dir = argv[optind];
+
+	read_journal(argv[optind + 1]);
+	for (i = 0; i < nprocs; i++) {
+		walk_proc = &procs[i];
+		twalk(procs[i].ents, collect);
+	}
+
+	/* hand out the entries a directory at a time */
+	qsort(ents, nents, sizeof(*ents), fullpath_cmp);
+	groups = malloc((nents + 1) * sizeof(*groups));
+	tids = malloc(jobs * sizeof(*tids));
+	if (!groups || !tids) {
+		perror("malloc");
+		exit(2);
+	}
+	for (i = 0; i < nents; i++)
+		if (i == 0 || !same_dir(ents[i - 1]->fullpath,
+					ents[i]->fullpath))
+			groups[ngroups++] = i;
+	for (i = 0; i < jobs; i++) {
+		errno = pthread_create(&tids[i], NULL, worker, NULL);
+		if (errno) {
+			perror("pthread_create");
+			exit(2);
+		}
+	}
+	for (i = 0; i < jobs; i++)
+		pthread_join(tids[i], NULL);
+
+	for (i = 0; i < nents; i++) {
+		if (ents[i]->err) {
+			printf("%s: %s\n", ents[i]->fullpath, ents[i]->err);
+			nbad++;
+		} else if (verbose) {
+			printf("%s: ok\n", ents[i]->fullpath);
+		}
+	}
+	printf("%zu entries checked, %lu changed since they were synced, "
+	       "%lu bad\n", nents, nchanged, nbad);
+	return nbad ? 1 : 0;
+}
@@ -40,6 +40,14 @@
 #include <liburing.h>
 #endif
 #include <sys/syscall.h>
+#include <pthread.h>
+#include "fsxlog.h"
+#include "ctrrand.h"
+#include "ophist.h"
+#if defined(__x86_64__) && defined(__SSE2__)
+#include <immintrin.h>
+#define FSX_SIMD	1
+#endif
 
 #ifndef MAP_FILE
 # define MAP_FILE 0
@@ -51,6 +59,8 @@
 
 #define NUMPRINTCOLUMNS 32	/* # columns of data to print on each line */
 
+#define ORIGINAL_BUF_MAX (256 * 1024 * 1024)	/* cap on original data pattern */
+
 /* Operation flags (bitmask) */
 enum opflags {
 	FL_NONE = 0,
@@ -67,15 +77,22 @@ enum opflags {
 struct log_entry {
 	int	operation;
 	int	nr_args;
-	int	args[4];
+	unsigned long long	args[4];
 	enum opflags flags;
+	unsigned long long	seq;	/* shared range ticket, 0 if none */
+	int	file;			/* --files pool file, 0 otherwise */
+	int	dest_file;		/* and the destination of log5 ops */
 };
 
 #define	LOGSIZE	10000
 
-struct log_entry	oplog[LOGSIZE];	/* the log */
-int			logptr = 0;	/* current position in log */
-int			logcount = 0;	/* total ops */
+/*
+ * With --threads every worker runs its own copy of the test loop, so all of
+ * the per-run state below is thread local.  Option settings stay global.
+ */
+__thread struct log_entry	oplog[LOGSIZE];	/* the log */
+__thread int		logptr = 0;	/* current position in log */
+__thread int		logcount = 0;	/* total ops */
 
 /*
  * The operation matrix is complex due to conditional execution of different
@@ -138,21 +155,22 @@ enum {
 #define PAGE_MASK       (PAGE_SIZE - 1)
 
 char	*original_buf;			/* a pointer to the original data */
-char	*good_buf;			/* a pointer to the correct data */
-char	*temp_buf;			/* a pointer to the current data */
+unsigned long	original_len;		/* bytes of original data */
+__thread char	*write_buf;		/* a pointer to the data being written */
+__thread char	*temp_buf;		/* a pointer to the current data */
 char	*fname;				/* name of our test file */
 char	*bname;				/* basename of our test file */
 char	*logdev;			/* -i flag */
-char	*logid;				/* -j flag */
+__thread char	*logid;			/* -j flag */
 char	dname[1024];			/* -P flag */
-char	goodfile[PATH_MAX];
+__thread char	goodfile[PATH_MAX];
 int	dirpath = 0;			/* -P flag */
-int	fd;				/* fd for our test file */
+__thread int	fd;			/* fd for our test file */
 
 blksize_t	block_size = 0;
-off_t		file_size = 0;
-off_t		biggest = 0;
-long long	testcalls = 0;		/* calls to function "test" */
+__thread off_t	file_size = 0;
+__thread off_t	biggest = 0;
+__thread long long	testcalls = 0;	/* calls to function "test" */
 
 long long	simulatedopcount = 0;	/* -b flag */
 int	closeprob = 0;			/* -c flag */
@@ -174,7 +192,7 @@ int	writebdy = 1;			/* -w flag */
 long	monitorstart = -1;		/* -m flag */
 long	monitorend = -1;		/* -m flag */
 int	lite = 0;			/* -L flag */
-long long numops = -1;			/* -N flag */
+__thread long long numops = -1;	/* -N flag */
 int	randomoplen = 1;		/* -O flag disables it */
 int	seed = 1;			/* -S flag */
 int     mapped_writes = 1;              /* -W flag disables */
@@ -193,27 +211,44 @@ int	copy_range_calls = 1;		/* -E flag disables */
 int	exchange_range_calls = 1;	/* -0 flag disables */
 int	integrity = 0;			/* -i flag */
 int	pollute_eof = 0;		/* -e flag */
-int	fsxgoodfd = 0;
+__thread int	fsxgoodfd = 0;
 int	o_direct;			/* -Z */
 int	aio = 0;
 int	uring = 0;
+int	uring_qd = 0;			/* --uring-qd */
+int	uring_sqpoll = 0;		/* --uring-sqpoll */
 int	mark_nr = 0;
 int	dontcache_io = 1;
 int	hugepages = 0;                  /* -h flag */
+int	folio_bias = 0;			/* --folio-bias, percent of ops */
+int	nr_threads = 0;			/* --threads */
+unsigned long long	shared_len = 0;	/* --shared-range */
+unsigned long long	thread_stride;	/* bytes of the file owned by each thread */
+unsigned long long	shared_base;	/* offset of the shared range */
+unsigned long long	lock_align;	/* granularity of shared range locks */
+__thread int		thread_id = -1;	/* worker number, -1 if single threaded */
+__thread unsigned long long	range_base;	/* start of our private range */
+__thread unsigned long long	op_seq;		/* ticket of the op being run */
 
 /* Stores info needed to periodically collapse hugepages */
 struct hugepages_collapse_info {
-	void *orig_good_buf;
-	long good_buf_size;
+	void *orig_write_buf;
+	long write_buf_size;
 	void *orig_temp_buf;
 	long temp_buf_size;
 };
-struct hugepages_collapse_info hugepages_info;
+__thread struct hugepages_collapse_info hugepages_info;
 
 int page_size;
 int page_mask;
 int mmap_mask;
-int fsx_rw(int rw, int fd, char *buf, unsigned len, unsigned offset, int flags);
+int fsx_rw(int rw, int fd, char *buf, unsigned len, unsigned long long offset,
+	   int flags);
+void uring_queue(int rw, char *buf, unsigned len, unsigned long long offset,
+		 int flags, bool wait);
+void uring_wait_overlap(int rw, unsigned long long offset, unsigned len);
+void uring_drain(void);
+void uring_reopen(void);
 #define READ 0
 #define WRITE 1
 #define fsxread(a,b,c,d,f)	fsx_rw(READ, a,b,c,d,f)
@@ -223,11 +258,49 @@ struct timespec deadline;
 
 const char *replayops = NULL;
 const char *recordops = NULL;
-FILE *	fsxlogf = NULL;
-FILE *	replayopsf = NULL;
-char opsfile[PATH_MAX];
-int badoff = -1;
-int closeopen = 0;
+const char *binlog = NULL;		/* --binlog */
+long long checkpoint_ops = 0;		/* --checkpoint */
+int	replay_checkpoint = 0;		/* --replay-checkpoint */
+const char *stats_path = NULL;		/* --stats */
+long	stats_interval = 0;		/* --stats-interval */
+__thread FILE *	fsxlogf = NULL;
+__thread FILE *	replayopsf = NULL;
+__thread char opsfile[PATH_MAX];
+__thread long long badoff = -1;
+__thread int closeopen = 0;
+
+/*
+ * Every worker needs its own reproducible random stream, so use a private
+ * random_r() state per thread.  The state size matches the glibc default so
+ * that the single threaded stream is the same as srandom()/fsx_random().
+ *
+ * --ctr-random uses a counter based stream instead (see ctrrand.h), which
+ * test() moves to the start of every op, so that the random numbers of op N
+ * only depend on the seed, the worker and N.
+ */
+__thread struct random_data	rand_data;
+__thread char	rand_state[128] __attribute__((aligned(8)));
+int		ctr_random = 0;		/* --ctr-random */
+__thread struct ctr_rand	ctr_rng;
+
+static void
+fsx_srandom(unsigned int s)
+{
+	memset(&rand_data, 0, sizeof(rand_data));
+	initstate_r(s, rand_state, sizeof(rand_state), &rand_data);
+	ctr_rand_seek(&ctr_rng, seed, thread_id + 1, 0);
+}
+
+static long
+fsx_random(void)
+{
+	int32_t r;
+
+	if (ctr_random)
+		return ctr_rand(&ctr_rng);
+	random_r(&rand_data, &r);
+	return r;
+}
 
 static void *round_ptr_up(void *ptr, unsigned long align, unsigned long offset)
 {
@@ -282,6 +355,561 @@ prterr(const char *prefix)
 	prt("%s%s%s\n", prefix, prefix ? ": " : "", strerror(errno));
 }
 
+/*
+ * The expected file contents are kept in a sparse shadow model rather than a
+ * flat buffer the size of the file so that we can exercise multi-terabyte
+ * sparse files.  The file is carved into SHADOW_CHUNK sized chunks which are
+ * only allocated once non-zero data is written to them; a missing chunk reads
+ * back as zeroes.  Chunks are indexed by a fixed depth radix tree that covers
+ * the whole 64 bit offset space.
+ */
+#define SHADOW_CHUNK_SHIFT	14
+#define SHADOW_CHUNK		(1ULL << SHADOW_CHUNK_SHIFT)
+#define SHADOW_CHUNK_MASK	(SHADOW_CHUNK - 1)
+#define SHADOW_FANOUT_SHIFT	9
+#define SHADOW_FANOUT		(1U << SHADOW_FANOUT_SHIFT)
+#define SHADOW_LEVELS		6	/* 6 * 9 + 14 >= 64 bits */
+
+struct shadow_node {
+	void	*slots[SHADOW_FANOUT];
+};
+
+__thread struct shadow_node	*shadow_root;
+
+/*
+ * With --threads each worker models its own private range in shadow_root,
+ * and the shared range lives in a separate tree that every worker updates
+ * while holding the range lock for the chunks it touches.
+ */
+struct shadow_node	*shared_root;
+
+static inline unsigned long long
+shadow_split(void)
+{
+	return shared_len ? shared_base >> SHADOW_CHUNK_SHIFT : ULLONG_MAX;
+}
+
+static inline unsigned
+shadow_slot(unsigned long long idx, int level)
+{
+	int shift = (SHADOW_LEVELS - 1 - level) * SHADOW_FANOUT_SHIFT;
+
+	return (idx >> shift) & (SHADOW_FANOUT - 1);
+}
+
+/*
+ * Return a pointer to the leaf slot for chunk idx, allocating the interior
+ * nodes on the way down if alloc is set.
+ */
+static void **
+shadow_leaf(unsigned long long idx, bool alloc)
+{
+	struct shadow_node **np;
+	int level;
+
+	np = idx < shadow_split() ? &shadow_root : &shared_root;
+
+	for (level = 0; ; level++) {
+		if (!*np) {
+			if (!alloc)
+				return NULL;
+			*np = calloc(1, sizeof(struct shadow_node));
+			if (!*np) {
+				prterr("shadow_leaf: calloc");
+				exit(101);
+			}
+		}
+		if (level == SHADOW_LEVELS - 1)
+			break;
+		np = (struct shadow_node **)&(*np)->slots[shadow_slot(idx, level)];
+	}
+	return &(*np)->slots[shadow_slot(idx, level)];
+}
+
+static char *
+shadow_chunk(unsigned long long idx, bool alloc)
+{
+	void **slot = shadow_leaf(idx, alloc);
+
+	if (!slot)
+		return NULL;
+	if (!*slot && alloc) {
+		*slot = calloc(1, SHADOW_CHUNK);
+		if (!*slot) {
+			prterr("shadow_chunk: calloc");
+			exit(101);
+		}
+	}
+	return *slot;
+}
+
+/*
+ * Find the nearest populated chunk at or after (dir > 0) or at or before
+ * (dir < 0) chunk idx, skipping over empty subtrees.
+ */
+static bool
+__shadow_find(struct shadow_node *node, int level, unsigned long long idx,
+	      int dir, unsigned long long *found)
+{
+	int shift = (SHADOW_LEVELS - 1 - level) * SHADOW_FANOUT_SHIFT;
+	unsigned long long below = (1ULL << shift) - 1;
+	unsigned long long prefix = idx & ~(below |
+				((unsigned long long)(SHADOW_FANOUT - 1) << shift));
+	int s;
+
+	for (s = shadow_slot(idx, level); s >= 0 && s < SHADOW_FANOUT; s += dir) {
+		unsigned long long sub = prefix | ((unsigned long long)s << shift);
+
+		if (!node->slots[s])
+			continue;
+		if (s == shadow_slot(idx, level))
+			sub = idx;
+		else if (dir < 0)
+			sub |= below;
+		if (level == SHADOW_LEVELS - 1) {
+			*found = sub;
+			return true;
+		}
+		if (__shadow_find(node->slots[s], level + 1, sub, dir, found))
+			return true;
+	}
+	return false;
+}
+
+static bool
+shadow_find(unsigned long long idx, int dir, unsigned long long *found)
+{
+	unsigned long long split = shadow_split();
+	struct shadow_node *first = shadow_root;
+	struct shadow_node *second = shared_root;
+
+	if (idx >= split) {
+		first = shared_root;
+		second = shadow_root;
+	}
+	if (first && __shadow_find(first, 0, idx, dir, found))
+		return true;
+
+	/* carry on into the other tree if it lies in the search direction */
+	if (idx < split && dir > 0)
+		idx = split;
+	else if (idx >= split && dir < 0)
+		idx = split - 1;
+	else
+		return false;
+	return second && __shadow_find(second, 0, idx, dir, found);
+}
+
+/*
+ * Data kernels: the write pattern, the zero check used to verify holes and
+ * the search for the first differing byte on a miscompare.  Each has a
+ * scalar version, which the vector ones also use for their tails, and on
+ * x86_64 SSE2 and AVX2 versions picked at startup.  They all produce the
+ * same bytes, so old seeds and replay logs still reproduce.
+ */
+bool	have_avx2;
+
+/*
+ * Byte i of a write is t, plus src[i] if the file offset of byte i is odd;
+ * odd says whether the first byte is at an odd offset.
+ */
+static void
+pattern_scalar(char *buf, const char *src, size_t n, int odd, char t)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		buf[i] = ((i & 1) ^ odd) ? t + src[i] : t;
+}
+
+static size_t
+mismatch_scalar(const char *a, const char *b, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n && a[i] == b[i]; i++)
+		;
+	return i;
+}
+
+#ifdef FSX_SIMD
+static void
+pattern_sse2(char *buf, const char *src, size_t n, int odd, char t)
+{
+	__m128i tv = _mm_set1_epi8(t);
+	__m128i mask = _mm_set1_epi16(odd ? 0x00ff : (short)0xff00);
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+
+		v = _mm_add_epi8(_mm_and_si128(v, mask), tv);
+		_mm_storeu_si128((__m128i *)(buf + i), v);
+	}
+	pattern_scalar(buf + i, src + i, n - i, odd, t);
+}
+
+static size_t
+mismatch_sse2(const char *a, const char *b, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+		__m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+		unsigned m = _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+
+		if (m != 0xffff)
+			return i + __builtin_ctz(~m);
+	}
+	return i + mismatch_scalar(a + i, b + i, n - i);
+}
+
+static bool
+zeroed_sse2(const char *buf, size_t n)
+{
+	__m128i zero = _mm_setzero_si128();
+	size_t i;
+
+	for (i = 0; i + 64 <= n; i += 64) {
+		__m128i v = _mm_or_si128(
+			_mm_or_si128(_mm_loadu_si128((const __m128i *)(buf + i)),
+				     _mm_loadu_si128((const __m128i *)(buf + i + 16))),
+			_mm_or_si128(_mm_loadu_si128((const __m128i *)(buf + i + 32)),
+				     _mm_loadu_si128((const __m128i *)(buf + i + 48))));
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xffff)
+			return false;
+	}
+	for (; i < n; i++)
+		if (buf[i])
+			return false;
+	return true;
+}
+
+static void __attribute__((target("avx2")))
+pattern_avx2(char *buf, const char *src, size_t n, int odd, char t)
+{
+	__m256i tv = _mm256_set1_epi8(t);
+	__m256i mask = _mm256_set1_epi16(odd ? 0x00ff : (short)0xff00);
+	size_t i;
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+
+		v = _mm256_add_epi8(_mm256_and_si256(v, mask), tv);
+		_mm256_storeu_si256((__m256i *)(buf + i), v);
+	}
+	pattern_scalar(buf + i, src + i, n - i, odd, t);
+}
+
+static size_t __attribute__((target("avx2")))
+mismatch_avx2(const char *a, const char *b, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		__m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+		__m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+		unsigned m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+
+		if (m != 0xffffffff)
+			return i + __builtin_ctz(~m);
+	}
+	return i + mismatch_scalar(a + i, b + i, n - i);
+}
+
+static bool __attribute__((target("avx2")))
+zeroed_avx2(const char *buf, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i + 128 <= n; i += 128) {
+		__m256i v = _mm256_or_si256(
+			_mm256_or_si256(_mm256_loadu_si256((const __m256i *)(buf + i)),
+					_mm256_loadu_si256((const __m256i *)(buf + i + 32))),
+			_mm256_or_si256(_mm256_loadu_si256((const __m256i *)(buf + i + 64)),
+					_mm256_loadu_si256((const __m256i *)(buf + i + 96))));
+
+		if (!_mm256_testz_si256(v, v))
+			return false;
+	}
+	return zeroed_sse2(buf + i, n - i);
+}
+#endif /* FSX_SIMD */
+
+static void
+pattern_fill(char *buf, const char *src, size_t n, int odd, char t)
+{
+#ifdef FSX_SIMD
+	if (have_avx2)
+		pattern_avx2(buf, src, n, odd, t);
+	else
+		pattern_sse2(buf, src, n, odd, t);
+#else
+	pattern_scalar(buf, src, n, odd, t);
+#endif
+}
+
+/* Return the index of the first byte that differs, or n if none do. */
+static size_t
+first_mismatch(const char *a, const char *b, size_t n)
+{
+#ifdef FSX_SIMD
+	if (have_avx2)
+		return mismatch_avx2(a, b, n);
+	return mismatch_sse2(a, b, n);
+#else
+	return mismatch_scalar(a, b, n);
+#endif
+}
+
+static bool
+is_zeroed(const char *buf, unsigned long long len)
+{
+#ifdef FSX_SIMD
+	if (have_avx2)
+		return zeroed_avx2(buf, len);
+	return zeroed_sse2(buf, len);
+#else
+	return len == 0 || (buf[0] == 0 && memcmp(buf, buf + 1, len - 1) == 0);
+#endif
+}
+
+/* Copy len bytes of the expected file contents at off into buf. */
+void
+shadow_read(unsigned long long off, char *buf, unsigned long long len)
+{
+	while (len) {
+		unsigned long long coff = off & SHADOW_CHUNK_MASK;
+		unsigned long long n = MIN(len, SHADOW_CHUNK - coff);
+		char *c = shadow_chunk(off >> SHADOW_CHUNK_SHIFT, false);
+
+		if (c)
+			memcpy(buf, c + coff, n);
+		else
+			memset(buf, 0, n);
+		off += n;
+		buf += n;
+		len -= n;
+	}
+}
+
+/* Record that len bytes of buf now live at off. */
+void
+shadow_write(unsigned long long off, const char *buf, unsigned long long len)
+{
+	while (len) {
+		unsigned long long coff = off & SHADOW_CHUNK_MASK;
+		unsigned long long n = MIN(len, SHADOW_CHUNK - coff);
+		char *c = shadow_chunk(off >> SHADOW_CHUNK_SHIFT, false);
+
+		if (!c && !is_zeroed(buf, n))
+			c = shadow_chunk(off >> SHADOW_CHUNK_SHIFT, true);
+		if (c)
+			memcpy(c + coff, buf, n);
+		off += n;
+		buf += n;
+		len -= n;
+	}
+}
+
+/* Zero a range of the model, releasing chunks that are entirely covered. */
+void
+shadow_zero(unsigned long long off, unsigned long long len)
+{
+	unsigned long long end = off + len;
+	unsigned long long idx = off >> SHADOW_CHUNK_SHIFT;
+
+	if (!len)
+		return;
+
+	while (shadow_find(idx, 1, &idx) && (idx << SHADOW_CHUNK_SHIFT) < end) {
+		unsigned long long cstart = idx << SHADOW_CHUNK_SHIFT;
+		unsigned long long s = MAX(off, cstart);
+		unsigned long long e = MIN(end, cstart + SHADOW_CHUNK);
+		void **slot = shadow_leaf(idx, false);
+
+		if (s == cstart && e == cstart + SHADOW_CHUNK) {
+			free(*slot);
+			*slot = NULL;
+		} else {
+			memset((char *)*slot + (s - cstart), 0, e - s);
+		}
+		idx++;
+	}
+}
+
+/* memcmp() for the model; holes compare equal to zeroes. */
+int
+shadow_cmp(unsigned long long off, const char *buf, unsigned long long len)
+{
+	while (len) {
+		unsigned long long coff = off & SHADOW_CHUNK_MASK;
+		unsigned long long n = MIN(len, SHADOW_CHUNK - coff);
+		char *c = shadow_chunk(off >> SHADOW_CHUNK_SHIFT, false);
+
+		if (c ? memcmp(c + coff, buf, n) != 0 : !is_zeroed(buf, n))
+			return 1;
+		off += n;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * memmove() for the model.  Holes in the source are skipped over a whole
+ * subtree at a time so that collapsing or inserting ranges in the middle of
+ * a huge sparse file only costs time proportional to the populated chunks.
+ */
+void
+shadow_move(unsigned long long dst, unsigned long long src,
+	    unsigned long long len)
+{
+	static __thread char bounce[SHADOW_CHUNK];
+	bool backward = dst > src && dst < src + len;
+	unsigned long long idx, found, n;
+
+	while (len) {
+		if (!backward) {
+			idx = src >> SHADOW_CHUNK_SHIFT;
+			if (shadow_chunk(idx, false)) {
+				n = MIN(len, SHADOW_CHUNK - (src & SHADOW_CHUNK_MASK));
+				shadow_read(src, bounce, n);
+				shadow_write(dst, bounce, n);
+			} else {
+				n = len;
+				if (shadow_find(idx, 1, &found))
+					n = MIN(n, (found << SHADOW_CHUNK_SHIFT) - src);
+				shadow_zero(dst, n);
+			}
+			src += n;
+			dst += n;
+		} else {
+			unsigned long long last = src + len - 1;
+
+			idx = last >> SHADOW_CHUNK_SHIFT;
+			if (shadow_chunk(idx, false)) {
+				n = MIN(len, (last & SHADOW_CHUNK_MASK) + 1);
+				shadow_read(src + len - n, bounce, n);
+				shadow_write(dst + len - n, bounce, n);
+			} else {
+				n = len;
+				if (shadow_find(idx, -1, &found))
+					n = MIN(n, last + 1 -
+						((found + 1) << SHADOW_CHUNK_SHIFT));
+				shadow_zero(dst + len - n, n);
+			}
+		}
+		len -= n;
+	}
+}
+
+/*
+ * Save the first len bytes of the model to fd.  Only populated chunks are
+ * written, so the result is as sparse as the model itself.
+ */
+void
+save_shadow(int fd, unsigned long long len, const char *what)
+{
+	unsigned long long idx = 0;
+
+	while (shadow_find(idx, 1, &idx) && (idx << SHADOW_CHUNK_SHIFT) < len) {
+		unsigned long long off = idx << SHADOW_CHUNK_SHIFT;
+		unsigned long long n = MIN(SHADOW_CHUNK, len - off);
+
+		if (pwrite(fd, shadow_chunk(idx, false), n, off) != n) {
+			prterr(what);
+			return;
+		}
+		idx++;
+	}
+	if (ftruncate(fd, len))
+		prterr(what);
+}
+
+/*
+ * --files=N runs the ops against a pool of N files, each with its own model.
+ * Every op picks the file it works on and clone, dedupe, copy and exchange
+ * pick another one for their destination, so extents end up shared between
+ * many files.  The file an op works on is made current by swapping its state
+ * in and out of fd, fname, file_size and shadow_root, so the single file
+ * code paths don't need to know about the pool.
+ */
+struct pool_file {
+	int			fd;
+	char			*name;
+	off_t			file_size;
+	struct shadow_node	*shadow;
+};
+
+int			nr_files = 1;
+struct pool_file	*pool;
+int			cur_file;	/* file in fd, fname, ... */
+int			dest_file;	/* destination of two file ops */
+
+static void
+pool_switch(int i)
+{
+	if (!pool || i == cur_file)
+		return;
+	/* in flight I/O is checked against the current model */
+	uring_drain();
+	pool[cur_file].fd = fd;
+	pool[cur_file].file_size = file_size;
+	pool[cur_file].shadow = shadow_root;
+	cur_file = i;
+	fd = pool[i].fd;
+	fname = pool[i].name;
+	file_size = pool[i].file_size;
+	shadow_root = pool[i].shadow;
+}
+
+static inline bool
+cross_file(void)
+{
+	return dest_file != cur_file;
+}
+
+static inline int
+dest_fd(void)
+{
+	return cross_file() ? pool[dest_file].fd : fd;
+}
+
+static inline off_t
+dest_size(void)
+{
+	return cross_file() ? pool[dest_file].file_size : file_size;
+}
+
+/*
+ * Model len bytes at src in the current file landing at dst in dest_file,
+ * which for a cross file op means copying between the two models.
+ */
+static void
+shadow_clone(unsigned long long dst, unsigned long long src,
+	     unsigned long long len)
+{
+	static char bounce[SHADOW_CHUNK];
+	struct shadow_node *src_root = shadow_root;
+	unsigned long long n;
+
+	if (!cross_file()) {
+		shadow_move(dst, src, len);
+		return;
+	}
+	for (; len; len -= n, src += n, dst += n) {
+		n = MIN(len, SHADOW_CHUNK);
+		shadow_read(src, bounce, n);
+		shadow_root = pool[dest_file].shadow;
+		shadow_write(dst, bounce, n);
+		pool[dest_file].shadow = shadow_root;
+		shadow_root = src_root;
+	}
+}
+
 
 static const char *op_names[] = {
 	[OP_READ] = "read",
@@ -321,8 +949,149 @@ static int op_code(const char *name)
 	return -1;
 }
 
+/*
+ * oplog[] only holds the last LOGSIZE ops.  --binlog additionally appends
+ * every op to a binary log (see fsxlog.h) through a shared mapping that is
+ * moved along the file BINLOG_WINDOW bytes at a time, and --checkpoint
+ * saves the model next to it every so many ops, so that long runs can be
+ * replayed in full or from their last checkpoint.
+ */
+#define BINLOG_WINDOW	(16ULL << 20)
+
+__thread int		binlog_fd = -1;
+__thread char		*binlog_map;	/* current window */
+__thread unsigned long long	binlog_win;	/* file offset of the window */
+__thread unsigned long long	binlog_pos;	/* file offset of next record */
+__thread unsigned long long	binlog_nr;	/* op records written */
+__thread char		binlog_path[PATH_MAX];
+
+static void
+binlog_map_window(unsigned long long win)
+{
+	if (binlog_map)
+		munmap(binlog_map, BINLOG_WINDOW);
+	binlog_map = NULL;
+	if (ftruncate(binlog_fd, win + BINLOG_WINDOW)) {
+		prterr("binlog: ftruncate");
+		exit(214);
+	}
+	binlog_map = mmap(NULL, BINLOG_WINDOW, PROT_READ | PROT_WRITE,
+			  MAP_SHARED, binlog_fd, win);
+	if (binlog_map == MAP_FAILED) {
+		prterr("binlog: mmap");
+		exit(214);
+	}
+	binlog_win = win;
+}
+
+static void
+binlog_append(struct fsxlog_rec *rec)
+{
+	if (binlog_pos + FSXLOG_REC_SIZE > binlog_win + BINLOG_WINDOW)
+		binlog_map_window(binlog_win + BINLOG_WINDOW);
+	memcpy(binlog_map + (binlog_pos - binlog_win), rec, sizeof(*rec));
+	binlog_pos += FSXLOG_REC_SIZE;
+}
+
+static void
+binlog_open(const char *path)
+{
+	struct fsxlog_hdr hdr = { 0 };
+	int i;
+
+	snprintf(binlog_path, sizeof(binlog_path), "%s", path);
+	binlog_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (binlog_fd < 0) {
+		prterr(path);
+		exit(93);
+	}
+	binlog_map_window(0);
+
+	memcpy(hdr.magic, FSXLOG_MAGIC, sizeof(hdr.magic));
+	hdr.version = FSXLOG_VERSION;
+	hdr.hdr_size = FSXLOG_HDR_SIZE;
+	hdr.rec_size = FSXLOG_REC_SIZE;
+	hdr.nr_ops = sizeof(op_names) / sizeof(op_names[0]);
+	hdr.seed = seed;
+	hdr.nr_files = nr_files;
+	hdr.maxfilelen = maxfilelen;
+	for (i = 0; i < hdr.nr_ops; i++)
+		if (op_names[i])
+			strncpy(hdr.op_names[i], op_names[i],
+				FSXLOG_NAME_LEN - 1);
+	memcpy(binlog_map, &hdr, sizeof(hdr));
+	binlog_pos = FSXLOG_HDR_SIZE;
+}
+
+static void
+binlog_op(struct log_entry *le)
+{
+	struct fsxlog_rec rec = {
+		.type		= FSXLOG_OP,
+		.op		= le->operation,
+		.flags		= le->flags,
+		.nr_args	= le->nr_args,
+		.file		= le->file,
+		.dest_file	= le->dest_file,
+		.seq		= le->seq,
+		.opnum		= testcalls,
+	};
+
+	if (!binlog_map)
+		return;
+	memcpy(rec.args, le->args, sizeof(rec.args));
+	binlog_append(&rec);
+	binlog_nr++;
+}
+
+/*
+ * Save the model to <binlog>.ckpt and note that in the log.  The image is
+ * written to a temporary file first so a crash never leaves a torn one.
+ */
+static void
+binlog_checkpoint(void)
+{
+	struct fsxlog_rec rec = {
+		.type		= FSXLOG_CKPT,
+		.opnum		= testcalls,
+	};
+	char path[PATH_MAX + 8], tmp[PATH_MAX + 16];
+	int cfd;
+
+	snprintf(path, sizeof(path), "%s.ckpt", binlog_path);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	cfd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (cfd < 0) {
+		prterr(tmp);
+		exit(214);
+	}
+	save_shadow(cfd, file_size, "binlog_checkpoint");
+	close(cfd);
+	if (rename(tmp, path)) {
+		prterr("binlog_checkpoint: rename");
+		exit(214);
+	}
+
+	rec.args[0] = file_size;
+	rec.args[1] = binlog_nr;
+	binlog_append(&rec);
+}
+
+static void
+binlog_close(void)
+{
+	if (!binlog_map)
+		return;
+	munmap(binlog_map, BINLOG_WINDOW);
+	binlog_map = NULL;
+	if (ftruncate(binlog_fd, binlog_pos))
+		prterr("binlog: ftruncate");
+	close(binlog_fd);
+}
+
 void
-log5(int operation, int arg0, int arg1, int arg2, enum opflags flags)
+log5(int operation, unsigned long long arg0, unsigned long long arg1,
+     unsigned long long arg2, enum opflags flags)
 {
 	struct log_entry *le;
 
@@ -336,14 +1105,19 @@ log5(int operation, int arg0, int arg1, int arg2, enum opflags flags)
 	le->args[3] = file_size;
 	le->nr_args = 4;
 	le->flags = flags;
+	le->seq = op_seq;
+	le->file = cur_file;
+	le->dest_file = dest_file;
 	logptr++;
 	logcount++;
 	if (logptr >= LOGSIZE)
 		logptr = 0;
+	binlog_op(le);
 }
 
 void
-log4(int operation, int arg0, int arg1, enum opflags flags)
+log4(int operation, unsigned long long arg0, unsigned long long arg1,
+     enum opflags flags)
 {
 	struct log_entry *le;
 
@@ -356,10 +1130,13 @@ log4(int operation, int arg0, int arg1, enum opflags flags)
 	le->args[2] = file_size;
 	le->nr_args = 3;
 	le->flags = flags;
+	le->seq = op_seq;
+	le->file = le->dest_file = cur_file;
 	logptr++;
 	logcount++;
 	if (logptr >= LOGSIZE)
 		logptr = 0;
+	binlog_op(le);
 }
 
 void
@@ -400,14 +1177,14 @@ logdump(void)
 
 		switch (lp->operation) {
 		case OP_MAPREAD:
-			prt("MAPREAD  0x%x thru 0x%x\t(0x%x bytes)",
+			prt("MAPREAD  0x%llx thru 0x%llx\t(0x%llx bytes)",
 			    lp->args[0], lp->args[0] + lp->args[1] - 1,
 			    lp->args[1]);
 			if (overlap)
 				prt("\t***RRRR***");
 			break;
 		case OP_MAPWRITE:
-			prt("MAPWRITE 0x%x thru 0x%x\t(0x%x bytes)",
+			prt("MAPWRITE 0x%llx thru 0x%llx\t(0x%llx bytes)",
 			    lp->args[0], lp->args[0] + lp->args[1] - 1,
 			    lp->args[1]);
 			if (overlap)
@@ -415,7 +1192,7 @@ logdump(void)
 			break;
 		case OP_READ:
 		case OP_READ_DONTCACHE:
-			prt("READ     0x%x thru 0x%x\t(0x%x bytes)",
+			prt("READ     0x%llx thru 0x%llx\t(0x%llx bytes)",
 			    lp->args[0], lp->args[0] + lp->args[1] - 1,
 			    lp->args[1]);
 			if (overlap)
@@ -423,7 +1200,7 @@ logdump(void)
 			break;
 		case OP_WRITE_DONTCACHE:
 		case OP_WRITE:
-			prt("WRITE    0x%x thru 0x%x\t(0x%x bytes)",
+			prt("WRITE    0x%llx thru 0x%llx\t(0x%llx bytes)",
 			    lp->args[0], lp->args[0] + lp->args[1] - 1,
 			    lp->args[1]);
 			if (lp->args[0] > lp->args[2])
@@ -438,7 +1215,7 @@ logdump(void)
 			break;
 		case OP_TRUNCATE:
 			down = lp->args[1] < lp->args[2];
-			prt("TRUNCATE %s\tfrom 0x%x to 0x%x",
+			prt("TRUNCATE %s\tfrom 0x%llx to 0x%llx",
 			    down ? "DOWN" : "UP", lp->args[2], lp->args[1]);
 			overlap = badoff >= lp->args[1 + !down] &&
 				  badoff < lp->args[1 + !!down];
@@ -447,7 +1224,7 @@ logdump(void)
 			break;
 		case OP_FALLOCATE:
 			/* 0: offset 1: length 2: where alloced */
-			prt("FALLOC   0x%x thru 0x%x\t(0x%x bytes) ",
+			prt("FALLOC   0x%llx thru 0x%llx\t(0x%llx bytes) ",
 				lp->args[0], lp->args[0] + lp->args[1],
 				lp->args[1]);
 			if (lp->args[0] + lp->args[1] <= lp->args[2])
@@ -460,35 +1237,35 @@ logdump(void)
 				prt("\t******FFFF");
 			break;
 		case OP_PUNCH_HOLE:
-			prt("PUNCH    0x%x thru 0x%x\t(0x%x bytes)",
+			prt("PUNCH    0x%llx thru 0x%llx\t(0x%llx bytes)",
 			    lp->args[0], lp->args[0] + lp->args[1] - 1,
 			    lp->args[1]);
 			if (overlap)
 				prt("\t******PPPP");
 			break;
 		case OP_ZERO_RANGE:
-			prt("ZERO     0x%x thru 0x%x\t(0x%x bytes)",
+			prt("ZERO     0x%llx thru 0x%llx\t(0x%llx bytes)",
 			    lp->args[0], lp->args[0] + lp->args[1] - 1,
 			    lp->args[1]);
 			if (overlap)
 				prt("\t******ZZZZ");
 			break;
 		case OP_COLLAPSE_RANGE:
-			prt("COLLAPSE 0x%x thru 0x%x\t(0x%x bytes)",
+			prt("COLLAPSE 0x%llx thru 0x%llx\t(0x%llx bytes)",
 			    lp->args[0], lp->args[0] + lp->args[1] - 1,
 			    lp->args[1]);
 			if (overlap)
 				prt("\t******CCCC");
 			break;
 		case OP_INSERT_RANGE:
-			prt("INSERT 0x%x thru 0x%x\t(0x%x bytes)",
+			prt("INSERT 0x%llx thru 0x%llx\t(0x%llx bytes)",
 			    lp->args[0], lp->args[0] + lp->args[1] - 1,
 			    lp->args[1]);
 			if (overlap)
 				prt("\t******IIII");
 			break;
 		case OP_EXCHANGE_RANGE:
-			prt("XCHG 0x%x thru 0x%x\t(0x%x bytes) to 0x%x thru 0x%x",
+			prt("XCHG 0x%llx thru 0x%llx\t(0x%llx bytes) to 0x%llx thru 0x%llx",
 			    lp->args[0], lp->args[0] + lp->args[1] - 1,
 			    lp->args[1],
 			    lp->args[2], lp->args[2] + lp->args[1] - 1);
@@ -502,7 +1279,7 @@ logdump(void)
 				prt("\t******XXXX");
 			break;
 		case OP_CLONE_RANGE:
-			prt("CLONE 0x%x thru 0x%x\t(0x%x bytes) to 0x%x thru 0x%x",
+			prt("CLONE 0x%llx thru 0x%llx\t(0x%llx bytes) to 0x%llx thru 0x%llx",
 			    lp->args[0], lp->args[0] + lp->args[1] - 1,
 			    lp->args[1],
 			    lp->args[2], lp->args[2] + lp->args[1] - 1);
@@ -516,7 +1293,7 @@ logdump(void)
 				prt("\t******JJJJ");
 			break;
 		case OP_DEDUPE_RANGE:
-			prt("DEDUPE 0x%x thru 0x%x\t(0x%x bytes) to 0x%x thru 0x%x",
+			prt("DEDUPE 0x%llx thru 0x%llx\t(0x%llx bytes) to 0x%llx thru 0x%llx",
 			    lp->args[0], lp->args[0] + lp->args[1] - 1,
 			    lp->args[1],
 			    lp->args[2], lp->args[2] + lp->args[1] - 1);
@@ -530,7 +1307,7 @@ logdump(void)
 				prt("\t******BBBB");
 			break;
 		case OP_COPY_RANGE:
-			prt("COPY 0x%x thru 0x%x\t(0x%x bytes) to 0x%x thru 0x%x",
+			prt("COPY 0x%llx thru 0x%llx\t(0x%llx bytes) to 0x%llx thru 0x%llx",
 			    lp->args[0], lp->args[0] + lp->args[1] - 1,
 			    lp->args[1],
 			    lp->args[2], lp->args[2] + lp->args[1] - 1);
@@ -553,6 +1330,12 @@ logdump(void)
 		}
 
 	    skipped:
+		if (pool && lp->dest_file != lp->file)
+			prt("\n\t\tFILE %d to %d", lp->file, lp->dest_file);
+		else if (pool)
+			prt("\n\t\tFILE %d", lp->file);
+		if (lp->seq)
+			prt("\n\t\tSHARED seq %llu", lp->seq);
 		if (lp->flags & FL_CLOSE_OPEN)
 			prt("\n\t\tCLOSE/OPEN");
 		prt("\n");
@@ -567,13 +1350,19 @@ logdump(void)
 				fprintf(logopsf, "skip ");
 			fprintf(logopsf, "%s", op_name(lp->operation));
 			for (j = 0; j < lp->nr_args; j++)
-				fprintf(logopsf, " 0x%x", lp->args[j]);
+				fprintf(logopsf, " 0x%llx", lp->args[j]);
 			if (lp->flags & FL_KEEP_SIZE)
 				fprintf(logopsf, " keep_size");
 			if (lp->flags & FL_CLOSE_OPEN)
 				fprintf(logopsf, " close_open");
 			if (lp->flags & FL_UNSHARE)
 				fprintf(logopsf, " unshare");
+			if (lp->seq)
+				fprintf(logopsf, " seq=%llu", lp->seq);
+			if (pool)
+				fprintf(logopsf, " file=%d", lp->file);
+			if (pool && lp->nr_args == 4)
+				fprintf(logopsf, " dest=%d", lp->dest_file);
 			if (overlap)
 				fprintf(logopsf, " *");
 			fprintf(logopsf, "\n");
@@ -591,19 +1380,118 @@ logdump(void)
 }
 
 
-void
-save_buffer(char *buffer, off_t bufferlength, int fd)
+/*
+ * --threads support.  Worker N owns the bytes from N * thread_stride to
+ * N * thread_stride + maxfilelen and nobody else touches them.  The shared
+ * range after the private ranges may be used by any worker, so ops touching
+ * it first lock the chunks involved and take a ticket.  The ticket goes into
+ * the oplog so that --replay-ops can run the shared ops of all the workers
+ * in their original order.
+ */
+struct range_lock {
+	unsigned long long	start;
+	unsigned long long	end;		/* 0 if not held */
+};
+
+#define SEQ_UNKNOWN	0ULL			/* running private ops */
+#define SEQ_DONE	ULLONG_MAX		/* worker has finished */
+
+pthread_mutex_t		range_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t		range_cond = PTHREAD_COND_INITIALIZER;
+struct range_lock	*range_locks;		/* one per worker */
+unsigned long long	*replay_seq;		/* next replayed ticket per worker */
+unsigned long long	last_seq;		/* last ticket handed out */
+volatile int		threads_failed;		/* status of the first failure */
+
+static bool
+range_locked(unsigned long long start, unsigned long long end)
+{
+	int i;
+
+	for (i = 0; i < nr_threads; i++)
+		if (i != thread_id && range_locks[i].end &&
+		    range_locks[i].start < end && start < range_locks[i].end)
+			return true;
+	return false;
+}
+
+/* A replayed ticket may run once no other worker can hold an older one. */
+static bool
+replay_turn(unsigned long long seq)
+{
+	int i;
+
+	for (i = 0; i < nr_threads; i++)
+		if (i != thread_id && replay_seq[i] <= seq)
+			return false;
+	return true;
+}
+
+/*
+ * Lock [start, end) of the shared range.  seq is the ticket of a replayed
+ * op, or 0 to hand out a new one.  Returns false if another worker failed
+ * while we were waiting.
+ */
+static bool
+shared_lock(unsigned long long start, unsigned long long end,
+	    unsigned long long seq)
 {
-	off_t ret;
-	ssize_t byteswritten;
+	start = rounddown_64(start, lock_align);
+	end = roundup_64(end, lock_align);
+
+	pthread_mutex_lock(&range_mutex);
+	if (seq) {
+		replay_seq[thread_id] = seq;
+		pthread_cond_broadcast(&range_cond);
+		while (!threads_failed && !replay_turn(seq))
+			pthread_cond_wait(&range_cond, &range_mutex);
+	}
+	while (!threads_failed && range_locked(start, end))
+		pthread_cond_wait(&range_cond, &range_mutex);
+	if (threads_failed) {
+		pthread_mutex_unlock(&range_mutex);
+		return false;
+	}
+	range_locks[thread_id].start = start;
+	range_locks[thread_id].end = end;
+	op_seq = seq ? seq : ++last_seq;
+	pthread_mutex_unlock(&range_mutex);
+	return true;
+}
 
+static void
+shared_unlock(void)
+{
+	if (!op_seq)
+		return;
+	pthread_mutex_lock(&range_mutex);
+	range_locks[thread_id].end = 0;
+	replay_seq[thread_id] = SEQ_UNKNOWN;
+	op_seq = 0;
+	pthread_cond_broadcast(&range_cond);
+	pthread_mutex_unlock(&range_mutex);
+}
+
+static void
+thread_done(int status)
+{
+	pthread_mutex_lock(&range_mutex);
+	if (status && !threads_failed)
+		threads_failed = status;
+	range_locks[thread_id].end = 0;
+	replay_seq[thread_id] = SEQ_DONE;
+	op_seq = 0;
+	pthread_cond_broadcast(&range_cond);
+	pthread_mutex_unlock(&range_mutex);
+}
+
+
+void
+save_buffer(off_t bufferlength, int fd)
+{
 	if (fd <= 0 || bufferlength == 0)
 		return;
 
-	if (bufferlength > SSIZE_MAX) {
-		prt("fsx flaw: overflow in save_buffer\n");
-		exit(67);
-	}
 	if (lite) {
 		off_t size_by_seek = lseek(fd, (off_t)0, SEEK_END);
 		if (size_by_seek == (off_t)-1)
@@ -615,35 +1503,225 @@ save_buffer(char *buffer, off_t bufferlength, int fd)
 		}
 	}
 
-	ret = lseek(fd, (off_t)0, SEEK_SET);
-	if (ret == (off_t)-1)
-		prterr("save_buffer: lseek 0");
-	
-	byteswritten = write(fd, buffer, (size_t)bufferlength);
-	if (byteswritten != bufferlength) {
-		if (byteswritten == -1)
-			prterr("save_buffer write");
-		else
-			warn("save_buffer: short write, 0x%x bytes instead of 0x%llx\n",
-			     (unsigned)byteswritten,
-			     (unsigned long long)bufferlength);
+	save_shadow(fd, bufferlength, "save_buffer");
+}
+
+
+/*
+ * --stats: per op latency histograms of ophist.h, split by the I/O path the
+ * op took.  Each thread counts into its own stats and the reports add them
+ * all up.  A report is a line of JSON, written every --stats-interval
+ * seconds and at the end.  The interval reports are written by the first
+ * thread while the others count, so the stats and histograms are published
+ * with release stores.
+ */
+enum {
+	PATH_BUFFERED,
+	PATH_DIRECT,
+	PATH_AIO,
+	PATH_URING,
+	PATH_MMAP,
+	PATH_NR,
+};
+
+static const char *path_names[] = {
+	[PATH_BUFFERED] = "buffered",
+	[PATH_DIRECT] = "direct",
+	[PATH_AIO] = "aio",
+	[PATH_URING] = "uring",
+	[PATH_MMAP] = "mmap",
+};
+
+struct op_stats {
+	struct op_hist		*hist[OP_MAX_INTEGRITY][PATH_NR];
+};
+
+__thread struct op_stats	*stats;
+struct op_stats		**all_stats;	/* one per thread */
+FILE			*statsf;
+struct timespec		stats_start;
+__thread struct timespec	stats_next;
+
+void
+stats_add(int op, int path, const struct timespec *start)
+{
+	struct op_hist *h = stats->hist[op][path];
+	struct timespec now;
+	unsigned long long ns;
+
+	if (!h) {
+		h = malloc(sizeof(*h));
+		if (!h) {
+			prterr("stats_add: malloc");
+			exit(101);
+		}
+		hist_init(h);
+		__atomic_store_n(&stats->hist[op][path], h, __ATOMIC_RELEASE);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ns = ts_ns(&now) - ts_ns(start);
+	hist_add(h, ns, 0);
+}
+
+/* the histogram thread t has for op and path, NULL if it has none yet */
+static struct op_hist *
+stats_hist(int t, int op, int path)
+{
+	struct op_stats *s = __atomic_load_n(&all_stats[t], __ATOMIC_ACQUIRE);
+
+	return s ? __atomic_load_n(&s->hist[op][path], __ATOMIC_ACQUIRE) : NULL;
+}
+
+/* the path an op on the test file takes */
+int
+stats_path_of(int op)
+{
+	switch (op) {
+	case OP_MAPREAD:
+	case OP_MAPWRITE:
+		return PATH_MMAP;
+	case OP_READ:
+	case OP_READ_DONTCACHE:
+	case OP_WRITE:
+	case OP_WRITE_DONTCACHE:
+		if (aio)
+			return PATH_AIO;
+		if (uring)
+			return PATH_URING;
+		break;
+	}
+	return o_direct ? PATH_DIRECT : PATH_BUFFERED;
+}
+
+void
+stats_report(bool final)
+{
+	static struct op_hist sum;
+	struct timespec now;
+	double secs;
+	unsigned long long total = 0;
+	struct op_hist *h;
+	int op, path, t, b;
+	int nr = nr_threads ? nr_threads : 1;
+	bool first = true;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	secs = (ts_ns(&now) - ts_ns(&stats_start)) / 1e9;
+
+	for (op = 0; op < OP_MAX_INTEGRITY; op++)
+		for (path = 0; path < PATH_NR; path++)
+			for (t = 0; t < nr; t++)
+				if ((h = stats_hist(t, op, path)))
+					total += __atomic_load_n(&h->count,
+							__ATOMIC_RELAXED);
+
+	fprintf(statsf, "{\"time\": %.3f, \"final\": %s, \"ops\": %llu, "
+		"\"ops_per_sec\": %.1f, \"ops_by_type\": [",
+		secs, final ? "true" : "false", total, total / secs);
+
+	for (op = 0; op < OP_MAX_INTEGRITY; op++) {
+		for (path = 0; path < PATH_NR; path++) {
+			hist_init(&sum);
+			for (t = 0; t < nr; t++)
+				if ((h = stats_hist(t, op, path)))
+					hist_sum(&sum, h);
+			if (!sum.count)
+				continue;
+
+			fprintf(statsf, "%s{\"op\": \"%s\", \"path\": \"%s\", "
+				"\"count\": %llu, \"ops_per_sec\": %.1f, "
+				"\"min_ns\": %llu, \"mean_ns\": %llu, "
+				"\"p50_ns\": %llu, \"p90_ns\": %llu, "
+				"\"p99_ns\": %llu, \"p999_ns\": %llu, "
+				"\"max_ns\": %llu, \"buckets\": [",
+				first ? "" : ", ", op_names[op], path_names[path],
+				sum.count, sum.count / secs, sum.min,
+				sum.sum / sum.count,
+				hist_percentile(&sum, 0.5),
+				hist_percentile(&sum, 0.9),
+				hist_percentile(&sum, 0.99),
+				hist_percentile(&sum, 0.999), sum.max);
+			first = false;
+
+			/* [lowest latency in the bucket, count] pairs */
+			t = 0;
+			for (b = 0; b < HIST_BUCKETS; b++) {
+				if (!sum.buckets[b])
+					continue;
+				fprintf(statsf, "%s[%llu, %llu]", t++ ? ", " : "",
+					hist_value(b), sum.buckets[b]);
+			}
+			fprintf(statsf, "]}");
+		}
+	}
+	fprintf(statsf, "]}\n");
+	fflush(statsf);
+}
+
+/* Count an op run by test() unless it was skipped or is still in flight. */
+void
+stats_op(int op, const struct timespec *start)
+{
+	struct log_entry *le = &oplog[(logptr + LOGSIZE - 1) % LOGSIZE];
+	int path = stats_path_of(op);
+
+	if (testcalls <= simulatedopcount || (le->flags & FL_SKIPPED))
+		return;
+	/* the deep queue counts reads and writes as they complete */
+	if (uring_qd && path == PATH_URING)
+		return;
+	stats_add(op, path, start);
+}
+
+/* Set up the stats of this thread, which the reports find as all_stats[id]. */
+void
+stats_init(int id)
+{
+	stats = calloc(1, sizeof(*stats));
+	if (!stats) {
+		prterr("stats_init: calloc");
+		exit(101);
 	}
+	__atomic_store_n(&all_stats[id], stats, __ATOMIC_RELEASE);
+	stats_next = stats_start;
+	stats_next.tv_sec += stats_interval;
 }
 
+/* Write an interval report if one is due; the first thread does them all. */
+void
+stats_tick(void)
+{
+	struct timespec now;
+
+	if (!stats_interval || thread_id > 0)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (now.tv_sec < stats_next.tv_sec)
+		return;
+	stats_report(false);
+	stats_next.tv_sec = now.tv_sec + stats_interval;
+}
 
 void
 report_failure(int status)
 {
 	logdump();
+	binlog_close();
+	if (statsf && thread_id < 0)
+		stats_report(true);
 	
 	if (fsxgoodfd) {
-		if (good_buf) {
-			save_buffer(good_buf, file_size, fsxgoodfd);
-			prt("Correct content saved for comparison\n");
-			prt("(maybe hexdump \"%s\" vs \"%s\")\n",
-			    fname, goodfile);
-		}
+		save_buffer(file_size, fsxgoodfd);
+		prt("Correct content saved for comparison\n");
+		prt("(maybe hexdump \"%s\" vs \"%s\")\n",
+		    fname, goodfile);
 		close(fsxgoodfd);
+		fsxgoodfd = 0;
+	}
+	if (thread_id >= 0) {
+		/* let the other workers stop and dump their logs too */
+		thread_done(status);
+		pthread_exit(NULL);
 	}
 	exit(status);
 }
@@ -673,9 +1751,6 @@ dump_fsync_buffer(void)
 	char fname_buffer[PATH_MAX];
 	int good_fd;
 
-	if (!good_buf)
-		return;
-
 	snprintf(fname_buffer, sizeof(fname_buffer), "%s%s.mark%d", dname,
 		 bname, mark_nr);
 	good_fd = open(fname_buffer, O_WRONLY|O_CREAT|O_TRUNC, 0666);
@@ -684,51 +1759,61 @@ dump_fsync_buffer(void)
 		exit(212);
 	}
 
-	save_buffer(good_buf, file_size, good_fd);
+	save_buffer(file_size, good_fd);
 	close(good_fd);
 	prt("Dumped fsync buffer to %s\n", fname_buffer + dirpath);
 }
 
 void
-check_buffers(char *buf, unsigned offset, unsigned size)
+check_buffers(char *buf, unsigned long long offset, unsigned size)
 {
-	unsigned char c, t;
 	unsigned i = 0;
 	unsigned n = 0;
 	unsigned op = 0;
 	unsigned bad = 0;
+	char *good;
 
-	if (memcmp(good_buf + offset, buf, size) != 0) {
-		prt("READ BAD DATA: offset = 0x%x, size = 0x%x, fname = %s\n",
+	if (shadow_cmp(offset, buf, size) != 0) {
+		prt("READ BAD DATA: offset = 0x%llx, size = 0x%x, fname = %s\n",
 		    offset, size, fname);
 		prt("%-10s  %-6s  %-6s  %s\n", "OFFSET", "GOOD", "BAD", "RANGE");
-		while (size > 0) {
-			c = good_buf[offset];
-			t = buf[i];
-			if (c != t) {
-			        if (n < 16) {
-					bad = short_at(&buf[i]);
-				        prt("0x%-8x  0x%04x  0x%04x  0x%x\n",
-					    offset,
-					    short_at(&good_buf[offset]), bad,
-					    n);
-					op = buf[offset & 1 ? i+1 : i];
-					if (op)
-						prt("operation# (mod 256) for "
-						  "the bad data may be %u\n",
-						((unsigned)op & 0xff));
-					else
-						prt("operation# (mod 256) for "
-						  "the bad data unknown, check"
-						  " HOLE and EXTEND ops\n");
-				}
-				n++;
-				badoff = offset;
+		/* one extra byte so short_at() can look past the last one */
+		good = malloc(size + 1);
+		if (!good) {
+			prterr("check_buffers: malloc");
+			report_failure(110);
+		}
+		shadow_read(offset, good, size + 1);
+		while (i < size) {
+			unsigned skip = first_mismatch(&good[i], &buf[i],
+						       size - i);
+
+			offset += skip;
+			i += skip;
+			if (i == size)
+				break;
+			if (n < 16) {
+				bad = short_at(&buf[i]);
+				prt("0x%-8llx  0x%04x  0x%04x  0x%x\n",
+				    offset,
+				    short_at(&good[i]), bad,
+				    n);
+				op = buf[offset & 1 ? i+1 : i];
+				if (op)
+					prt("operation# (mod 256) for "
+					  "the bad data may be %u\n",
+					((unsigned)op & 0xff));
+				else
+					prt("operation# (mod 256) for "
+					  "the bad data unknown, check"
+					  " HOLE and EXTEND ops\n");
 			}
+			n++;
+			badoff = offset;
 			offset++;
 			i++;
-			size--;
 		}
+		free(good);
 		report_failure(110);
 	}
 }
@@ -778,7 +1863,7 @@ ftruncate_err:
 }
 
 void
-doflush(unsigned offset, unsigned size)
+doflush(unsigned long long offset, unsigned size)
 {
 	unsigned pg_offset;
 	unsigned map_size;
@@ -807,7 +1892,7 @@ doflush(unsigned offset, unsigned size)
 }
 
 void
-doread(unsigned offset, unsigned size, int flags)
+doread(unsigned long long offset, unsigned size, int flags)
 {
 	unsigned iret;
 
@@ -838,8 +1923,13 @@ doread(unsigned offset, unsigned size, int flags)
 		       (monitorstart == -1 ||
 			(offset + size > monitorstart &&
 			(monitorend == -1 || offset <= monitorend))))))
-		prt("%lld read\t0x%x thru\t0x%x\t(0x%x bytes)\n", testcalls,
+		prt("%lld read\t0x%llx thru\t0x%llx\t(0x%x bytes)\n", testcalls,
 		    offset, offset + size - 1, size);
+	if (uring_qd) {
+		/* checked against the model when it completes */
+		uring_queue(READ, NULL, size, offset, flags, op_seq != 0);
+		return;
+	}
 	iret = fsxread(fd, temp_buf, size, offset, flags);
 	if (iret != size) {
 		if (iret == -1)
@@ -853,7 +1943,7 @@ doread(unsigned offset, unsigned size, int flags)
 }
 
 void
-check_eofpage(char *s, unsigned offset, char *p, int size)
+check_eofpage(char *s, unsigned long long offset, char *p, int size)
 {
 	unsigned long last_page, should_be_zero;
 
@@ -878,22 +1968,92 @@ check_eofpage(char *s, unsigned offset, char *p, int size)
 		}
 }
 
-void
-check_contents(void)
+/*
+ * Skip over ranges that are holes both in the model and in the test file,
+ * there is nothing to compare there.  Returns the first offset at or after
+ * off where either of them may have data.
+ */
+static unsigned long long
+check_next_data(unsigned long long off)
 {
-	static char *check_buf;
-	unsigned offset = 0;
-	unsigned size = file_size;
-	unsigned map_offset;
-	unsigned map_size;
-	char *p;
+#ifdef SEEK_DATA
+	unsigned long long idx, next = ULLONG_MAX;
+	off_t data;
+
+	if (shadow_find(off >> SHADOW_CHUNK_SHIFT, 1, &idx))
+		next = MAX(off, idx << SHADOW_CHUNK_SHIFT);
+	data = lseek(fd, off, SEEK_DATA);
+	if (data == (off_t)-1) {
+		if (errno != ENXIO)
+			return off;
+	} else {
+		next = MIN(next, data);
+	}
+	return next;
+#else
+	return off;
+#endif
+}
+
+/* Compare [start, end) of the file to the model. */
+static void
+check_range(unsigned long long start, unsigned long long end)
+{
+	static __thread char *check_buf;
+	static __thread unsigned check_len;
+	unsigned long long offset;
 	unsigned iret;
 
 	if (!check_buf) {
-		check_buf = (char *) malloc(maxfilelen + writebdy);
+		check_len = rounddown_64(MAX(1024 * 1024, readbdy), readbdy);
+		check_buf = (char *) malloc(check_len + writebdy);
 		assert(check_buf != NULL);
 		check_buf = round_ptr_up(check_buf, writebdy, 0);
-		memset(check_buf, '\0', maxfilelen);
+		memset(check_buf, '\0', check_len);
+	}
+
+	/* The file may be huge, so compare it a piece at a time. */
+	for (offset = start; offset < end; offset += check_len) {
+		unsigned len;
+
+		offset = MAX(start,
+			     rounddown_64(check_next_data(offset), check_len));
+		if (offset >= end)
+			break;
+		len = MIN(check_len, end - offset);
+		iret = fsxread(fd, check_buf, len, offset, 0);
+		if (iret != len) {
+			if (iret == -1)
+				prterr("check_contents: read");
+			else
+				prt("short check read: 0x%x bytes instead of 0x%x\n",
+				    iret, len);
+			report_failure(141);
+		}
+		check_buffers(check_buf, offset, len);
+	}
+}
+
+void
+check_contents(void)
+{
+	unsigned long long size = file_size;
+	unsigned long long map_offset;
+	unsigned map_size;
+	char *p;
+
+	if (thread_id >= 0) {
+		/* our own range, then the shared one; no EOF page to check */
+		size = range_base + maxfilelen;
+		if (o_direct)
+			size -= size % readbdy;
+		check_range(range_base, size);
+		if (shared_len &&
+		    shared_lock(shared_base, shared_base + shared_len, 0)) {
+			check_range(shared_base, shared_base + shared_len);
+			shared_unlock();
+		}
+		return;
 	}
 
 	if (o_direct)
@@ -901,16 +2061,7 @@ check_contents(void)
 	if (size == 0)
 		return;
 
-	iret = fsxread(fd, check_buf, size, offset, 0);
-	if (iret != size) {
-		if (iret == -1)
-			prterr("check_contents: read");
-		else
-			prt("short check read: 0x%x bytes instead of 0x%x\n",
-			    iret, size);
-		report_failure(141);
-	}
-	check_buffers(check_buf, offset, size);
+	check_range(0, size);
 
 	/* Map eof page, check it */
 	map_offset = size - (size & PAGE_MASK);
@@ -932,7 +2083,7 @@ check_contents(void)
 }
 
 void
-domapread(unsigned offset, unsigned size)
+domapread(unsigned long long offset, unsigned size)
 {
 	unsigned pg_offset;
 	unsigned map_size;
@@ -963,7 +2114,7 @@ domapread(unsigned offset, unsigned size)
 		       (monitorstart == -1 ||
 			(offset + size > monitorstart &&
 			(monitorend == -1 || offset <= monitorend))))))
-		prt("%lld mapread\t0x%x thru\t0x%x\t(0x%x bytes)\n", testcalls,
+		prt("%lld mapread\t0x%llx thru\t0x%llx\t(0x%x bytes)\n", testcalls,
 		    offset, offset + size - 1, size);
 
 	pg_offset = offset & PAGE_MASK;
@@ -987,18 +2138,29 @@ domapread(unsigned offset, unsigned size)
 }
 
 
+/*
+ * Fill buf with the data for file offset onwards.  The original data pattern
+ * repeats every original_len bytes so that its size doesn't scale with the
+ * size of the file.
+ */
 void
-gendata(char *original_buf, char *good_buf, unsigned offset, unsigned size)
+gendata(char *buf, unsigned long long offset, unsigned size)
 {
-	while (size--) {
-		if (filldata) {
-			good_buf[offset] = filldata;
-		} else {
-			good_buf[offset] = testcalls % 256;
-			if (offset % 2)
-				good_buf[offset] += original_buf[offset];
-		}
-		offset++;
+	if (filldata) {
+		memset(buf, filldata, size);
+		return;
+	}
+
+	/* original_buf repeats every original_len bytes */
+	while (size) {
+		unsigned long pos = offset % original_len;
+		unsigned n = MIN(size, original_len - pos);
+
+		pattern_fill(buf, original_buf + pos, n, offset & 1,
+			     testcalls % 256);
+		buf += n;
+		offset += n;
+		size -= n;
 	}
 }
 
@@ -1009,9 +2171,9 @@ gendata(char *original_buf, char *good_buf, unsigned offset, unsigned size)
  * be detected.
  */
 void
-pollute_eofpage(unsigned int maxoff)
+pollute_eofpage(unsigned long long maxoff)
 {
-	unsigned offset = file_size;
+	unsigned long long offset = file_size;
 	unsigned pg_offset;
 	unsigned write_size;
 	char    *p;
@@ -1037,7 +2199,7 @@ pollute_eofpage(unsigned int maxoff)
 	     (monitorstart == -1 ||
 	     (offset + write_size > monitorstart &&
 	      (monitorend == -1 || offset <= monitorend)))))) {
-		prt("%lld pollute_eof\t0x%x thru\t0x%x\t(0x%x bytes)\n",
+		prt("%lld pollute_eof\t0x%llx thru\t0x%llx\t(0x%x bytes)\n",
 			testcalls, offset, offset + write_size - 1, write_size);
 	}
 
@@ -1053,7 +2215,7 @@ pollute_eofpage(unsigned int maxoff)
 	 * good buffer because the upcoming operation is expected to zero this
 	 * range of the file.
 	 */
-	gendata(original_buf, p, pg_offset, write_size);
+	gendata(p + pg_offset, pg_offset, write_size);
 
 	if (munmap(p, PAGE_SIZE) != 0)
 		prterr("pollute_eofpage: munmap");
@@ -1064,19 +2226,31 @@ pollute_eofpage(unsigned int maxoff)
  * EOF, zero the range from EOF to offset in the good buffer.
  */
 void
-update_file_size(unsigned offset, unsigned size)
+update_file_size(unsigned long long offset, unsigned long long size)
 {
 	if (offset > file_size) {
 		pollute_eofpage(offset + size);
-		memset(good_buf + file_size, '\0', offset - file_size);
+		shadow_zero(file_size, offset - file_size);
 	}
 	file_size = offset + size;
 }
 
+/* update_file_size() for the destination of a two file op */
+void
+update_dest_size(unsigned long long offset, unsigned long long size)
+{
+	int src = cur_file;
+
+	pool_switch(dest_file);
+	update_file_size(offset, size);
+	pool_switch(src);
+}
+
 void
-dowrite(unsigned offset, unsigned size, int flags)
+dowrite(unsigned long long offset, unsigned size, int flags)
 {
 	unsigned iret;
+	bool extending = offset + size > file_size;
 
 	offset -= offset % writebdy;
 	if (o_direct)
@@ -1090,7 +2264,11 @@ dowrite(unsigned offset, unsigned size, int flags)
 
 	log4(OP_WRITE, offset, size, FL_NONE);
 
-	gendata(original_buf, good_buf, offset, size);
+	/* reads still in flight must be checked against the old contents */
+	if (uring_qd)
+		uring_wait_overlap(WRITE, offset, size);
+	gendata(write_buf, offset, size);
+	shadow_write(offset, write_buf, size);
 	if (offset + size > file_size) {
 		update_file_size(offset, size);
 		if (lite) {
@@ -1108,16 +2286,25 @@ dowrite(unsigned offset, unsigned size, int flags)
 		       (monitorstart == -1 ||
 			(offset + size > monitorstart &&
 			(monitorend == -1 || offset <= monitorend))))))
-		prt("%lld write\t0x%x thru\t0x%x\t(0x%x bytes)\tdontcache=%d\n", testcalls,
+		prt("%lld write\t0x%llx thru\t0x%llx\t(0x%x bytes)\tdontcache=%d\n", testcalls,
 		    offset, offset + size - 1, size, (flags & RWF_DONTCACHE) != 0);
-	iret = fsxwrite(fd, good_buf + offset, size, offset, flags);
-	if (iret != size) {
-		if (iret == -1)
-			prterr("dowrite: write");
-		else
-			prt("short write: 0x%x bytes instead of 0x%x\n",
-			    iret, size);
-		report_failure(151);
+	if (uring_qd) {
+		/*
+		 * Size changes have to be visible before the next op looks at
+		 * the file, and so do writes we are about to fsync or flush.
+		 */
+		uring_queue(WRITE, write_buf, size, offset, flags,
+			    extending || op_seq || do_fsync || flush);
+	} else {
+		iret = fsxwrite(fd, write_buf, size, offset, flags);
+		if (iret != size) {
+			if (iret == -1)
+				prterr("dowrite: write");
+			else
+				prt("short write: 0x%x bytes instead of 0x%x\n",
+				    iret, size);
+			report_failure(151);
+		}
 	}
 	if (do_fsync) {
 		if (fsync(fd)) {
@@ -1132,7 +2319,7 @@ dowrite(unsigned offset, unsigned size, int flags)
 
 
 void
-domapwrite(unsigned offset, unsigned size)
+domapwrite(unsigned long long offset, unsigned size)
 {
 	unsigned pg_offset;
 	unsigned map_size;
@@ -1150,7 +2337,8 @@ domapwrite(unsigned offset, unsigned size)
 
 	log4(OP_MAPWRITE, offset, size, FL_NONE);
 
-	gendata(original_buf, good_buf, offset, size);
+	gendata(write_buf, offset, size);
+	shadow_write(offset, write_buf, size);
 	if (offset + size > file_size) {
 		update_file_size(offset, size);
 		if (lite) {
@@ -1168,7 +2356,7 @@ domapwrite(unsigned offset, unsigned size)
 		       (monitorstart == -1 ||
 			(offset + size > monitorstart &&
 			(monitorend == -1 || offset <= monitorend))))))
-		prt("%lld mapwrite\t0x%x thru\t0x%x\t(0x%x bytes)\n", testcalls,
+		prt("%lld mapwrite\t0x%llx thru\t0x%llx\t(0x%x bytes)\n", testcalls,
 		    offset, offset + size - 1, size);
 
 	if (file_size > cur_filesize) {
@@ -1186,7 +2374,7 @@ domapwrite(unsigned offset, unsigned size)
 	        prterr("domapwrite: mmap");
 		report_failure(202);
 	}
-	memcpy(p + pg_offset, good_buf + offset, size);
+	memcpy(p + pg_offset, write_buf, size);
 	if (msync(p, map_size, MS_SYNC) != 0) {
 		prterr("domapwrite: msync");
 		report_failure(203);
@@ -1202,22 +2390,24 @@ domapwrite(unsigned offset, unsigned size)
 
 
 void
-dotruncate(unsigned size)
+dotruncate(unsigned long long size)
 {
-	int oldsize = file_size;
+	unsigned long long oldsize = file_size;
 
 	size -= size % truncbdy;
 	if (size > biggest) {
 		biggest = size;
 		if (!quiet && testcalls > simulatedopcount)
-			prt("truncating to largest ever: 0x%x\n", size);
+			prt("truncating to largest ever: 0x%llx\n", size);
 	}
 
 	log4(OP_TRUNCATE, 0, size, FL_NONE);
 
 	/* pollute the current EOF before a truncate down */
-	if (size < file_size)
+	if (size < file_size) {
 		pollute_eofpage(maxfilelen);
+		shadow_zero(size, file_size - size);
+	}
 	update_file_size(size, 0);
 
 	if (testcalls <= simulatedopcount)
@@ -1226,10 +2416,10 @@ dotruncate(unsigned size)
 	if ((progressinterval && testcalls % progressinterval == 0) ||
 	    (debug && (monitorstart == -1 || monitorend == -1 ||
 		      size <= monitorend)))
-		prt("%lld trunc\tfrom 0x%x to 0x%x\n", testcalls, oldsize,
+		prt("%lld trunc\tfrom 0x%llx to 0x%llx\n", testcalls, oldsize,
 				size);
 	if (ftruncate(fd, (off_t)size) == -1) {
-	        prt("ftruncate1: %x\n", size);
+	        prt("ftruncate1: %llx\n", size);
 		prterr("dotruncate: ftruncate");
 		report_failure(160);
 	}
@@ -1237,11 +2427,11 @@ dotruncate(unsigned size)
 
 #ifdef FALLOC_FL_PUNCH_HOLE
 void
-do_punch_hole(unsigned offset, unsigned length)
+do_punch_hole(unsigned long long offset, unsigned length)
 {
-	unsigned end_offset;
-	int max_offset = 0;
-	int max_len = 0;
+	unsigned long long end_offset;
+	unsigned long long max_offset = 0;
+	unsigned long long max_len = 0;
 	int mode = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
 
 	if (length == 0) {
@@ -1268,11 +2458,11 @@ do_punch_hole(unsigned offset, unsigned length)
 	if ((progressinterval && testcalls % progressinterval == 0) ||
 	    (debug && (monitorstart == -1 || monitorend == -1 ||
 		      end_offset <= monitorend))) {
-		prt("%lld punch\tfrom 0x%x to 0x%x, (0x%x bytes)\n", testcalls,
+		prt("%lld punch\tfrom 0x%llx to 0x%llx, (0x%x bytes)\n", testcalls,
 			offset, offset+length, length);
 	}
 	if (fallocate(fd, mode, (loff_t)offset, (loff_t)length) == -1) {
-		prt("punch hole: 0x%x to 0x%x\n", offset, offset + length);
+		prt("punch hole: 0x%llx to 0x%llx\n", offset, offset + length);
 		prterr("do_punch_hole: fallocate");
 		report_failure(161);
 	}
@@ -1281,12 +2471,12 @@ do_punch_hole(unsigned offset, unsigned length)
 	max_offset = offset < file_size ? offset : file_size;
 	max_len = max_offset + length <= file_size ? length :
 			file_size - max_offset;
-	memset(good_buf + max_offset, '\0', max_len);
+	shadow_zero(max_offset, max_len);
 }
 
 #else
 void
-do_punch_hole(unsigned offset, unsigned length)
+do_punch_hole(unsigned long long offset, unsigned length)
 {
 	return;
 }
@@ -1294,9 +2484,9 @@ do_punch_hole(unsigned offset, unsigned length)
 
 #ifdef FALLOC_FL_ZERO_RANGE
 void
-do_zero_range(unsigned offset, unsigned length, int keep_size)
+do_zero_range(unsigned long long offset, unsigned length, int keep_size)
 {
-	unsigned end_offset;
+	unsigned long long end_offset;
 	int mode = FALLOC_FL_ZERO_RANGE;
 
 	if (keep_size)
@@ -1315,7 +2505,7 @@ do_zero_range(unsigned offset, unsigned length, int keep_size)
 	if (end_offset > biggest) {
 		biggest = end_offset;
 		if (!quiet && testcalls > simulatedopcount)
-			prt("zero_range to largest ever: 0x%x\n", end_offset);
+			prt("zero_range to largest ever: 0x%llx\n", end_offset);
 	}
 
 	/*
@@ -1336,21 +2526,21 @@ do_zero_range(unsigned offset, unsigned length, int keep_size)
 	if ((progressinterval && testcalls % progressinterval == 0) ||
 	    (debug && (monitorstart == -1 || monitorend == -1 ||
 		      end_offset <= monitorend))) {
-		prt("%lld zero\tfrom 0x%x to 0x%x, (0x%x bytes)\n", testcalls,
+		prt("%lld zero\tfrom 0x%llx to 0x%llx, (0x%x bytes)\n", testcalls,
 			offset, offset+length, length);
 	}
 	if (fallocate(fd, mode, (loff_t)offset, (loff_t)length) == -1) {
-		prt("zero range: 0x%x to 0x%x\n", offset, offset + length);
+		prt("zero range: 0x%llx to 0x%llx\n", offset, offset + length);
 		prterr("do_zero_range: fallocate");
 		report_failure(161);
 	}
 
-	memset(good_buf + offset, '\0', length);
+	shadow_zero(offset, length);
 }
 
 #else
 void
-do_zero_range(unsigned offset, unsigned length, int keep_size)
+do_zero_range(unsigned long long offset, unsigned length, int keep_size)
 {
 	return;
 }
@@ -1358,9 +2548,9 @@ do_zero_range(unsigned offset, unsigned length, int keep_size)
 
 #ifdef FALLOC_FL_COLLAPSE_RANGE
 void
-do_collapse_range(unsigned offset, unsigned length)
+do_collapse_range(unsigned long long offset, unsigned length)
 {
-	unsigned end_offset;
+	unsigned long long end_offset;
 	int mode = FALLOC_FL_COLLAPSE_RANGE;
 
 	if (length == 0) {
@@ -1389,23 +2579,23 @@ do_collapse_range(unsigned offset, unsigned length)
 	if ((progressinterval && testcalls % progressinterval == 0) ||
 	    (debug && (monitorstart == -1 || monitorend == -1 ||
 		      end_offset <= monitorend))) {
-		prt("%lld collapse\tfrom 0x%x to 0x%x, (0x%x bytes)\n",
+		prt("%lld collapse\tfrom 0x%llx to 0x%llx, (0x%x bytes)\n",
 				testcalls, offset, offset+length, length);
 	}
 	if (fallocate(fd, mode, (loff_t)offset, (loff_t)length) == -1) {
-		prt("collapse range: 0x%x to 0x%x\n", offset, offset + length);
+		prt("collapse range: 0x%llx to 0x%llx\n", offset, offset + length);
 		prterr("do_collapse_range: fallocate");
 		report_failure(161);
 	}
 
-	memmove(good_buf + offset, good_buf + end_offset,
-		file_size - end_offset);
+	shadow_move(offset, end_offset, file_size - end_offset);
+	shadow_zero(file_size - length, length);
 	file_size -= length;
 }
 
 #else
 void
-do_collapse_range(unsigned offset, unsigned length)
+do_collapse_range(unsigned long long offset, unsigned length)
 {
 	return;
 }
@@ -1413,9 +2603,9 @@ do_collapse_range(unsigned offset, unsigned length)
 
 #ifdef FALLOC_FL_INSERT_RANGE
 void
-do_insert_range(unsigned offset, unsigned length)
+do_insert_range(unsigned long long offset, unsigned length)
 {
-	unsigned end_offset;
+	unsigned long long end_offset;
 	int mode = FALLOC_FL_INSERT_RANGE;
 
 	if (length == 0) {
@@ -1444,30 +2634,50 @@ do_insert_range(unsigned offset, unsigned length)
 	if ((progressinterval && testcalls % progressinterval == 0) ||
 	    (debug && (monitorstart == -1 || monitorend == -1 ||
 		      end_offset <= monitorend))) {
-		prt("%lld insert\tfrom 0x%x to 0x%x, (0x%x bytes)\n", testcalls,
+		prt("%lld insert\tfrom 0x%llx to 0x%llx, (0x%x bytes)\n", testcalls,
 			offset, offset+length, length);
 	}
 	if (fallocate(fd, mode, (loff_t)offset, (loff_t)length) == -1) {
-		prt("insert range: 0x%x to 0x%x\n", offset, offset + length);
+		prt("insert range: 0x%llx to 0x%llx\n", offset, offset + length);
 		prterr("do_insert_range: fallocate");
 		report_failure(161);
 	}
 
-	memmove(good_buf + end_offset, good_buf + offset,
-		file_size - offset);
-	memset(good_buf + offset, '\0', length);
+	shadow_move(end_offset, offset, file_size - offset);
+	shadow_zero(offset, length);
 	file_size += length;
 }
 
 #else
 void
-do_insert_range(unsigned offset, unsigned length)
+do_insert_range(unsigned long long offset, unsigned length)
 {
 	return;
 }
 #endif
 
 #ifdef XFS_IOC_EXCHANGE_RANGE
+/* Swap len bytes at off in the current file with those at dst in dest_file. */
+static void
+shadow_exchange(unsigned long long off, unsigned long long dst,
+		unsigned long long len)
+{
+	static char a[SHADOW_CHUNK], b[SHADOW_CHUNK];
+	struct shadow_node *src_root = shadow_root;
+	unsigned long long n;
+
+	for (; len; len -= n, off += n, dst += n) {
+		n = MIN(len, SHADOW_CHUNK);
+		shadow_read(off, a, n);
+		shadow_root = pool[dest_file].shadow;
+		shadow_read(dst, b, n);
+		shadow_write(dst, a, n);
+		pool[dest_file].shadow = shadow_root;
+		shadow_root = src_root;
+		shadow_write(off, b, n);
+	}
+}
+
 int
 test_exchange_range(void)
 {
@@ -1491,7 +2701,7 @@ test_exchange_range(void)
 }
 
 void
-do_exchange_range(unsigned offset, unsigned length, unsigned dest)
+do_exchange_range(unsigned long long offset, unsigned length, unsigned long long dest)
 {
 	struct xfs_exchange_range	fsr = {
 		.file1_fd = fd,
@@ -1508,7 +2718,7 @@ do_exchange_range(unsigned offset, unsigned length, unsigned dest)
 		return;
 	}
 
-	if ((loff_t)offset >= file_size || (loff_t)dest >= file_size) {
+	if ((loff_t)offset >= file_size || (loff_t)dest >= dest_size()) {
 		if (!quiet && testcalls > simulatedopcount)
 			prt("skipping exchange range behind EOF\n");
 		log5(OP_EXCHANGE_RANGE, offset, length, dest, FL_SKIPPED);
@@ -1531,21 +2741,25 @@ do_exchange_range(unsigned offset, unsigned length, unsigned dest)
 	if ((progressinterval && testcalls % progressinterval == 0) ||
 	    (debug && (monitorstart == -1 || monitorend == -1 ||
 		       dest <= monitorstart || dest + length <= monitorend))) {
-		prt("%lu swap\tfrom 0x%x to 0x%x, (0x%x bytes) at 0x%x\n",
+		prt("%lld swap\tfrom 0x%llx to 0x%llx, (0x%x bytes) at 0x%llx\n",
 			testcalls, offset, offset+length, length, dest);
 	}
 
-	if (ioctl(fd, XFS_IOC_EXCHANGE_RANGE, &fsr) == -1) {
-		prt("exchange range: 0x%x to 0x%x at 0x%x\n", offset,
+	if (ioctl(dest_fd(), XFS_IOC_EXCHANGE_RANGE, &fsr) == -1) {
+		prt("exchange range: 0x%llx to 0x%llx at 0x%llx\n", offset,
 				offset + length, dest);
 		prterr("do_exchange_range: XFS_IOC_EXCHANGE_RANGE");
 		report_failure(161);
 		goto out_free;
 	}
 
-	memcpy(p, good_buf + offset, length);
-	memcpy(good_buf + offset, good_buf + dest, length);
-	memcpy(good_buf + dest, p, length);
+	if (cross_file()) {
+		shadow_exchange(offset, dest, length);
+		goto out_free;
+	}
+	shadow_read(offset, p, length);
+	shadow_move(offset, dest, length);
+	shadow_write(dest, p, length);
 out_free:
 	free(p);
 }
@@ -1558,7 +2772,7 @@ test_exchange_range(void)
 }
 
 void
-do_exchange_range(unsigned offset, unsigned length, unsigned dest)
+do_exchange_range(unsigned long long offset, unsigned length, unsigned long long dest)
 {
 	return;
 }
@@ -1585,7 +2799,7 @@ test_clone_range(void)
 }
 
 void
-do_clone_range(unsigned offset, unsigned length, unsigned dest)
+do_clone_range(unsigned long long offset, unsigned length, unsigned long long dest)
 {
 	struct file_clone_range	fcr = {
 		.src_fd = fd,
@@ -1611,13 +2825,13 @@ do_clone_range(unsigned offset, unsigned length, unsigned dest)
 	if (dest + length > biggest) {
 		biggest = dest + length;
 		if (!quiet && testcalls > simulatedopcount)
-			prt("cloning to largest ever: 0x%x\n", dest + length);
+			prt("cloning to largest ever: 0x%llx\n", dest + length);
 	}
 
 	log5(OP_CLONE_RANGE, offset, length, dest, FL_NONE);
 
-	if (dest + length > file_size)
-		update_file_size(dest, length);
+	if (dest + length > dest_size())
+		update_dest_size(dest, length);
 
 	if (testcalls <= simulatedopcount)
 		return;
@@ -1625,18 +2839,18 @@ do_clone_range(unsigned offset, unsigned length, unsigned dest)
 	if ((progressinterval && testcalls % progressinterval == 0) ||
 	    (debug && (monitorstart == -1 || monitorend == -1 ||
 		       dest <= monitorstart || dest + length <= monitorend))) {
-		prt("%lu clone\tfrom 0x%x to 0x%x, (0x%x bytes) at 0x%x\n",
+		prt("%lld clone\tfrom 0x%llx to 0x%llx, (0x%x bytes) at 0x%llx\n",
 			testcalls, offset, offset+length, length, dest);
 	}
 
-	if (ioctl(fd, FICLONERANGE, &fcr) == -1) {
-		prt("clone range: 0x%x to 0x%x at 0x%x\n", offset,
+	if (ioctl(dest_fd(), FICLONERANGE, &fcr) == -1) {
+		prt("clone range: 0x%llx to 0x%llx at 0x%llx\n", offset,
 				offset + length, dest);
 		prterr("do_clone_range: FICLONERANGE");
 		report_failure(161);
 	}
 
-	memcpy(good_buf + dest, good_buf + offset, length);
+	shadow_clone(dest, offset, length);
 }
 
 #else
@@ -1647,7 +2861,7 @@ test_clone_range(void)
 }
 
 void
-do_clone_range(unsigned offset, unsigned length, unsigned dest)
+do_clone_range(unsigned long long offset, unsigned length, unsigned long long dest)
 {
 	return;
 }
@@ -1710,7 +2924,7 @@ test_dedupe_range(void)
 }
 
 void
-do_dedupe_range(unsigned offset, unsigned length, unsigned dest)
+do_dedupe_range(unsigned long long offset, unsigned length, unsigned long long dest)
 {
 	struct file_dedupe_range *fdr;
 
@@ -1736,7 +2950,7 @@ do_dedupe_range(unsigned offset, unsigned length, unsigned dest)
 	if ((progressinterval && testcalls % progressinterval == 0) ||
 	    (debug && (monitorstart == -1 || monitorend == -1 ||
 		       dest <= monitorstart || dest + length <= monitorend))) {
-		prt("%lu dedupe\tfrom 0x%x to 0x%x, (0x%x bytes) at 0x%x\n",
+		prt("%lld dedupe\tfrom 0x%llx to 0x%llx, (0x%x bytes) at 0x%llx\n",
 			testcalls, offset, offset+length, length, dest);
 	}
 
@@ -1752,17 +2966,17 @@ do_dedupe_range(unsigned offset, unsigned length, unsigned dest)
 	fdr->src_offset = offset;
 	fdr->src_length = length;
 	fdr->dest_count = 1;
-	fdr->info[0].dest_fd = fd;
+	fdr->info[0].dest_fd = dest_fd();
 	fdr->info[0].dest_offset = dest;
 
 	if (ioctl(fd, FIDEDUPERANGE, fdr) == -1) {
-		prt("dedupe range: 0x%x to 0x%x at 0x%x\n", offset,
+		prt("dedupe range: 0x%llx to 0x%llx at 0x%llx\n", offset,
 				offset + length, dest);
 		prterr("do_dedupe_range(0): FIDEDUPERANGE");
 		report_failure(161);
 	} else if (fdr->info[0].status < 0) {
 		errno = -fdr->info[0].status;
-		prt("dedupe range: 0x%x to 0x%x at 0x%x\n", offset,
+		prt("dedupe range: 0x%llx to 0x%llx at 0x%llx\n", offset,
 				offset + length, dest);
 		prterr("do_dedupe_range(1): FIDEDUPERANGE");
 		report_failure(161);
@@ -1779,7 +2993,7 @@ test_dedupe_range(void)
 }
 
 void
-do_dedupe_range(unsigned offset, unsigned length, unsigned dest)
+do_dedupe_range(unsigned long long offset, unsigned length, unsigned long long dest)
 {
 	return;
 }
@@ -1804,7 +3018,7 @@ test_copy_range(void)
 }
 
 void
-do_copy_range(unsigned offset, unsigned length, unsigned dest)
+do_copy_range(unsigned long long offset, unsigned length, unsigned long long dest)
 {
 	loff_t o1, o2;
 	size_t olen;
@@ -1828,13 +3042,13 @@ do_copy_range(unsigned offset, unsigned length, unsigned dest)
 	if (dest + length > biggest) {
 		biggest = dest + length;
 		if (!quiet && testcalls > simulatedopcount)
-			prt("copying to largest ever: 0x%x\n", dest + length);
+			prt("copying to largest ever: 0x%llx\n", dest + length);
 	}
 
 	log5(OP_COPY_RANGE, offset, length, dest, FL_NONE);
 
-	if (dest + length > file_size)
-		update_file_size(dest, length);
+	if (dest + length > dest_size())
+		update_dest_size(dest, length);
 
 	if (testcalls <= simulatedopcount)
 		return;
@@ -1842,7 +3056,7 @@ do_copy_range(unsigned offset, unsigned length, unsigned dest)
 	if ((progressinterval && testcalls % progressinterval == 0) ||
 	    (debug && (monitorstart == -1 || monitorend == -1 ||
 		       dest <= monitorstart || dest + length <= monitorend))) {
-		prt("%lu copy\tfrom 0x%x to 0x%x, (0x%x bytes) at 0x%x\n",
+		prt("%lld copy\tfrom 0x%llx to 0x%llx, (0x%x bytes) at 0x%llx\n",
 			testcalls, offset, offset+length, length, dest);
 	}
 
@@ -1851,12 +3065,13 @@ do_copy_range(unsigned offset, unsigned length, unsigned dest)
 	olen = length;
 
 	while (olen > 0) {
-		nr = syscall(__NR_copy_file_range, fd, &o1, fd, &o2, olen, 0);
+		nr = syscall(__NR_copy_file_range, fd, &o1, dest_fd(), &o2,
+			     olen, 0);
 		if (nr < 0) {
 			if (errno != EAGAIN || tries++ >= 300)
 				break;
 		} else if (nr > olen) {
-			prt("copy range: 0x%x to 0x%x at 0x%x\n", offset,
+			prt("copy range: 0x%llx to 0x%llx at 0x%llx\n", offset,
 					offset + length, dest);
 			prt("do_copy_range: asked %u, copied %u??\n",
 					olen, nr);
@@ -1865,13 +3080,13 @@ do_copy_range(unsigned offset, unsigned length, unsigned dest)
 			olen -= nr;
 	}
 	if (nr < 0) {
-		prt("copy range: 0x%x to 0x%x at 0x%x\n", offset,
+		prt("copy range: 0x%llx to 0x%llx at 0x%llx\n", offset,
 				offset + length, dest);
 		prterr("do_copy_range:");
 		report_failure(161);
 	}
 
-	memcpy(good_buf + dest, good_buf + offset, length);
+	shadow_clone(dest, offset, length);
 }
 
 #else
@@ -1882,7 +3097,7 @@ test_copy_range(void)
 }
 
 void
-do_copy_range(unsigned offset, unsigned length, unsigned dest)
+do_copy_range(unsigned long long offset, unsigned length, unsigned long long dest)
 {
 	return;
 }
@@ -1891,9 +3106,9 @@ do_copy_range(unsigned offset, unsigned length, unsigned dest)
 #ifdef HAVE_LINUX_FALLOC_H
 /* fallocate is basically a no-op unless extending, then a lot like a truncate */
 void
-do_preallocate(unsigned offset, unsigned length, int keep_size, int unshare)
+do_preallocate(unsigned long long offset, unsigned length, int keep_size, int unshare)
 {
-	unsigned end_offset;
+	unsigned long long end_offset;
 	enum opflags opflags = FL_NONE;
 	int mode = 0;
 
@@ -1920,7 +3135,7 @@ do_preallocate(unsigned offset, unsigned length, int keep_size, int unshare)
 	if (end_offset > biggest) {
 		biggest = end_offset;
 		if (!quiet && testcalls > simulatedopcount)
-			prt("fallocating to largest ever: 0x%x\n", end_offset);
+			prt("fallocating to largest ever: 0x%llx\n", end_offset);
 	}
 
 	/*
@@ -1932,7 +3147,7 @@ do_preallocate(unsigned offset, unsigned length, int keep_size, int unshare)
 	log4(OP_FALLOCATE, offset, length, opflags);
 
 	if (end_offset > file_size) {
-		memset(good_buf + file_size, '\0', end_offset - file_size);
+		shadow_zero(file_size, end_offset - file_size);
 		update_file_size(offset, length);
 	}
 
@@ -1942,17 +3157,17 @@ do_preallocate(unsigned offset, unsigned length, int keep_size, int unshare)
 	if ((progressinterval && testcalls % progressinterval == 0) ||
 	    (debug && (monitorstart == -1 || monitorend == -1 ||
 		      end_offset <= monitorend)))
-		prt("%lld falloc\tfrom 0x%x to 0x%x (0x%x bytes)\n", testcalls,
+		prt("%lld falloc\tfrom 0x%llx to 0x%llx (0x%x bytes)\n", testcalls,
 				offset, offset + length, length);
 	if (fallocate(fd, mode, (loff_t)offset, (loff_t)length) == -1) {
-	        prt("fallocate: 0x%x to 0x%x\n", offset, offset + length);
+	        prt("fallocate: 0x%llx to 0x%llx\n", offset, offset + length);
 		prterr("do_preallocate: fallocate");
 		report_failure(161);
 	}
 }
 #else
 void
-do_preallocate(unsigned offset, unsigned length, int keep_size, int unshare)
+do_preallocate(unsigned long long offset, unsigned length, int keep_size, int unshare)
 {
 	return;
 }
@@ -1981,20 +3196,40 @@ test_dontcache_io(void)
 void
 writefileimage()
 {
+	static __thread char buf[SHADOW_CHUNK];
+	unsigned long long off;
 	ssize_t iret;
 
-	if (lseek(fd, (off_t)0, SEEK_SET) == (off_t)-1) {
-		prterr("writefileimage: lseek");
+	/*
+	 * Drop whatever was there and write back only the populated parts of
+	 * the model.  fsxLite can't change the file size, so it has to write
+	 * the zeroes out explicitly.
+	 */
+	if (!lite && ftruncate(fd, 0) == -1) {
+		prterr("writefileimage: ftruncate");
 		report_failure(171);
 	}
-	iret = write(fd, good_buf, file_size);
-	if ((off_t)iret != file_size) {
-		if (iret == -1)
-			prterr("writefileimage: write");
-		else
-			prt("short write: 0x%x bytes instead of 0x%llx\n",
-			    iret, (unsigned long long)file_size);
-		report_failure(172);
+	for (off = 0; off < file_size; off += SHADOW_CHUNK) {
+		unsigned long long len = MIN(SHADOW_CHUNK, file_size - off);
+
+		if (!lite && !shadow_chunk(off >> SHADOW_CHUNK_SHIFT, false)) {
+			unsigned long long idx;
+
+			if (!shadow_find(off >> SHADOW_CHUNK_SHIFT, 1, &idx))
+				break;
+			off = (idx << SHADOW_CHUNK_SHIFT) - SHADOW_CHUNK;
+			continue;
+		}
+		shadow_read(off, buf, len);
+		iret = pwrite(fd, buf, len, off);
+		if (iret != len) {
+			if (iret == -1)
+				prterr("writefileimage: write");
+			else
+				prt("short write: 0x%x bytes instead of 0x%llx\n",
+				    (unsigned)iret, len);
+			report_failure(172);
+		}
 	}
 	if (lite ? 0 : ftruncate(fd, file_size) == -1) {
 	        prt("ftruncate2: %llx\n", (unsigned long long)file_size);
@@ -2012,6 +3247,7 @@ docloseopen(void)
 
 	if (debug)
 		prt("%lld close/open\n", testcalls);
+	uring_drain();
 	if (close(fd)) {
 		prterr("docloseopen: close");
 		report_failure(180);
@@ -2025,6 +3261,7 @@ docloseopen(void)
 		prterr("docloseopen: open");
 		report_failure(182);
 	}
+	uring_reopen();
 }
 
 void
@@ -2090,11 +3327,202 @@ op_args_count(int operation)
 	}
 }
 
+__thread const char	*replay_map;	/* binary --replay-ops log */
+__thread size_t		replay_len;
+__thread size_t		replay_pos;
+__thread int		replay_opmap[FSXLOG_MAX_OPS];
+
+/* Open a --replay-ops file, either a text .fsxops file or a --binlog log. */
+static void
+open_replay(const char *path)
+{
+	const struct fsxlog_hdr *hdr;
+	char magic[8] = "";
+	struct stat st;
+	int i;
+
+	replayopsf = fopen(path, "r");
+	if (!replayopsf) {
+		prterr(path);
+		exit(93);
+	}
+	if (fread(magic, sizeof(magic), 1, replayopsf) != 1 ||
+	    memcmp(magic, FSXLOG_MAGIC, sizeof(magic)) != 0) {
+		rewind(replayopsf);
+		return;
+	}
+
+	if (fstat(fileno(replayopsf), &st)) {
+		prterr(path);
+		exit(93);
+	}
+	replay_len = st.st_size;
+	replay_map = mmap(NULL, replay_len, PROT_READ, MAP_SHARED,
+			  fileno(replayopsf), 0);
+	if (replay_map == MAP_FAILED) {
+		prterr(path);
+		exit(93);
+	}
+	hdr = (const struct fsxlog_hdr *)replay_map;
+	if (replay_len < sizeof(*hdr) || hdr->version != FSXLOG_VERSION ||
+	    hdr->hdr_size < sizeof(*hdr) ||
+	    hdr->rec_size < sizeof(struct fsxlog_rec) ||
+	    hdr->nr_ops > FSXLOG_MAX_OPS) {
+		fprintf(stderr, "%s: unsupported binary log\n", path);
+		exit(93);
+	}
+	/* ops past our maxfilelen would leave the file and the model apart */
+	if (hdr->maxfilelen != maxfilelen) {
+		fprintf(stderr, "%s: recorded with -l %llu, replay it with the same\n",
+			path, (unsigned long long)hdr->maxfilelen);
+		exit(93);
+	}
+	/* match ops up by name in case the numbering ever changes */
+	for (i = 0; i < hdr->nr_ops; i++)
+		replay_opmap[i] = op_code(hdr->op_names[i]);
+	replay_pos = hdr->hdr_size;
+}
+
+static int
+read_binlog_op(struct log_entry *log_entry)
+{
+	const struct fsxlog_hdr *hdr = (const struct fsxlog_hdr *)replay_map;
+
+	while (replay_pos + hdr->rec_size <= replay_len) {
+		const struct fsxlog_rec *rec;
+
+		rec = (const struct fsxlog_rec *)(replay_map + replay_pos);
+		replay_pos += hdr->rec_size;
+		if (rec->type == 0)
+			break;
+		if (rec->type != FSXLOG_OP)
+			continue;
+		if (rec->op >= hdr->nr_ops || replay_opmap[rec->op] == -1 ||
+		    rec->nr_args > 4 || rec->file >= nr_files ||
+		    rec->dest_file >= nr_files) {
+			fprintf(stderr, "%s: bad record at 0x%zx\n", replayops,
+				replay_pos - hdr->rec_size);
+			cleanup(100);
+		}
+		memset(log_entry, 0, sizeof(*log_entry));
+		log_entry->operation = replay_opmap[rec->op];
+		log_entry->nr_args = rec->nr_args;
+		memcpy(log_entry->args, rec->args, sizeof(log_entry->args));
+		log_entry->flags = rec->flags & (FL_SKIPPED | FL_CLOSE_OPEN |
+						 FL_KEEP_SIZE | FL_UNSHARE);
+		log_entry->seq = rec->seq;
+		log_entry->file = rec->file;
+		log_entry->dest_file = rec->dest_file;
+		/*
+		 * number ops as the logged run did, skipped ones included,
+		 * so that a full replay and one from a checkpoint agree
+		 */
+		testcalls = rec->opnum;
+		return 1;
+	}
+
+	/* test() counted a call for the end of the log */
+	testcalls--;
+	munmap((void *)replay_map, replay_len);
+	replay_map = NULL;
+	fclose(replayopsf);
+	replayopsf = NULL;
+	return 0;
+}
+
+/*
+ * --replay-checkpoint: load <log>.ckpt, the model saved at the last
+ * checkpoint of a binary log, into the file and the model and carry on
+ * replaying from the op after it.
+ */
+static void
+replay_from_checkpoint(void)
+{
+	const struct fsxlog_hdr *hdr = (const struct fsxlog_hdr *)replay_map;
+	const struct fsxlog_rec *ckpt = NULL;
+	char path[PATH_MAX + 8];
+	unsigned long long off, size;
+	size_t pos;
+	ssize_t ret;
+	int cfd, wfd;
+
+	if (!replay_map) {
+		fprintf(stderr, "--replay-checkpoint needs a binary log\n");
+		exit(93);
+	}
+	for (pos = hdr->hdr_size; pos + hdr->rec_size <= replay_len;
+	     pos += hdr->rec_size) {
+		const struct fsxlog_rec *rec;
+
+		rec = (const struct fsxlog_rec *)(replay_map + pos);
+		if (rec->type == 0)
+			break;
+		if (rec->type == FSXLOG_CKPT) {
+			ckpt = rec;
+			replay_pos = pos + hdr->rec_size;
+		}
+	}
+	if (!ckpt) {
+		fprintf(stderr, "%s: no checkpoint in log\n", replayops);
+		exit(93);
+	}
+
+	snprintf(path, sizeof(path), "%s.ckpt", replayops);
+	cfd = open(path, O_RDONLY);
+	if (cfd < 0) {
+		prterr(path);
+		exit(93);
+	}
+	/* not through fd, which may be O_DIRECT */
+	wfd = open(fname, O_WRONLY);
+	if (wfd < 0) {
+		prterr(fname);
+		exit(98);
+	}
+	size = ckpt->args[0];
+	for (off = 0; off < size; off += ret) {
+#ifdef SEEK_DATA
+		off_t data = lseek(cfd, off, SEEK_DATA);
+
+		if (data < 0 || data >= size)
+			break;
+		off = data;
+#endif
+		ret = pread(cfd, temp_buf, MIN(maxoplen, size - off), off);
+		if (ret <= 0) {
+			prterr(path);
+			exit(93);
+		}
+		if (is_zeroed(temp_buf, ret))
+			continue;
+		shadow_write(off, temp_buf, ret);
+		if (pwrite(wfd, temp_buf, ret, off) != ret) {
+			prterr(fname);
+			exit(98);
+		}
+	}
+	if (ftruncate(wfd, size)) {
+		prterr(fname);
+		exit(98);
+	}
+	close(wfd);
+	close(cfd);
+
+	file_size = biggest = size;
+	testcalls = ckpt->opnum;
+	if (!quiet)
+		prt("Replaying from the checkpoint at operation %llu\n",
+		    (unsigned long long)ckpt->opnum);
+}
+
 static int
 read_op(struct log_entry *log_entry)
 {
 	char line[256];
 
+	if (replay_map)
+		return read_binlog_op(log_entry);
+
 	memset(log_entry, 0, sizeof(*log_entry));
 	log_entry->operation = -1;
 
@@ -2129,7 +3557,7 @@ read_op(struct log_entry *log_entry)
 			str = strtok(NULL, " \t\n");
 			if (!str)
 				goto fail;
-			log_entry->args[i] = strtoul(str, &end, 0);
+			log_entry->args[i] = strtoull(str, &end, 0);
 			if (*end)
 				goto fail;
 		}
@@ -2140,6 +3568,27 @@ read_op(struct log_entry *log_entry)
 				log_entry->flags |= FL_CLOSE_OPEN;
 			else if (strcmp(str, "unshare") == 0)
 				log_entry->flags |= FL_UNSHARE;
+			else if (strncmp(str, "seq=", 4) == 0) {
+				char *end;
+
+				log_entry->seq = strtoull(str + 4, &end, 0);
+				if (*end || !log_entry->seq)
+					goto fail;
+			} else if (strncmp(str, "file=", 5) == 0) {
+				char *end;
+
+				log_entry->file = strtoul(str + 5, &end, 0);
+				if (*end || log_entry->file >= nr_files)
+					goto fail;
+				if (log_entry->nr_args != 4)
+					log_entry->dest_file = log_entry->file;
+			} else if (strncmp(str, "dest=", 5) == 0) {
+				char *end;
+
+				log_entry->dest_file = strtoul(str + 5, &end, 0);
+				if (*end || log_entry->dest_file >= nr_files)
+					goto fail;
+			}
 			else if (strcmp(str, "*") == 0)
 				;  /* overlap marker; ignore */
 			else
@@ -2156,6 +3605,328 @@ fail:
 	return 0;
 }
 
+/*
+ * fsx_random() only gives us 31 bits, which isn't enough to reach every offset
+ * of a file bigger than 2GiB.  Only burn a second value when we need one so
+ * that the op stream for a given seed doesn't change for smaller files.
+ */
+static unsigned long long
+random_offset(void)
+{
+	unsigned long long r = fsx_random();
+
+	if (maxfilelen > RAND_MAX)
+		r = (r << 31) | fsx_random();
+	return r;
+}
+
+/*
+ * --folio-bias: with large folios the page cache works in 16k, 64k and PMD
+ * sized chunks, and the interesting cases are ops that split one of those or
+ * that move EOF around inside one.  Steer that percentage of ops onto such a
+ * boundary, and count how often every op run actually crosses one.
+ */
+enum {
+	FOLIO_16K,
+	FOLIO_64K,
+	FOLIO_PMD,
+	FOLIO_EOF,
+	FOLIO_NR,
+};
+
+static const char *folio_names[] = {
+	[FOLIO_16K] = "16k",
+	[FOLIO_64K] = "64k",
+	[FOLIO_PMD] = "pmd",
+	[FOLIO_EOF] = "eof",
+};
+
+unsigned long		folio_sizes[FOLIO_EOF] = { 16384, 65536, 2 << 20 };
+__thread unsigned long long	folio_hits[FOLIO_NR];
+__thread unsigned long long	folio_ops;
+
+/* the PMD size is what THP maps a folio with, not the hugetlb page size */
+static void
+folio_setup(void)
+{
+	unsigned long pmd = 0;
+	FILE *f;
+
+	f = fopen("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size", "r");
+	if (f) {
+		if (fscanf(f, "%lu", &pmd) == 1 && pmd > folio_sizes[FOLIO_64K])
+			folio_sizes[FOLIO_PMD] = pmd;
+		fclose(f);
+	}
+}
+
+/*
+ * Replace offset and size with a range that crosses a folio boundary or eof,
+ * the end of what the ops run against: the file, or with --threads the
+ * worker's range of it, since the file size is fixed there.  Boundaries are
+ * picked from the folio sizes that fit in the file, eof as often as any one
+ * of them.
+ */
+static void
+folio_offset(unsigned long *offset, unsigned long *size, unsigned long eof)
+{
+	unsigned long bnd, before;
+	int nr = 0, class;
+
+	while (nr < FOLIO_EOF && folio_sizes[nr] < maxfilelen)
+		nr++;
+	if (maxoplen < 2)
+		return;
+
+	class = fsx_random() % (nr + 1);
+	if (class == nr) {
+		bnd = eof;
+	} else {
+		unsigned long b = folio_sizes[class];
+
+		bnd = b * (1 + fsx_random() % ((maxfilelen - 1) / b));
+	}
+	if (!bnd)
+		return;
+
+	/* start up to maxoplen - 1 bytes before the boundary, end after it */
+	before = 1 + fsx_random() % MIN(bnd, maxoplen - 1);
+	*offset = bnd - before;
+	*size = maxoplen;
+	if (randomoplen)
+		*size = before + 1 + fsx_random() % (maxoplen - before);
+}
+
+static bool
+folio_crosses(unsigned long off, unsigned long len, unsigned long b)
+{
+	return len && off / b != (off + len - 1) / b;
+}
+
+/*
+ * Count the boundaries crossed by the op test() just ran.  A truncate
+ * crosses everything between the old and the new EOF, and hits EOF if the
+ * new one lands inside a folio.
+ */
+static void
+folio_count(unsigned long old_size)
+{
+	struct log_entry *le = &oplog[(logptr + LOGSIZE - 1) % LOGSIZE];
+	unsigned long off = le->args[0], len = le->args[1];
+	bool eof;
+	int i;
+
+	if (testcalls <= simulatedopcount || (le->flags & FL_SKIPPED) ||
+	    le->operation == OP_FSYNC)
+		return;
+	if (le->operation == OP_TRUNCATE) {
+		eof = len % folio_sizes[FOLIO_16K];
+		off = MIN(len, old_size);
+		len = MAX(len, old_size) - off;
+	} else {
+		eof = old_size % folio_sizes[FOLIO_16K] &&
+		      off <= old_size && old_size <= off + len;
+	}
+
+	folio_ops++;
+	for (i = 0; i < FOLIO_EOF; i++)
+		if (folio_crosses(off, len, folio_sizes[i]) ||
+		    (le->nr_args == 4 &&
+		     folio_crosses(le->args[2], len, folio_sizes[i])))
+			folio_hits[i]++;
+	if (eof)
+		folio_hits[FOLIO_EOF]++;
+}
+
+static void
+folio_report(void)
+{
+	int i;
+
+	prt("folio boundaries crossed by %llu ops:", folio_ops);
+	for (i = 0; i < FOLIO_NR; i++)
+		prt(" %s %llu", folio_names[i], folio_hits[i]);
+	prt("\n");
+}
+
+/*
+ * --kcov: let kernel coverage steer the op mix.  Every op is traced with kcov
+ * and its edges are hashed into a bitmap that all threads share.  An op that
+ * finds new edges adds to the score of its op type, which decays again as
+ * that type keeps running without finding more, and the ops leading up to it
+ * go into a per thread corpus.  Op types are then picked in proportion to
+ * 1 + score, and now and then a corpus sequence is run again with its offsets
+ * and lengths nudged.  All of it goes through the usual ops, so the data is
+ * still verified; without kcov the ops just stay uniform.
+ */
+#ifndef KCOV_INIT_TRACE
+#define KCOV_INIT_TRACE		_IOR('c', 1, unsigned long)
+#define KCOV_ENABLE		_IO('c', 100)
+#define KCOV_DISABLE		_IO('c', 101)
+#endif
+#define KCOV_TRACE_PC		0
+#define KCOV_COVER_SIZE		(256 << 10)	/* PCs traced per op */
+#define KCOV_MAP_BITS		22
+#define KCOV_SEQ_LEN		8
+#define KCOV_CORPUS		64
+
+struct kcov_op {
+	int			op;
+	unsigned long		offset;
+	unsigned long		size;
+};
+
+struct kcov_seq {
+	struct kcov_op		ops[KCOV_SEQ_LEN];
+};
+
+int			kcov_guided = 0;	/* --kcov */
+unsigned long		*kcov_map;		/* edges seen by any thread */
+unsigned long long	kcov_edges;
+unsigned long long	kcov_new_ops;		/* ops that found new edges */
+__thread int		kcov_fd = -1;
+__thread unsigned long	*kcov_cover;
+__thread double		kcov_score[OP_MAX_INTEGRITY];
+__thread struct kcov_op	kcov_recent[KCOV_SEQ_LEN];	/* ring of the last ops */
+__thread unsigned	kcov_recent_pos;
+__thread struct kcov_seq	*kcov_corpus;
+__thread int		kcov_corpus_nr;
+__thread struct kcov_seq	*kcov_rerun;	/* corpus sequence being rerun */
+__thread int		kcov_rerun_pos;
+
+/* Trace this thread with kcov, or say why not and carry on without it. */
+static void
+kcov_setup(void)
+{
+	void *p;
+	int fd;
+
+	fd = open("/sys/kernel/debug/kcov", O_RDWR);
+	if (fd < 0)
+		goto out_warn;
+	if (ioctl(fd, KCOV_INIT_TRACE, KCOV_COVER_SIZE))
+		goto out_close;
+	p = mmap(NULL, KCOV_COVER_SIZE * sizeof(unsigned long),
+		 PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED)
+		goto out_close;
+	if (ioctl(fd, KCOV_ENABLE, KCOV_TRACE_PC)) {
+		munmap(p, KCOV_COVER_SIZE * sizeof(unsigned long));
+		goto out_close;
+	}
+
+	kcov_corpus = calloc(KCOV_CORPUS, sizeof(*kcov_corpus));
+	if (!kcov_corpus) {
+		prterr("kcov_setup: calloc");
+		exit(101);
+	}
+	kcov_cover = p;
+	kcov_fd = fd;
+	return;
+
+out_close:
+	close(fd);
+out_warn:
+	prt("kcov unavailable (%s), ops stay uniform\n", strerror(errno));
+}
+
+static void
+kcov_start(void)
+{
+	if (kcov_fd >= 0)
+		__atomic_store_n(&kcov_cover[0], 0, __ATOMIC_RELAXED);
+}
+
+/* Hash the edges of the op test() just ran and score it on the new ones. */
+static void
+kcov_end(void)
+{
+	struct log_entry *le = &oplog[(logptr + LOGSIZE - 1) % LOGSIZE];
+	unsigned long long edge, prev = 0, found = 0;
+	unsigned long n, i, bit, old;
+	struct kcov_op *k;
+	struct kcov_seq *seq;
+
+	if (kcov_fd < 0 || testcalls <= simulatedopcount ||
+	    (le->flags & FL_SKIPPED))
+		return;
+
+	n = __atomic_load_n(&kcov_cover[0], __ATOMIC_RELAXED);
+	n = MIN(n, KCOV_COVER_SIZE - 1);
+	for (i = 1; i <= n; i++) {
+		edge = kcov_cover[i] ^ (prev >> 1);
+		prev = kcov_cover[i];
+		bit = (edge * 0x9e3779b97f4a7c15ULL) >> (64 - KCOV_MAP_BITS);
+		old = __atomic_fetch_or(&kcov_map[bit / (8 * sizeof(long))],
+					1UL << (bit % (8 * sizeof(long))),
+					__ATOMIC_RELAXED);
+		if (!(old & (1UL << (bit % (8 * sizeof(long))))))
+			found++;
+	}
+
+	k = &kcov_recent[kcov_recent_pos++ % KCOV_SEQ_LEN];
+	k->op = le->operation;
+	k->offset = le->args[0];
+	k->size = le->args[1];
+	kcov_score[k->op] = kcov_score[k->op] * 0.9 + MIN(found, 100);
+	if (!found)
+		return;
+
+	__atomic_add_fetch(&kcov_edges, found, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&kcov_new_ops, 1, __ATOMIC_RELAXED);
+	if (kcov_corpus_nr < KCOV_CORPUS)
+		seq = &kcov_corpus[kcov_corpus_nr++];
+	else
+		seq = &kcov_corpus[fsx_random() % KCOV_CORPUS];
+	/* oldest first */
+	for (i = 0; i < KCOV_SEQ_LEN; i++)
+		seq->ops[i] = kcov_recent[(kcov_recent_pos + i) % KCOV_SEQ_LEN];
+}
+
+/*
+ * Pick the next op type by score, or the next op of a corpus sequence that
+ * is being rerun.  Returns true if it set offset and size as well.
+ */
+static bool
+kcov_pick(unsigned long *op, unsigned long op_max, unsigned long *offset,
+	  unsigned long *size)
+{
+	double total = 0, r;
+	unsigned long i;
+
+	if (!kcov_rerun && kcov_corpus_nr && fsx_random() % 4 == 0) {
+		kcov_rerun = &kcov_corpus[fsx_random() % kcov_corpus_nr];
+		kcov_rerun_pos = 0;
+	}
+	if (kcov_rerun) {
+		struct kcov_op *k = &kcov_rerun->ops[kcov_rerun_pos];
+
+		if (++kcov_rerun_pos == KCOV_SEQ_LEN)
+			kcov_rerun = NULL;
+		if (k->op < op_max) {
+			*op = k->op;
+			*offset = k->offset ^ (fsx_random() % page_size);
+			*size = k->size ^ (fsx_random() % page_size);
+			if (*op == OP_TRUNCATE)
+				*size %= maxfilelen;
+			else
+				*size = MIN(*size, maxoplen);
+			return true;
+		}
+	}
+
+	for (i = 0; i < op_max; i++)
+		total += 1 + kcov_score[i];
+	r = total * fsx_random() / ((double)RAND_MAX + 1);
+	for (i = 0; i < op_max - 1; i++) {
+		r -= 1 + kcov_score[i];
+		if (r < 0)
+			break;
+	}
+	*op = i;
+	return false;
+}
+
 static inline bool
 range_overlaps(
 	unsigned long	off0,
@@ -2166,6 +3937,7 @@ range_overlaps(
 }
 
 static void generate_dest_range(bool bdy_align,
+				unsigned long src_range_end,
 				unsigned long max_range_end,
 				unsigned long *src_offset,
 				unsigned long *size,
@@ -2173,7 +3945,7 @@ static void generate_dest_range(bool bdy_align,
 {
 	int tries = 0;
 
-	TRIM_OFF_LEN(*src_offset, *size, file_size);
+	TRIM_OFF_LEN(*src_offset, *size, src_range_end);
 	if (bdy_align) {
 		*src_offset = rounddown_64(*src_offset, readbdy);
 		if (o_direct)
@@ -2188,7 +3960,7 @@ static void generate_dest_range(bool bdy_align,
 			*size = 0;
 			break;
 		}
-		*dst_offset = random();
+		*dst_offset = random_offset();
 		TRIM_OFF(*dst_offset, max_range_end);
 		if (bdy_align)
 			*dst_offset = rounddown_64(*dst_offset, writebdy);
@@ -2198,6 +3970,70 @@ static void generate_dest_range(bool bdy_align,
 		 *dst_offset + *size > max_range_end);
 }
 
+/*
+ * Move an op generated against [0, maxfilelen) into this worker's private
+ * range, or now and then into the shared range.  Two range ops keep their
+ * source private and may put the destination into the shared range.
+ */
+static void
+place_shared(unsigned long *offset, unsigned long *size, unsigned align)
+{
+	if (*size > shared_len)
+		*size = shared_len;
+	*offset = shared_base +
+		rounddown_64(random_offset() % (shared_len - *size + 1), align);
+}
+
+static void
+place_op(unsigned long op, unsigned long *offset, unsigned long *size,
+	 unsigned long *offset2)
+{
+	bool two_range = op == OP_CLONE_RANGE || op == OP_DEDUPE_RANGE ||
+			 op == OP_COPY_RANGE || op == OP_EXCHANGE_RANGE;
+
+	*offset += range_base;
+	if (two_range)
+		*offset2 += range_base;
+	if (!shared_len || op == OP_TRUNCATE || op == OP_FSYNC)
+		return;
+
+	if (two_range) {
+		if (fsx_random() % 2 == 0)
+			place_shared(offset2, size, op == OP_COPY_RANGE ?
+				     writebdy : block_size);
+	} else if (fsx_random() % 8 == 0) {
+		place_shared(offset, size, 1);
+	}
+}
+
+/* Widen [*start, *end) to cover the part of an op inside the shared range. */
+static void
+shared_span(unsigned long long offset, unsigned long long size,
+	    unsigned long long *start, unsigned long long *end)
+{
+	if (!size || offset + size <= shared_base)
+		return;
+	*start = MIN(*start, MAX(offset, shared_base));
+	*end = MAX(*end, offset + size);
+}
+
+static bool
+lock_op(unsigned long op, unsigned long long offset, unsigned long long size,
+	unsigned long long offset2, unsigned long long seq)
+{
+	unsigned long long start = ULLONG_MAX, end = 0;
+
+	if (!shared_len)
+		return true;
+	shared_span(offset, size, &start, &end);
+	if (op == OP_CLONE_RANGE || op == OP_DEDUPE_RANGE ||
+	    op == OP_COPY_RANGE || op == OP_EXCHANGE_RANGE)
+		shared_span(offset2, size, &start, &end);
+	if (end <= start)
+		return true;
+	return shared_lock(start, end, seq);
+}
+
 int
 test(void)
 {
@@ -2207,11 +4043,24 @@ test(void)
 	unsigned long	op;
 	int		keep_size = 0;
 	int		unshare = 0;
+	unsigned long long	seq = 0;
+	struct timespec	op_start;
+	unsigned long	old_size;
+	bool		folio = false;
+	bool		guided = false;
+	/*
+	 * Threads generate ops against [0, maxfilelen) and then move them
+	 * into the file; everything else runs against the whole file.
+	 */
+	unsigned long	size_lim = nr_threads ? maxfilelen : file_size;
+	unsigned long	max_lim = maxfilelen;
 
 	if (simulatedopcount > 0 && testcalls == simulatedopcount)
 		writefileimage();
 
 	testcalls++;
+	if (ctr_random)
+		ctr_rand_seek(&ctr_rng, seed, thread_id + 1, testcalls);
 
 	if (debugstart > 0 && testcalls >= debugstart)
 		debug = 1;
@@ -2223,6 +4072,8 @@ test(void)
 		struct log_entry log_entry;
 
 		while (read_op(&log_entry)) {
+			pool_switch(log_entry.file);
+			dest_file = log_entry.dest_file;
 			if (log_entry.flags & FL_SKIPPED) {
 				log4(log_entry.operation,
 				     log_entry.args[0], log_entry.args[1],
@@ -2234,6 +4085,7 @@ test(void)
 			offset = log_entry.args[0];
 			size = log_entry.args[1];
 			offset2 = log_entry.args[2];
+			seq = log_entry.seq;
 			closeopen = !!(log_entry.flags & FL_CLOSE_OPEN);
 			keep_size = !!(log_entry.flags & FL_KEEP_SIZE);
 			unshare = !!(log_entry.flags & FL_UNSHARE);
@@ -2242,18 +4094,32 @@ test(void)
 		return 0;
 	}
 
-	rv = random();
+	rv = fsx_random();
 	if (closeprob)
 		closeopen = (rv >> 3) < (1 << 28) / closeprob;
 
-	offset = random();
+	if (pool) {
+		pool_switch(fsx_random() % nr_files);
+		dest_file = fsx_random() % nr_files;
+		size_lim = file_size;
+	}
+
+	offset = random_offset();
 	offset2 = 0;
 	size = maxoplen;
 	if (randomoplen)
-		size = random() % (maxoplen + 1);
+		size = fsx_random() % (maxoplen + 1);
+	if (folio_bias && fsx_random() % 100 < folio_bias) {
+		folio_offset(&offset, &size, size_lim);
+		folio = true;
+	}
 
 	/* calculate appropriate op to run */
-	if (lite)
+	if (kcov_fd >= 0)
+		guided = kcov_pick(&op, lite ? OP_MAX_LITE :
+				   !integrity ? OP_MAX_FULL : OP_MAX_INTEGRITY,
+				   &offset, &size);
+	else if (lite)
 		op = rv % OP_MAX_LITE;
 	else if (!integrity)
 		op = rv % OP_MAX_FULL;
@@ -2262,36 +4128,64 @@ test(void)
 
 	switch(op) {
 	case OP_TRUNCATE:
-		if (!style)
-			size = random() % maxfilelen;
+		if (folio)
+			size = (offset + fsx_random() % (size + 1)) % maxfilelen;
+		else if (!style && !guided)
+			size = random_offset() % maxfilelen;
 		break;
 	case OP_FALLOCATE:
 		if (fallocate_calls && size) {
 			if (keep_size_calls)
-				keep_size = random() % 2;
+				keep_size = fsx_random() % 2;
 			if (unshare_range_calls)
-				unshare = random() % 2;
+				unshare = fsx_random() % 2;
 		}
 		break;
 	case OP_ZERO_RANGE:
 		if (zero_range_calls && size && keep_size_calls)
-			keep_size = random() % 2;
+			keep_size = fsx_random() % 2;
 		break;
 	case OP_CLONE_RANGE:
-		generate_dest_range(false, maxfilelen, &offset, &size, &offset2);
+		generate_dest_range(false, size_lim, max_lim, &offset, &size,
+				    &offset2);
 		break;
 	case OP_DEDUPE_RANGE:
-		generate_dest_range(false, file_size, &offset, &size, &offset2);
+		generate_dest_range(false, size_lim, pool ? dest_size() : size_lim,
+				    &offset, &size, &offset2);
 		break;
 	case OP_COPY_RANGE:
-		generate_dest_range(true, maxfilelen, &offset, &size, &offset2);
+		generate_dest_range(true, size_lim, max_lim, &offset, &size,
+				    &offset2);
 		break;
 	case OP_EXCHANGE_RANGE:
-		generate_dest_range(false, file_size, &offset, &size, &offset2);
+		generate_dest_range(false, size_lim, pool ? dest_size() : size_lim,
+				    &offset, &size, &offset2);
 		break;
 	}
 
+	if (nr_threads) {
+		switch (op) {
+		case OP_READ:
+		case OP_READ_DONTCACHE:
+		case OP_WRITE:
+		case OP_WRITE_DONTCACHE:
+		case OP_MAPREAD:
+		case OP_MAPWRITE:
+		case OP_FALLOCATE:
+		case OP_PUNCH_HOLE:
+		case OP_ZERO_RANGE:
+			TRIM_OFF_LEN(offset, size, maxfilelen);
+			break;
+		}
+		place_op(op, &offset, &size, &offset2);
+	}
+
 have_op:
+	if (nr_threads)
+		size_lim = max_lim = file_size;
+	else if (pool)
+		size_lim = file_size;
+
 
 	switch (op) {
 	case OP_MAPREAD:
@@ -2356,16 +4250,36 @@ have_op:
 			goto out;
 		}
 		break;
+	case OP_TRUNCATE:
+		/* the file size is fixed while threads share it */
+		if (nr_threads) {
+			log4(OP_TRUNCATE, 0, size, FL_SKIPPED);
+			goto out;
+		}
+		break;
 	}
 
+	/* only reads and writes may run behind other I/O */
+	if (uring_qd && op != OP_READ && op != OP_READ_DONTCACHE &&
+	    op != OP_WRITE && op != OP_WRITE_DONTCACHE)
+		uring_drain();
+
+	if (nr_threads && !lock_op(op, offset, size, offset2, seq))
+		return 0;
+
+	if (stats)
+		clock_gettime(CLOCK_MONOTONIC, &op_start);
+	old_size = file_size;
+	kcov_start();
+
 	switch (op) {
 	case OP_READ:
-		TRIM_OFF_LEN(offset, size, file_size);
+		TRIM_OFF_LEN(offset, size, size_lim);
 		doread(offset, size, 0);
 		break;
 
 	case OP_READ_DONTCACHE:
-		TRIM_OFF_LEN(offset, size, file_size);
+		TRIM_OFF_LEN(offset, size, size_lim);
 		if (dontcache_io)
 			doread(offset, size, RWF_DONTCACHE);
 		else
@@ -2373,12 +4287,12 @@ have_op:
 		break;
 
 	case OP_WRITE:
-		TRIM_OFF_LEN(offset, size, maxfilelen);
+		TRIM_OFF_LEN(offset, size, max_lim);
 		dowrite(offset, size, 0);
 		break;
 
 	case OP_WRITE_DONTCACHE:
-		TRIM_OFF_LEN(offset, size, maxfilelen);
+		TRIM_OFF_LEN(offset, size, max_lim);
 		if (dontcache_io)
 			dowrite(offset, size, RWF_DONTCACHE);
 		else
@@ -2386,12 +4300,12 @@ have_op:
 		break;
 
 	case OP_MAPREAD:
-		TRIM_OFF_LEN(offset, size, file_size);
+		TRIM_OFF_LEN(offset, size, size_lim);
 		domapread(offset, size);
 		break;
 
 	case OP_MAPWRITE:
-		TRIM_OFF_LEN(offset, size, maxfilelen);
+		TRIM_OFF_LEN(offset, size, max_lim);
 		domapwrite(offset, size);
 		break;
 
@@ -2400,16 +4314,16 @@ have_op:
 		break;
 
 	case OP_FALLOCATE:
-		TRIM_OFF_LEN(offset, size, maxfilelen);
+		TRIM_OFF_LEN(offset, size, max_lim);
 		do_preallocate(offset, size, keep_size, unshare);
 		break;
 
 	case OP_PUNCH_HOLE:
-		TRIM_OFF_LEN(offset, size, file_size);
+		TRIM_OFF_LEN(offset, size, size_lim);
 		do_punch_hole(offset, size);
 		break;
 	case OP_ZERO_RANGE:
-		TRIM_OFF_LEN(offset, size, maxfilelen);
+		TRIM_OFF_LEN(offset, size, max_lim);
 		do_zero_range(offset, size, keep_size);
 		break;
 	case OP_COLLAPSE_RANGE:
@@ -2443,7 +4357,7 @@ have_op:
 			log5(OP_EXCHANGE_RANGE, offset, size, offset2, FL_SKIPPED);
 			goto out;
 		}
-		if (offset2 + size > maxfilelen) {
+		if (offset2 + size > max_lim) {
 			log5(OP_EXCHANGE_RANGE, offset, size, offset2, FL_SKIPPED);
 			goto out;
 		}
@@ -2455,7 +4369,7 @@ have_op:
 			log5(OP_CLONE_RANGE, offset, size, offset2, FL_SKIPPED);
 			goto out;
 		}
-		if (offset2 + size > maxfilelen) {
+		if (offset2 + size > max_lim) {
 			log5(OP_CLONE_RANGE, offset, size, offset2, FL_SKIPPED);
 			goto out;
 		}
@@ -2467,7 +4381,7 @@ have_op:
 			log5(OP_DEDUPE_RANGE, offset, size, offset2, FL_SKIPPED);
 			goto out;
 		}
-		if (offset2 + size > maxfilelen) {
+		if (offset2 + size > max_lim) {
 			log5(OP_DEDUPE_RANGE, offset, size, offset2, FL_SKIPPED);
 			goto out;
 		}
@@ -2479,7 +4393,7 @@ have_op:
 			log5(OP_COPY_RANGE, offset, size, offset2, FL_SKIPPED);
 			goto out;
 		}
-		if (offset2 + size > maxfilelen) {
+		if (offset2 + size > max_lim) {
 			log5(OP_COPY_RANGE, offset, size, offset2, FL_SKIPPED);
 			goto out;
 		}
@@ -2495,14 +4409,28 @@ have_op:
 		break;
 	}
 
+	if (stats)
+		stats_op(op, &op_start);
+	folio_count(old_size);
+	kcov_end();
+
+	if (nr_threads)
+		shared_unlock();
+
 	if (check_file && testcalls > simulatedopcount)
 		check_contents();
 
 out:
+	if (nr_threads)
+		shared_unlock();
 	if (closeopen)
 		docloseopen();
 	if (sizechecks && testcalls > simulatedopcount)
 		check_size();
+	if (checkpoint_ops && testcalls % checkpoint_ops == 0)
+		binlog_checkpoint();
+	if (stats)
+		stats_tick();
 	return 1;
 }
 
@@ -2517,7 +4445,10 @@ usage(void)
 	   [-r readbdy] [-s style] [-t truncbdy] [-w writebdy]\n\
 	   [-A|-U] [-D startingop] [-N numops] [-P dirpath] [-S seed]\n\
 	   [--replay-ops=opsfile] [--record-ops[=opsfile]] [--duration=seconds]\n\
-	   ... fname\n\
+	   [--threads=N] [--shared-range=bytes] [--uring-qd=N] [--uring-sqpoll]\n\
+	   [--binlog=file] [--checkpoint=N] [--replay-checkpoint] [--files=N]\n\
+	   [--stats=file] [--stats-interval=secs] [--folio-bias=pct] [--kcov]\n\
+	   [--ctr-random] ... fname\n\
 	-b opnum: beginning operation number (default 1)\n\
 	-c P: 1 in P chance of file close+open at each op (default infinity)\n\
 	-d: debug output for all operations\n\
@@ -2594,6 +4525,27 @@ usage(void)
 	--replay-ops=opsfile: replay ops from recorded .fsxops file\n\
 	--record-ops[=opsfile]: dump ops file also on success. optionally specify ops file name\n\
 	--duration=seconds: ignore any -N setting and run for this many seconds\n\
+	--threads=N: run N threads on the file, each in its own -l sized range, with\n\
+	    per-thread .tN log, ops and good files (excludes -b, -e, -i, -k, -L)\n\
+	--shared-range=bytes: add a range after the private ones that all threads\n\
+	    clone, copy, exchange, dedupe and do I/O into under range locks\n\
+	--uring-qd=N: implies -U, keep up to N reads and writes in flight using\n\
+	    registered buffers and file, checking reads as they complete\n\
+	--uring-sqpoll: implies -U, use a kernel submission queue polling thread\n\
+	--binlog=file: also append every op to a binary log, which --replay-ops\n\
+	    reads as well and ltp/fsxlog converts to text\n\
+	--checkpoint=N: save the model to <binlog>.ckpt every N ops\n\
+	--replay-checkpoint: start replaying a binary log from its last checkpoint\n\
+	--files=N: run against fname and fname.1 to fname.N-1, with clone, dedupe,\n\
+	    copy and exchange going between them\n\
+	--stats=file: write per op and I/O path latency histograms to file as JSON\n\
+	--stats-interval=secs: also write them every secs seconds\n\
+	--folio-bias=pct: aim pct percent of ops at 16k, 64k and PMD folio boundaries\n\
+	    and at EOF, and report how often ops crossed them\n\
+	--kcov: pick ops by the new kernel coverage they found (needs kcov), so\n\
+	    the op stream is only reproducible from an op log\n\
+	--ctr-random: draw the random numbers of every op from a stream of its own,\n\
+	    keyed by the seed, the thread and the op number\n\
 	fname: this filename is REQUIRED (no default)\n");
 	exit(90);
 }
@@ -2623,6 +4575,16 @@ getnum(char *s, char **e)
 			ret *= 1024*1024;
 			*e = *e + 1;
 			break;
+		case 'g':
+		case 'G':
+			ret *= 1024*1024*1024LL;
+			*e = *e + 1;
+			break;
+		case 't':
+		case 'T':
+			ret *= 1024*1024*1024*1024LL;
+			*e = *e + 1;
+			break;
 		case 'w':
 		case 'W':
 			ret *= 4;
@@ -2635,8 +4597,8 @@ getnum(char *s, char **e)
 #ifdef AIO
 
 #define QSZ     1024
-io_context_t	io_ctx;
-struct iocb 	iocb;
+__thread io_context_t	io_ctx;
+__thread struct iocb 	iocb;
 
 int
 aio_setup()
@@ -2652,10 +4614,10 @@ aio_setup()
 }
 
 int
-aio_rw(int rw, int fd, char *buf, unsigned len, unsigned offset)
+aio_rw(int rw, int fd, char *buf, unsigned len, unsigned long long offset)
 {
 	struct io_event event;
-	static struct timespec ts;
+	static __thread struct timespec ts;
 	struct iocb *iocbs[] = { &iocb };
 	int ret;
 	long res;
@@ -2719,7 +4681,7 @@ out_error:
 }
 #else
 int
-aio_rw(int rw, int fd, char *buf, unsigned len, unsigned offset)
+aio_rw(int rw, int fd, char *buf, unsigned len, unsigned long long offset)
 {
 	fprintf(stderr, "io_rw: need AIO support!\n");
 	exit(111);
@@ -2728,25 +4690,279 @@ aio_rw(int rw, int fd, char *buf, unsigned len, unsigned offset)
 
 #ifdef URING
 
-struct io_uring ring;
+__thread struct io_uring ring;
 #define URING_ENTRIES	1024
 
+/*
+ * With --uring-qd reads and writes are queued rather than waited for, and up
+ * to uring_qd of them are kept in flight, each in its own slot buffer.  An
+ * I/O only waits for older ones it overlaps (a read and a write, or two
+ * writes), so whenever a read completes the model for its range is still
+ * what it was at submission time and the read can be checked right there,
+ * in whatever order the completions arrive.  Every other op drains the
+ * queue first.  The slot buffers and the file are registered with the ring
+ * where the kernel allows it.
+ */
+struct uring_slot {
+	bool			busy;
+	int			rw;
+	int			flags;
+	unsigned		len;
+	unsigned		done;
+	unsigned long long	offset;
+	char			*buf;
+	struct timespec		start;		/* for --stats */
+};
+
+__thread struct uring_slot	*uring_slots;
+__thread int	uring_inflight;
+__thread bool	uring_fixed_bufs;
+__thread bool	uring_fixed_file;
+
+static int
+uring_setup_queue(void)
+{
+	struct iovec *iov;
+	unsigned align = MAX(page_size, MAX(readbdy, writebdy));
+	int i, ret;
+
+	if (uring_qd > URING_ENTRIES) {
+		fprintf(stderr, "uring_setup: queue depth %d is over %d\n",
+			uring_qd, URING_ENTRIES);
+		exit(111);
+	}
+	uring_slots = calloc(uring_qd, sizeof(*uring_slots));
+	iov = calloc(uring_qd, sizeof(*iov));
+	if (!uring_slots || !iov) {
+		prterr("uring_setup: calloc");
+		exit(101);
+	}
+	for (i = 0; i < uring_qd; i++) {
+		char *buf = malloc(maxoplen + align);
+
+		if (!buf) {
+			prterr("uring_setup: malloc");
+			exit(101);
+		}
+		uring_slots[i].buf = round_ptr_up(buf, align, 0);
+		iov[i].iov_base = uring_slots[i].buf;
+		iov[i].iov_len = maxoplen;
+	}
+
+	ret = io_uring_register_buffers(&ring, iov, uring_qd);
+	if (ret)
+		prt("uring_setup: can't register buffers (%s), carrying on without\n",
+		    strerror(-ret));
+	uring_fixed_bufs = !ret;
+	free(iov);
+
+	/* with --files fd changes from op to op */
+	if (pool)
+		return 0;
+	ret = io_uring_register_files(&ring, &fd, 1);
+	if (ret)
+		prt("uring_setup: can't register the file (%s), carrying on without\n",
+		    strerror(-ret));
+	uring_fixed_file = !ret;
+	return 0;
+}
+
 int
 uring_setup()
 {
+	struct io_uring_params params = { 0 };
 	int ret;
 
-	ret = io_uring_queue_init(URING_ENTRIES, &ring, 0);
+	if (uring_sqpoll) {
+		params.flags |= IORING_SETUP_SQPOLL;
+		params.sq_thread_idle = 1000;
+	}
+	ret = io_uring_queue_init_params(URING_ENTRIES, &ring, &params);
 	if (ret != 0) {
 		fprintf(stderr, "uring_setup: io_uring_queue_init failed: %s\n",
-				strerror(ret));
+				strerror(-ret));
+		if (uring_sqpoll)
+			exit(111);
 		return -1;
 	}
+	if (uring_qd)
+		return uring_setup_queue();
 	return 0;
 }
 
+/* (Re)issue whatever is left of the I/O in slot s. */
+static void
+uring_prep_slot(struct uring_slot *s)
+{
+	struct io_uring_sqe *sqe;
+	char *p = s->buf + s->done;
+	unsigned l = s->len - s->done;
+	unsigned long long o = s->offset + s->done;
+	int fdx = uring_fixed_file ? 0 : fd;
+
+	sqe = io_uring_get_sqe(&ring);
+	if (!sqe) {
+		prt("uring_queue: io_uring_get_sqe failed\n");
+		report_failure(153);
+	}
+	if (uring_fixed_bufs && s->rw == READ)
+		io_uring_prep_read_fixed(sqe, fdx, p, l, o, s - uring_slots);
+	else if (uring_fixed_bufs)
+		io_uring_prep_write_fixed(sqe, fdx, p, l, o, s - uring_slots);
+	else if (s->rw == READ)
+		io_uring_prep_read(sqe, fdx, p, l, o);
+	else
+		io_uring_prep_write(sqe, fdx, p, l, o);
+	if (uring_fixed_file)
+		sqe->flags |= IOSQE_FIXED_FILE;
+	sqe->rw_flags = s->flags;
+	io_uring_sqe_set_data(sqe, s);
+}
+
+static void
+uring_submit_slots(void)
+{
+	int ret = io_uring_submit(&ring);
+
+	if (ret < 0) {
+		errno = -ret;
+		prterr("uring_queue: io_uring_submit");
+		report_failure(153);
+	}
+}
+
+/* Wait for one completion and check it. */
+static void
+uring_reap(void)
+{
+	struct io_uring_cqe *cqe;
+	struct uring_slot *s;
+	int ret;
+
+	ret = io_uring_wait_cqe(&ring, &cqe);
+	if (ret) {
+		errno = -ret;
+		prterr("uring_reap: io_uring_wait_cqe");
+		report_failure(153);
+	}
+	s = io_uring_cqe_get_data(cqe);
+	ret = cqe->res;
+	io_uring_cqe_seen(&ring, cqe);
+
+	if (ret <= 0) {
+		if (ret < 0) {
+			errno = -ret;
+			prterr(s->rw == READ ? "doread: read" : "dowrite: write");
+		} else {
+			prt("short %s: 0x%x bytes instead of 0x%x at 0x%llx\n",
+			    s->rw == READ ? "read" : "write", s->done, s->len,
+			    s->offset);
+		}
+		report_failure(s->rw == READ ? 141 : 151);
+	}
+
+	/* io_uring may hand back short transfers, so just go again */
+	s->done += ret;
+	if (s->done < s->len) {
+		uring_prep_slot(s);
+		uring_submit_slots();
+		return;
+	}
+
+	if (s->rw == READ)
+		check_buffers(s->buf, s->offset, s->len);
+	if (stats) {
+		int op = s->rw == READ ? OP_READ : OP_WRITE;
+
+		if (s->flags & RWF_DONTCACHE)
+			op++;	/* OP_READ_DONTCACHE or OP_WRITE_DONTCACHE */
+		stats_add(op, PATH_URING, &s->start);
+	}
+	s->busy = false;
+	uring_inflight--;
+}
+
+static bool
+uring_conflicts(int rw, unsigned long long offset, unsigned len)
+{
+	int i;
+
+	for (i = 0; i < uring_qd; i++) {
+		struct uring_slot *s = &uring_slots[i];
+
+		if (s->busy && (rw == WRITE || s->rw == WRITE) &&
+		    offset < s->offset + s->len && s->offset < offset + len)
+			return true;
+	}
+	return false;
+}
+
+void
+uring_wait_overlap(int rw, unsigned long long offset, unsigned len)
+{
+	while (uring_conflicts(rw, offset, len))
+		uring_reap();
+}
+
+void
+uring_queue(int rw, char *buf, unsigned len, unsigned long long offset,
+	    int flags, bool wait)
+{
+	struct uring_slot *s = NULL;
+	int i;
+
+	uring_wait_overlap(rw, offset, len);
+	while (!s) {
+		for (i = 0; i < uring_qd && !s; i++)
+			if (!uring_slots[i].busy)
+				s = &uring_slots[i];
+		if (!s)
+			uring_reap();
+	}
+
+	s->busy = true;
+	s->rw = rw;
+	s->flags = flags;
+	s->len = len;
+	s->done = 0;
+	s->offset = offset;
+	if (rw == WRITE)
+		memcpy(s->buf, buf, len);
+	if (stats)
+		clock_gettime(CLOCK_MONOTONIC, &s->start);
+	uring_inflight++;
+	uring_prep_slot(s);
+	uring_submit_slots();
+
+	while (wait && s->busy)
+		uring_reap();
+}
+
+void
+uring_drain(void)
+{
+	while (uring_inflight)
+		uring_reap();
+}
+
+void
+uring_reopen(void)
+{
+	int ret;
+
+	if (!uring_fixed_file)
+		return;
+	ret = io_uring_register_files_update(&ring, 0, &fd, 1);
+	if (ret != 1) {
+		errno = ret < 0 ? -ret : EIO;
+		prterr("uring_reopen: io_uring_register_files_update");
+		report_failure(182);
+	}
+}
+
 int
-uring_rw(int rw, int fd, char *buf, unsigned len, unsigned offset, int flags)
+uring_rw(int rw, int fd, char *buf, unsigned len, unsigned long long offset,
+	 int flags)
 {
 	struct io_uring_sqe     *sqe;
 	struct io_uring_cqe     *cqe;
@@ -2755,7 +4971,10 @@ uring_rw(int rw, int fd, char *buf, unsigned len, unsigned offset, int flags)
 	int res = 0;
 	char *p = buf;
 	unsigned l = len;
-	unsigned o = offset;
+	unsigned long long o = offset;
+
+	/* anything queued has to finish before we can wait for just us */
+	uring_drain();
 
 	/*
 	 * Due to io_uring tries non-blocking IOs (especially read), that
@@ -2826,15 +5045,40 @@ uring_rw(int rw, int fd, char *buf, unsigned len, unsigned offset, int flags)
 }
 #else
 int
-uring_rw(int rw, int fd, char *buf, unsigned len, unsigned offset, int flags)
+uring_rw(int rw, int fd, char *buf, unsigned len, unsigned long long offset,
+	 int flags)
 {
 	fprintf(stderr, "io_rw: need IO_URING support!\n");
 	exit(111);
 }
+
+void
+uring_queue(int rw, char *buf, unsigned len, unsigned long long offset,
+	    int flags, bool wait)
+{
+	fprintf(stderr, "uring_queue: need IO_URING support!\n");
+	exit(111);
+}
+
+void
+uring_wait_overlap(int rw, unsigned long long offset, unsigned len)
+{
+}
+
+void
+uring_drain(void)
+{
+}
+
+void
+uring_reopen(void)
+{
+}
 #endif
 
 int
-fsx_rw(int rw, int fd, char *buf, unsigned len, unsigned offset, int flags)
+fsx_rw(int rw, int fd, char *buf, unsigned len, unsigned long long offset,
+       int flags)
 {
 	int ret;
 
@@ -2894,10 +5138,10 @@ collapse_hugepages(void)
 	if (!numops || (numops & ((1U << 14) - 1)))
 		return;
 
-	ret = madvise(hugepages_info.orig_good_buf,
-		      hugepages_info.good_buf_size, MADV_COLLAPSE);
+	ret = madvise(hugepages_info.orig_write_buf,
+		      hugepages_info.write_buf_size, MADV_COLLAPSE);
 	if (ret)
-		prt("collapsing hugepages for good_buf failed (numops=%llu): %s\n",
+		prt("collapsing hugepages for write_buf failed (numops=%llu): %s\n",
 		     numops, strerror(errno));
 	ret = madvise(hugepages_info.orig_temp_buf,
 		      hugepages_info.temp_buf_size, MADV_COLLAPSE);
@@ -2912,6 +5156,9 @@ keep_running(void)
 {
 	int ret;
 
+	if (threads_failed)
+		return false;
+
 	if (hugepages)
 	        collapse_hugepages();
 
@@ -2992,27 +5239,23 @@ init_hugepages_buf(unsigned len, int hugepage_size, int alignment, long *buf_siz
 	return buf;
 }
 
+/* Allocate the per-thread I/O buffers. */
 static void
-init_buffers(void)
+init_op_buffers(void)
 {
-	int i;
-
-	original_buf = (char *) malloc(maxfilelen);
-	for (i = 0; i < maxfilelen; i++)
-		original_buf[i] = random() % 256;
 	if (hugepages) {
 		long hugepage_size = get_hugepage_size();
 		if (hugepage_size == -1) {
 			prterr("get_hugepage_size()");
 			exit(102);
 		}
-		good_buf = init_hugepages_buf(maxfilelen, hugepage_size, writebdy,
-					      &hugepages_info.good_buf_size);
-		if (!good_buf) {
-			prterr("init_hugepages_buf failed for good_buf");
+		write_buf = init_hugepages_buf(maxoplen, hugepage_size, writebdy,
+					       &hugepages_info.write_buf_size);
+		if (!write_buf) {
+			prterr("init_hugepages_buf failed for write_buf");
 			exit(103);
 		}
-		hugepages_info.orig_good_buf = good_buf;
+		hugepages_info.orig_write_buf = write_buf;
 
 		temp_buf = init_hugepages_buf(maxoplen, hugepage_size, readbdy,
 					      &hugepages_info.temp_buf_size);
@@ -3022,20 +5265,228 @@ init_buffers(void)
 		}
 		hugepages_info.orig_temp_buf = temp_buf;
 	} else {
-		unsigned long good_buf_len = maxfilelen + writebdy;
+		unsigned long write_buf_len = maxoplen + writebdy;
 		unsigned long temp_buf_len = maxoplen + readbdy;
 
-		good_buf = calloc(1, good_buf_len);
+		write_buf = calloc(1, write_buf_len);
 		temp_buf = calloc(1, temp_buf_len);
 	}
-	good_buf = round_ptr_up(good_buf, writebdy, 0);
+	write_buf = round_ptr_up(write_buf, writebdy, 0);
 	temp_buf = round_ptr_up(temp_buf, readbdy, 0);
 }
 
+static void
+init_buffers(void)
+{
+	unsigned long i;
+
+	original_len = MIN(maxfilelen, ORIGINAL_BUF_MAX);
+	original_buf = (char *) malloc(original_len);
+	if (!original_buf) {
+		prterr("init_buffers: malloc");
+		exit(101);
+	}
+	for (i = 0; i < original_len; i++)
+		original_buf[i] = fsx_random() % 256;
+	init_op_buffers();
+}
+
+static unsigned long long
+lcm(unsigned long long a, unsigned long long b)
+{
+	unsigned long long x = a, y = b;
+
+	while (y) {
+		unsigned long long t = x % y;
+
+		x = y;
+		y = t;
+	}
+	return a / x * b;
+}
+
+struct fsx_worker {
+	int		id;
+	pthread_t	tid;
+	long long	numops;
+	long long	testcalls;
+	unsigned long long	folio_ops;
+	unsigned long long	folio_hits[FOLIO_NR];
+	const char	*logid;
+	const char	*goodfile;
+	const char	*logfile;
+	const char	*opsfile;
+};
+
+static void *
+fsx_worker(void *arg)
+{
+	struct fsx_worker *w = arg;
+	char logfile[PATH_MAX];
+	char name[PATH_MAX];
+
+	thread_id = w->id;
+	range_base = w->id * thread_stride;
+	numops = w->numops;
+	file_size = biggest = shared_base + shared_len;
+	fsx_srandom(seed + w->id);
+
+	snprintf(name, sizeof(name), "%s%st%d", w->logid ? w->logid : "",
+		 w->logid ? "." : "", w->id);
+	logid = strdup(name);
+	snprintf(goodfile, sizeof(goodfile), "%s.t%d", w->goodfile, w->id);
+	snprintf(logfile, sizeof(logfile), "%s.t%d", w->logfile, w->id);
+	snprintf(opsfile, sizeof(opsfile), "%s.t%d", w->opsfile, w->id);
+
+	fd = open(fname, O_RDWR|o_direct, 0);
+	if (fd < 0) {
+		prterr(fname);
+		exit(91);
+	}
+	fsxgoodfd = open(goodfile, O_RDWR|O_CREAT|O_TRUNC, 0666);
+	if (fsxgoodfd < 0) {
+		prterr(goodfile);
+		exit(92);
+	}
+	fsxlogf = fopen(logfile, "w");
+	if (fsxlogf == NULL) {
+		prterr(logfile);
+		exit(93);
+	}
+	unlink(opsfile);
+
+	if (replayops) {
+		snprintf(name, sizeof(name), "%s.t%d", replayops, w->id);
+		open_replay(name);
+	}
+	if (binlog) {
+		snprintf(name, sizeof(name), "%s.t%d", binlog, w->id);
+		binlog_open(name);
+	}
+
+#ifdef AIO
+	if (aio)
+		aio_setup();
+#endif
+#ifdef URING
+	if (uring)
+		uring_setup();
+#endif
+	init_op_buffers();
+	if (all_stats)
+		stats_init(w->id);
+	if (kcov_guided)
+		kcov_setup();
+
+	while (keep_running())
+		if (!test())
+			break;
+	uring_drain();
+	thread_done(0);
+
+	if (close(fd)) {
+		prterr("close");
+		report_failure(99);
+	}
+	if (recordops || threads_failed)
+		logdump();
+	binlog_close();
+	w->testcalls = testcalls;
+	w->folio_ops = folio_ops;
+	memcpy(w->folio_hits, folio_hits, sizeof(folio_hits));
+	fclose(fsxlogf);
+	return NULL;
+}
+
+/*
+ * Lay the file out as nr_threads private ranges followed by the shared
+ * range, run a worker on each and wait for them.  Ranges are aligned so
+ * that no I/O, mapping or lock granule ever straddles two of them.
+ */
+static int
+run_threads(const char *logfile)
+{
+	struct fsx_worker *workers;
+	unsigned long long unit, idx;
+	long long calls = 0;
+	int i, j, ret;
+
+	lock_align = lcm(lcm(readbdy, writebdy), lcm(page_size, SHADOW_CHUNK));
+	unit = lcm(lock_align, lcm(block_size, 1024 * 1024));
+	thread_stride = roundup_64(maxfilelen, unit);
+	shared_base = nr_threads * thread_stride;
+	shared_len = roundup_64(shared_len, unit);
+
+	/* populate the shared tree now so workers only ever fill in leaves */
+	for (idx = 0; idx < shared_len >> SHADOW_CHUNK_SHIFT; idx += SHADOW_FANOUT)
+		shadow_leaf((shared_base >> SHADOW_CHUNK_SHIFT) + idx, true);
+
+	file_size = biggest = shared_base + shared_len;
+	if (ftruncate(fd, file_size)) {
+		prterr("run_threads: ftruncate");
+		exit(94);
+	}
+	if (!quiet)
+		prt("%d threads, 0x%llx bytes apart, shared range 0x%llx thru 0x%llx\n",
+		    nr_threads, thread_stride, shared_base,
+		    shared_len ? shared_base + shared_len - 1 : shared_base);
+
+	/* each worker keeps its own .fsxgood */
+	close(fsxgoodfd);
+	fsxgoodfd = 0;
+	unlink(goodfile);
+
+	range_locks = calloc(nr_threads, sizeof(*range_locks));
+	replay_seq = calloc(nr_threads, sizeof(*replay_seq));
+	workers = calloc(nr_threads, sizeof(*workers));
+	if (!range_locks || !replay_seq || !workers) {
+		prterr("run_threads: calloc");
+		exit(101);
+	}
+	for (i = 0; i < nr_threads; i++) {
+		workers[i].id = i;
+		workers[i].numops = numops;
+		workers[i].logid = logid;
+		workers[i].goodfile = goodfile;
+		workers[i].logfile = logfile;
+		workers[i].opsfile = opsfile;
+		ret = pthread_create(&workers[i].tid, NULL, fsx_worker,
+				     &workers[i]);
+		if (ret) {
+			errno = ret;
+			prterr("run_threads: pthread_create");
+			exit(101);
+		}
+	}
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(workers[i].tid, NULL);
+		calls += workers[i].testcalls;
+		folio_ops += workers[i].folio_ops;
+		for (j = 0; j < FOLIO_NR; j++)
+			folio_hits[j] += workers[i].folio_hits[j];
+	}
+	testcalls = calls;
+	free(workers);
+	return threads_failed;
+}
+
 static struct option longopts[] = {
 	{"replay-ops", required_argument, 0, 256},
 	{"record-ops", optional_argument, 0, 255},
 	{"duration", optional_argument, 0, 254},
+	{"threads", required_argument, 0, 253},
+	{"shared-range", required_argument, 0, 252},
+	{"uring-qd", required_argument, 0, 251},
+	{"uring-sqpoll", no_argument, 0, 250},
+	{"binlog", required_argument, 0, 249},
+	{"checkpoint", required_argument, 0, 248},
+	{"replay-checkpoint", no_argument, 0, 247},
+	{"files", required_argument, 0, 246},
+	{"stats", required_argument, 0, 245},
+	{"stats-interval", required_argument, 0, 244},
+	{"folio-bias", required_argument, 0, 243},
+	{"kcov", no_argument, 0, 242},
+	{"ctr-random", no_argument, 0, 241},
 	{ }
 };
 
@@ -3057,6 +5508,9 @@ main(int argc, char **argv)
 	mmap_mask = page_mask;
 
 	setvbuf(stdout, (char *)0, _IOLBF, 0); /* line buffered stdout */
+#ifdef FSX_SIMD
+	have_avx2 = __builtin_cpu_supports("avx2");
+#endif
 
 	while ((ch = getopt_long(argc, argv,
 				 "0b:c:de:fg:hi:j:kl:m:no:p:qr:s:t:uw:xyABD:EFJKHzCILN:OP:RS:UWXZ",
@@ -3293,6 +5747,61 @@ main(int argc, char **argv)
 		case 256:  /* --replay-ops */
 			replayops = optarg;
 			break;
+		case 253:  /* --threads */
+			nr_threads = getnum(optarg, &endp);
+			if (nr_threads <= 0)
+				usage();
+			break;
+		case 252:  /* --shared-range */
+			shared_len = getnum(optarg, &endp);
+			if (shared_len == 0)
+				usage();
+			break;
+		case 251:  /* --uring-qd */
+			uring_qd = getnum(optarg, &endp);
+			if (uring_qd <= 0)
+				usage();
+			uring = 1;
+			break;
+		case 250:  /* --uring-sqpoll */
+			uring_sqpoll = 1;
+			uring = 1;
+			break;
+		case 249:  /* --binlog */
+			binlog = optarg;
+			break;
+		case 248:  /* --checkpoint */
+			checkpoint_ops = getnum(optarg, &endp);
+			if (checkpoint_ops <= 0)
+				usage();
+			break;
+		case 247:  /* --replay-checkpoint */
+			replay_checkpoint = 1;
+			break;
+		case 245:  /* --stats */
+			stats_path = optarg;
+			break;
+		case 244:  /* --stats-interval */
+			stats_interval = getnum(optarg, &endp);
+			if (stats_interval <= 0)
+				usage();
+			break;
+		case 242:  /* --kcov */
+			kcov_guided = 1;
+			break;
+		case 241:  /* --ctr-random */
+			ctr_random = 1;
+			break;
+		case 243:  /* --folio-bias */
+			folio_bias = getnum(optarg, &endp);
+			if (folio_bias < 0 || folio_bias > 100)
+				usage();
+			break;
+		case 246:  /* --files */
+			nr_files = getnum(optarg, &endp);
+			if (nr_files < 1 || nr_files > 65535)
+				usage();
+			break;
 		default:
 			usage();
 			/* NOTREACHED */
@@ -3312,6 +5821,39 @@ main(int argc, char **argv)
 		usage();
 	}
 
+	if (nr_threads && (simulatedopcount || pollute_eof || integrity ||
+			   lite || !(o_flags & O_TRUNC))) {
+		fprintf(stderr, "--threads excludes -b, -e, -i, -k and -L\n");
+		usage();
+	}
+	if (shared_len && !nr_threads) {
+		fprintf(stderr, "--shared-range requires --threads\n");
+		usage();
+	}
+	if (checkpoint_ops && !binlog) {
+		fprintf(stderr, "--checkpoint requires --binlog\n");
+		usage();
+	}
+	if (replay_checkpoint && !replayops) {
+		fprintf(stderr, "--replay-checkpoint requires --replay-ops\n");
+		usage();
+	}
+	if (nr_threads && (checkpoint_ops || replay_checkpoint)) {
+		fprintf(stderr, "--threads excludes checkpoints\n");
+		usage();
+	}
+	if (stats_interval && !stats_path) {
+		fprintf(stderr, "--stats-interval requires --stats\n");
+		usage();
+	}
+	if (nr_files > 1 && (nr_threads || simulatedopcount || integrity ||
+			     lite || !(o_flags & O_TRUNC) || checkpoint_ops ||
+			     replay_checkpoint)) {
+		fprintf(stderr, "--files excludes -b, -i, -k, -L, --threads "
+			"and checkpoints\n");
+		usage();
+	}
+
 	fname = argv[0];
 	tmp = strdup(fname);
 	if (!tmp) {
@@ -3333,7 +5875,7 @@ main(int argc, char **argv)
 
 	if (!quiet && seed)
 		prt("Seed set to %d\n", seed);
-	srandom(seed);
+	fsx_srandom(seed);
 	fd = open(fname, o_flags, 0666);
 	if (fd < 0) {
 		prterr(fname);
@@ -3361,6 +5903,26 @@ main(int argc, char **argv)
 		}
 	}
 #endif
+	if (nr_files > 1) {
+		pool = calloc(nr_files, sizeof(*pool));
+		if (!pool) {
+			prterr("calloc");
+			exit(101);
+		}
+		pool[0].fd = fd;
+		pool[0].name = fname;
+		for (i = 1; i < nr_files; i++) {
+			if (asprintf(&pool[i].name, "%s.%d", fname, i) < 0) {
+				prterr("asprintf");
+				exit(101);
+			}
+			pool[i].fd = open(pool[i].name, o_flags, 0666);
+			if (pool[i].fd < 0) {
+				prterr(pool[i].name);
+				exit(91);
+			}
+		}
+	}
 
 	if (dirpath) {
 		snprintf(goodfile, sizeof(goodfile), "%s%s.fsxgood", dname, bname);
@@ -3385,22 +5947,28 @@ main(int argc, char **argv)
 	}
 	unlink(opsfile);
 
-	if (replayops) {
-		replayopsf = fopen(replayops, "r");
-		if (!replayopsf) {
-			prterr(replayops);
-			exit(93);
-		}
-	}
+	if (replayops && !nr_threads)
+		open_replay(replayops);
+	if (binlog && !nr_threads)
+		binlog_open(binlog);
 
 #ifdef AIO
-	if (aio) 
+	if (aio && !nr_threads)
 		aio_setup();
 #endif
 #ifdef URING
-	if (uring)
+	if (uring && !nr_threads)
 		uring_setup();
 #endif
+	if (kcov_guided) {
+		kcov_map = calloc((1 << KCOV_MAP_BITS) / 8, 1);
+		if (!kcov_map) {
+			prterr("main: calloc");
+			exit(101);
+		}
+		if (!nr_threads)
+			kcov_setup();
+	}
 
 	if (!(o_flags & O_TRUNC)) {
 		off_t ret;
@@ -3420,30 +5988,37 @@ main(int argc, char **argv)
 	init_buffers();
 	if (lite) {	/* zero entire existing file */
 		ssize_t written;
-
-		written = write(fd, good_buf, (size_t)maxfilelen);
-		if (written != maxfilelen) {
-			if (written == -1) {
-				prterr(fname);
-				warn("main: error on write");
-			} else
-				warn("main: short write, 0x%x bytes instead "
-					"of 0x%lx\n",
-					(unsigned)written,
-					maxfilelen);
-			exit(98);
+		off_t off;
+
+		/* temp_buf is still all zeroes at this point */
+		for (off = 0; off < maxfilelen; off += written) {
+			size_t len = MIN(maxoplen, maxfilelen - off);
+
+			written = write(fd, temp_buf, len);
+			if (written != len) {
+				if (written == -1) {
+					prterr(fname);
+					warn("main: error on write");
+				} else
+					warn("main: short write, 0x%x bytes instead "
+						"of 0x%lx\n",
+						(unsigned)written,
+						maxfilelen);
+				exit(98);
+			}
 		}
 	} else {
 		ssize_t ret, len = file_size;
 		off_t off = 0;
 
 		while (len > 0) {
-			ret = read(fd, good_buf + off, len);
+			ret = read(fd, temp_buf, MIN(len, maxoplen));
 			if (ret == -1) {
 				prterr(fname);
 				warn("main: error on read");
 				exit(98);
 			}
+			shadow_write(off, temp_buf, ret);
 			len -= ret;
 			off += ret;
 		}
@@ -3451,6 +6026,13 @@ main(int argc, char **argv)
 		check_trunc_hack();
 	}
 
+	if (replay_checkpoint)
+		replay_from_checkpoint();
+
+	/* these move data between the ranges of different threads */
+	if (nr_threads)
+		collapse_range_calls = insert_range_calls = 0;
+
 	if (fallocate_calls)
 		fallocate_calls = test_fallocate(0);
 	if (keep_size_calls)
@@ -3476,18 +6058,62 @@ main(int argc, char **argv)
 	if (dontcache_io)
 		dontcache_io = test_dontcache_io();
 
-	while (keep_running())
-		if (!test())
-			break;
+	if (folio_bias)
+		folio_setup();
+
+	if (stats_path) {
+		statsf = fopen(stats_path, "w");
+		if (statsf == NULL) {
+			prterr(stats_path);
+			exit(93);
+		}
+		all_stats = calloc(MAX(nr_threads, 1), sizeof(*all_stats));
+		if (!all_stats) {
+			prterr("main: calloc");
+			exit(101);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &stats_start);
+		if (!nr_threads)
+			stats_init(0);
+	}
 
+	if (nr_threads) {
+		i = run_threads(logfile);
+		if (i) {
+			prt("thread failure, see the per-thread logs\n");
+			exit(i);
+		}
+	} else {
+		while (keep_running())
+			if (!test())
+				break;
+		uring_drain();
+	}
+
+	for (i = 0; pool && i < nr_files; i++) {
+		if (i != cur_file && close(pool[i].fd)) {
+			prterr("close");
+			report_failure(99);
+		}
+	}
 	free(tmp);
 	if (close(fd)) {
 		prterr("close");
 		report_failure(99);
 	}
 	prt("All %lld operations completed A-OK!\n", testcalls);
-	if (recordops)
+	if (folio_bias)
+		folio_report();
+	if (kcov_guided)
+		prt("kcov: %llu edges, found by %llu ops\n", kcov_edges,
+		    kcov_new_ops);
+	if (recordops && !nr_threads)
 		logdump();
+	binlog_close();
+	if (statsf) {
+		stats_report(true);
+		fclose(statsf);
+	}
 
 	fclose(fsxlogf);
 	exit(0);
@@ -0,0 +1,141 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Convert a binary fsx --binlog log to the text format of .fsxops files,
+ * so it can be read, edited and fed back to fsx --replay-ops.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "fsxlog.h"
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: fsxlog [-c] [-i] binlog\n"
+		"	-c: only print the ops after the last checkpoint\n"
+		"	-i: print the header and the checkpoints instead of the ops\n");
+	exit(1);
+}
+
+static void
+print_op(const struct fsxlog_hdr *hdr, const struct fsxlog_rec *rec)
+{
+	unsigned int i;
+
+	if (rec->op >= hdr->nr_ops || !hdr->op_names[rec->op][0] ||
+	    rec->nr_args > 4) {
+		fprintf(stderr, "bad op record for operation %llu\n",
+			(unsigned long long)rec->opnum);
+		exit(1);
+	}
+	if (rec->flags & FSXLOG_FL_SKIPPED)
+		printf("skip ");
+	printf("%.*s", FSXLOG_NAME_LEN, hdr->op_names[rec->op]);
+	for (i = 0; i < rec->nr_args; i++)
+		printf(" 0x%llx", (unsigned long long)rec->args[i]);
+	if (rec->flags & FSXLOG_FL_KEEP_SIZE)
+		printf(" keep_size");
+	if (rec->flags & FSXLOG_FL_CLOSE_OPEN)
+		printf(" close_open");
+	if (rec->flags & FSXLOG_FL_UNSHARE)
+		printf(" unshare");
+	if (rec->seq)
+		printf(" seq=%llu", (unsigned long long)rec->seq);
+	if (hdr->nr_files > 1)
+		printf(" file=%u", rec->file);
+	if (hdr->nr_files > 1 && rec->nr_args == 4)
+		printf(" dest=%u", rec->dest_file);
+	printf("\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	const struct fsxlog_hdr *hdr;
+	const struct fsxlog_rec *rec;
+	const char *map;
+	size_t pos, start, end;
+	struct stat st;
+	int after_ckpt = 0, info = 0;
+	int c, fd;
+
+	while ((c = getopt(argc, argv, "ci")) != EOF) {
+		switch (c) {
+		case 'c':
+			after_ckpt = 1;
+			break;
+		case 'i':
+			info = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 1)
+		usage();
+
+	fd = open(argv[optind], O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(argv[optind]);
+		return 1;
+	}
+	if (st.st_size < sizeof(*hdr)) {
+		fprintf(stderr, "%s: too short for a binary log\n", argv[optind]);
+		return 1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+	hdr = (const struct fsxlog_hdr *)map;
+	if (memcmp(hdr->magic, FSXLOG_MAGIC, sizeof(hdr->magic)) != 0 ||
+	    hdr->version != FSXLOG_VERSION || hdr->hdr_size < sizeof(*hdr) ||
+	    hdr->rec_size < sizeof(*rec) || hdr->nr_ops > FSXLOG_MAX_OPS) {
+		fprintf(stderr, "%s: not a binary fsx log\n", argv[optind]);
+		return 1;
+	}
+
+	/* find the end of the log and the last checkpoint */
+	start = hdr->hdr_size;
+	for (pos = hdr->hdr_size; pos + hdr->rec_size <= st.st_size;
+	     pos += hdr->rec_size) {
+		rec = (const struct fsxlog_rec *)(map + pos);
+		if (rec->type == 0)
+			break;
+		if (rec->type != FSXLOG_CKPT)
+			continue;
+		if (info)
+			printf("checkpoint at operation %llu: size 0x%llx, "
+			       "%llu ops logged\n",
+			       (unsigned long long)rec->opnum,
+			       (unsigned long long)rec->args[0],
+			       (unsigned long long)rec->args[1]);
+		start = pos + hdr->rec_size;
+	}
+	end = pos;
+
+	if (info) {
+		printf("seed %d, %u files, maxfilelen 0x%llx, %zu records\n",
+		       hdr->seed, hdr->nr_files,
+		       (unsigned long long)hdr->maxfilelen,
+		       (end - hdr->hdr_size) / hdr->rec_size);
+		return 0;
+	}
+
+	if (!after_ckpt)
+		start = hdr->hdr_size;
+	for (pos = start; pos < end; pos += hdr->rec_size) {
+		rec = (const struct fsxlog_rec *)(map + pos);
+		if (rec->type == FSXLOG_OP)
+			print_op(hdr, rec);
+	}
+	return 0;
+}
@@ -0,0 +1,66 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Binary operation log written by fsx --binlog and read back by
+ * fsx --replay-ops and the fsxlog tool.
+ *
+ * The file is a header followed by fixed size records, appended through a
+ * shared mapping so that the log survives the process being killed.  A
+ * record with type 0 marks the end of the log, which is how a log that was
+ * never closed cleanly ends too.
+ */
+#ifndef FSXLOG_H
+#define FSXLOG_H
+
+#include <stdint.h>
+
+#define FSXLOG_MAGIC		"FSXBLOG"	/* 8 bytes with the NUL */
+#define FSXLOG_VERSION		1
+#define FSXLOG_MAX_OPS		32
+#define FSXLOG_NAME_LEN		16
+
+/* Record types */
+#define FSXLOG_OP		1	/* one logged operation */
+#define FSXLOG_CKPT		2	/* the model was saved to <log>.ckpt */
+
+/* Op flags, same values as fsx's enum opflags */
+#define FSXLOG_FL_SKIPPED	1
+#define FSXLOG_FL_CLOSE_OPEN	2
+#define FSXLOG_FL_KEEP_SIZE	4
+#define FSXLOG_FL_UNSHARE	8
+
+struct fsxlog_hdr {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	hdr_size;	/* offset of the first record */
+	uint32_t	rec_size;
+	uint32_t	nr_ops;		/* entries in op_names */
+	int32_t		seed;
+	uint32_t	nr_files;	/* fsx --files, 1 without */
+	uint64_t	maxfilelen;
+	/* op names indexed by fsxlog_rec.op, as used in .fsxops files */
+	char		op_names[FSXLOG_MAX_OPS][FSXLOG_NAME_LEN];
+};
+
+/*
+ * For FSXLOG_OP records op, flags, nr_args, args, seq and the pool files are
+ * exactly what the text log holds.  For FSXLOG_CKPT records args[0] is the file size of
+ * the saved model and args[1] the number of op records before this one.
+ * opnum is fsx's operation counter at the time of the record.
+ */
+struct fsxlog_rec {
+	uint32_t	type;
+	uint16_t	op;
+	uint16_t	file;		/* pool file the op ran on */
+	uint32_t	flags;
+	uint16_t	nr_args;
+	uint16_t	dest_file;	/* destination file of two file ops */
+	uint64_t	args[4];
+	uint64_t	seq;
+	uint64_t	opnum;
+};
+
+/* records are laid out on rec_size boundaries after a hdr_size header */
+#define FSXLOG_HDR_SIZE		1024
+#define FSXLOG_REC_SIZE		64
+
+#endif /* FSXLOG_H */
@@ -0,0 +1,142 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Op latency histograms for fsx and fsstress --stats.
+ *
+ * Histograms are log-linear like HDR histograms: HIST_SUB buckets for every
+ * power of two of nanoseconds, so any latency lands in a bucket no more than
+ * 1/HIST_SUB wider than itself.  hist_add() counts with atomics, so that the
+ * workers that share a histogram, and a report reading one while it is
+ * counted into, need no locks.  A report adds the histograms it reads into
+ * one of its own with hist_sum() and works on that.
+ */
+#ifndef OPHIST_H
+#define OPHIST_H
+
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+
+#define HIST_SUB_BITS	4
+#define HIST_SUB	(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS	(48 * HIST_SUB)	/* up to 2^48ns, a few days */
+
+struct op_hist {
+	unsigned long long	count;
+	unsigned long long	errors;
+	unsigned long long	sum;
+	unsigned long long	min;
+	unsigned long long	max;
+	unsigned long long	buckets[HIST_BUCKETS];
+};
+
+static inline unsigned long long
+ts_ns(const struct timespec *ts)
+{
+	return ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+static inline void
+hist_init(struct op_hist *h)
+{
+	memset(h, 0, sizeof(*h));
+	h->min = ULLONG_MAX;
+}
+
+static inline unsigned
+hist_bucket(unsigned long long ns)
+{
+	unsigned b;
+	int msb;
+
+	if (ns < HIST_SUB)
+		return ns;
+	msb = 63 - __builtin_clzll(ns);
+	b = (msb - HIST_SUB_BITS + 1) * HIST_SUB +
+	    ((ns >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+	return b < HIST_BUCKETS ? b : HIST_BUCKETS - 1;
+}
+
+/* smallest latency that lands in bucket b */
+static inline unsigned long long
+hist_value(unsigned b)
+{
+	if (b < HIST_SUB)
+		return b;
+	return (unsigned long long)(HIST_SUB + b % HIST_SUB) << (b / HIST_SUB - 1);
+}
+
+static inline unsigned long long
+hist_percentile(const struct op_hist *h, double q)
+{
+	unsigned long long want = q * h->count + 0.5, seen = 0;
+	unsigned long long v;
+	unsigned b;
+
+	if (!want)
+		want = 1;
+	for (b = 0; b < HIST_BUCKETS; b++) {
+		seen += h->buckets[b];
+		if (seen >= want) {
+			v = hist_value(b + 1) - 1;
+			return v < h->max ? v : h->max;
+		}
+	}
+	return h->max;
+}
+
+static inline void
+hist_atomic_min(unsigned long long *p, unsigned long long v)
+{
+	unsigned long long old = __atomic_load_n(p, __ATOMIC_RELAXED);
+
+	while (v < old && !__atomic_compare_exchange_n(p, &old, v, true,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+static inline void
+hist_atomic_max(unsigned long long *p, unsigned long long v)
+{
+	unsigned long long old = __atomic_load_n(p, __ATOMIC_RELAXED);
+
+	while (v > old && !__atomic_compare_exchange_n(p, &old, v, true,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/* count an op that took ns, and failed if err */
+static inline void
+hist_add(struct op_hist *h, unsigned long long ns, int err)
+{
+	__atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+	if (err)
+		__atomic_fetch_add(&h->errors, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->sum, ns, __ATOMIC_RELAXED);
+	hist_atomic_min(&h->min, ns);
+	hist_atomic_max(&h->max, ns);
+	__atomic_fetch_add(&h->buckets[hist_bucket(ns)], 1, __ATOMIC_RELAXED);
+}
+
+/* add what h has counted so far to sum, which only the caller uses */
+static inline void
+hist_sum(struct op_hist *sum, struct op_hist *h)
+{
+	unsigned long long v;
+	unsigned b;
+
+	sum->count += __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+	sum->errors += __atomic_load_n(&h->errors, __ATOMIC_RELAXED);
+	sum->sum += __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+	v = __atomic_load_n(&h->min, __ATOMIC_RELAXED);
+	if (v < sum->min)
+		sum->min = v;
+	v = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+	if (v > sum->max)
+		sum->max = v;
+	for (b = 0; b < HIST_BUCKETS; b++)
+		sum->buckets[b] += __atomic_load_n(&h->buckets[b],
+						   __ATOMIC_RELAXED);
+}
+
+#endif /* OPHIST_H */
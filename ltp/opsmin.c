@@ -0,0 +1,458 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Shrink the op log of a failing fsx or fsstress run.
+ *
+ * The log is split into ops: a line of an fsx .fsxops file, or the lines of
+ * an fsstress -v log that share a "proc/opno:" prefix.  The command is run on
+ * the whole log first to get the failure signature, its exit status and
+ * optionally a string in its output, and then on ever smaller subsets of the
+ * ops (delta debugging), keeping any subset that still fails the same way.
+ * Up to -j candidates run at once, each with its own copy of the log and its
+ * own scratch directory.
+ *
+ * In the command %o is replaced with the candidate log and %w with the
+ * scratch directory, e.g.
+ *
+ *	opsmin junk.fsxops -- ltp/fsx -q --replay-ops=%o %w/junk
+ *	opsmin -m "Detected EIO" ss.log -- ltp/fsstress --replay-ops=%o -s 1 -d %w
+ *
+ * A command that needs a fresh filesystem for every run can be a script that
+ * makes one on a loop device under %w.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ftw.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define SIG_TIMEOUT	-1
+
+struct unit {
+	int	first;		/* first line of the op */
+	int	nr;		/* number of lines */
+};
+
+struct job {
+	pid_t	pid;		/* 0 if the slot is free */
+	int	cand;		/* candidate being run, -1 for the whole log */
+	int	timed_out;
+	int	cancelled;
+	time_t	deadline;
+	char	ops[PATH_MAX];
+	char	out[PATH_MAX];
+	char	work[PATH_MAX];
+};
+
+char		**lines;
+int		nr_lines;
+struct unit	*units;
+int		nr_units;
+
+int		*cur;		/* units still in the log */
+int		nr_cur;
+int		nr_chunks;
+
+struct job	*jobs;
+int		nr_jobs;
+char		**cmd;
+const char	*match;
+int		timeout;
+int		fail_sig;
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+"Usage: opsmin [-j jobs] [-d dir] [-o out] [-m string] [-t secs] log -- command...\n"
+"	-j jobs: candidates to run in parallel (default: online cpus)\n"
+"	-d dir: where to put the candidate logs and scratch dirs (default .)\n"
+"	-o out: where to write the shrunk log (default log.min)\n"
+"	-m string: the output of a failing run must contain string\n"
+"	-t secs: kill candidates after secs, default 4x the first run + 10s\n"
+"	%%o in the command is the candidate log, %%w the scratch directory\n");
+	exit(1);
+}
+
+static void
+read_log(const char *path)
+{
+	FILE	*f;
+	char	*line = NULL;
+	size_t	len = 0;
+	char	key[64], prev[64] = "";
+	int	id;
+	long long opno;
+
+	f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		exit(1);
+	}
+	while (getline(&line, &len, f) != -1) {
+		lines = realloc(lines, (nr_lines + 1) * sizeof(*lines));
+		units = realloc(units, (nr_units + 1) * sizeof(*units));
+		if (!lines || !units) {
+			perror("realloc");
+			exit(1);
+		}
+		lines[nr_lines] = strdup(line);
+
+		/* fsstress prints one or more lines per op */
+		key[0] = '\0';
+		if (sscanf(line, "%d/%lld:", &id, &opno) == 2)
+			snprintf(key, sizeof(key), "%d/%lld", id, opno);
+		if (key[0] && nr_units && !strcmp(key, prev)) {
+			units[nr_units - 1].nr++;
+		} else {
+			units[nr_units].first = nr_lines;
+			units[nr_units].nr = 1;
+			nr_units++;
+		}
+		strcpy(prev, key);
+		nr_lines++;
+	}
+	free(line);
+	fclose(f);
+}
+
+/*
+ * Candidate c of a round is chunk c of the current log, or for c >=
+ * nr_chunks the current log without chunk c - nr_chunks.
+ */
+static int
+in_candidate(int cand, int i)
+{
+	int	chunk;
+	int	in;
+
+	if (cand < 0)
+		return 1;
+	chunk = cand % nr_chunks;
+	in = i >= (long long)chunk * nr_cur / nr_chunks &&
+	     i < (long long)(chunk + 1) * nr_cur / nr_chunks;
+	return cand < nr_chunks ? in : !in;
+}
+
+static void
+write_candidate(const char *path, int cand)
+{
+	FILE	*f;
+	int	i, j;
+
+	f = fopen(path, "w");
+	if (!f) {
+		perror(path);
+		exit(1);
+	}
+	for (i = 0; i < nr_cur; i++) {
+		struct unit *u = &units[cur[i]];
+
+		if (!in_candidate(cand, i))
+			continue;
+		for (j = 0; j < u->nr; j++)
+			fputs(lines[u->first + j], f);
+	}
+	if (fclose(f)) {
+		perror(path);
+		exit(1);
+	}
+}
+
+static char *
+subst(const char *arg, struct job *job)
+{
+	char	buf[PATH_MAX * 4];
+	char	*p = buf;
+	const char *s;
+
+	for (s = arg; *s && p < buf + sizeof(buf) - PATH_MAX; s++) {
+		if (s[0] == '%' && s[1] == 'o') {
+			p += sprintf(p, "%s", job->ops);
+			s++;
+		} else if (s[0] == '%' && s[1] == 'w') {
+			p += sprintf(p, "%s", job->work);
+			s++;
+		} else {
+			*p++ = *s;
+		}
+	}
+	*p = '\0';
+	return strdup(buf);
+}
+
+static int
+rm_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+	return remove(path);
+}
+
+/* rm -rf without a shell, the paths come from the command line */
+static int
+rm_tree(const char *path)
+{
+	if (nftw(path, rm_entry, 16, FTW_DEPTH | FTW_PHYS) && errno != ENOENT)
+		return -1;
+	return 0;
+}
+
+static void
+start_job(struct job *job, int cand)
+{
+	char	*argv[256];
+	int	i, fd;
+
+	write_candidate(job->ops, cand);
+	if (rm_tree(job->work) || mkdir(job->work, 0777)) {
+		perror(job->work);
+		exit(1);
+	}
+
+	job->cand = cand;
+	job->timed_out = 0;
+	job->cancelled = 0;
+	job->deadline = timeout ? time(NULL) + timeout : 0;
+	job->pid = fork();
+	if (job->pid < 0) {
+		perror("fork");
+		exit(1);
+	}
+	/* own process group so a timeout kills everything it started */
+	setpgid(job->pid, job->pid);
+	if (job->pid)
+		return;
+
+	fd = open(job->out, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		perror(job->out);
+		_exit(127);
+	}
+	dup2(fd, 1);
+	dup2(fd, 2);
+	close(fd);
+	for (i = 0; cmd[i] && i < 255; i++)
+		argv[i] = subst(cmd[i], job);
+	argv[i] = NULL;
+	execvp(argv[0], argv);
+	perror(argv[0]);
+	_exit(127);
+}
+
+static int
+job_sig(struct job *job, int status)
+{
+	if (job->timed_out)
+		return SIG_TIMEOUT;
+	if (WIFSIGNALED(status))
+		return 128 + WTERMSIG(status);
+	return WEXITSTATUS(status);
+}
+
+static int
+output_matches(struct job *job)
+{
+	FILE	*f;
+	char	*line = NULL;
+	size_t	len = 0;
+	int	found = 0;
+
+	if (!match)
+		return 1;
+	f = fopen(job->out, "r");
+	if (!f)
+		return 0;
+	while (!found && getline(&line, &len, f) != -1)
+		found = strstr(line, match) != NULL;
+	free(line);
+	fclose(f);
+	return found;
+}
+
+/*
+ * Run candidates 0 to nr_cands - 1 on all the job slots and return the first
+ * one to fail like the original run, or -1 if none does.  The other runs are
+ * killed as soon as one fails.
+ */
+static int
+run_candidates(int nr_cands)
+{
+	int	next = 0, running = 0, found = -1;
+	int	i, status;
+	pid_t	pid;
+
+	while ((found < 0 && next < nr_cands) || running) {
+		for (i = 0; i < nr_jobs && found < 0 && next < nr_cands; i++) {
+			if (jobs[i].pid)
+				continue;
+			start_job(&jobs[i], next++);
+			running++;
+		}
+
+		pid = waitpid(-1, &status, WNOHANG);
+		if (pid < 0) {
+			perror("waitpid");
+			exit(1);
+		}
+		if (pid == 0) {
+			time_t now = time(NULL);
+
+			for (i = 0; i < nr_jobs; i++) {
+				if (!jobs[i].pid || jobs[i].timed_out ||
+				    !jobs[i].deadline || now < jobs[i].deadline)
+					continue;
+				jobs[i].timed_out = 1;
+				kill(-jobs[i].pid, SIGKILL);
+			}
+			usleep(10000);
+			continue;
+		}
+
+		for (i = 0; i < nr_jobs; i++)
+			if (jobs[i].pid == pid)
+				break;
+		if (i == nr_jobs)
+			continue;
+		jobs[i].pid = 0;
+		running--;
+		if (found >= 0 || jobs[i].cancelled)
+			continue;
+		if (job_sig(&jobs[i], status) != fail_sig ||
+		    !output_matches(&jobs[i]))
+			continue;
+
+		found = jobs[i].cand;
+		for (i = 0; i < nr_jobs; i++) {
+			if (!jobs[i].pid)
+				continue;
+			jobs[i].cancelled = 1;
+			kill(-jobs[i].pid, SIGKILL);
+		}
+	}
+	return found;
+}
+
+static void
+keep_candidate(int cand, const char *out)
+{
+	int	i, n = 0;
+
+	for (i = 0; i < nr_cur; i++)
+		if (in_candidate(cand, i))
+			cur[n++] = cur[i];
+	nr_cur = n;
+	write_candidate(out, -1);
+}
+
+int
+main(int argc, char **argv)
+{
+	char		outpath[PATH_MAX];
+	const char	*dir = ".", *out = NULL, *log;
+	struct timespec	start, end;
+	int		c, i, status, found;
+	pid_t		pid;
+
+	nr_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((c = getopt(argc, argv, "d:j:m:o:t:")) != EOF) {
+		switch (c) {
+		case 'd':
+			dir = optarg;
+			break;
+		case 'j':
+			nr_jobs = atoi(optarg);
+			break;
+		case 'm':
+			match = optarg;
+			break;
+		case 'o':
+			out = optarg;
+			break;
+		case 't':
+			timeout = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind + 2 > argc || nr_jobs < 1)
+		usage();
+	log = argv[optind++];
+	cmd = &argv[optind];
+	if (!out) {
+		snprintf(outpath, sizeof(outpath), "%s.min", log);
+		out = outpath;
+	}
+
+	read_log(log);
+	cur = malloc(nr_units * sizeof(*cur));
+	jobs = calloc(nr_jobs, sizeof(*jobs));
+	if (!cur || !jobs) {
+		perror("malloc");
+		exit(1);
+	}
+	for (i = 0; i < nr_units; i++)
+		cur[i] = i;
+	nr_cur = nr_units;
+	for (i = 0; i < nr_jobs; i++) {
+		snprintf(jobs[i].ops, PATH_MAX, "%s/opsmin.%d.%d.ops", dir,
+			 getpid(), i);
+		snprintf(jobs[i].out, PATH_MAX, "%s/opsmin.%d.%d.out", dir,
+			 getpid(), i);
+		snprintf(jobs[i].work, PATH_MAX, "%s/opsmin.%d.%d", dir,
+			 getpid(), i);
+	}
+
+	/* the failure signature of the whole log */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	start_job(&jobs[0], -1);
+	do {
+		pid = waitpid(jobs[0].pid, &status, 0);
+	} while (pid < 0 && errno == EINTR);
+	jobs[0].pid = 0;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	fail_sig = job_sig(&jobs[0], status);
+	if (fail_sig == 0 || !output_matches(&jobs[0])) {
+		fprintf(stderr, "%s: the command does not fail on the whole log, "
+			"see %s\n", log, jobs[0].out);
+		exit(1);
+	}
+	if (!timeout)
+		timeout = 4 * (end.tv_sec - start.tv_sec) + 10;
+	printf("%d ops, failing with status %d\n", nr_cur, fail_sig);
+
+	/* ddmin: try chunks, then complements, then split finer */
+	nr_chunks = 2;
+	while (nr_cur >= 2) {
+		found = run_candidates(nr_chunks == 2 ? 2 : 2 * nr_chunks);
+		if (found >= 0 && found < nr_chunks) {
+			keep_candidate(found, out);
+			nr_chunks = 2;
+		} else if (found >= 0) {
+			keep_candidate(found, out);
+			nr_chunks = nr_chunks > 2 ? nr_chunks - 1 : 2;
+		} else if (nr_chunks < nr_cur) {
+			nr_chunks = nr_chunks * 2 < nr_cur ? nr_chunks * 2 : nr_cur;
+		} else {
+			break;
+		}
+		if (found >= 0)
+			printf("%d ops\n", nr_cur);
+	}
+	write_candidate(out, -1);
+	printf("%d ops left, written to %s\n", nr_cur, out);
+
+	for (i = 0; i < nr_jobs; i++) {
+		if (rm_tree(jobs[i].work) ||
+		    (unlink(jobs[i].ops) && errno != ENOENT) ||
+		    (unlink(jobs[i].out) && errno != ENOENT))
+			perror(jobs[i].work);
+	}
+	return 0;
+}